@@ -0,0 +1,69 @@
+/*!
+ * @file atomic.h
+ * @brief Minimal set of atomic operations on pointers and pointer-sized
+ * integers.
+ *
+ * Loads have acquire semantics, stores have release semantics and
+ * read-modify-write operations as well as ws_atomic_fence() are sequentially
+ * consistent. The variables operated on must be declared volatile.
+ */
+
+#ifndef WAVESIM_ATOMIC_H
+#define WAVESIM_ATOMIC_H
+
+#include "wavesim/config.h"
+
+#if defined(__GNUC__) || defined(__clang__)
+
+#   define ws_atomic_load_ptr(p)            __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#   define ws_atomic_store_ptr(p, v)        __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#   define ws_atomic_exchange_ptr(p, v)     __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+
+#   define ws_atomic_load_uptr(p)           __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#   define ws_atomic_store_uptr(p, v)       __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#   define ws_atomic_fetch_add_uptr(p, v)   __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+    /* Returns non-zero if *p was equal to expected and was replaced */
+#   define ws_atomic_cas_uptr(p, expected, desired) \
+        ws_atomic_cas_uptr_gcc((p), (expected), (desired))
+
+#   define ws_atomic_fence()                __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+static __inline__ int
+ws_atomic_cas_uptr_gcc(volatile uintptr_t* p, uintptr_t expected, uintptr_t desired)
+{
+    return __atomic_compare_exchange_n(p, &expected, desired, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+#elif defined(_MSC_VER)
+
+#   include <intrin.h>
+#   include <Windows.h>
+
+    /* volatile accesses have acquire/release semantics with /volatile:ms,
+     * which is the default on x86 and x64 */
+#   define ws_atomic_load_ptr(p)            (*(p))
+#   define ws_atomic_store_ptr(p, v)        (*(p) = (v))
+#   define ws_atomic_exchange_ptr(p, v)     InterlockedExchangePointer((PVOID volatile*)(p), (v))
+
+#   define ws_atomic_load_uptr(p)           (*(p))
+#   define ws_atomic_store_uptr(p, v)       (*(p) = (v))
+#   if defined(_WIN64)
+#       define ws_atomic_fetch_add_uptr(p, v) \
+            ((uintptr_t)InterlockedExchangeAdd64((LONG64 volatile*)(p), (LONG64)(v)))
+#       define ws_atomic_cas_uptr(p, expected, desired) \
+            ((uintptr_t)InterlockedCompareExchange64((LONG64 volatile*)(p), (LONG64)(desired), (LONG64)(expected)) == (uintptr_t)(expected))
+#   else
+#       define ws_atomic_fetch_add_uptr(p, v) \
+            ((uintptr_t)InterlockedExchangeAdd((LONG volatile*)(p), (LONG)(v)))
+#       define ws_atomic_cas_uptr(p, expected, desired) \
+            ((uintptr_t)InterlockedCompareExchange((LONG volatile*)(p), (LONG)(desired), (LONG)(expected)) == (uintptr_t)(expected))
+#   endif
+
+#   define ws_atomic_fence()                MemoryBarrier()
+
+#else
+#   error Atomic operations are not implemented for this compiler
+#endif
+
+#endif /* WAVESIM_ATOMIC_H */
@@ -0,0 +1,17 @@
+#ifndef WAVESIM_CLOCK_H
+#define WAVESIM_CLOCK_H
+
+#include "wavesim/config.h"
+
+C_BEGIN
+
+/*!
+ * @brief Returns the time in seconds of a monotonic wall clock. Only the
+ * difference between two calls is meaningful, e.g. to enforce a time budget.
+ */
+WAVESIM_PRIVATE_API wsreal_t
+ws_clock_seconds(void);
+
+C_END
+
+#endif /* WAVESIM_CLOCK_H */
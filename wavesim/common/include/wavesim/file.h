@@ -0,0 +1,33 @@
+#ifndef WAVESIM_FILE_H
+#define WAVESIM_FILE_H
+
+#include "wavesim/config.h"
+
+C_BEGIN
+
+/*!
+ * @brief Cuts a file off after the specified number of bytes.
+ * @return Returns WS_ERR_FOPEN_FAILED if the file couldn't be opened or
+ * WS_ERR_WRITE_ERROR if it couldn't be resized.
+ */
+WAVESIM_PRIVATE_API wsret WAVESIM_WARN_UNUSED
+ws_file_truncate(const char* file_name, uintptr_t size);
+
+/*!
+ * @brief Returns the ID of the running process.
+ */
+WAVESIM_PRIVATE_API uintptr_t
+ws_process_id(void);
+
+/*!
+ * @brief Returns a name next to file_name for writing a file that is renamed
+ * to file_name once complete. The name is different for every call, in every
+ * process, so concurrent writers never share a temporary file. The string
+ * must be freed with FREE(). Returns NULL if out of memory.
+ */
+WAVESIM_PRIVATE_API char*
+ws_file_temp_name(const char* file_name);
+
+C_END
+
+#endif /* WAVESIM_FILE_H */
@@ -7,6 +7,10 @@ C_BEGIN
 
 typedef uint32_t hash32_t;
 typedef hash32_t (*hash32_func)(const void*, uintptr_t);
+typedef uint64_t hash64_t;
+
+/* Start value of hash64_fnv1a() */
+#define HASH64_FNV1A_INIT 0xCBF29CE484222325ULL
 
 WAVESIM_PRIVATE_API hash32_t
 hash32_jenkins_oaat(const void* key, uintptr_t len);
@@ -30,6 +34,14 @@ hash32_edge_indices(const wsib_t indices[2]);
 WAVESIM_PRIVATE_API hash32_t
 hash32_face_indices(const wsib_t indices[3]);
 
+/*!
+ * @brief 64-bit FNV-1a, for content hashes that must practically never
+ * collide. Continues from hash, so a sequence of buffers can be hashed by
+ * passing each result on to the next call, starting with HASH64_FNV1A_INIT.
+ */
+WAVESIM_PRIVATE_API hash64_t
+hash64_fnv1a(const void* key, uintptr_t len, hash64_t hash);
+
 C_END
 
 #endif /* WAVESIM_HASH_H */
@@ -0,0 +1,32 @@
+#ifndef WAVESIM_MAPPED_FILE_H
+#define WAVESIM_MAPPED_FILE_H
+
+#include "wavesim/config.h"
+
+C_BEGIN
+
+/*!
+ * A read-only view of a whole file mapped into the address space. Pages are
+ * loaded lazily by the OS as they are touched, so opening large files is cheap
+ * and the memory can be shared between processes.
+ */
+typedef struct mapped_file_t
+{
+    const void* data;
+    uintptr_t size;
+} mapped_file_t;
+
+/*!
+ * @brief Maps the specified file into memory (read-only).
+ * @return Returns WS_ERR_FOPEN_FAILED if the file couldn't be opened or
+ * WS_ERR_READ_ERROR if it couldn't be mapped (this includes empty files).
+ */
+WAVESIM_PRIVATE_API wsret WAVESIM_WARN_UNUSED
+mapped_file_open(mapped_file_t* mf, const char* file_name);
+
+WAVESIM_PRIVATE_API void
+mapped_file_close(mapped_file_t* mf);
+
+C_END
+
+#endif /* WAVESIM_MAPPED_FILE_H */
@@ -0,0 +1,41 @@
+#ifndef WAVESIM_RANDOM_H
+#define WAVESIM_RANDOM_H
+
+#include "wavesim/config.h"
+
+C_BEGIN
+
+/*!
+ * xorshift128+ pseudo-random number generator. Fast and small enough that
+ * every thread can own one, and seeding it with the same value always
+ * reproduces the same sequence.
+ */
+typedef struct random_t
+{
+    uint64_t s[2];
+} random_t;
+
+/*!
+ * @brief Seeds the generator. Any value (including 0) is a valid seed.
+ */
+WAVESIM_PRIVATE_API void
+random_seed(random_t* rng, uint64_t seed);
+
+WAVESIM_PRIVATE_API uint64_t
+random_next(random_t* rng);
+
+/*!
+ * @brief Returns a uniformly distributed number in the range [0, 1).
+ */
+WAVESIM_PRIVATE_API wsreal_t
+random_uniform(random_t* rng);
+
+/*!
+ * @brief Writes a uniformly distributed direction on the unit sphere.
+ */
+WAVESIM_PRIVATE_API void
+random_unit_vector(random_t* rng, wsreal_t v[3]);
+
+C_END
+
+#endif /* WAVESIM_RANDOM_H */
@@ -28,6 +28,12 @@ typedef enum wsret
     WS_ERR_SIM_MEDIUM_NOT_SET         = -11,
     WS_ERR_SIM_AUDIO_SOURCE_NOT_SET   = -12,
     WS_ERR_SIM_AUDIO_LISTENER_NOT_SET = -13,
+    WS_ERR_SIM_ADVANCE_FAILED         = -14,
+    WS_ERR_WRITE_ERROR                = -15,
+    WS_ERR_BAD_FILE_FORMAT            = -16,
+    WS_ERR_WOULD_BLOCK                = -17,
+    WS_ERR_THREAD_CREATE_FAILED       = -18,
+    WS_ERR_INVALID_STATE              = -19,
 } wsret;
 
 WAVESIM_PUBLIC_API int
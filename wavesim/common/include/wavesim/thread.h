@@ -0,0 +1,67 @@
+#ifndef WAVESIM_THREAD_H
+#define WAVESIM_THREAD_H
+
+#include "wavesim/config.h"
+
+C_BEGIN
+
+typedef struct ws_thread_t ws_thread_t;
+typedef struct ws_mutex_t ws_mutex_t;
+typedef void* (*ws_thread_func)(void*);
+
+/*!
+ * @brief Starts a new thread.
+ * @param[out] thread Receives the thread handle, which must be passed to
+ * ws_thread_join() eventually.
+ * @param[in] func Entry point of the thread.
+ * @param[in] arg Argument passed to func.
+ */
+WAVESIM_PRIVATE_API wsret WAVESIM_WARN_UNUSED
+ws_thread_create(ws_thread_t** thread, ws_thread_func func, void* arg);
+
+/*!
+ * @brief Waits for the thread to finish and frees the handle.
+ * @return Returns the value returned by the thread's entry point.
+ */
+WAVESIM_PRIVATE_API void*
+ws_thread_join(ws_thread_t* thread);
+
+/*!
+ * @brief Runs func once per element of an array on separate threads. The
+ * calling thread runs the first element itself and waits for the rest.
+ * @param[in] args Array of count elements, each arg_size bytes. Element i is
+ * passed to the i-th call of func.
+ * If there is no memory for the thread handles, the calling thread runs
+ * every element.
+ * @return Returns an error if not all threads could be started. The elements
+ * whose threads did start (and the first) still ran to completion.
+ */
+WAVESIM_PRIVATE_API wsret WAVESIM_WARN_UNUSED
+ws_thread_run_parallel(ws_thread_func func, void* args, uintptr_t arg_size, uintptr_t count);
+
+/*!
+ * @brief Returns the number of logical processors, or 1 if unknown.
+ */
+WAVESIM_PRIVATE_API uintptr_t
+ws_thread_hardware_concurrency(void);
+
+/*!
+ * @brief Creates a recursive mutex.
+ * @note Mutexes are allocated with the C library's malloc() rather than
+ * MALLOC(), because the memory debugging code uses them itself.
+ */
+WAVESIM_PRIVATE_API wsret WAVESIM_WARN_UNUSED
+ws_mutex_create(ws_mutex_t** mutex);
+
+WAVESIM_PRIVATE_API void
+ws_mutex_destroy(ws_mutex_t* mutex);
+
+WAVESIM_PRIVATE_API void
+ws_mutex_lock(ws_mutex_t* mutex);
+
+WAVESIM_PRIVATE_API void
+ws_mutex_unlock(ws_mutex_t* mutex);
+
+C_END
+
+#endif /* WAVESIM_THREAD_H */
@@ -0,0 +1,19 @@
+#include "wavesim/atomic.h"
+#include "wavesim/file.h"
+#include "wavesim/memory.h"
+#include <stdio.h>
+#include <string.h>
+
+static volatile uintptr_t g_temp_counter = 0;
+
+/* ------------------------------------------------------------------------- */
+char*
+ws_file_temp_name(const char* file_name)
+{
+    uintptr_t count = ws_atomic_fetch_add_uptr(&g_temp_counter, 1);
+    char* name = MALLOC(strlen(file_name) + 48);
+    if (name != NULL)
+        sprintf(name, "%s.%lu.%lu.tmp", file_name,
+                (unsigned long)ws_process_id(), (unsigned long)count);
+    return name;
+}
@@ -67,3 +67,16 @@ hash32_face_indices(const wsib_t indices[3])
             hash32_index(indices[1])),
             hash32_index(indices[2]));
 }
+
+/* ------------------------------------------------------------------------- */
+hash64_t
+hash64_fnv1a(const void* key, uintptr_t len, hash64_t hash)
+{
+    uintptr_t i;
+    for (i = 0; i != len; ++i)
+    {
+        hash ^= *((const uint8_t*)key + i);
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
@@ -1,6 +1,7 @@
 #include "wavesim/memory.h"
 #include "wavesim/btree.h"
 #include "wavesim/backtrace.h"
+#include "wavesim/thread.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -14,6 +15,7 @@ static uintptr_t g_allocations = 0;
 static uintptr_t g_deallocations = 0;
 static uintptr_t g_ignore_btree_malloc = 0;
 static btree_t report;
+static ws_mutex_t* g_lock = NULL; /* Recursive, because the btree calls MALLOC() */
 
 typedef struct report_info_t
 {
@@ -44,12 +46,16 @@ memory_init(void)
         btree_erase(&report, 0);
     g_ignore_btree_malloc = 0;
 
+    /* Simulations may run on multiple threads */
+    if (g_lock == NULL && ws_mutex_create(&g_lock) != WS_OK)
+        return -1;
+
     return 0;
 }
 
 /* ------------------------------------------------------------------------- */
-void*
-malloc_wrapper(uintptr_t size)
+static void*
+malloc_wrapper_locked(uintptr_t size)
 {
     void* p = NULL;
     report_info_t* info = NULL;
@@ -146,8 +152,19 @@ malloc_wrapper(uintptr_t size)
 }
 
 /* ------------------------------------------------------------------------- */
-void
-free_wrapper(void* ptr)
+void*
+malloc_wrapper(uintptr_t size)
+{
+    void* p;
+    if (g_lock) ws_mutex_lock(g_lock);
+        p = malloc_wrapper_locked(size);
+    if (g_lock) ws_mutex_unlock(g_lock);
+    return p;
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+free_wrapper_locked(void* ptr)
 {
     /* find matching allocation and remove from btree */
     if (!g_ignore_btree_malloc)
@@ -196,12 +213,27 @@ free_wrapper(void* ptr)
         fprintf(stderr, "Warning: free(NULL)\n");
 }
 
+/* ------------------------------------------------------------------------- */
+void
+free_wrapper(void* ptr)
+{
+    if (g_lock) ws_mutex_lock(g_lock);
+        free_wrapper_locked(ptr);
+    if (g_lock) ws_mutex_unlock(g_lock);
+}
+
 /* ------------------------------------------------------------------------- */
 int
 memory_deinit(void)
 {
     uintptr_t leaks;
 
+    if (g_lock != NULL)
+    {
+        ws_mutex_destroy(g_lock);
+        g_lock = NULL;
+    }
+
     --g_allocations; /* this is the single allocation still held by the report vector */
 
     printf("=========================================\n");
@@ -0,0 +1,11 @@
+#include "wavesim/clock.h"
+#include <time.h>
+
+/* ------------------------------------------------------------------------- */
+wsreal_t
+ws_clock_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (wsreal_t)ts.tv_sec + (wsreal_t)ts.tv_nsec * 1e-9;
+}
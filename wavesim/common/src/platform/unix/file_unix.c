@@ -0,0 +1,22 @@
+#include "wavesim/file.h"
+#include <errno.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* ------------------------------------------------------------------------- */
+wsret
+ws_file_truncate(const char* file_name, uintptr_t size)
+{
+    if (truncate(file_name, (off_t)size) == 0)
+        WSRET(WS_OK);
+    if (errno == ENOENT || errno == EACCES)
+        WSRET(WS_ERR_FOPEN_FAILED);
+    WSRET(WS_ERR_WRITE_ERROR);
+}
+
+/* ------------------------------------------------------------------------- */
+uintptr_t
+ws_process_id(void)
+{
+    return (uintptr_t)getpid();
+}
@@ -0,0 +1,46 @@
+#include "wavesim/mapped_file.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* ------------------------------------------------------------------------- */
+wsret
+mapped_file_open(mapped_file_t* mf, const char* file_name)
+{
+    int fd;
+    struct stat st;
+    void* data;
+
+    mf->data = NULL;
+    mf->size = 0;
+
+    fd = open(file_name, O_RDONLY);
+    if (fd == -1)
+        WSRET(WS_ERR_FOPEN_FAILED);
+
+    if (fstat(fd, &st) != 0 || st.st_size <= 0)
+    {
+        close(fd);
+        WSRET(WS_ERR_READ_ERROR);
+    }
+
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); /* The mapping keeps its own reference to the file */
+    if (data == MAP_FAILED)
+        WSRET(WS_ERR_READ_ERROR);
+
+    mf->data = data;
+    mf->size = (uintptr_t)st.st_size;
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+mapped_file_close(mapped_file_t* mf)
+{
+    if (mf->data != NULL)
+        munmap((void*)mf->data, mf->size);
+    mf->data = NULL;
+    mf->size = 0;
+}
@@ -0,0 +1,95 @@
+#include "wavesim/memory.h"
+#include "wavesim/thread.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct ws_thread_t
+{
+    pthread_t handle;
+};
+
+struct ws_mutex_t
+{
+    pthread_mutex_t handle;
+};
+
+/* ------------------------------------------------------------------------- */
+wsret
+ws_thread_create(ws_thread_t** thread, ws_thread_func func, void* arg)
+{
+    *thread = MALLOC(sizeof **thread);
+    if (*thread == NULL)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+
+    if (pthread_create(&(*thread)->handle, NULL, func, arg) != 0)
+    {
+        FREE(*thread);
+        WSRET(WS_ERR_THREAD_CREATE_FAILED);
+    }
+
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+void*
+ws_thread_join(ws_thread_t* thread)
+{
+    void* result = NULL;
+    pthread_join(thread->handle, &result);
+    FREE(thread);
+    return result;
+}
+
+/* ------------------------------------------------------------------------- */
+uintptr_t
+ws_thread_hardware_concurrency(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (uintptr_t)count : 1;
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+ws_mutex_create(ws_mutex_t** mutex)
+{
+    pthread_mutexattr_t attr;
+
+    *mutex = malloc(sizeof **mutex);
+    if (*mutex == NULL)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    if (pthread_mutex_init(&(*mutex)->handle, &attr) != 0)
+    {
+        pthread_mutexattr_destroy(&attr);
+        free(*mutex);
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+    }
+
+    pthread_mutexattr_destroy(&attr);
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+ws_mutex_destroy(ws_mutex_t* mutex)
+{
+    pthread_mutex_destroy(&mutex->handle);
+    free(mutex);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+ws_mutex_lock(ws_mutex_t* mutex)
+{
+    pthread_mutex_lock(&mutex->handle);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+ws_mutex_unlock(ws_mutex_t* mutex)
+{
+    pthread_mutex_unlock(&mutex->handle);
+}
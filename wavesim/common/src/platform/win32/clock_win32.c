@@ -0,0 +1,12 @@
+#include "wavesim/clock.h"
+#include <Windows.h>
+
+/* ------------------------------------------------------------------------- */
+wsreal_t
+ws_clock_seconds(void)
+{
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (wsreal_t)counter.QuadPart / (wsreal_t)frequency.QuadPart;
+}
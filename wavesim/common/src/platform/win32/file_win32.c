@@ -0,0 +1,30 @@
+#include "wavesim/file.h"
+#include <Windows.h>
+
+/* ------------------------------------------------------------------------- */
+wsret
+ws_file_truncate(const char* file_name, uintptr_t size)
+{
+    HANDLE file;
+    LARGE_INTEGER position;
+    BOOL success;
+
+    file = CreateFileA(file_name, GENERIC_WRITE, 0, NULL,
+                       OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        WSRET(WS_ERR_FOPEN_FAILED);
+
+    position.QuadPart = (LONGLONG)size;
+    success = SetFilePointerEx(file, position, NULL, FILE_BEGIN) && SetEndOfFile(file);
+    CloseHandle(file);
+    if (!success)
+        WSRET(WS_ERR_WRITE_ERROR);
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+uintptr_t
+ws_process_id(void)
+{
+    return (uintptr_t)GetCurrentProcessId();
+}
@@ -0,0 +1,50 @@
+#include "wavesim/mapped_file.h"
+#include <Windows.h>
+
+/* ------------------------------------------------------------------------- */
+wsret
+mapped_file_open(mapped_file_t* mf, const char* file_name)
+{
+    HANDLE file, mapping;
+    LARGE_INTEGER size;
+    void* data;
+
+    mf->data = NULL;
+    mf->size = 0;
+
+    file = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ, NULL,
+                       OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        WSRET(WS_ERR_FOPEN_FAILED);
+
+    if (!GetFileSizeEx(file, &size) || size.QuadPart <= 0)
+    {
+        CloseHandle(file);
+        WSRET(WS_ERR_READ_ERROR);
+    }
+
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL)
+        WSRET(WS_ERR_READ_ERROR);
+
+    /* The view keeps the mapping object alive */
+    data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (data == NULL)
+        WSRET(WS_ERR_READ_ERROR);
+
+    mf->data = data;
+    mf->size = (uintptr_t)size.QuadPart;
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+mapped_file_close(mapped_file_t* mf)
+{
+    if (mf->data != NULL)
+        UnmapViewOfFile(mf->data);
+    mf->data = NULL;
+    mf->size = 0;
+}
@@ -0,0 +1,101 @@
+#include "wavesim/memory.h"
+#include "wavesim/thread.h"
+#include <Windows.h>
+#include <stdlib.h>
+
+struct ws_thread_t
+{
+    HANDLE handle;
+    ws_thread_func func;
+    void* arg;
+    void* result;
+};
+
+struct ws_mutex_t
+{
+    CRITICAL_SECTION handle; /* Critical sections are always recursive */
+};
+
+/* ------------------------------------------------------------------------- */
+static DWORD WINAPI
+thread_entry(LPVOID param)
+{
+    ws_thread_t* thread = param;
+    thread->result = thread->func(thread->arg);
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+ws_thread_create(ws_thread_t** thread, ws_thread_func func, void* arg)
+{
+    *thread = MALLOC(sizeof **thread);
+    if (*thread == NULL)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+
+    (*thread)->func = func;
+    (*thread)->arg = arg;
+    (*thread)->result = NULL;
+    (*thread)->handle = CreateThread(NULL, 0, thread_entry, *thread, 0, NULL);
+    if ((*thread)->handle == NULL)
+    {
+        FREE(*thread);
+        WSRET(WS_ERR_THREAD_CREATE_FAILED);
+    }
+
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+void*
+ws_thread_join(ws_thread_t* thread)
+{
+    void* result;
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+    result = thread->result;
+    FREE(thread);
+    return result;
+}
+
+/* ------------------------------------------------------------------------- */
+uintptr_t
+ws_thread_hardware_concurrency(void)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (uintptr_t)info.dwNumberOfProcessors : 1;
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+ws_mutex_create(ws_mutex_t** mutex)
+{
+    *mutex = malloc(sizeof **mutex);
+    if (*mutex == NULL)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+    InitializeCriticalSection(&(*mutex)->handle);
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+ws_mutex_destroy(ws_mutex_t* mutex)
+{
+    DeleteCriticalSection(&mutex->handle);
+    free(mutex);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+ws_mutex_lock(ws_mutex_t* mutex)
+{
+    EnterCriticalSection(&mutex->handle);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+ws_mutex_unlock(ws_mutex_t* mutex)
+{
+    LeaveCriticalSection(&mutex->handle);
+}
@@ -0,0 +1,56 @@
+#include "wavesim/random.h"
+#include <math.h>
+
+#define PI 3.14159265358979323846
+
+/* ------------------------------------------------------------------------- */
+static uint64_t
+splitmix64(uint64_t* x)
+{
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+random_seed(random_t* rng, uint64_t seed)
+{
+    /* The state must not be all zeros, splitmix64 makes sure it isn't */
+    rng->s[0] = splitmix64(&seed);
+    rng->s[1] = splitmix64(&seed);
+}
+
+/* ------------------------------------------------------------------------- */
+uint64_t
+random_next(random_t* rng)
+{
+    uint64_t s1 = rng->s[0];
+    const uint64_t s0 = rng->s[1];
+    const uint64_t result = s0 + s1;
+    rng->s[0] = s0;
+    s1 ^= s1 << 23;
+    rng->s[1] = s1 ^ s0 ^ (s1 >> 18) ^ (s0 >> 5);
+    return result;
+}
+
+/* ------------------------------------------------------------------------- */
+wsreal_t
+random_uniform(random_t* rng)
+{
+    /* The upper 53 bits are the most random ones and fill a double's mantissa */
+    return (wsreal_t)(random_next(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+random_unit_vector(random_t* rng, wsreal_t v[3])
+{
+    wsreal_t z = 1.0 - 2.0 * random_uniform(rng);
+    wsreal_t r = sqrt(1.0 - z*z);
+    wsreal_t phi = 2.0 * PI * random_uniform(rng);
+    v[0] = r * cos(phi);
+    v[1] = r * sin(phi);
+    v[2] = z;
+}
@@ -6,6 +6,7 @@ static const char* codemap[] = {
     "The program ran out of memory in a malloc() call somewhere.",
     "The library was built without unit tests. Try passing -DWAVESIM_TESTS=ON to CMake and rebuild.",
     "One or more unit tests failed to pass. This indicates that some bugs are present and need to be fixed. Consider running the unit tests with ./wavesim_tests --gtest_output=xml and submitting the resulting test_detail.xml file to https://github.com/thecomet/wavesim/issues",
+    "The requested feature is not implemented.",
     "An attempt was made to subdivide a node in the octree that was not a leaf node. This operation is only valid for leaf nodes.",
     "Failed to open file.",
     "Something went wrong while reading from a file/stream.",
@@ -14,7 +15,13 @@ static const char* codemap[] = {
     "The corresponding index to a vertex was not found. This can occur in the obj exporter when the indices are exported and a vertex is not found in vi_map.",
     "Cannot do a simulation without a medium to simulate in. You need to create and pass a medium to the simulation  with simulation_set_medium()",
     "Simulation requires an audio source, but none was set.",
-    "Simulation requires an audio listener, but none was set."
+    "Simulation requires an audio listener, but none was set.",
+    "The simulation backend reported an error while advancing the simulation.",
+    "Something went wrong while writing to a file/stream.",
+    "The file has an unexpected format, was written by an incompatible version or is truncated.",
+    "The operation could not be completed without blocking. Try again later.",
+    "Failed to create a thread.",
+    "The object isn't ready for the operation. Something it depends on has to be built or set first."
 };
 
 /* ------------------------------------------------------------------------- */
@@ -0,0 +1,33 @@
+#include "wavesim/memory.h"
+#include "wavesim/thread.h"
+#include <stddef.h>
+
+/* ------------------------------------------------------------------------- */
+wsret
+ws_thread_run_parallel(ws_thread_func func, void* args, uintptr_t arg_size, uintptr_t count)
+{
+    wsret result = WS_OK;
+    uintptr_t i, started;
+    ws_thread_t** threads;
+
+    if (count == 0)
+        WSRET(WS_OK);
+
+    /* Without memory for the handles, the calling thread runs everything */
+    if (count == 1 || (threads = MALLOC(sizeof(ws_thread_t*) * count)) == NULL)
+    {
+        for (i = 0; i != count; ++i)
+            func((char*)args + i * arg_size);
+        WSRET(WS_OK);
+    }
+
+    for (started = 1; started < count; ++started)
+        if ((result = ws_thread_create(&threads[started], func, (char*)args + started * arg_size)) != WS_OK)
+            break;
+    func(args);
+    for (i = 1; i < started; ++i)
+        ws_thread_join(threads[i]);
+
+    FREE(threads);
+    return result;
+}
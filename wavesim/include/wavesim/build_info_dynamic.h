@@ -0,0 +1,3 @@
+/* build_info_dynamic.h generated by CMake. Changes will be lost! */
+#define WAVESIM_BUILD_TIME "2026-10-19T14:15:57Z"
+#define WAVESIM_BUILD_NUMBER 2097
@@ -6,6 +6,12 @@
 
 C_BEGIN
 
+/*!
+ * Number of octave bands of the frequency dependent attributes. The bands are
+ * centered on 63, 125, 250, 500, 1k, 2k, 4k and 8k Hz.
+ */
+#define ATTRIBUTE_BAND_COUNT 8
+
 /*!
  * @brief 
  */
@@ -18,6 +24,11 @@ typedef struct attribute_t
     /*  */
     wsreal_t sound_velocity;
     vec3_t   velocity;
+    /* The same per octave band, for backends that are frequency dependent (ray
+     * tracing). The reflection of a band is whatever remains. attribute() and
+     * the default setters copy the broadband values into every band */
+    wsreal_t band_absorption[ATTRIBUTE_BAND_COUNT];
+    wsreal_t band_transmission[ATTRIBUTE_BAND_COUNT];
 } attribute_t;
 
 WAVESIM_PRIVATE_API attribute_t
@@ -44,9 +55,28 @@ attribute_is_zero(attribute_t* attribute);
 WAVESIM_PRIVATE_API int
 attribute_is_same(const attribute_t* a1, const attribute_t* a2);
 
+/*!
+ * @brief Scales reflection, transmission and absorption so they sum up to 1,
+ * or makes the attribute solid if all are 0. Bands keep their own values,
+ * only made non-negative and scaled down where absorption and transmission
+ * exceed 1.
+ */
 WAVESIM_PRIVATE_API void
 attribute_normalize_rta(attribute_t* attribute);
 
+/*!
+ * @brief Sets every band to the (normalized) broadband reflection,
+ * transmission and absorption.
+ */
+WAVESIM_PRIVATE_API void
+attribute_set_uniform_bands(attribute_t* attribute);
+
+/*!
+ * @brief Returns the fraction of energy reflected in a band.
+ */
+WAVESIM_PRIVATE_API wsreal_t
+attribute_band_reflection(const attribute_t* attribute, int band);
+
 C_END
 
 #endif /* ATTRIBUTE_H */
@@ -0,0 +1,285 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "wavesim/config.h"
+#include "wavesim/vector.h"
+
+#define BVH_MAX_LEAF_SIZE 8
+#define BVH_BLOCK_SIZE    4
+#define BVH_PACKET_SIZE   8
+#define BVH_STACK_SIZE    64
+#define BVH_NO_TRIANGLE   0xFFFFFFFFu
+
+C_BEGIN
+
+typedef struct mesh_t mesh_t;
+
+/*!
+ * Nodes are stored depth-first: the first child of an inner node always
+ * directly follows it, so only the index of the second child is stored.
+ * Bounds are stored in single precision and rounded outwards, which keeps a
+ * node at 32 bytes (two per cache line) without ever missing a hit.
+ */
+typedef struct bvh_node_t
+{
+    float    aabb[6];
+    uint32_t offset;  /* Inner node: index of the second child.
+                       * Leaf: index of the first triangle slot, always the
+                       * first slot of a block */
+    uint16_t count;   /* Number of triangles, 0 for inner nodes */
+    uint16_t axis;    /* Axis the node was split along */
+} bvh_node_t;
+
+/*!
+ * The triangles of a leaf are stored in structure-of-arrays blocks of
+ * BVH_BLOCK_SIZE, so that one block is intersected with a ray in a single
+ * pass of SIMD instructions. Edges are precomputed for Moeller-Trumbore.
+ * Unused lanes hold degenerate triangles, which are never hit.
+ */
+typedef struct bvh_block_t
+{
+    wsreal_t v0[3][BVH_BLOCK_SIZE];
+    wsreal_t e1[3][BVH_BLOCK_SIZE];  /* v1 - v0 */
+    wsreal_t e2[3][BVH_BLOCK_SIZE];  /* v2 - v0 */
+} bvh_block_t;
+
+/*!
+ * Bounding volume hierarchy over a triangle soup, built with a binned
+ * surface area heuristic. The triangles are copied and reordered so that
+ * the triangles of each leaf are contiguous in memory.
+ */
+typedef struct bvh_t
+{
+    bvh_node_t*  nodes;
+    uintptr_t    node_count;
+    bvh_block_t* blocks;
+    uintptr_t    block_count;
+    uint32_t*    triangle_ids;  /* One per slot (BVH_BLOCK_SIZE per block), maps
+                                 * to the original triangle index. Unused slots
+                                 * are BVH_NO_TRIANGLE */
+    uintptr_t    triangle_count;
+} bvh_t;
+
+typedef struct bvh_hit_t
+{
+    wsreal_t distance;
+    wsreal_t bary[3];          /* Weights of v1, v2, v0, see intersect_ray_triangle() */
+    uint32_t triangle;         /* Original index of the triangle that was hit */
+} bvh_hit_t;
+
+WAVESIM_PRIVATE_API void
+bvh_construct(bvh_t* bvh);
+
+WAVESIM_PRIVATE_API void
+bvh_destruct(bvh_t* bvh);
+
+/*!
+ * @brief Builds the hierarchy, replacing any previous contents.
+ * @param[in] vertices 9 coordinates (3 vertices) per triangle.
+ * @param[in] triangle_count Number of triangles.
+ */
+WAVESIM_PRIVATE_API wsret WAVESIM_WARN_UNUSED
+bvh_build(bvh_t* bvh, const wsreal_t* vertices, uintptr_t triangle_count);
+
+/*!
+ * @brief Builds the hierarchy over all faces of a mesh. Triangle indices are
+ * face indices.
+ */
+WAVESIM_PRIVATE_API wsret WAVESIM_WARN_UNUSED
+bvh_build_from_mesh(bvh_t* bvh, const mesh_t* mesh);
+
+/*!
+ * @brief Finds the closest triangle hit by a ray.
+ * @param[in] direction Does not have to be normalized. Distances are in units
+ * of its length.
+ * @param[in] max_distance Hits further away than this are ignored. Can be
+ * INFINITY.
+ * @param[in] ignore_triangle Triangle that is never hit, typically the one
+ * the ray is leaving. BVH_NO_TRIANGLE to consider all triangles.
+ * @param[out] hit Written only if a triangle was hit.
+ * @return Returns non-zero if a triangle was hit.
+ */
+WAVESIM_PRIVATE_API int
+bvh_ray_first_hit(const bvh_t* bvh,
+                  const wsreal_t origin[3],
+                  const wsreal_t direction[3],
+                  wsreal_t max_distance,
+                  uint32_t ignore_triangle,
+                  bvh_hit_t* hit);
+
+/*!
+ * @brief Checks whether any triangle lies between the origin and
+ * max_distance along the ray. Stops at the first triangle found, which makes
+ * it cheaper than bvh_ray_first_hit() for visibility tests.
+ */
+WAVESIM_PRIVATE_API int
+bvh_ray_any_hit(const bvh_t* bvh,
+                const wsreal_t origin[3],
+                const wsreal_t direction[3],
+                wsreal_t max_distance,
+                uint32_t ignore_triangle);
+
+/*!
+ * @brief Up to BVH_PACKET_SIZE rays that traverse the hierarchy together.
+ * Rays that start in the same place or travel in similar directions visit
+ * mostly the same nodes, so every node and leaf is fetched once for all of
+ * them instead of once per ray.
+ */
+typedef struct bvh_ray_packet_t
+{
+    wsreal_t origin[3][BVH_PACKET_SIZE];
+    wsreal_t direction[3][BVH_PACKET_SIZE];
+    wsreal_t max_distance[BVH_PACKET_SIZE];
+    uint32_t ignore_triangle[BVH_PACKET_SIZE];
+    uintptr_t count;
+} bvh_ray_packet_t;
+
+/*!
+ * @brief Finds the closest hit of every ray in the packet. Same as calling
+ * bvh_ray_first_hit() for each ray.
+ * @param[out] hits One per ray, written only if the ray hit something.
+ * @param[out] found One per ray, set to 1 if the ray hit something and 0
+ * otherwise.
+ * @return Returns the number of rays that hit something.
+ */
+WAVESIM_PRIVATE_API uintptr_t
+bvh_ray_packet_first_hit(const bvh_t* bvh,
+                         const bvh_ray_packet_t* packet,
+                         bvh_hit_t* hits,
+                         char* found);
+
+/*!
+ * @brief Finds all triangles whose bounding boxes overlap the specified
+ * bounding box.
+ * @param[out] result The original indices (uint32_t) of the triangles are
+ * pushed into this vector. As with octree_query_potential_faces(), the
+ * triangles *may* intersect the box and need to be further evaluated.
+ * @return Returns WS_OK on success.
+ */
+WAVESIM_PRIVATE_API wsret WAVESIM_WARN_UNUSED
+bvh_query_aabb(const bvh_t* bvh, vector_t* result, const wsreal_t aabb[6]);
+
+/*!
+ * @brief Updates the hierarchy after the vertices moved, without rebuilding
+ * it. The triangles must be the same as when the hierarchy was built, only
+ * their positions may differ. The node bounds are recomputed bottom-up, which
+ * is much cheaper than a build. The tree gets less efficient the further the
+ * triangles move from where they were, rebuild it after large changes.
+ * @param[in] vertices 9 coordinates (3 vertices) per triangle, in the same
+ * order as passed to bvh_build().
+ */
+WAVESIM_PRIVATE_API void
+bvh_refit(bvh_t* bvh, const wsreal_t* vertices);
+
+/*!
+ * @brief Same as bvh_refit(), reading the vertices from the mesh the
+ * hierarchy was built from with bvh_build_from_mesh().
+ */
+WAVESIM_PRIVATE_API wsret WAVESIM_WARN_UNUSED
+bvh_refit_from_mesh(bvh_t* bvh, const mesh_t* mesh);
+
+/*!
+ * A bottom-level hierarchy placed in the scene with an affine transform.
+ */
+typedef struct bvh_instance_t
+{
+    const bvh_t* blas;
+    wsreal_t transform[12];   /* Object to world, 3x4 row-major */
+    wsreal_t inverse[12];     /* World to object */
+    wsreal_t aabb[6];         /* World space bounds */
+    uint32_t first_triangle;  /* Added to the triangle indices of the BLAS, so
+                               * that every instance has its own range */
+} bvh_instance_t;
+
+/*!
+ * Two-level hierarchy: a top-level BVH over instances of bottom-level BVHs
+ * (typically one per mesh). Moving an instance only changes its transform and
+ * the top-level bounds, and deforming a mesh only refits its own BLAS, so
+ * dynamic geometry never needs a full rebuild. Rays are transformed into the
+ * object space of every instance they reach. Since directions are not
+ * normalized, distances along the ray are the same in both spaces.
+ *
+ * Top-level nodes use the same layout as bvh_t. Leaves index instance_ids,
+ * which maps to instances.
+ */
+typedef struct bvh_scene_t
+{
+    vector_t    instances;    /* bvh_instance_t */
+    bvh_node_t* nodes;
+    uintptr_t   node_count;
+    uint32_t*   instance_ids;
+} bvh_scene_t;
+
+WAVESIM_PRIVATE_API void
+bvh_scene_construct(bvh_scene_t* scene);
+
+WAVESIM_PRIVATE_API void
+bvh_scene_destruct(bvh_scene_t* scene);
+
+/*!
+ * @brief Adds an instance with the identity transform. The BLAS is
+ * referenced, not copied, and must outlive the scene. Call bvh_scene_build()
+ * after adding all instances.
+ * @param[in] first_triangle Hits on triangle i of the BLAS report the triangle
+ * first_triangle + i.
+ */
+WAVESIM_PRIVATE_API wsret WAVESIM_WARN_UNUSED
+bvh_scene_add_instance(bvh_scene_t* scene, const bvh_t* blas, uint32_t first_triangle);
+
+/*!
+ * @brief Sets the object to world transform of an instance. Call
+ * bvh_scene_refit() once all instances are updated.
+ * @param[in] transform 3x4 row-major matrix, the left 3x3 part must be
+ * invertible.
+ */
+WAVESIM_PRIVATE_API void
+bvh_scene_set_transform(bvh_scene_t* scene, uintptr_t instance, const wsreal_t transform[12]);
+
+/*!
+ * @brief Builds the top-level hierarchy over the instances.
+ */
+WAVESIM_PRIVATE_API wsret WAVESIM_WARN_UNUSED
+bvh_scene_build(bvh_scene_t* scene);
+
+/*!
+ * @brief Updates the top-level bounds after transforms changed or BLASes were
+ * refitted.
+ */
+WAVESIM_PRIVATE_API void
+bvh_scene_refit(bvh_scene_t* scene);
+
+/*!
+ * @brief Same as bvh_ray_first_hit(), for all instances of the scene.
+ */
+WAVESIM_PRIVATE_API int
+bvh_scene_ray_first_hit(const bvh_scene_t* scene,
+                        const wsreal_t origin[3],
+                        const wsreal_t direction[3],
+                        wsreal_t max_distance,
+                        uint32_t ignore_triangle,
+                        bvh_hit_t* hit);
+
+/*!
+ * @brief Same as bvh_ray_any_hit(), for all instances of the scene.
+ */
+WAVESIM_PRIVATE_API int
+bvh_scene_ray_any_hit(const bvh_scene_t* scene,
+                      const wsreal_t origin[3],
+                      const wsreal_t direction[3],
+                      wsreal_t max_distance,
+                      uint32_t ignore_triangle);
+
+/*!
+ * @brief Same as bvh_ray_packet_first_hit(), for all instances of the scene.
+ * The rays of the packet that reach an instance are traced through its BLAS
+ * as one packet.
+ */
+WAVESIM_PRIVATE_API uintptr_t
+bvh_scene_ray_packet_first_hit(const bvh_scene_t* scene,
+                               const bvh_ray_packet_t* packet,
+                               bvh_hit_t* hits,
+                               char* found);
+
+C_END
+
+#endif /* BVH_H */
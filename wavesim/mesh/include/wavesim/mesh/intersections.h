@@ -83,6 +83,28 @@ WAVESIM_PRIVATE_API int
 intersect_line_triangle_test(const wsreal_t p0[3], const wsreal_t p1[3],
                              const wsreal_t v0[3], const wsreal_t v1[3], const wsreal_t v2[3]);
 
+/*!
+ * @brief Calculates where a ray hits a triangle (Moeller-Trumbore). Both
+ * sides of the triangle are hit.
+ * @param[out] distance Distance along the ray to the point of intersection,
+ * in units of the length of direction.
+ * @param[out] bary The barycentric coordinates of the intersection, in the
+ * same order as intersect_line_triangle_barycentric(): the weights of v1, v2
+ * and v0.
+ * @param[in] origin x,y,z coordinates of where the ray starts.
+ * @param[in] direction x,y,z direction of the ray. Does not have to be
+ * normalized.
+ * @param[in] v0/v1/v2 x,y,z coordinates of the 3 vertices that define the
+ * triangle.
+ * @return Returns non-zero ("true") if the ray hits the triangle in front of
+ * its origin. Returns 0 if there was no intersection, in which case nothing
+ * is written to distance or bary.
+ */
+WAVESIM_PRIVATE_API int
+intersect_ray_triangle(wsreal_t* distance, wsreal_t bary[3],
+                       const wsreal_t origin[3], const wsreal_t direction[3],
+                       const wsreal_t v0[3], const wsreal_t v1[3], const wsreal_t v2[3]);
+
 /*!
  * @brief Tests whether an axis-aligned bounding-box intersects a triangle.
  */
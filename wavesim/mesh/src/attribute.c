@@ -13,6 +13,7 @@ attribute(wsreal_t reflection, wsreal_t transmission, wsreal_t absorption, wsrea
     a.absorption = absorption;
     a.sound_velocity = sound_velocity;
     a.velocity = velocity;
+    attribute_set_uniform_bands(&a);
     return a;
 }
 
@@ -43,6 +44,7 @@ attribute_set_default_solid(attribute_t* attribute)
     attribute->transmission = 0;
     attribute->sound_velocity = 2000;
     vec3_set_zero(attribute->velocity.xyz);
+    attribute_set_uniform_bands(attribute);
 }
 
 /* ------------------------------------------------------------------------- */
@@ -54,15 +56,22 @@ attribute_set_default_air(attribute_t* attribute)
     attribute->transmission = 1;
     attribute->sound_velocity = 340;
     vec3_set_zero(attribute->velocity.xyz);
+    attribute_set_uniform_bands(attribute);
 }
 
 /* ------------------------------------------------------------------------- */
 void
 attribute_set_zero(attribute_t* attribute)
 {
+    int band;
     attribute->absorption = 0;
     attribute->reflection = 0;
     attribute->transmission = 0;
+    for (band = 0; band != ATTRIBUTE_BAND_COUNT; ++band)
+    {
+        attribute->band_absorption[band] = 0;
+        attribute->band_transmission[band] = 0;
+    }
 }
 
 /* ------------------------------------------------------------------------- */
@@ -78,11 +87,52 @@ attribute_is_zero(attribute_t* attribute)
 int
 attribute_is_same(const attribute_t* a1, const attribute_t* a2)
 {
-    return (
-        a1->absorption == a2->absorption &&
-        a1->reflection == a2->reflection &&
-        a1->transmission == a2->transmission
-    );
+    int band;
+    if (a1->absorption != a2->absorption ||
+        a1->reflection != a2->reflection ||
+        a1->transmission != a2->transmission)
+        return 0;
+
+    for (band = 0; band != ATTRIBUTE_BAND_COUNT; ++band)
+        if (a1->band_absorption[band] != a2->band_absorption[band] ||
+            a1->band_transmission[band] != a2->band_transmission[band])
+            return 0;
+    return 1;
+}
+
+/* ------------------------------------------------------------------------- */
+static int
+bands_are_zero(const attribute_t* attribute)
+{
+    int band;
+    for (band = 0; band != ATTRIBUTE_BAND_COUNT; ++band)
+        if (attribute->band_absorption[band] != 0.0 || attribute->band_transmission[band] != 0.0)
+            return 0;
+    return 1;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Makes every band non-negative and scales down bands whose absorption and
+ * transmission exceed 1, leaving the rest of each band to reflection.
+ */
+static void
+normalize_bands(attribute_t* attribute)
+{
+    int band;
+    for (band = 0; band != ATTRIBUTE_BAND_COUNT; ++band)
+    {
+        wsreal_t absorption = fabs(attribute->band_absorption[band]);
+        wsreal_t transmission = fabs(attribute->band_transmission[band]);
+        wsreal_t sum = absorption + transmission;
+        if (sum > 1.0)
+        {
+            absorption /= sum;
+            transmission /= sum;
+        }
+        attribute->band_absorption[band] = absorption;
+        attribute->band_transmission[band] = transmission;
+    }
 }
 
 /* ------------------------------------------------------------------------- */
@@ -93,7 +143,15 @@ attribute_normalize_rta(attribute_t* attribute)
 
     if (attribute->reflection == 0.0 && attribute->transmission == 0.0 && attribute->absorption == 0.0)
     {
+        /* An attribute that was never set. Bands that were keep their values */
+        attribute_t bands = *attribute;
         attribute_set_default_solid(attribute);
+        if (!bands_are_zero(&bands))
+        {
+            memcpy(attribute->band_absorption, bands.band_absorption, sizeof(bands.band_absorption));
+            memcpy(attribute->band_transmission, bands.band_transmission, sizeof(bands.band_transmission));
+            normalize_bands(attribute);
+        }
         return;
     }
 
@@ -105,4 +163,33 @@ attribute_normalize_rta(attribute_t* attribute)
     attribute->reflection *= sum;
     attribute->transmission *= sum;
     attribute->absorption *= sum;
+    normalize_bands(attribute);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+attribute_set_uniform_bands(attribute_t* attribute)
+{
+    int band;
+    wsreal_t absorption = 1.0, transmission = 0.0;
+    wsreal_t sum = attribute->reflection + attribute->transmission + attribute->absorption;
+    if (sum > 0.0)
+    {
+        absorption = attribute->absorption / sum;
+        transmission = attribute->transmission / sum;
+    }
+
+    for (band = 0; band != ATTRIBUTE_BAND_COUNT; ++band)
+    {
+        attribute->band_absorption[band] = absorption;
+        attribute->band_transmission[band] = transmission;
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+wsreal_t
+attribute_band_reflection(const attribute_t* attribute, int band)
+{
+    wsreal_t reflection = 1.0 - attribute->band_absorption[band] - attribute->band_transmission[band];
+    return reflection > 0.0 ? reflection : 0.0;
 }
@@ -0,0 +1,1360 @@
+#include "wavesim/memory.h"
+#include "wavesim/mesh/bvh.h"
+#include "wavesim/mesh/intersections.h"
+#include "wavesim/mesh/mesh.h"
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(WAVESIM_PRECISION_DOUBLE) && (defined(__AVX__) || defined(__SSE2__))
+#   include <immintrin.h>
+#   define BVH_SIMD
+#endif
+
+#define BIN_COUNT 16
+
+/* Subtrees deeper than this are split at the object median, which halves the
+ * triangle count on every level and keeps the tree within BVH_STACK_SIZE */
+#define SAH_MAX_DEPTH 32
+
+/* Relative cost of traversing a node versus intersecting a triangle */
+#define TRAVERSAL_COST 1.0
+
+typedef struct build_ref_t
+{
+    wsreal_t aabb[6];
+    wsreal_t centroid[3];
+    uint32_t id;
+} build_ref_t;
+
+typedef struct bin_t
+{
+    wsreal_t aabb[6];
+    uintptr_t count;
+} bin_t;
+
+/* ------------------------------------------------------------------------- */
+void
+bvh_construct(bvh_t* bvh)
+{
+    bvh->nodes = NULL;
+    bvh->node_count = 0;
+    bvh->blocks = NULL;
+    bvh->block_count = 0;
+    bvh->triangle_ids = NULL;
+    bvh->triangle_count = 0;
+}
+
+/* ------------------------------------------------------------------------- */
+void
+bvh_destruct(bvh_t* bvh)
+{
+    if (bvh->nodes != NULL)        FREE(bvh->nodes);
+    if (bvh->blocks != NULL)       FREE(bvh->blocks);
+    if (bvh->triangle_ids != NULL) FREE(bvh->triangle_ids);
+    bvh_construct(bvh);
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+aabb_clear(wsreal_t bb[6])
+{
+    bb[0] = bb[1] = bb[2] = INFINITY;
+    bb[3] = bb[4] = bb[5] = -INFINITY;
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+aabb_grow(wsreal_t bb[6], const wsreal_t other[6])
+{
+    int i;
+    for (i = 0; i != 3; ++i)
+    {
+        if (bb[i]   > other[i])   bb[i]   = other[i];
+        if (bb[i+3] < other[i+3]) bb[i+3] = other[i+3];
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+static wsreal_t
+aabb_half_area(const wsreal_t bb[6])
+{
+    wsreal_t dx = bb[3] - bb[0], dy = bb[4] - bb[1], dz = bb[5] - bb[2];
+    if (dx < 0.0 || dy < 0.0 || dz < 0.0)
+        return 0.0;
+    return dx*dy + dy*dz + dz*dx;
+}
+
+/* ------------------------------------------------------------------------- */
+static float
+round_down(wsreal_t x)
+{
+    float f = (float)x;
+    if ((wsreal_t)f > x)
+        f = nextafterf(f, -FLT_MAX);
+    return f;
+}
+
+/* ------------------------------------------------------------------------- */
+static float
+round_up(wsreal_t x)
+{
+    float f = (float)x;
+    if ((wsreal_t)f < x)
+        f = nextafterf(f, FLT_MAX);
+    return f;
+}
+
+/* ------------------------------------------------------------------------- */
+static int compare_x(const void* a, const void* b)
+{
+    wsreal_t ca = ((const build_ref_t*)a)->centroid[0], cb = ((const build_ref_t*)b)->centroid[0];
+    return (ca > cb) - (ca < cb);
+}
+static int compare_y(const void* a, const void* b)
+{
+    wsreal_t ca = ((const build_ref_t*)a)->centroid[1], cb = ((const build_ref_t*)b)->centroid[1];
+    return (ca > cb) - (ca < cb);
+}
+static int compare_z(const void* a, const void* b)
+{
+    wsreal_t ca = ((const build_ref_t*)a)->centroid[2], cb = ((const build_ref_t*)b)->centroid[2];
+    return (ca > cb) - (ca < cb);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Finds the cheapest binned SAH split of the range. Returns the axis, or -1
+ * if no split is cheaper than the cost limit (or if the centroids are all in
+ * the same place).
+ */
+static int
+find_sah_split(const build_ref_t* refs, uintptr_t count,
+               const wsreal_t centroid_bounds[6],
+               wsreal_t* cost, int* split_bin)
+{
+    int axis, best_axis = -1;
+    uintptr_t i;
+
+    for (axis = 0; axis != 3; ++axis)
+    {
+        bin_t bins[BIN_COUNT];
+        wsreal_t right_cost[BIN_COUNT];
+        wsreal_t bb[6];
+        uintptr_t n;
+        int b;
+        wsreal_t min = centroid_bounds[axis];
+        wsreal_t extent = centroid_bounds[axis+3] - min;
+        if (extent <= 0.0)
+            continue;
+
+        for (b = 0; b != BIN_COUNT; ++b)
+        {
+            aabb_clear(bins[b].aabb);
+            bins[b].count = 0;
+        }
+        for (i = 0; i != count; ++i)
+        {
+            b = (int)((refs[i].centroid[axis] - min) * BIN_COUNT / extent);
+            if (b >= BIN_COUNT)
+                b = BIN_COUNT - 1;
+            aabb_grow(bins[b].aabb, refs[i].aabb);
+            bins[b].count++;
+        }
+
+        /* Sweep from the right to get the cost of every right side */
+        aabb_clear(bb);
+        n = 0;
+        for (b = BIN_COUNT - 1; b > 0; --b)
+        {
+            aabb_grow(bb, bins[b].aabb);
+            n += bins[b].count;
+            right_cost[b] = aabb_half_area(bb) * (wsreal_t)n;
+        }
+
+        /* Then from the left, splitting between bin b and b+1 */
+        aabb_clear(bb);
+        n = 0;
+        for (b = 0; b != BIN_COUNT - 1; ++b)
+        {
+            wsreal_t c;
+            aabb_grow(bb, bins[b].aabb);
+            n += bins[b].count;
+            if (n == 0 || n == count)
+                continue;
+            c = aabb_half_area(bb) * (wsreal_t)n + right_cost[b+1];
+            if (c < *cost)
+            {
+                *cost = c;
+                *split_bin = b;
+                best_axis = axis;
+            }
+        }
+    }
+
+    return best_axis;
+}
+
+/* ------------------------------------------------------------------------- */
+static wsret
+build_recursive(vector_t* nodes, build_ref_t* refs, uintptr_t begin, uintptr_t end, int depth)
+{
+    wsret result;
+    uintptr_t i, mid, count = end - begin;
+    uintptr_t node_index = vector_count(nodes);
+    wsreal_t bounds[6], centroid_bounds[6], leaf_cost, split_cost;
+    int axis, split_bin = 0;
+    bvh_node_t* node = vector_emplace(nodes);
+    if (node == NULL)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+
+    aabb_clear(bounds);
+    aabb_clear(centroid_bounds);
+    for (i = begin; i != end; ++i)
+    {
+        wsreal_t c[6];
+        aabb_grow(bounds, refs[i].aabb);
+        memcpy(c, refs[i].centroid, sizeof(refs[i].centroid));
+        memcpy(c + 3, refs[i].centroid, sizeof(refs[i].centroid));
+        aabb_grow(centroid_bounds, c);
+    }
+
+    for (i = 0; i != 3; ++i)
+    {
+        node->aabb[i] = round_down(bounds[i]);
+        node->aabb[i+3] = round_up(bounds[i+3]);
+    }
+    node->axis = 0;
+
+    /* Both costs are relative to the surface area of this node */
+    leaf_cost = (wsreal_t)count * aabb_half_area(bounds);
+    split_cost = INFINITY;
+    axis = -1;
+    if (count > 1 && depth < SAH_MAX_DEPTH)
+    {
+        axis = find_sah_split(refs + begin, count, centroid_bounds, &split_cost, &split_bin);
+        split_cost += TRAVERSAL_COST * aabb_half_area(bounds);
+    }
+
+    if (count <= BVH_MAX_LEAF_SIZE && (count <= 1 || split_cost >= leaf_cost))
+    {
+        node->offset = (uint32_t)begin;
+        node->count = (uint16_t)count;
+        WSRET(WS_OK);
+    }
+
+    if (axis >= 0)
+    {
+        /* Partition around the chosen bin */
+        wsreal_t min = centroid_bounds[axis];
+        wsreal_t extent = centroid_bounds[axis+3] - min;
+        uintptr_t left = begin, right = end;
+        while (left < right)
+        {
+            int b = (int)((refs[left].centroid[axis] - min) * BIN_COUNT / extent);
+            if (b >= BIN_COUNT)
+                b = BIN_COUNT - 1;
+            if (b <= split_bin)
+                ++left;
+            else
+            {
+                build_ref_t tmp = refs[left];
+                refs[left] = refs[--right];
+                refs[right] = tmp;
+            }
+        }
+        mid = left;
+    }
+    else
+    {
+        /* Too deep, or too many triangles in one place: split at the object
+         * median along the longest axis of the centroids */
+        wsreal_t dx = centroid_bounds[3] - centroid_bounds[0];
+        wsreal_t dy = centroid_bounds[4] - centroid_bounds[1];
+        wsreal_t dz = centroid_bounds[5] - centroid_bounds[2];
+        axis = (dx >= dy && dx >= dz) ? 0 : (dy >= dz ? 1 : 2);
+        qsort(refs + begin, count, sizeof(build_ref_t),
+              axis == 0 ? compare_x : (axis == 1 ? compare_y : compare_z));
+        mid = begin + count / 2;
+    }
+
+    if (mid == begin || mid == end)
+        mid = begin + count / 2;
+
+    node->axis = (uint16_t)axis;
+    node->count = 0;
+    if ((result = build_recursive(nodes, refs, begin, mid, depth + 1)) != WS_OK)
+        return result;
+
+    /* The vector may have been reallocated */
+    node = vector_get(nodes, node_index);
+    node->offset = (uint32_t)vector_count(nodes);
+    return build_recursive(nodes, refs, mid, end, depth + 1);
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+fill_block_lane(bvh_block_t* block, uintptr_t lane, const wsreal_t* tri)
+{
+    int axis;
+    for (axis = 0; axis != 3; ++axis)
+    {
+        block->v0[axis][lane] = tri[axis];
+        block->e1[axis][lane] = tri[3+axis] - tri[axis];
+        block->e2[axis][lane] = tri[6+axis] - tri[axis];
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+bvh_build(bvh_t* bvh, const wsreal_t* vertices, uintptr_t triangle_count)
+{
+    wsret result;
+    uintptr_t i, slot, block_count;
+    vector_t nodes;
+    build_ref_t* refs;
+
+    bvh_destruct(bvh);
+    if (triangle_count == 0)
+        WSRET(WS_OK);
+
+    refs = MALLOC(sizeof(build_ref_t) * triangle_count);
+    if (refs == NULL)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+
+    for (i = 0; i != triangle_count; ++i)
+    {
+        int v, axis;
+        const wsreal_t* tri = vertices + i * 9;
+        aabb_clear(refs[i].aabb);
+        for (v = 0; v != 3; ++v)
+            for (axis = 0; axis != 3; ++axis)
+            {
+                if (refs[i].aabb[axis]   > tri[v*3+axis]) refs[i].aabb[axis]   = tri[v*3+axis];
+                if (refs[i].aabb[axis+3] < tri[v*3+axis]) refs[i].aabb[axis+3] = tri[v*3+axis];
+            }
+        for (axis = 0; axis != 3; ++axis)
+            refs[i].centroid[axis] = (refs[i].aabb[axis] + refs[i].aabb[axis+3]) * 0.5;
+        refs[i].id = (uint32_t)i;
+    }
+
+    vector_construct(&nodes, sizeof(bvh_node_t));
+    if ((result = build_recursive(&nodes, refs, 0, triangle_count, 0)) != WS_OK)
+    {
+        vector_clear_free(&nodes);
+        FREE(refs);
+        return result;
+    }
+
+    /* Every leaf starts a new block */
+    block_count = 0;
+    VECTOR_FOR_EACH(&nodes, bvh_node_t, node)
+        block_count += ((uintptr_t)node->count + BVH_BLOCK_SIZE - 1) / BVH_BLOCK_SIZE;
+    VECTOR_END_EACH
+
+    bvh->blocks = MALLOC(sizeof(bvh_block_t) * block_count);
+    bvh->triangle_ids = MALLOC(sizeof(uint32_t) * BVH_BLOCK_SIZE * block_count);
+    bvh->nodes = MALLOC(sizeof(bvh_node_t) * vector_count(&nodes));
+    if (bvh->blocks == NULL || bvh->triangle_ids == NULL || bvh->nodes == NULL)
+    {
+        vector_clear_free(&nodes);
+        FREE(refs);
+        bvh_destruct(bvh);
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+    }
+
+    /* Zeroed lanes are degenerate triangles */
+    memset(bvh->blocks, 0, sizeof(bvh_block_t) * block_count);
+    for (i = 0; i != BVH_BLOCK_SIZE * block_count; ++i)
+        bvh->triangle_ids[i] = BVH_NO_TRIANGLE;
+
+    slot = 0;
+    VECTOR_FOR_EACH(&nodes, bvh_node_t, node)
+        if (node->count == 0)
+            continue;
+        for (i = 0; i != node->count; ++i)
+        {
+            const build_ref_t* ref = &refs[node->offset + i];
+            fill_block_lane(&bvh->blocks[(slot + i) / BVH_BLOCK_SIZE], (slot + i) % BVH_BLOCK_SIZE,
+                            vertices + ref->id * 9);
+            bvh->triangle_ids[slot + i] = ref->id;
+        }
+        node->offset = (uint32_t)slot;
+        slot += ((uintptr_t)node->count + BVH_BLOCK_SIZE - 1) / BVH_BLOCK_SIZE * BVH_BLOCK_SIZE;
+    VECTOR_END_EACH
+
+    memcpy(bvh->nodes, nodes.data, sizeof(bvh_node_t) * vector_count(&nodes));
+    bvh->node_count = vector_count(&nodes);
+    bvh->block_count = block_count;
+    bvh->triangle_count = triangle_count;
+
+    vector_clear_free(&nodes);
+    FREE(refs);
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Copies the vertices of all faces of a mesh into a new array, 9 coordinates
+ * per face. The caller frees it.
+ */
+static wsreal_t*
+copy_mesh_vertices(const mesh_t* mesh)
+{
+    uintptr_t i;
+    wsreal_t* vertices = MALLOC(sizeof(wsreal_t) * 9 * (mesh_face_count(mesh) + 1));
+    if (vertices == NULL)
+        return NULL;
+
+    for (i = 0; i != mesh_face_count(mesh); ++i)
+    {
+        wsib_t indices[3];
+        mesh_get_face_indices(indices, mesh, i);
+        mesh_get_face_vertices(vertices + i * 9, mesh, indices);
+    }
+
+    return vertices;
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+bvh_build_from_mesh(bvh_t* bvh, const mesh_t* mesh)
+{
+    wsret result;
+    wsreal_t* vertices = copy_mesh_vertices(mesh);
+    if (vertices == NULL)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+
+    result = bvh_build(bvh, vertices, mesh_face_count(mesh));
+    FREE(vertices);
+    return result;
+}
+
+/* ------------------------------------------------------------------------- */
+typedef void (*leaf_bounds_func)(const void* context, const bvh_node_t* leaf, wsreal_t bounds[6]);
+
+/*!
+ * Recomputes the bounds of all nodes. Children always come after their
+ * parent, so walking the nodes backwards visits both children of a node
+ * before the node itself.
+ */
+static void
+refit_nodes(bvh_node_t* nodes, uintptr_t node_count, leaf_bounds_func leaf_bounds, const void* context)
+{
+    uintptr_t i;
+    for (i = node_count; i-- > 0; )
+    {
+        int axis;
+        wsreal_t bounds[6];
+        bvh_node_t* node = &nodes[i];
+
+        aabb_clear(bounds);
+        if (node->count > 0)
+            leaf_bounds(context, node, bounds);
+        else
+        {
+            wsreal_t child[6];
+            for (axis = 0; axis != 6; ++axis)
+                child[axis] = nodes[i + 1].aabb[axis];
+            aabb_grow(bounds, child);
+            for (axis = 0; axis != 6; ++axis)
+                child[axis] = nodes[node->offset].aabb[axis];
+            aabb_grow(bounds, child);
+        }
+
+        for (axis = 0; axis != 3; ++axis)
+        {
+            node->aabb[axis] = round_down(bounds[axis]);
+            node->aabb[axis+3] = round_up(bounds[axis+3]);
+        }
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+typedef struct triangle_bounds_context_t
+{
+    const bvh_t* bvh;
+    const wsreal_t* vertices;
+} triangle_bounds_context_t;
+
+static void
+triangle_leaf_bounds(const void* context, const bvh_node_t* leaf, wsreal_t bounds[6])
+{
+    uint32_t slot;
+    const triangle_bounds_context_t* ctx = context;
+    for (slot = leaf->offset; slot != leaf->offset + leaf->count; ++slot)
+    {
+        int v, axis;
+        const wsreal_t* tri = ctx->vertices + ctx->bvh->triangle_ids[slot] * 9;
+        for (v = 0; v != 3; ++v)
+            for (axis = 0; axis != 3; ++axis)
+            {
+                if (bounds[axis]   > tri[v*3+axis]) bounds[axis]   = tri[v*3+axis];
+                if (bounds[axis+3] < tri[v*3+axis]) bounds[axis+3] = tri[v*3+axis];
+            }
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+void
+bvh_refit(bvh_t* bvh, const wsreal_t* vertices)
+{
+    uintptr_t slot;
+    triangle_bounds_context_t context;
+
+    for (slot = 0; slot != bvh->block_count * BVH_BLOCK_SIZE; ++slot)
+        if (bvh->triangle_ids[slot] != BVH_NO_TRIANGLE)
+            fill_block_lane(&bvh->blocks[slot / BVH_BLOCK_SIZE], slot % BVH_BLOCK_SIZE,
+                            vertices + bvh->triangle_ids[slot] * 9);
+
+    context.bvh = bvh;
+    context.vertices = vertices;
+    refit_nodes(bvh->nodes, bvh->node_count, triangle_leaf_bounds, &context);
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+bvh_refit_from_mesh(bvh_t* bvh, const mesh_t* mesh)
+{
+    wsreal_t* vertices = copy_mesh_vertices(mesh);
+    if (vertices == NULL)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+
+    bvh_refit(bvh, vertices);
+    FREE(vertices);
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Moeller-Trumbore against every lane of a block. Writes the distance and
+ * the barycentric coordinates u,v of every lane and returns a bit mask of the
+ * lanes that were hit in front of the ray. The arithmetic is done in the same
+ * order as in intersect_ray_triangle(), so both give identical results.
+ */
+#if defined(BVH_SIMD)
+#   if defined(__AVX__)
+#       define SIMD_LANES           4
+#       define simd_t               __m256d
+#       define simd_set1            _mm256_set1_pd
+#       define simd_load            _mm256_loadu_pd
+#       define simd_store           _mm256_storeu_pd
+#       define simd_add             _mm256_add_pd
+#       define simd_sub             _mm256_sub_pd
+#       define simd_mul             _mm256_mul_pd
+#       define simd_div             _mm256_div_pd
+#       define simd_and             _mm256_and_pd
+#       define simd_andnot          _mm256_andnot_pd
+#       define simd_ge(a, b)        _mm256_cmp_pd(a, b, _CMP_GE_OQ)
+#       define simd_le(a, b)        _mm256_cmp_pd(a, b, _CMP_LE_OQ)
+#       define simd_gt(a, b)        _mm256_cmp_pd(a, b, _CMP_GT_OQ)
+#       define simd_movemask        _mm256_movemask_pd
+#   else
+#       define SIMD_LANES           2
+#       define simd_t               __m128d
+#       define simd_set1            _mm_set1_pd
+#       define simd_load            _mm_loadu_pd
+#       define simd_store           _mm_storeu_pd
+#       define simd_add             _mm_add_pd
+#       define simd_sub             _mm_sub_pd
+#       define simd_mul             _mm_mul_pd
+#       define simd_div             _mm_div_pd
+#       define simd_and             _mm_and_pd
+#       define simd_andnot          _mm_andnot_pd
+#       define simd_ge              _mm_cmpge_pd
+#       define simd_le              _mm_cmple_pd
+#       define simd_gt              _mm_cmpgt_pd
+#       define simd_movemask        _mm_movemask_pd
+#   endif
+
+static unsigned
+intersect_block(const bvh_block_t* b,
+                const wsreal_t origin[3],
+                const wsreal_t direction[3],
+                wsreal_t t[BVH_BLOCK_SIZE],
+                wsreal_t u[BVH_BLOCK_SIZE],
+                wsreal_t v[BVH_BLOCK_SIZE])
+{
+    int lane;
+    unsigned mask = 0;
+    const simd_t ox = simd_set1(origin[0]), oy = simd_set1(origin[1]), oz = simd_set1(origin[2]);
+    const simd_t dx = simd_set1(direction[0]), dy = simd_set1(direction[1]), dz = simd_set1(direction[2]);
+    const simd_t zero = simd_set1(0.0), one = simd_set1(1.0), sign = simd_set1(-0.0);
+    const simd_t epsilon = simd_set1((double)FLT_EPSILON * (double)FLT_EPSILON);
+
+    for (lane = 0; lane != BVH_BLOCK_SIZE; lane += SIMD_LANES)
+    {
+        simd_t e1x = simd_load(b->e1[0] + lane), e1y = simd_load(b->e1[1] + lane), e1z = simd_load(b->e1[2] + lane);
+        simd_t e2x = simd_load(b->e2[0] + lane), e2y = simd_load(b->e2[1] + lane), e2z = simd_load(b->e2[2] + lane);
+        simd_t px, py, pz, qx, qy, qz, sx, sy, sz, det, inv, uu, vv, tt, hit;
+
+        /* p = d x e2 */
+        px = simd_sub(simd_mul(dy, e2z), simd_mul(e2y, dz));
+        py = simd_sub(simd_mul(dz, e2x), simd_mul(e2z, dx));
+        pz = simd_sub(simd_mul(dx, e2y), simd_mul(e2x, dy));
+        det = simd_add(simd_add(simd_mul(e1x, px), simd_mul(e1y, py)), simd_mul(e1z, pz));
+        inv = simd_div(one, det);
+
+        /* s = o - v0 */
+        sx = simd_sub(ox, simd_load(b->v0[0] + lane));
+        sy = simd_sub(oy, simd_load(b->v0[1] + lane));
+        sz = simd_sub(oz, simd_load(b->v0[2] + lane));
+        uu = simd_mul(simd_add(simd_add(simd_mul(sx, px), simd_mul(sy, py)), simd_mul(sz, pz)), inv);
+
+        /* q = s x e1 */
+        qx = simd_sub(simd_mul(sy, e1z), simd_mul(e1y, sz));
+        qy = simd_sub(simd_mul(sz, e1x), simd_mul(e1z, sx));
+        qz = simd_sub(simd_mul(sx, e1y), simd_mul(e1x, sy));
+        vv = simd_mul(simd_add(simd_add(simd_mul(dx, qx), simd_mul(dy, qy)), simd_mul(dz, qz)), inv);
+        tt = simd_mul(simd_add(simd_add(simd_mul(e2x, qx), simd_mul(e2y, qy)), simd_mul(e2z, qz)), inv);
+
+        hit = simd_ge(simd_andnot(sign, det), epsilon);
+        hit = simd_and(hit, simd_and(simd_ge(uu, zero), simd_le(uu, one)));
+        hit = simd_and(hit, simd_and(simd_ge(vv, zero), simd_le(simd_add(uu, vv), one)));
+        hit = simd_and(hit, simd_gt(tt, zero));
+
+        simd_store(t + lane, tt);
+        simd_store(u + lane, uu);
+        simd_store(v + lane, vv);
+        mask |= (unsigned)simd_movemask(hit) << lane;
+    }
+
+    return mask;
+}
+#else
+static unsigned
+intersect_block(const bvh_block_t* b,
+                const wsreal_t origin[3],
+                const wsreal_t direction[3],
+                wsreal_t t[BVH_BLOCK_SIZE],
+                wsreal_t u[BVH_BLOCK_SIZE],
+                wsreal_t v[BVH_BLOCK_SIZE])
+{
+    int lane;
+    unsigned mask = 0;
+    for (lane = 0; lane != BVH_BLOCK_SIZE; ++lane)
+    {
+        wsreal_t v0[3], v1[3], v2[3], bary[3];
+        int axis;
+        for (axis = 0; axis != 3; ++axis)
+        {
+            v0[axis] = b->v0[axis][lane];
+            v1[axis] = b->v0[axis][lane] + b->e1[axis][lane];
+            v2[axis] = b->v0[axis][lane] + b->e2[axis][lane];
+        }
+        if (intersect_ray_triangle(&t[lane], bary, origin, direction, v0, v1, v2))
+        {
+            u[lane] = bary[0];
+            v[lane] = bary[1];
+            mask |= 1u << lane;
+        }
+    }
+    return mask;
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Slab test. NaNs (from 0 * infinity when the ray lies in a slab plane) fail
+ * every comparison and leave the interval untouched.
+ */
+static int
+ray_hits_node(const bvh_node_t* node,
+              const wsreal_t origin[3],
+              const wsreal_t inv_direction[3],
+              wsreal_t max_distance)
+{
+    int axis;
+    wsreal_t t_near = 0.0, t_far = max_distance;
+    for (axis = 0; axis != 3; ++axis)
+    {
+        wsreal_t t1 = ((wsreal_t)node->aabb[axis]   - origin[axis]) * inv_direction[axis];
+        wsreal_t t2 = ((wsreal_t)node->aabb[axis+3] - origin[axis]) * inv_direction[axis];
+        if (t1 > t2)
+        {
+            wsreal_t tmp = t1;
+            t1 = t2;
+            t2 = tmp;
+        }
+        if (t1 > t_near) t_near = t1;
+        if (t2 < t_far)  t_far = t2;
+        if (t_near > t_far)
+            return 0;
+    }
+    return 1;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Intersects a ray with all triangles of a leaf and updates the hit if a
+ * closer triangle is found. Returns 1 if the hit was updated.
+ */
+static int
+intersect_leaf(const bvh_t* bvh,
+               const bvh_node_t* node,
+               const wsreal_t origin[3],
+               const wsreal_t direction[3],
+               wsreal_t* max_distance,
+               uint32_t ignore_triangle,
+               bvh_hit_t* hit)
+{
+    uintptr_t block;
+    int found = 0;
+    uintptr_t first = node->offset / BVH_BLOCK_SIZE;
+    uintptr_t last = ((uintptr_t)node->offset + node->count + BVH_BLOCK_SIZE - 1) / BVH_BLOCK_SIZE;
+
+    for (block = first; block != last; ++block)
+    {
+        wsreal_t t[BVH_BLOCK_SIZE], u[BVH_BLOCK_SIZE], v[BVH_BLOCK_SIZE];
+        unsigned lane, mask = intersect_block(&bvh->blocks[block], origin, direction, t, u, v);
+        for (lane = 0; mask != 0; ++lane, mask >>= 1)
+        {
+            uint32_t id = bvh->triangle_ids[block * BVH_BLOCK_SIZE + lane];
+            if (!(mask & 1) || id == ignore_triangle || t[lane] >= *max_distance)
+                continue;
+
+            *max_distance = t[lane];
+            found = 1;
+            if (hit == NULL)
+                return 1;
+            hit->distance = t[lane];
+            hit->bary[0] = u[lane];
+            hit->bary[1] = v[lane];
+            hit->bary[2] = 1.0 - u[lane] - v[lane];
+            hit->triangle = id;
+        }
+    }
+
+    return found;
+}
+
+/* ------------------------------------------------------------------------- */
+static int
+traverse(const bvh_t* bvh,
+         const wsreal_t origin[3],
+         const wsreal_t direction[3],
+         wsreal_t max_distance,
+         uint32_t ignore_triangle,
+         int any_hit,
+         bvh_hit_t* hit)
+{
+    uint32_t stack[BVH_STACK_SIZE];
+    int sp = 0, found = 0;
+    wsreal_t inv_direction[3];
+
+    if (bvh->node_count == 0)
+        return 0;
+
+    inv_direction[0] = 1.0 / direction[0];
+    inv_direction[1] = 1.0 / direction[1];
+    inv_direction[2] = 1.0 / direction[2];
+
+    stack[sp++] = 0;
+    while (sp > 0)
+    {
+        uint32_t index = stack[--sp];
+        const bvh_node_t* node = &bvh->nodes[index];
+        if (!ray_hits_node(node, origin, inv_direction, max_distance))
+            continue;
+
+        if (node->count > 0)
+        {
+            if (intersect_leaf(bvh, node, origin, direction, &max_distance,
+                               ignore_triangle, any_hit ? NULL : hit))
+            {
+                if (any_hit)
+                    return 1;
+                found = 1;
+            }
+        }
+        else
+        {
+            /* Visit the child on the near side of the split first */
+            if (direction[node->axis] < 0.0)
+            {
+                stack[sp++] = index + 1;
+                stack[sp++] = node->offset;
+            }
+            else
+            {
+                stack[sp++] = node->offset;
+                stack[sp++] = index + 1;
+            }
+        }
+    }
+
+    return found;
+}
+
+/* ------------------------------------------------------------------------- */
+int
+bvh_ray_first_hit(const bvh_t* bvh,
+                  const wsreal_t origin[3],
+                  const wsreal_t direction[3],
+                  wsreal_t max_distance,
+                  uint32_t ignore_triangle,
+                  bvh_hit_t* hit)
+{
+    return traverse(bvh, origin, direction, max_distance, ignore_triangle, 0, hit);
+}
+
+/* ------------------------------------------------------------------------- */
+int
+bvh_ray_any_hit(const bvh_t* bvh,
+                const wsreal_t origin[3],
+                const wsreal_t direction[3],
+                wsreal_t max_distance,
+                uint32_t ignore_triangle)
+{
+    return traverse(bvh, origin, direction, max_distance, ignore_triangle, 1, NULL);
+}
+
+/* ------------------------------------------------------------------------- */
+uintptr_t
+bvh_ray_packet_first_hit(const bvh_t* bvh,
+                         const bvh_ray_packet_t* packet,
+                         bvh_hit_t* hits,
+                         char* found)
+{
+    uint32_t stack[BVH_STACK_SIZE];
+    int sp = 0;
+    uintptr_t r, found_count = 0;
+    wsreal_t origin[BVH_PACKET_SIZE][3], direction[BVH_PACKET_SIZE][3];
+    wsreal_t inv_direction[BVH_PACKET_SIZE][3], max_distance[BVH_PACKET_SIZE];
+
+    for (r = 0; r != packet->count; ++r)
+    {
+        int axis;
+        for (axis = 0; axis != 3; ++axis)
+        {
+            origin[r][axis] = packet->origin[axis][r];
+            direction[r][axis] = packet->direction[axis][r];
+            inv_direction[r][axis] = 1.0 / direction[r][axis];
+        }
+        max_distance[r] = packet->max_distance[r];
+        found[r] = 0;
+    }
+
+    if (bvh->node_count == 0)
+        return 0;
+
+    stack[sp++] = 0;
+    while (sp > 0)
+    {
+        unsigned active = 0;
+        uint32_t index = stack[--sp];
+        const bvh_node_t* node = &bvh->nodes[index];
+
+        /* The node is visited once for all rays that pass through it */
+        for (r = 0; r != packet->count; ++r)
+            if (ray_hits_node(node, origin[r], inv_direction[r], max_distance[r]))
+                active |= 1u << r;
+        if (active == 0)
+            continue;
+
+        if (node->count > 0)
+        {
+            for (r = 0; r != packet->count; ++r)
+                if ((active & (1u << r)) &&
+                    intersect_leaf(bvh, node, origin[r], direction[r], &max_distance[r],
+                                   packet->ignore_triangle[r], &hits[r]))
+                    found[r] = 1;
+        }
+        else
+        {
+            /* Order by the first active ray, the others are assumed to be
+             * travelling in a similar direction */
+            for (r = 0; !(active & (1u << r)); ++r) {}
+            if (direction[r][node->axis] < 0.0)
+            {
+                stack[sp++] = index + 1;
+                stack[sp++] = node->offset;
+            }
+            else
+            {
+                stack[sp++] = node->offset;
+                stack[sp++] = index + 1;
+            }
+        }
+    }
+
+    for (r = 0; r != packet->count; ++r)
+        found_count += (uintptr_t)found[r];
+    return found_count;
+}
+
+/* ------------------------------------------------------------------------- */
+static int
+boxes_overlap(const wsreal_t a[6], const wsreal_t b[6])
+{
+    int i;
+    for (i = 0; i != 3; ++i)
+        if (a[i+3] < b[i] || a[i] > b[i+3])
+            return 0;
+    return 1;
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+bvh_query_aabb(const bvh_t* bvh, vector_t* result, const wsreal_t aabb[6])
+{
+    uint32_t stack[BVH_STACK_SIZE];
+    int sp = 0;
+
+    if (bvh->node_count == 0)
+        WSRET(WS_OK);
+
+    stack[sp++] = 0;
+    while (sp > 0)
+    {
+        int axis;
+        uint32_t i;
+        wsreal_t bb[6];
+        uint32_t index = stack[--sp];
+        const bvh_node_t* node = &bvh->nodes[index];
+        for (axis = 0; axis != 6; ++axis)
+            bb[axis] = node->aabb[axis];
+        if (!boxes_overlap(bb, aabb))
+            continue;
+
+        if (node->count == 0)
+        {
+            stack[sp++] = node->offset;
+            stack[sp++] = index + 1;
+            continue;
+        }
+
+        for (i = node->offset; i != node->offset + node->count; ++i)
+        {
+            const bvh_block_t* block = &bvh->blocks[i / BVH_BLOCK_SIZE];
+            uint32_t lane = i % BVH_BLOCK_SIZE;
+            uint32_t id = bvh->triangle_ids[i];
+            for (axis = 0; axis != 3; ++axis)
+            {
+                wsreal_t v0 = block->v0[axis][lane];
+                wsreal_t v1 = v0 + block->e1[axis][lane];
+                wsreal_t v2 = v0 + block->e2[axis][lane];
+                bb[axis]   = v0 < v1 ? (v0 < v2 ? v0 : v2) : (v1 < v2 ? v1 : v2);
+                bb[axis+3] = v0 > v1 ? (v0 > v2 ? v0 : v2) : (v1 > v2 ? v1 : v2);
+            }
+            if (boxes_overlap(bb, aabb) && vector_push(result, &id) == VECTOR_ERROR)
+                WSRET(WS_ERR_OUT_OF_MEMORY);
+        }
+    }
+
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+bvh_scene_construct(bvh_scene_t* scene)
+{
+    vector_construct(&scene->instances, sizeof(bvh_instance_t));
+    scene->nodes = NULL;
+    scene->node_count = 0;
+    scene->instance_ids = NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+free_top_level(bvh_scene_t* scene)
+{
+    if (scene->nodes != NULL)        FREE(scene->nodes);
+    if (scene->instance_ids != NULL) FREE(scene->instance_ids);
+    scene->nodes = NULL;
+    scene->node_count = 0;
+    scene->instance_ids = NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+void
+bvh_scene_destruct(bvh_scene_t* scene)
+{
+    free_top_level(scene);
+    vector_clear_free(&scene->instances);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Transforms the root bounds of the BLAS into world space. Each output
+ * extent is the translation plus the sum of the smaller (larger) of the
+ * matrix element times the lower and upper bounds (Arvo's method).
+ */
+static void
+update_instance_bounds(bvh_instance_t* instance)
+{
+    int i, j;
+    const bvh_node_t* root = instance->blas->nodes;
+
+    aabb_clear(instance->aabb);
+    if (instance->blas->node_count == 0)
+        return;
+
+    for (i = 0; i != 3; ++i)
+    {
+        instance->aabb[i] = instance->aabb[i+3] = instance->transform[i*4+3];
+        for (j = 0; j != 3; ++j)
+        {
+            wsreal_t a = instance->transform[i*4+j] * (wsreal_t)root->aabb[j];
+            wsreal_t b = instance->transform[i*4+j] * (wsreal_t)root->aabb[j+3];
+            instance->aabb[i]   += a < b ? a : b;
+            instance->aabb[i+3] += a < b ? b : a;
+        }
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+bvh_scene_add_instance(bvh_scene_t* scene, const bvh_t* blas, uint32_t first_triangle)
+{
+    static const wsreal_t identity[12] = {
+        1, 0, 0, 0,
+        0, 1, 0, 0,
+        0, 0, 1, 0
+    };
+    bvh_instance_t* instance = vector_emplace(&scene->instances);
+    if (instance == NULL)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+
+    instance->blas = blas;
+    instance->first_triangle = first_triangle;
+    memcpy(instance->transform, identity, sizeof(identity));
+    memcpy(instance->inverse, identity, sizeof(identity));
+    update_instance_bounds(instance);
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+bvh_scene_set_transform(bvh_scene_t* scene, uintptr_t index, const wsreal_t transform[12])
+{
+    int i, j;
+    wsreal_t det;
+    const wsreal_t* m = transform;
+    bvh_instance_t* instance = vector_get(&scene->instances, index);
+    wsreal_t* inv = instance->inverse;
+
+    memcpy(instance->transform, transform, sizeof(instance->transform));
+
+    /* Inverse of the 3x3 part from its adjugate */
+    inv[0] = m[5]*m[10] - m[6]*m[9];
+    inv[1] = m[2]*m[9]  - m[1]*m[10];
+    inv[2] = m[1]*m[6]  - m[2]*m[5];
+    inv[4] = m[6]*m[8]  - m[4]*m[10];
+    inv[5] = m[0]*m[10] - m[2]*m[8];
+    inv[6] = m[2]*m[4]  - m[0]*m[6];
+    inv[8] = m[4]*m[9]  - m[5]*m[8];
+    inv[9] = m[1]*m[8]  - m[0]*m[9];
+    inv[10] = m[0]*m[5] - m[1]*m[4];
+    det = m[0]*inv[0] + m[1]*inv[4] + m[2]*inv[8];
+    for (i = 0; i != 3; ++i)
+        for (j = 0; j != 3; ++j)
+            inv[i*4+j] /= det;
+
+    /* The translation moves the world origin back */
+    for (i = 0; i != 3; ++i)
+        inv[i*4+3] = -(inv[i*4+0]*m[3] + inv[i*4+1]*m[7] + inv[i*4+2]*m[11]);
+
+    update_instance_bounds(instance);
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+bvh_scene_build(bvh_scene_t* scene)
+{
+    wsret result;
+    uintptr_t i, count = 0;
+    vector_t nodes;
+    build_ref_t* refs;
+
+    free_top_level(scene);
+    refs = MALLOC(sizeof(build_ref_t) * (vector_count(&scene->instances) + 1));
+    if (refs == NULL)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+
+    /* Empty instances have inverted bounds, which would pass the slab test */
+    for (i = 0; i != vector_count(&scene->instances); ++i)
+    {
+        int axis;
+        const bvh_instance_t* instance = vector_get(&scene->instances, i);
+        if (instance->blas->node_count == 0)
+            continue;
+        memcpy(refs[count].aabb, instance->aabb, sizeof(instance->aabb));
+        for (axis = 0; axis != 3; ++axis)
+            refs[count].centroid[axis] = (instance->aabb[axis] + instance->aabb[axis+3]) * 0.5;
+        refs[count].id = (uint32_t)i;
+        ++count;
+    }
+    if (count == 0)
+    {
+        FREE(refs);
+        WSRET(WS_OK);
+    }
+
+    vector_construct(&nodes, sizeof(bvh_node_t));
+    if ((result = build_recursive(&nodes, refs, 0, count, 0)) != WS_OK)
+        goto out;
+
+    /* Leaves index the instance ids directly, there are no blocks */
+    scene->nodes = MALLOC(sizeof(bvh_node_t) * vector_count(&nodes));
+    scene->instance_ids = MALLOC(sizeof(uint32_t) * count);
+    if (scene->nodes == NULL || scene->instance_ids == NULL)
+    {
+        free_top_level(scene);
+        result = WS_ERR_OUT_OF_MEMORY;
+        goto out;
+    }
+    memcpy(scene->nodes, nodes.data, sizeof(bvh_node_t) * vector_count(&nodes));
+    scene->node_count = vector_count(&nodes);
+    for (i = 0; i != count; ++i)
+        scene->instance_ids[i] = refs[i].id;
+
+    out:
+    vector_clear_free(&nodes);
+    FREE(refs);
+    return result;
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+instance_leaf_bounds(const void* context, const bvh_node_t* leaf, wsreal_t bounds[6])
+{
+    uint32_t i;
+    const bvh_scene_t* scene = context;
+    for (i = leaf->offset; i != leaf->offset + leaf->count; ++i)
+    {
+        const bvh_instance_t* instance = vector_get(&scene->instances, scene->instance_ids[i]);
+        aabb_grow(bounds, instance->aabb);
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+void
+bvh_scene_refit(bvh_scene_t* scene)
+{
+    VECTOR_FOR_EACH(&scene->instances, bvh_instance_t, instance)
+        update_instance_bounds(instance);
+    VECTOR_END_EACH
+    refit_nodes(scene->nodes, scene->node_count, instance_leaf_bounds, scene);
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+transform_ray(const bvh_instance_t* instance,
+              const wsreal_t origin[3],
+              const wsreal_t direction[3],
+              wsreal_t local_origin[3],
+              wsreal_t local_direction[3])
+{
+    int i;
+    const wsreal_t* m = instance->inverse;
+    for (i = 0; i != 3; ++i)
+    {
+        local_origin[i] = m[i*4]*origin[0] + m[i*4+1]*origin[1] + m[i*4+2]*origin[2] + m[i*4+3];
+        local_direction[i] = m[i*4]*direction[0] + m[i*4+1]*direction[1] + m[i*4+2]*direction[2];
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+static uint32_t
+local_triangle(const bvh_instance_t* instance, uint32_t triangle)
+{
+    if (triangle == BVH_NO_TRIANGLE || triangle < instance->first_triangle ||
+        triangle - instance->first_triangle >= instance->blas->triangle_count)
+        return BVH_NO_TRIANGLE;
+    return triangle - instance->first_triangle;
+}
+
+/* ------------------------------------------------------------------------- */
+static int
+traverse_scene(const bvh_scene_t* scene,
+               const wsreal_t origin[3],
+               const wsreal_t direction[3],
+               wsreal_t max_distance,
+               uint32_t ignore_triangle,
+               int any_hit,
+               bvh_hit_t* hit)
+{
+    uint32_t stack[BVH_STACK_SIZE];
+    int sp = 0, found = 0;
+    wsreal_t inv_direction[3];
+
+    if (scene->node_count == 0)
+        return 0;
+
+    inv_direction[0] = 1.0 / direction[0];
+    inv_direction[1] = 1.0 / direction[1];
+    inv_direction[2] = 1.0 / direction[2];
+
+    stack[sp++] = 0;
+    while (sp > 0)
+    {
+        uint32_t i, index = stack[--sp];
+        const bvh_node_t* node = &scene->nodes[index];
+        if (!ray_hits_node(node, origin, inv_direction, max_distance))
+            continue;
+
+        if (node->count == 0)
+        {
+            if (direction[node->axis] < 0.0)
+            {
+                stack[sp++] = index + 1;
+                stack[sp++] = node->offset;
+            }
+            else
+            {
+                stack[sp++] = node->offset;
+                stack[sp++] = index + 1;
+            }
+            continue;
+        }
+
+        for (i = node->offset; i != node->offset + node->count; ++i)
+        {
+            wsreal_t local_origin[3], local_direction[3];
+            const bvh_instance_t* instance = vector_get(&scene->instances, scene->instance_ids[i]);
+            transform_ray(instance, origin, direction, local_origin, local_direction);
+            if (!traverse(instance->blas, local_origin, local_direction, max_distance,
+                          local_triangle(instance, ignore_triangle), any_hit, hit))
+                continue;
+
+            if (any_hit)
+                return 1;
+            max_distance = hit->distance;
+            hit->triangle += instance->first_triangle;
+            found = 1;
+        }
+    }
+
+    return found;
+}
+
+/* ------------------------------------------------------------------------- */
+int
+bvh_scene_ray_first_hit(const bvh_scene_t* scene,
+                        const wsreal_t origin[3],
+                        const wsreal_t direction[3],
+                        wsreal_t max_distance,
+                        uint32_t ignore_triangle,
+                        bvh_hit_t* hit)
+{
+    return traverse_scene(scene, origin, direction, max_distance, ignore_triangle, 0, hit);
+}
+
+/* ------------------------------------------------------------------------- */
+int
+bvh_scene_ray_any_hit(const bvh_scene_t* scene,
+                      const wsreal_t origin[3],
+                      const wsreal_t direction[3],
+                      wsreal_t max_distance,
+                      uint32_t ignore_triangle)
+{
+    return traverse_scene(scene, origin, direction, max_distance, ignore_triangle, 1, NULL);
+}
+
+/* ------------------------------------------------------------------------- */
+uintptr_t
+bvh_scene_ray_packet_first_hit(const bvh_scene_t* scene,
+                               const bvh_ray_packet_t* packet,
+                               bvh_hit_t* hits,
+                               char* found)
+{
+    uint32_t stack[BVH_STACK_SIZE];
+    int sp = 0;
+    uintptr_t r, found_count = 0;
+    wsreal_t origin[BVH_PACKET_SIZE][3], direction[BVH_PACKET_SIZE][3];
+    wsreal_t inv_direction[BVH_PACKET_SIZE][3], max_distance[BVH_PACKET_SIZE];
+
+    for (r = 0; r != packet->count; ++r)
+    {
+        int axis;
+        for (axis = 0; axis != 3; ++axis)
+        {
+            origin[r][axis] = packet->origin[axis][r];
+            direction[r][axis] = packet->direction[axis][r];
+            inv_direction[r][axis] = 1.0 / direction[r][axis];
+        }
+        max_distance[r] = packet->max_distance[r];
+        found[r] = 0;
+    }
+
+    if (scene->node_count == 0)
+        return 0;
+
+    stack[sp++] = 0;
+    while (sp > 0)
+    {
+        uint32_t i;
+        unsigned active = 0;
+        uint32_t index = stack[--sp];
+        const bvh_node_t* node = &scene->nodes[index];
+
+        for (r = 0; r != packet->count; ++r)
+            if (ray_hits_node(node, origin[r], inv_direction[r], max_distance[r]))
+                active |= 1u << r;
+        if (active == 0)
+            continue;
+
+        if (node->count == 0)
+        {
+            for (r = 0; !(active & (1u << r)); ++r) {}
+            if (direction[r][node->axis] < 0.0)
+            {
+                stack[sp++] = index + 1;
+                stack[sp++] = node->offset;
+            }
+            else
+            {
+                stack[sp++] = node->offset;
+                stack[sp++] = index + 1;
+            }
+            continue;
+        }
+
+        /* The active rays go through each instance as a smaller packet */
+        for (i = node->offset; i != node->offset + node->count; ++i)
+        {
+            bvh_ray_packet_t local;
+            bvh_hit_t local_hits[BVH_PACKET_SIZE];
+            char local_found[BVH_PACKET_SIZE];
+            uintptr_t k, ray_of[BVH_PACKET_SIZE];
+            const bvh_instance_t* instance = vector_get(&scene->instances, scene->instance_ids[i]);
+
+            local.count = 0;
+            for (r = 0; r != packet->count; ++r)
+            {
+                wsreal_t local_origin[3], local_direction[3];
+                int axis;
+                if (!(active & (1u << r)))
+                    continue;
+                k = local.count++;
+                transform_ray(instance, origin[r], direction[r], local_origin, local_direction);
+                for (axis = 0; axis != 3; ++axis)
+                {
+                    local.origin[axis][k] = local_origin[axis];
+                    local.direction[axis][k] = local_direction[axis];
+                }
+                local.max_distance[k] = max_distance[r];
+                local.ignore_triangle[k] = local_triangle(instance, packet->ignore_triangle[r]);
+                ray_of[k] = r;
+            }
+
+            if (bvh_ray_packet_first_hit(instance->blas, &local, local_hits, local_found) == 0)
+                continue;
+            for (k = 0; k != local.count; ++k)
+            {
+                if (!local_found[k])
+                    continue;
+                r = ray_of[k];
+                hits[r] = local_hits[k];
+                hits[r].triangle += instance->first_triangle;
+                max_distance[r] = hits[r].distance;
+                found[r] = 1;
+            }
+        }
+    }
+
+    for (r = 0; r != packet->count; ++r)
+        found_count += (uintptr_t)found[r];
+    return found_count;
+}
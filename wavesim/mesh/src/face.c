@@ -46,7 +46,7 @@ face_calculate_aabb(const face_t* face)
 void
 face_interpolate_attributes_barycentric(const face_t* face, attribute_t* attr, const wsreal_t bary[3])
 {
-    int i;
+    int i, band;
 
     attribute_set_zero(attr);
     for (i = 0; i != 3; ++i)
@@ -54,5 +54,10 @@ face_interpolate_attributes_barycentric(const face_t* face, attribute_t* attr, c
         attr->absorption   += face->vertices[i].attr.absorption   * bary[i];
         attr->reflection   += face->vertices[i].attr.reflection   * bary[i];
         attr->transmission += face->vertices[i].attr.transmission * bary[i];
+        for (band = 0; band != ATTRIBUTE_BAND_COUNT; ++band)
+        {
+            attr->band_absorption[band]   += face->vertices[i].attr.band_absorption[band]   * bary[i];
+            attr->band_transmission[band] += face->vertices[i].attr.band_transmission[band] * bary[i];
+        }
     }
 }
@@ -209,13 +209,60 @@ intersect_line_triangle_test(const wsreal_t p0[3], const wsreal_t p1[3],
     return intersect_line_triangle_barycentric(result.xyz, p0, p1, v0, v1, v2);
 }
 
+/* ------------------------------------------------------------------------- */
+int
+intersect_ray_triangle(wsreal_t* distance, wsreal_t bary[3],
+                       const wsreal_t origin[3], const wsreal_t direction[3],
+                       const wsreal_t v0[3], const wsreal_t v1[3], const wsreal_t v2[3])
+{
+    vec3_t e1, e2, p, q, s;
+    wsreal_t determinant, inv_determinant, u, v, t;
+
+    /*
+     * Algorithm taken from:
+     * Moeller, Trumbore, "Fast, Minimum Storage Ray/Triangle Intersection"
+     */
+    vec3_copy(&e1, v1); vec3_sub_vec3(e1.xyz, v0);
+    vec3_copy(&e2, v2); vec3_sub_vec3(e2.xyz, v0);
+
+    vec3_copy(&p, direction);
+    vec3_cross(p.xyz, e2.xyz);
+    determinant = vec3_dot(e1.xyz, p.xyz);
+    if (fabs(determinant) < FLT_EPSILON * FLT_EPSILON) /* ray is parallel to triangle */
+        return 0;
+    inv_determinant = 1.0 / determinant;
+
+    vec3_copy(&s, origin);
+    vec3_sub_vec3(s.xyz, v0);
+    u = vec3_dot(s.xyz, p.xyz) * inv_determinant;
+    if (u < 0.0 || u > 1.0)
+        return 0;
+
+    vec3_copy(&q, s.xyz);
+    vec3_cross(q.xyz, e1.xyz);
+    v = vec3_dot(direction, q.xyz) * inv_determinant;
+    if (v < 0.0 || u + v > 1.0)
+        return 0;
+
+    t = vec3_dot(e2.xyz, q.xyz) * inv_determinant;
+    if (t <= 0.0) /* triangle is behind the ray */
+        return 0;
+
+    *distance = t;
+    bary[0] = u;
+    bary[1] = v;
+    bary[2] = 1.0 - u - v;
+    return 1;
+}
+
 /* ------------------------------------------------------------------------- */
 int
 intersect_triangle_aabb_test(const wsreal_t v0[3], const wsreal_t v1[3], const wsreal_t v2[3],
                              const wsreal_t aabb[6])
 {
-    vec3_t c, v0c, v1c, v2c, f0, f1, f2;
-    wsreal_t e0, e1, e2, p0, p1, p2, r;
+    vec3_t c, v0c, v1c, v2c, f[3];
+    wsreal_t e[3];
+    int i, j;
 
     /* Calculate box center */
     vec3_copy(&c, aabb+3); /* copies second 3 elements of aabb, max */
@@ -223,9 +270,9 @@ intersect_triangle_aabb_test(const wsreal_t v0[3], const wsreal_t v1[3], const w
     vec3_mul_scalar(c.xyz, 0.5);;
 
     /* Calculate box extents */
-    e0 = (aabb[3] - aabb[0]) * 0.5;
-    e1 = (aabb[4] - aabb[1]) * 0.5;
-    e2 = (aabb[5] - aabb[2]) * 0.5;
+    e[0] = (aabb[3] - aabb[0]) * 0.5;
+    e[1] = (aabb[4] - aabb[1]) * 0.5;
+    e[2] = (aabb[5] - aabb[2]) * 0.5;
 
     /* Translate triangle as conceptually moving AABB to origin */
     vec3_copy(&v0c, v0); vec3_sub_vec3(v0c.xyz, c.xyz);
@@ -233,81 +280,39 @@ intersect_triangle_aabb_test(const wsreal_t v0[3], const wsreal_t v1[3], const w
     vec3_copy(&v2c, v2); vec3_sub_vec3(v2c.xyz, c.xyz);
 
     /* Calculate edge vectors of triangle */
-    vec3_copy(&f0, v1); vec3_sub_vec3(f0.xyz, v0);
-    vec3_copy(&f1, v2); vec3_sub_vec3(f1.xyz, v1);
-    vec3_copy(&f2, v0); vec3_sub_vec3(f2.xyz, v2);
+    vec3_copy(&f[0], v1); vec3_sub_vec3(f[0].xyz, v0);
+    vec3_copy(&f[1], v2); vec3_sub_vec3(f[1].xyz, v1);
+    vec3_copy(&f[2], v0); vec3_sub_vec3(f[2].xyz, v2);
 
     /*
-     * n00 = u0 x f0 = (1,0,0) x f0 = (0,-f0z,f0y)
-     * n01 = u0 x f1 = (1,0,0) x f1 = (0,-f1z,f1y)
-     * n02 = u0 x f2 = (1,0,0) x f2 = (0,-f2z,f2y)
-     * n10 = u1 x f0 = (0,1,0) x f0 = (f0z,0,-f0x)
-     * n11 = u1 x f1 = (0,1,0) x f1 = (f1z,0,-f1x)
-     * n12 = u1 x f2 = (0,1,0) x f2 = (f2z,0,-f2x)
-     * n20 = u2 x f0 = (0,0,1) x f0 = (-f0y,f0x,0)
-     * n21 = u2 x f1 = (0,0,1) x f1 = (-f1y,f1x,0)
-     * n22 = u2 x f2 = (0,0,1) x f2 = (-f2y,f2x,0)
-     *
-     * p0 = v0*n
-     * p1 = v1*n
-     * p2 = v2*n
-     * r = e0|u0*n| + e1|u1*n| + e2|u2*n|
+     * Test the 9 axes a = u_i x f_j, where u_i are the box axes. The triangle
+     * projects onto [min(p0,p1,p2), max(p0,p1,p2)] with p_k = v_k.a, the box
+     * onto [-r,r] with r = e0|a.x| + e1|a.y| + e2|a.z|.
      */
-
-    /* n00: p0=v0z*v1y - v0y*v1z, p2=v2z*f0y - v2y*f0z */
-    p0 = v0c.v.z*v1c.v.y - v0c.v.y*v1c.v.z;
-    p2 = v2c.v.z*f0.v.y - v2c.v.z*f0.v.z;
-    r = e1*fabs(f0.v.z) + e2*fabs(f0.v.y);
-    if (fmax(p0, p2) < -r || fmin(p0, p2) > r) return 0; /* Axis is a separating axis */
-    /* n01: p0=v0z*f1y - v0y*f1z, p1=v2y*v1z - v1y*v2z */
-    p0 = v0c.v.z*f1.v.y - v0c.v.y*f1.v.z;
-    p1 = v2c.v.y*v1c.v.z - v1c.v.y*v2c.v.z;
-    r = e1*fabs(f1.v.z) + e2*fabs(f1.v.y);
-    if (fmax(p0, p1) < -r || fmin(p0, p1) > r) return 0;
-    /* n02: p0=v0y*v2z - v2y*v0z, p1=v1z*f2y - v1y*f2z */
-    p0 = v0c.v.y*v2c.v.z - v2c.v.y*v0c.v.z;
-    p1 = v1c.v.z*f2.v.y - v1c.v.y*f2.v.z;
-    r = e1*fabs(f2.v.z) + e2*fabs(f2.v.y);
-    if (fmax(p0, p1) < -r || fmin(p0, p1) > r) return 0;
-    /* n10: p0=v0x*v1z - v1x*v0z, p2=v2z*f0x - v2x*f0z */
-    p0 = v0c.v.x*v1c.v.z - v1c.v.x*v0c.v.z;
-    p2 = v2c.v.z*f0.v.x - v2c.v.x*f0.v.z;
-    r = e0*fabs(f0.v.z) + e2*fabs(f0.v.x);
-    if (fmax(p0, p2) < -r || fmin(p0, p2) > r) return 0;
-    /* n11: p0=v0z*f1x - v0x*f1z, p1=v1x*v2z - v2x*v1z */
-    p0 = v0c.v.z*f1.v.x - v0c.v.x*f1.v.z;
-    p1 = v1c.v.x*v2c.v.z - v2c.v.x*v1c.v.z;
-    r = e0*fabs(f1.v.z) + e2*fabs(f1.v.x);
-    if (fmax(p0, p1) < -r || fmin(p0, p1) > r) return 0;
-    /* n12: p0=v2x*v0z - v0x*v2z, p1=v1x*f2z - v1z*f2x */
-    p0 = v2c.v.x*v0c.v.z - v0c.v.x*v2c.v.z;
-    p1 = v1c.v.x*f2.v.z - v1c.v.z*f2.v.x;
-    r = e0*fabs(f2.v.z) + e2*fabs(f2.v.x);
-    if (fmax(p0, p1) < -r || fmin(p0, p1) > r) return 0;
-    /* n20: p0=v1x*v0y - v0x*v1y, p2=v2x*f0y - v2y*f0x */
-    p0 = v1c.v.x*v0c.v.y - v0c.v.x*v1c.v.y;
-    p2 = v2c.v.x*f0.v.y - v2c.v.y*f0.v.x;
-    r = e0*fabs(f0.v.y) + e1*fabs(f0.v.x);
-    if (fmax(p0, p2) < -r || fmin(p0, p2) > r) return 0;
-    /* n21: p0=v0x*f1y - v0y*f1x, p1=v2x*v1y - v1x*v2y */
-    p0 = v0c.v.x*f1.v.y - v0c.v.y*f1.v.x;
-    p1 = v2c.v.x*v1c.v.y - v1c.v.x*v2c.v.y;
-    r = e0*fabs(f1.v.y) + e1*fabs(f1.v.x);
-    if (fmax(p0, p1) < -r || fmin(p0, p1) > r) return 0;
-    /* n22: p0=v0x*v2y - v2x*v0y, p1=v1y*f2x - v1x*f2y */
-    p0 = v0c.v.x*v2c.v.y - v2c.v.x*v0c.v.y;
-    p1 = v1c.v.y*f2.v.x - v1c.v.x*f2.v.y;
-    r = e0*fabs(f2.v.y) + e1*fabs(f2.v.x);
-    if (fmax(p0, p1) < -r || fmin(p0, p1) > r) return 0;
+    for (i = 0; i != 3; ++i)
+        for (j = 0; j != 3; ++j)
+        {
+            vec3_t a;
+            wsreal_t p0, p1, p2, r;
+            vec3_set_zero(a.xyz);
+            a.xyz[i] = 1.0;
+            vec3_cross(a.xyz, f[j].xyz);
+            p0 = vec3_dot(v0c.xyz, a.xyz);
+            p1 = vec3_dot(v1c.xyz, a.xyz);
+            p2 = vec3_dot(v2c.xyz, a.xyz);
+            r = e[0]*fabs(a.v.x) + e[1]*fabs(a.v.y) + e[2]*fabs(a.v.z);
+            if (fmax(fmax(p0, p1), p2) < -r || fmin(fmin(p0, p1), p2) > r)
+                return 0; /* Axis is a separating axis */
+        }
 
     /* Test the three axes corresponding to the face normals of AABB b */
     /* Exit if... */
     /* ... [-e0,e0] and [min(v1x,v2x,v3x), max(v1x,v2x,v3x)] do not overlap */
-    if (fmax(fmax(v0c.v.x, v1c.v.x), v2c.v.x) < -e0 || fmin(fmin(v0c.v.x, v1c.v.x), v2c.v.x) > e0) return 0;
+    if (fmax(fmax(v0c.v.x, v1c.v.x), v2c.v.x) < -e[0] || fmin(fmin(v0c.v.x, v1c.v.x), v2c.v.x) > e[0]) return 0;
     /* ... [-e1,e1] and [min(v1y,v2y,v3y), max(v1y,v2y,v3y)] do not overlap */
-    if (fmax(fmax(v0c.v.y, v1c.v.y), v2c.v.y) < -e1 || fmin(fmin(v0c.v.y, v1c.v.y), v2c.v.y) > e1) return 0;
+    if (fmax(fmax(v0c.v.y, v1c.v.y), v2c.v.y) < -e[1] || fmin(fmin(v0c.v.y, v1c.v.y), v2c.v.y) > e[1]) return 0;
     /* ... [-e2,e2] and [min(v1z,v2z,v3z), max(v1z,v2z,v3z)] do not overlap */
-    if (fmax(fmax(v0c.v.z, v1c.v.z), v2c.v.z) < -e2 || fmin(fmin(v0c.v.z, v1c.v.z), v2c.v.z) > e2) return 0;
+    if (fmax(fmax(v0c.v.z, v1c.v.z), v2c.v.z) < -e[2] || fmin(fmin(v0c.v.z, v1c.v.z), v2c.v.z) > e[2]) return 0;
 
     /* Test separating axis corresponding to triangle face normal */
     return intersect_plane_aabb_test(v0, v1, v2, aabb);
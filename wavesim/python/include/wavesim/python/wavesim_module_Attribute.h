@@ -13,3 +13,10 @@ PyTypeObject wavesim_AttributeType;
 
 int
 wavesim_init_Attribute(void);
+
+/*!
+ * @brief Converts to an attribute_t. Python only exposes the broadband values,
+ * so every band is set from them.
+ */
+attribute_t
+wavesim_Attribute_to_attribute(const wavesim_Attribute* self);
@@ -28,6 +28,18 @@ Attribute_init(wavesim_Attribute* self, PyObject* args, PyObject* kwds)
     return 0;
 }
 
+/* ------------------------------------------------------------------------- */
+attribute_t
+wavesim_Attribute_to_attribute(const wavesim_Attribute* self)
+{
+    attribute_t attr = attribute_default_solid();
+    attr.reflection = self->reflection;
+    attr.transmission = self->transmission;
+    attr.absorption = self->absorption;
+    attribute_set_uniform_bands(&attr);
+    return attr;
+}
+
 /* ------------------------------------------------------------------------- */
 static PyObject*
 Attribute_repr(wavesim_Attribute* self)
@@ -102,28 +102,22 @@ Mesh_add_face(wavesim_Mesh* self, wavesim_Face* pyFace)
             PyFloat_AsDouble(PyTuple_GetItem(((wavesim_Vertex*)PyTuple_GetItem(pyFace->vertices, 0))->position, 0)),
             PyFloat_AsDouble(PyTuple_GetItem(((wavesim_Vertex*)PyTuple_GetItem(pyFace->vertices, 0))->position, 1)),
             PyFloat_AsDouble(PyTuple_GetItem(((wavesim_Vertex*)PyTuple_GetItem(pyFace->vertices, 0))->position, 2))
-        ), attribute(
-            ((wavesim_Vertex*)PyTuple_GetItem(pyFace->vertices, 0))->attr->reflection,
-            ((wavesim_Vertex*)PyTuple_GetItem(pyFace->vertices, 0))->attr->transmission,
-            ((wavesim_Vertex*)PyTuple_GetItem(pyFace->vertices, 0))->attr->absorption
+        ), wavesim_Attribute_to_attribute(
+            ((wavesim_Vertex*)PyTuple_GetItem(pyFace->vertices, 0))->attr
         )),
         vertex(vec3(
             PyFloat_AsDouble(PyTuple_GetItem(((wavesim_Vertex*)PyTuple_GetItem(pyFace->vertices, 1))->position, 0)),
             PyFloat_AsDouble(PyTuple_GetItem(((wavesim_Vertex*)PyTuple_GetItem(pyFace->vertices, 1))->position, 1)),
             PyFloat_AsDouble(PyTuple_GetItem(((wavesim_Vertex*)PyTuple_GetItem(pyFace->vertices, 1))->position, 2))
-        ), attribute(
-            ((wavesim_Vertex*)PyTuple_GetItem(pyFace->vertices, 1))->attr->reflection,
-            ((wavesim_Vertex*)PyTuple_GetItem(pyFace->vertices, 1))->attr->transmission,
-            ((wavesim_Vertex*)PyTuple_GetItem(pyFace->vertices, 1))->attr->absorption
+        ), wavesim_Attribute_to_attribute(
+            ((wavesim_Vertex*)PyTuple_GetItem(pyFace->vertices, 1))->attr
         )),
         vertex(vec3(
             PyFloat_AsDouble(PyTuple_GetItem(((wavesim_Vertex*)PyTuple_GetItem(pyFace->vertices, 2))->position, 0)),
             PyFloat_AsDouble(PyTuple_GetItem(((wavesim_Vertex*)PyTuple_GetItem(pyFace->vertices, 2))->position, 1)),
             PyFloat_AsDouble(PyTuple_GetItem(((wavesim_Vertex*)PyTuple_GetItem(pyFace->vertices, 2))->position, 2))
-        ), attribute(
-            ((wavesim_Vertex*)PyTuple_GetItem(pyFace->vertices, 2))->attr->reflection,
-            ((wavesim_Vertex*)PyTuple_GetItem(pyFace->vertices, 2))->attr->transmission,
-            ((wavesim_Vertex*)PyTuple_GetItem(pyFace->vertices, 2))->attr->absorption
+        ), wavesim_Attribute_to_attribute(
+            ((wavesim_Vertex*)PyTuple_GetItem(pyFace->vertices, 2))->attr
         ))
     );
     if (mesh_builder_add_face(self->mesh_builder, f) != 0)
@@ -4,6 +4,7 @@
 #include "wavesim/config.h"
 #include "wavesim/vec3.h"
 #include "wavesim/vector.h"
+#include "wavesim/mesh/attribute.h"
 
 C_BEGIN
 
@@ -17,6 +18,13 @@ typedef struct audio_listener_t
     vector_t samples;    /* wsreal_t */
     wsreal_t fs;         /* sampling frequency of the audio data in Hz */
     wsreal_t t;          /* Current position in time of the active sample */
+    vector_t energy;     /* wsreal_t, time-binned energy histogram. Filled by
+                          * backends that don't simulate pressure (e.g. ray
+                          * tracing) */
+    wsreal_t energy_bin_width; /* Duration of each histogram bin in seconds */
+    vector_t band_energy[ATTRIBUTE_BAND_COUNT]; /* wsreal_t, the same histogram
+                          * per octave band, filled by frequency dependent
+                          * backends. energy is then the mean of the bands */
 
 } audio_listener_t;
 
@@ -38,6 +46,96 @@ audio_listener_reset(audio_listener_t* al);
 WAVESIM_PRIVATE_API wsret
 audio_listener_add_sample(audio_listener_t* al, wsreal_t dt, wsreal_t sample);
 
+/*!
+ * @brief Adds energy arriving at the specified time to the histogram. The
+ * histogram grows as necessary.
+ * @param[in] time Seconds since the simulation started.
+ * @param[in] energy Energy to add to the bin containing time.
+ */
+WAVESIM_PRIVATE_API wsret
+audio_listener_add_energy(audio_listener_t* al, wsreal_t time, wsreal_t energy);
+
+/*!
+ * @brief Adds a range of histogram bins, e.g. a histogram accumulated
+ * separately, to the histogram. The histogram grows as necessary.
+ * @param[in] first_bin Index of the bin bins[0] is added to.
+ * @param[in] bins Energies, one per bin.
+ * @param[in] count Number of bins to add.
+ */
+WAVESIM_PRIVATE_API wsret
+audio_listener_add_energy_bins(audio_listener_t* al,
+                               uintptr_t first_bin,
+                               const wsreal_t* bins,
+                               uintptr_t count);
+
+/*!
+ * @brief Adds energy arriving at the specified time to every band histogram
+ * and their mean to the broadband histogram.
+ * @param[in] time Seconds since the simulation started.
+ * @param[in] energy Energy to add to each band.
+ */
+WAVESIM_PRIVATE_API wsret
+audio_listener_add_band_energy(audio_listener_t* al,
+                               wsreal_t time,
+                               const wsreal_t energy[ATTRIBUTE_BAND_COUNT]);
+
+/*!
+ * @brief Adds a range of bins to the histogram of one band, like
+ * audio_listener_add_energy_bins(). The broadband histogram is not updated,
+ * call audio_listener_mix_bands() afterwards.
+ */
+WAVESIM_PRIVATE_API wsret
+audio_listener_add_band_energy_bins(audio_listener_t* al,
+                                    int band,
+                                    uintptr_t first_bin,
+                                    const wsreal_t* bins,
+                                    uintptr_t count);
+
+/*!
+ * @brief Replaces the broadband histogram with the mean of the band
+ * histograms.
+ */
+WAVESIM_PRIVATE_API wsret
+audio_listener_mix_bands(audio_listener_t* al);
+
+/*!
+ * @brief Treats the recorded samples as an impulse response and truncates
+ * them at the point where the Schroeder decay curve (backward-integrated
+ * energy relative to the total energy) falls below the specified level.
+ * @param[in] al The listener to trim.
+ * @param[in] decay_threshold Level in dB, e.g. -60.
+ * @return Returns the new number of samples.
+ */
+WAVESIM_PRIVATE_API uintptr_t
+audio_listener_trim_to_decay(audio_listener_t* al, wsreal_t decay_threshold);
+
+/*!
+ * @brief Replaces the late part of the energy histogram with an exponential
+ * decay fitted to its Schroeder curve. Stochastic backends need far fewer
+ * rays for the early, strong part of the histogram than for the late, weak
+ * part, which this makes up for.
+ *
+ * A line is fitted to the Schroeder curve (in dB) between fit_begin and
+ * fit_end. All bins after fit_end are then replaced by the model, and the
+ * histogram is extended or truncated until the model falls below stop.
+ * Histograms without enough dynamic range to fit are left unchanged.
+ *
+ * If the listener has band histograms, every band is extrapolated on its own
+ * (the bands decay at different rates) and the broadband histogram is mixed
+ * from them again.
+ * @param[in] fit_begin Start of the fitted range in dB, e.g. -5.
+ * @param[in] fit_end End of the fitted range in dB, e.g. -25.
+ * @param[in] stop Level in dB at which the histogram ends, e.g. -60.
+ * @param[in] max_duration The histogram is never extended past this time.
+ * @return Returns WS_OK on success.
+ */
+WAVESIM_PRIVATE_API wsret
+audio_listener_extrapolate_energy_tail(audio_listener_t* al,
+                                       wsreal_t fit_begin,
+                                       wsreal_t fit_end,
+                                       wsreal_t stop,
+                                       wsreal_t max_duration);
+
 C_END
 
 #endif /* WAVESIM_AUDIO_LISTENER_H */
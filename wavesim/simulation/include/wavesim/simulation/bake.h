@@ -0,0 +1,134 @@
+/*!
+ * @file bake.h
+ * @brief Bakes a filter lattice for a whole level.
+ * @page bake Bake
+ *
+ * A bake runs one impulse-response simulation per listener probe. Probes are
+ * placed on a regular grid spanning the medium, skipping all points that lie
+ * inside solid partitions or outside of the medium. Thanks to acoustic
+ * reciprocity, each run places a single Dirac source at the probe and one
+ * listener at every (non-solid) emitter lattice point, so a single run yields
+ * the filters of all emitters for that probe.
+ *
+ * Work is distributed on two levels:
+ *
+ *   + Across processes (or machines): Every process is given the same
+ *     settings except for process_index. The probes are dealt out round-robin,
+ *     and each process writes its own shard file.
+ *   + Across cores: Within a process, threads pull probes from a shared
+ *     counter. Every thread prepares its simulation once and reuses the
+ *     prepared state for all of its probes.
+ *
+ * Next to every shard, a manifest records which probes have been completed.
+ * Entries are only added to the manifest after the shard has been flushed, so
+ * if a bake is killed, constructing it again with the same settings skips all
+ * probes that were completed. Resuming cuts the shard back to the end of the
+ * last entry the manifest lists, and bake_merge() reads entries at the offsets
+ * the manifest lists, so partial entries of a killed bake are never read. Once
+ * all processes are done, bake_merge() combines the shards into a single
+ * filter lattice file.
+ *
+ * Shard files consist of a filter_lattice_header_t followed by entries of a
+ * uint32_t probe index, 4 reserved bytes and the block of records of that
+ * probe (see filter_lattice.h).
+ */
+
+#ifndef WAVESIM_BAKE_H
+#define WAVESIM_BAKE_H
+
+#include "wavesim/config.h"
+#include "wavesim/vector.h"
+#include "wavesim/simulation/filter_lattice.h"
+
+C_BEGIN
+
+typedef struct simulation_t simulation_t;
+typedef struct medium_t medium_t;
+
+/*!
+ * A probe listed in a manifest, and where its entry starts in the shard.
+ */
+typedef struct bake_entry_t
+{
+    uintptr_t offset;
+    uint32_t probe;
+} bake_entry_t;
+
+typedef struct bake_settings_t
+{
+    wsreal_t probe_spacing;    /* Distance between listener probes in meters */
+    wsreal_t emitter_spacing;  /* Distance between emitter lattice points in meters */
+    wsreal_t sample_rate;      /* Of the recorded impulse responses */
+    uintptr_t thread_count;    /* 0 uses one thread per logical processor */
+    uintptr_t process_index;   /* Which share of the probes this process bakes */
+    uintptr_t process_count;
+    const char* output_prefix; /* Shards and manifests are named
+                                * <prefix>.<process_index>.shard/.manifest */
+} bake_settings_t;
+
+typedef struct bake_t
+{
+    bake_settings_t settings;
+    const simulation_t* simulation;
+    filter_lattice_header_t header;
+    uintptr_t listener_point_count;
+    uintptr_t emitter_point_count;
+    vector_t pending;          /* uint32_t, probes this process still has to bake */
+    vector_t emitters;         /* uint32_t, emitter lattice points not inside solid partitions */
+    uintptr_t completed;       /* Probes of this process that are done, including previous runs */
+    vector_t entries;          /* bake_entry_t, complete entries of previous runs */
+    char* shard_file_name;
+    char* manifest_file_name;
+} bake_t;
+
+/*!
+ * @brief Fills in sensible defaults: 2m probe spacing, 1m emitter spacing,
+ * 48kHz, one thread per core, a single process and "bake" as the output
+ * prefix.
+ */
+WAVESIM_PUBLIC_API void
+bake_settings_set_default(bake_settings_t* settings);
+
+/*!
+ * @brief Generates the probe grid and determines which probes of this
+ * process still have to be baked, by reading the manifest of a previous bake
+ * if it exists.
+ * @param[in] simulation Template for the simulations. Its backend, resolution,
+ * impulse-response mode and ray settings are copied, as are its meshes and user data.
+ * Its sources, listeners and advance callback are ignored.
+ * @param[in] medium Used to place the probes. Must have at least one
+ * partition.
+ * @return Returns WS_ERR_BAD_FILE_FORMAT if an existing manifest or shard
+ * belongs to a bake with different settings.
+ */
+WAVESIM_PUBLIC_API wsret WAVESIM_WARN_UNUSED
+bake_construct(bake_t* bake,
+               const simulation_t* simulation,
+               const medium_t* medium,
+               const bake_settings_t* settings);
+
+WAVESIM_PUBLIC_API void
+bake_destruct(bake_t* bake);
+
+/*!
+ * @brief Bakes all pending probes of this process. If this fails, the probes
+ * completed so far are kept and the bake can be resumed.
+ */
+WAVESIM_PUBLIC_API wsret WAVESIM_WARN_UNUSED
+bake_run(bake_t* bake);
+
+#define bake_remaining(bake) \
+        vector_count(&(bake)->pending)
+
+/*!
+ * @brief Combines the shards of all processes into a filter lattice file.
+ * Probes that haven't been baked have no data, including all probes of a
+ * process that has no shard yet.
+ * @return Returns WS_ERR_FOPEN_FAILED if none of the processes has a shard.
+ */
+WAVESIM_PUBLIC_API wsret WAVESIM_WARN_UNUSED
+bake_merge(const char* output_prefix, uintptr_t process_count, const char* file_name);
+
+C_END
+
+#endif /* WAVESIM_BAKE_H */
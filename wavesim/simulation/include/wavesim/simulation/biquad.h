@@ -0,0 +1,58 @@
+#ifndef WAVESIM_BIQUAD_H
+#define WAVESIM_BIQUAD_H
+
+#include "wavesim/config.h"
+
+C_BEGIN
+
+/*!
+ * Second order IIR filter in transposed direct form II. Coefficients are
+ * normalized so a0 = 1.
+ */
+typedef struct biquad_t
+{
+    wsreal_t b0, b1, b2;
+    wsreal_t a1, a2;
+    wsreal_t z1, z2;
+} biquad_t;
+
+/*!
+ * @brief Configures a band-pass filter with 0 dB gain at the center frequency.
+ * @param[in] center_frequency Center frequency in Hz.
+ * @param[in] sample_rate Sample rate in Hz.
+ * @param[in] bandwidth Bandwidth in octaves.
+ */
+WAVESIM_PRIVATE_API void
+biquad_set_bandpass(biquad_t* bq, wsreal_t center_frequency, wsreal_t sample_rate, wsreal_t bandwidth);
+
+/*!
+ * @brief Configures a second order low-pass filter.
+ * @param[in] cutoff_frequency -3 dB frequency in Hz for q = 1/sqrt(2).
+ * @param[in] sample_rate Sample rate in Hz.
+ * @param[in] q Quality factor. 1/sqrt(2) gives a Butterworth response, two of
+ * which in series form a 4th order Linkwitz-Riley filter.
+ */
+WAVESIM_PRIVATE_API void
+biquad_set_lowpass(biquad_t* bq, wsreal_t cutoff_frequency, wsreal_t sample_rate, wsreal_t q);
+
+/*!
+ * @brief Configures a second order high-pass filter. See biquad_set_lowpass().
+ */
+WAVESIM_PRIVATE_API void
+biquad_set_highpass(biquad_t* bq, wsreal_t cutoff_frequency, wsreal_t sample_rate, wsreal_t q);
+
+/*!
+ * @brief Clears the filter state without touching the coefficients.
+ */
+WAVESIM_PRIVATE_API void
+biquad_reset(biquad_t* bq);
+
+/*!
+ * @brief Filters a single sample.
+ */
+WAVESIM_PRIVATE_API wsreal_t
+biquad_process(biquad_t* bq, wsreal_t x);
+
+C_END
+
+#endif /* WAVESIM_BIQUAD_H */
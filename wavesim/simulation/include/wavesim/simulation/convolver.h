@@ -0,0 +1,117 @@
+/*!
+ * @file convolver.h
+ * @brief Low-latency uniformly-partitioned overlap-save convolution.
+ * @page convolver Convolver
+ *
+ * Renders dry audio through an impulse response (e.g. one recorded by an
+ * audio_listener_t) in blocks of a fixed size. The impulse response is split
+ * into partitions of the block size, each of which is transformed once into
+ * the frequency domain and stored in a convolver_ir_t. Every voice that
+ * should be rendered through that impulse response gets its own convolver_t,
+ * which holds a frequency-domain delay line (FDL) of the spectra of its most
+ * recent input blocks.
+ *
+ * Processing one block costs one forward FFT, one complex multiply-accumulate
+ * per partition and one inverse FFT. The latency is exactly one block.
+ *
+ * When many voices share the same impulse response, use
+ * convolver_process_batch(). It walks the partitions in the outer loop and
+ * the voices in the inner loop, so each partition spectrum is loaded into the
+ * cache once per block instead of once per voice.
+ */
+
+#ifndef WAVESIM_CONVOLVER_H
+#define WAVESIM_CONVOLVER_H
+
+#include "wavesim/config.h"
+
+C_BEGIN
+
+typedef struct convolver_ir_t
+{
+    uintptr_t block_size;      /* Number of samples processed per call */
+    uintptr_t partition_count; /* Number of block_size long IR partitions */
+    uintptr_t bin_count;       /* Number of complex bins of one partition spectrum */
+    uintptr_t stride;          /* bin_count rounded up to keep the partitions aligned */
+    double*   re;              /* partition_count*stride, real parts of the spectra */
+    double*   im;              /* partition_count*stride, imaginary parts of the spectra */
+    void*     forward_plan;    /* fftw_plan, real to split-complex, 2*block_size points */
+    void*     inverse_plan;    /* fftw_plan, split-complex to real, 2*block_size points */
+} convolver_ir_t;
+
+typedef struct convolver_t
+{
+    const convolver_ir_t* ir;
+    uintptr_t fdl_head;        /* Partition slot holding the most recent input spectrum */
+    double*   fdl_re;          /* partition_count*stride, input spectra delay line */
+    double*   fdl_im;
+    double*   acc_re;          /* stride, accumulated output spectrum */
+    double*   acc_im;
+    double*   input;           /* 2*block_size, previous and current input block */
+    double*   output;          /* 2*block_size, result of the inverse transform */
+} convolver_t;
+
+/*!
+ * @brief Partitions and transforms an impulse response.
+ * @param[in] ir The object to initialize.
+ * @param[in] samples The impulse response.
+ * @param[in] sample_count Number of samples in the impulse response. The
+ * impulse response is zero-padded to a multiple of block_size.
+ * @param[in] block_size Number of samples processed per call. This is also the
+ * latency of the convolution. Must be greater than 0.
+ * @return Returns WS_OK on success.
+ */
+WAVESIM_PUBLIC_API wsret WAVESIM_WARN_UNUSED
+convolver_ir_construct(convolver_ir_t* ir,
+                       const wsreal_t* samples,
+                       uintptr_t sample_count,
+                       uintptr_t block_size);
+
+WAVESIM_PUBLIC_API void
+convolver_ir_destruct(convolver_ir_t* ir);
+
+/*!
+ * @brief Initializes a voice that renders audio through the specified impulse
+ * response. The impulse response must outlive the voice.
+ */
+WAVESIM_PUBLIC_API wsret WAVESIM_WARN_UNUSED
+convolver_construct(convolver_t* convolver, const convolver_ir_t* ir);
+
+WAVESIM_PUBLIC_API void
+convolver_destruct(convolver_t* convolver);
+
+/*!
+ * @brief Clears the delay line, as if the voice had only ever received
+ * silence.
+ */
+WAVESIM_PUBLIC_API void
+convolver_reset(convolver_t* convolver);
+
+/*!
+ * @brief Convolves one block of input.
+ * @param[in] convolver The voice to process.
+ * @param[in] input block_size samples of dry audio.
+ * @param[out] output block_size samples of convolved audio. May point to the
+ * same memory as input.
+ */
+WAVESIM_PUBLIC_API void
+convolver_process(convolver_t* convolver, const wsreal_t* input, wsreal_t* output);
+
+/*!
+ * @brief Convolves one block of input for many voices sharing the same
+ * impulse response.
+ * @param[in] ir The impulse response every voice was constructed with.
+ * @param[in] convolvers Array of voice_count voices.
+ * @param[in] inputs Array of voice_count pointers to block_size samples each.
+ * @param[out] outputs Array of voice_count pointers to block_size samples each.
+ */
+WAVESIM_PUBLIC_API void
+convolver_process_batch(const convolver_ir_t* ir,
+                        convolver_t* convolvers,
+                        const wsreal_t* const* inputs,
+                        wsreal_t* const* outputs,
+                        uintptr_t voice_count);
+
+C_END
+
+#endif /* WAVESIM_CONVOLVER_H */
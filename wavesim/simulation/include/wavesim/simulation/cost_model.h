@@ -0,0 +1,61 @@
+#ifndef WAVESIM_COST_MODEL_H
+#define WAVESIM_COST_MODEL_H
+
+#include "wavesim/config.h"
+
+C_BEGIN
+
+typedef struct medium_t medium_t;
+
+/*!
+ * Predicts how long one time step of the ARD solver takes on a decomposed
+ * medium. A step transforms every partition to its modes and back, and
+ * exchanges forcing terms across every interface between partitions:
+ *
+ *   t = sum over partitions (partition + transform * N*log2(N))
+ *     + interface * interface cells
+ *
+ * where N is the number of cells of a partition.
+ */
+typedef struct cost_model_t
+{
+    wsreal_t partition;       /* Seconds of fixed overhead per partition */
+    wsreal_t transform;       /* Seconds per N*log2(N) of a DCT/IDCT pair */
+    wsreal_t interface;       /* Seconds per cell on an interface */
+    int calibrated;           /* Set by cost_model_calibrate() */
+} cost_model_t;
+
+/*!
+ * @brief Signature of a cost model. Returns the predicted seconds per step of
+ * the medium's partitions, on cells of grid_size.
+ */
+typedef wsreal_t (*medium_cost_func)(const cost_model_t* model,
+                                     const medium_t* medium,
+                                     const wsreal_t grid_size[3]);
+
+/*!
+ * @brief Initializes the model with coefficients of a typical desktop machine.
+ */
+WAVESIM_PRIVATE_API void
+cost_model_construct(cost_model_t* model);
+
+/*!
+ * @brief Measures the coefficients on this machine. Transforms of a tiny and a
+ * medium sized partition are timed to separate the fixed overhead from the
+ * N*log2(N) part, and the interface stencil is timed on a batch of cells.
+ * Takes a few tens of milliseconds.
+ */
+WAVESIM_PRIVATE_API wsret
+cost_model_calibrate(cost_model_t* model);
+
+/*!
+ * @brief The default medium_cost_func.
+ */
+WAVESIM_PRIVATE_API wsreal_t
+cost_model_predict(const cost_model_t* model,
+                   const medium_t* medium,
+                   const wsreal_t grid_size[3]);
+
+C_END
+
+#endif /* WAVESIM_COST_MODEL_H */
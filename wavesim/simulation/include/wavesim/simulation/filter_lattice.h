@@ -0,0 +1,257 @@
+/*!
+ * @file filter_lattice.h
+ * @brief Compact, memory-mapped lattice of acoustic filters.
+ * @page filter_lattice Filter Lattice
+ *
+ * This is the output format of wavesim that is meant to be shipped with a
+ * game. A filter lattice stores, for a grid of listener positions and a grid
+ * of emitter positions, a parametric description of how sound travels from
+ * the emitter to the listener:
+ *
+ *   + FILTER_LATTICE_TAP_COUNT early reflection taps (delay and gain, the
+ *     first tap usually being the direct path).
+ *   + FILTER_LATTICE_BAND_COUNT octave bands of late reverberation, each
+ *     described by its level and its decay time (T60). The center frequency
+ *     of band i is FILTER_LATTICE_LOWEST_BAND * 2^i.
+ *
+ * Each listener/emitter pair is stored as a fixed-size, quantized record of 48
+ * bytes. The file is a filter_lattice_header_t followed by all records,
+ * ordered by listener lattice point first, then by emitter lattice point.
+ * This allows the file to be memory-mapped and every record to be addressed
+ * directly, without parsing or copying anything at load time. All values are
+ * stored in the byte order of the machine that wrote the file, which the
+ * header records. Files are rejected on machines of the other byte order.
+ *
+ * Lookups snap the listener to its nearest lattice point and trilinearly
+ * interpolate between the 8 emitter lattice points surrounding the emitter,
+ * which is O(1) and touches at most 8 records. Records that have no data
+ * (e.g. because the lattice point lies inside of a wall) are ignored during
+ * interpolation.
+ */
+
+#ifndef WAVESIM_FILTER_LATTICE_H
+#define WAVESIM_FILTER_LATTICE_H
+
+#include "wavesim/config.h"
+#include "wavesim/mapped_file.h"
+
+#define FILTER_LATTICE_TAP_COUNT    8
+#define FILTER_LATTICE_BAND_COUNT   8
+#define FILTER_LATTICE_LOWEST_BAND  62.5
+#define FILTER_LATTICE_VERSION      2
+#define FILTER_LATTICE_BYTE_ORDER   0x01020304u
+
+C_BEGIN
+
+/*!
+ * Describes a regular grid of lattice points. Lattice point (x,y,z) is
+ * located at origin + (x,y,z) * spacing.
+ */
+typedef struct filter_lattice_grid_t
+{
+    wsreal_t origin[3];
+    wsreal_t spacing;
+    uint32_t dims[3];
+} filter_lattice_grid_t;
+
+/*!
+ * On-disk header. Floating point values are stored as IEEE 754 single
+ * precision floats.
+ */
+typedef struct filter_lattice_header_t
+{
+    char     magic[4];              /* "WSFL" */
+    uint32_t version;               /* FILTER_LATTICE_VERSION */
+    uint32_t tap_count;             /* FILTER_LATTICE_TAP_COUNT */
+    uint32_t band_count;            /* FILTER_LATTICE_BAND_COUNT */
+    uint32_t listener_dims[3];
+    uint32_t emitter_dims[3];
+    float    sample_rate;           /* Unit of the tap delays */
+    float    listener_origin[3];
+    float    listener_spacing;
+    float    emitter_origin[3];
+    float    emitter_spacing;
+    uint32_t byte_order;            /* FILTER_LATTICE_BYTE_ORDER as written
+                                     * by the machine that saved the file */
+} filter_lattice_header_t;
+
+/*!
+ * Quantized filter of a single listener/emitter pair.
+ *   + Delays are in samples. A delay of 0xFFFF in the first tap marks a
+ *     record without data.
+ *   + Gains are Q15 fixed point numbers in the range [-1, 1).
+ *   + Band levels are in steps of -0.5 dB. 255 means silence.
+ *   + Band decays are T60 = 10ms * 2^(q/24), which covers 10ms to about 16s
+ *     with a resolution of 3%.
+ */
+typedef struct filter_lattice_record_t
+{
+    uint16_t tap_delay[FILTER_LATTICE_TAP_COUNT];
+    int16_t  tap_gain[FILTER_LATTICE_TAP_COUNT];
+    uint8_t  band_level[FILTER_LATTICE_BAND_COUNT];
+    uint8_t  band_decay[FILTER_LATTICE_BAND_COUNT];
+} filter_lattice_record_t;
+
+/*!
+ * Decoded (and possibly interpolated) filter.
+ */
+typedef struct filter_lattice_filter_t
+{
+    wsreal_t tap_delay[FILTER_LATTICE_TAP_COUNT];   /* seconds */
+    wsreal_t tap_gain[FILTER_LATTICE_TAP_COUNT];    /* linear amplitude */
+    wsreal_t band_level[FILTER_LATTICE_BAND_COUNT]; /* linear amplitude */
+    wsreal_t band_decay[FILTER_LATTICE_BAND_COUNT]; /* T60 in seconds */
+} filter_lattice_filter_t;
+
+typedef struct filter_lattice_t
+{
+    mapped_file_t file;
+    const filter_lattice_header_t* header;
+    const filter_lattice_record_t* records;
+    uintptr_t emitter_point_count;
+    wsreal_t level_table[256];   /* Dequantized band levels, avoids pow() per lookup */
+    wsreal_t decay_table[256];   /* Dequantized band decays */
+} filter_lattice_t;
+
+/*!
+ * @brief Memory-maps a filter lattice file.
+ * @return Returns WS_ERR_BAD_FILE_FORMAT if the header is invalid (including
+ * files written in the other byte order, and grids whose origin or spacing
+ * isn't finite or whose spacing isn't positive), or if the file is too small
+ * to contain all of the records the header describes.
+ */
+WAVESIM_PUBLIC_API wsret WAVESIM_WARN_UNUSED
+filter_lattice_open(filter_lattice_t* fl, const char* file_name);
+
+/*!
+ * @brief Uses a filter lattice that already resides in memory, e.g. one that
+ * was loaded from a package file. The memory is not copied and must outlive
+ * the filter lattice.
+ */
+WAVESIM_PUBLIC_API wsret WAVESIM_WARN_UNUSED
+filter_lattice_open_memory(filter_lattice_t* fl, const void* data, uintptr_t size);
+
+WAVESIM_PUBLIC_API void
+filter_lattice_close(filter_lattice_t* fl);
+
+/*!
+ * @brief Writes a filter lattice file.
+ * @param[in] records listener_point_count * emitter_point_count records,
+ * ordered by listener lattice point first, then by emitter lattice point.
+ */
+WAVESIM_PUBLIC_API wsret WAVESIM_WARN_UNUSED
+filter_lattice_save(const char* file_name,
+                    const filter_lattice_grid_t* listener_grid,
+                    const filter_lattice_grid_t* emitter_grid,
+                    wsreal_t sample_rate,
+                    const filter_lattice_record_t* records);
+
+/*!
+ * @brief Returns the record of a listener lattice point and an emitter
+ * lattice point. This points directly into the mapped file.
+ */
+WAVESIM_PUBLIC_API const filter_lattice_record_t*
+filter_lattice_get_record(const filter_lattice_t* fl,
+                          const uint32_t listener_point[3],
+                          const uint32_t emitter_point[3]);
+
+/*!
+ * @brief Looks up the filter for a single listener/emitter pair.
+ * @return Returns 1 if the filter was written, or 0 if there is no data for
+ * this pair, in which case the filter is left untouched.
+ */
+WAVESIM_PUBLIC_API int
+filter_lattice_lookup(const filter_lattice_t* fl,
+                      const wsreal_t listener[3],
+                      const wsreal_t emitter[3],
+                      filter_lattice_filter_t* filter);
+
+/*!
+ * @brief Looks up the filters of many listener/emitter pairs at once.
+ * @param[in] listeners 3*count coordinates.
+ * @param[in] emitters 3*count coordinates.
+ * @param[out] filters count filters.
+ * @param[out] found count flags, set to the return value of
+ * filter_lattice_lookup() for each pair. May be NULL.
+ * @return Returns the number of pairs for which a filter was found.
+ */
+WAVESIM_PUBLIC_API uintptr_t
+filter_lattice_lookup_batch(const filter_lattice_t* fl,
+                            const wsreal_t* listeners,
+                            const wsreal_t* emitters,
+                            uintptr_t count,
+                            filter_lattice_filter_t* filters,
+                            char* found);
+
+/*!
+ * @brief Quantizes a filter. Values outside of the representable range are
+ * clamped.
+ */
+WAVESIM_PUBLIC_API void
+filter_lattice_encode(filter_lattice_record_t* record,
+                      const filter_lattice_filter_t* filter,
+                      wsreal_t sample_rate);
+
+WAVESIM_PUBLIC_API void
+filter_lattice_decode(filter_lattice_filter_t* filter,
+                      const filter_lattice_record_t* record,
+                      wsreal_t sample_rate);
+
+/*!
+ * @brief Marks a record as having no data.
+ */
+WAVESIM_PUBLIC_API void
+filter_lattice_record_set_empty(filter_lattice_record_t* record);
+
+WAVESIM_PUBLIC_API int
+filter_lattice_record_is_empty(const filter_lattice_record_t* record);
+
+/*!
+ * @brief Extracts the parametric filter from an impulse response, e.g. the
+ * samples recorded by an audio_listener_t.
+ *
+ * The taps are the strongest peaks within the first 80ms. For every octave
+ * band, the impulse response is band-pass filtered and the decay time is
+ * estimated from the slope of its Schroeder decay curve.
+ */
+WAVESIM_PUBLIC_API wsret WAVESIM_WARN_UNUSED
+filter_lattice_analyze_ir(filter_lattice_filter_t* filter,
+                          const wsreal_t* samples,
+                          uintptr_t sample_count,
+                          wsreal_t sample_rate);
+
+/* Building blocks shared with filter_lattice_runtime.h ---------------------- */
+
+WAVESIM_PRIVATE_API void
+filter_lattice_header_init(filter_lattice_header_t* header,
+                           const filter_lattice_grid_t* listener_grid,
+                           const filter_lattice_grid_t* emitter_grid,
+                           wsreal_t sample_rate);
+
+WAVESIM_PRIVATE_API void
+filter_lattice_build_tables(wsreal_t level_table[256], wsreal_t decay_table[256]);
+
+/*!
+ * @brief Returns the index of the listener lattice point nearest to the
+ * specified position.
+ */
+WAVESIM_PRIVATE_API uintptr_t
+filter_lattice_nearest_listener_point(const filter_lattice_header_t* header,
+                                      const wsreal_t listener[3]);
+
+/*!
+ * @brief Interpolates the filter at the emitter position from a block of
+ * records, which holds the records of all emitter lattice points of a single
+ * listener lattice point.
+ */
+WAVESIM_PRIVATE_API int
+filter_lattice_interpolate(const filter_lattice_header_t* header,
+                           const wsreal_t* level_table,
+                           const wsreal_t* decay_table,
+                           const filter_lattice_record_t* block,
+                           const wsreal_t emitter[3],
+                           filter_lattice_filter_t* filter);
+
+C_END
+
+#endif /* WAVESIM_FILTER_LATTICE_H */
@@ -0,0 +1,204 @@
+/*!
+ * @file filter_lattice_runtime.h
+ * @brief Lock-free filter lattice that can be updated while it is queried.
+ * @page filter_lattice_runtime Filter Lattice Runtime
+ *
+ * A filter_lattice_t is immutable. The runtime is its mutable counterpart,
+ * meant for a real-time client (e.g. the audio thread of a game or an editor)
+ * that queries filters while a background simulation refines them.
+ *
+ * The records are split into blocks, one per listener lattice point, each
+ * holding the records of all emitter lattice points. Readers access blocks
+ * through an array of atomic pointers. The writer never modifies a block that
+ * is visible to readers: it fills a fresh block and swaps the pointer.
+ * Replaced blocks are reclaimed with epoch-based reclamation:
+ *
+ *   + Readers announce the global epoch they observed in a per-reader slot
+ *     before touching any blocks, and clear it afterwards.
+ *   + The writer advances the global epoch only once every active reader has
+ *     announced the current epoch.
+ *   + A block retired in epoch E is reused once the global epoch reaches E+2,
+ *     at which point no reader can still hold a pointer to it.
+ *
+ * Readers therefore never take locks, never wait on the writer and never
+ * allocate memory. All blocks are allocated up front from a fixed pool, so
+ * the writer doesn't allocate either; if the pool is exhausted because
+ * readers are holding on to old epochs, publishing fails with
+ * WS_ERR_WOULD_BLOCK and should be retried later.
+ *
+ * There can be many readers (up to FILTER_LATTICE_RUNTIME_MAX_READERS), but
+ * only one writer thread.
+ */
+
+#ifndef WAVESIM_FILTER_LATTICE_RUNTIME_H
+#define WAVESIM_FILTER_LATTICE_RUNTIME_H
+
+#include "wavesim/config.h"
+#include "wavesim/simulation/filter_lattice.h"
+
+#define FILTER_LATTICE_RUNTIME_MAX_READERS 64
+
+C_BEGIN
+
+typedef struct simulation_t simulation_t;
+
+/*! Padded to a cache line so readers don't contend on each other's slots */
+typedef struct filter_lattice_reader_slot_t
+{
+    volatile uintptr_t epoch;  /* 0 if idle, otherwise (observed epoch << 1) | 1 */
+    volatile uintptr_t in_use;
+    char padding[64 - 2*sizeof(uintptr_t)];
+} filter_lattice_reader_slot_t;
+
+typedef struct filter_lattice_retired_t
+{
+    filter_lattice_record_t* block;
+    uintptr_t epoch;
+} filter_lattice_retired_t;
+
+typedef struct filter_lattice_runtime_t
+{
+    filter_lattice_header_t header;
+    uintptr_t listener_point_count;
+    uintptr_t emitter_point_count;
+    filter_lattice_record_t* volatile* blocks; /* listener_point_count, NULL if no data */
+    volatile uintptr_t epoch;
+    filter_lattice_reader_slot_t readers[FILTER_LATTICE_RUNTIME_MAX_READERS];
+
+    /* Only accessed by the writer */
+    filter_lattice_record_t* pool;
+    filter_lattice_record_t** free_blocks;
+    uintptr_t free_count;
+    filter_lattice_retired_t* retired;
+    uintptr_t retired_count;
+
+    wsreal_t level_table[256];
+    wsreal_t decay_table[256];
+} filter_lattice_runtime_t;
+
+typedef struct filter_lattice_reader_t
+{
+    filter_lattice_reader_slot_t* slot;
+} filter_lattice_reader_t;
+
+/*!
+ * @brief Creates an empty runtime. Every listener lattice point starts
+ * without data.
+ * @param[in] spare_blocks Number of blocks in addition to one per listener
+ * lattice point. This is how many updates can be in flight before old blocks
+ * must be reclaimed. Must be at least 1.
+ */
+WAVESIM_PUBLIC_API wsret WAVESIM_WARN_UNUSED
+filter_lattice_runtime_create(filter_lattice_runtime_t** runtime,
+                              const filter_lattice_grid_t* listener_grid,
+                              const filter_lattice_grid_t* emitter_grid,
+                              wsreal_t sample_rate,
+                              uintptr_t spare_blocks);
+
+/*!
+ * @brief Destroys the runtime. There must be no active readers or writer.
+ */
+WAVESIM_PUBLIC_API void
+filter_lattice_runtime_destroy(filter_lattice_runtime_t* runtime);
+
+/*!
+ * @brief Claims a reader slot. Every thread that queries the runtime needs
+ * its own reader.
+ * @return Returns WS_ERR_WOULD_BLOCK if all slots are taken.
+ */
+WAVESIM_PUBLIC_API wsret WAVESIM_WARN_UNUSED
+filter_lattice_runtime_register_reader(filter_lattice_runtime_t* runtime,
+                                       filter_lattice_reader_t* reader);
+
+WAVESIM_PUBLIC_API void
+filter_lattice_runtime_unregister_reader(filter_lattice_runtime_t* runtime,
+                                         filter_lattice_reader_t* reader);
+
+/*!
+ * @brief Looks up the filters of many listener/emitter pairs, typically once
+ * per frame. See filter_lattice_lookup_batch() for the parameters. All pairs
+ * are served from the same consistent snapshot of each block.
+ */
+WAVESIM_PUBLIC_API uintptr_t
+filter_lattice_runtime_query(filter_lattice_runtime_t* runtime,
+                             filter_lattice_reader_t* reader,
+                             const wsreal_t* listeners,
+                             const wsreal_t* emitters,
+                             uintptr_t count,
+                             filter_lattice_filter_t* filters,
+                             char* found);
+
+/*!
+ * @brief Replaces the records of a listener lattice point (writer only).
+ * @param[in] listener_point Index of the listener lattice point.
+ * @param[in] records emitter_point_count records, which are copied.
+ * @return Returns WS_ERR_WOULD_BLOCK if no block is free, because readers
+ * still hold on to older epochs.
+ */
+WAVESIM_PUBLIC_API wsret WAVESIM_WARN_UNUSED
+filter_lattice_runtime_publish(filter_lattice_runtime_t* runtime,
+                               uintptr_t listener_point,
+                               const filter_lattice_record_t* records);
+
+/*!
+ * @brief Publishes every listener lattice point of a baked filter lattice
+ * (writer only). The grids must match.
+ */
+WAVESIM_PUBLIC_API wsret WAVESIM_WARN_UNUSED
+filter_lattice_runtime_load(filter_lattice_runtime_t* runtime,
+                            const filter_lattice_t* fl);
+
+/*!
+ * @brief Tries to advance the epoch and returns retired blocks to the pool
+ * (writer only). This is also done by every publish.
+ */
+WAVESIM_PUBLIC_API void
+filter_lattice_runtime_collect(filter_lattice_runtime_t* runtime);
+
+/*!
+ * @brief Progressively publishes the results of a running simulation.
+ *
+ * Set the simulation's user data to this structure and its advance callback
+ * to filter_lattice_runtime_on_advance(). The simulation's listeners must
+ * correspond to the emitter lattice points, in order (this uses acoustic
+ * reciprocity: the audio source is placed at the listener lattice point).
+ * Every publish_interval seconds of simulated time, the impulse responses
+ * recorded so far are analyzed and published as the block of
+ * listener_point.
+ */
+typedef struct filter_lattice_progress_t
+{
+    filter_lattice_runtime_t* runtime;
+    uintptr_t listener_point;
+    wsreal_t publish_interval;
+    wsreal_t next_publish;
+    filter_lattice_record_t* records;  /* emitter_point_count */
+} filter_lattice_progress_t;
+
+WAVESIM_PUBLIC_API wsret WAVESIM_WARN_UNUSED
+filter_lattice_progress_construct(filter_lattice_progress_t* progress,
+                                  filter_lattice_runtime_t* runtime,
+                                  uintptr_t listener_point,
+                                  wsreal_t publish_interval);
+
+WAVESIM_PUBLIC_API void
+filter_lattice_progress_destruct(filter_lattice_progress_t* progress);
+
+/*!
+ * @brief Analyzes the simulation's listeners and publishes the results.
+ * @return Returns WS_OK on success, or WS_ERR_WOULD_BLOCK if the results
+ * could not be published.
+ */
+WAVESIM_PUBLIC_API wsret WAVESIM_WARN_UNUSED
+filter_lattice_progress_publish(filter_lattice_progress_t* progress,
+                                const simulation_t* simulation);
+
+/*!
+ * @brief Simulation advance callback, see filter_lattice_progress_t.
+ */
+WAVESIM_PUBLIC_API void
+filter_lattice_runtime_on_advance(const simulation_t* simulation, wsreal_t time);
+
+C_END
+
+#endif /* WAVESIM_FILTER_LATTICE_RUNTIME_H */
@@ -0,0 +1,96 @@
+#ifndef WAVESIM_IMAGE_SOURCE_H
+#define WAVESIM_IMAGE_SOURCE_H
+
+#include "wavesim/config.h"
+#include "wavesim/vec3.h"
+#include "wavesim/vector.h"
+#include "wavesim/mesh/attribute.h"
+
+#define IMAGE_SOURCE_NONE 0xFFFFFFFFu
+
+C_BEGIN
+
+typedef struct bvh_scene_t bvh_scene_t;
+typedef struct face_t face_t;
+
+typedef struct image_source_t
+{
+    vec3_t   position;
+    uint32_t face;    /* Face the parent was mirrored across, IMAGE_SOURCE_NONE
+                       * for the real source */
+    uint32_t parent;  /* Index of the parent image, IMAGE_SOURCE_NONE for the
+                       * real source */
+} image_source_t;
+
+/*!
+ * All image sources of one source position up to some reflection order. The
+ * tree only depends on the source position and the geometry, so it is built
+ * once and kept for as long as the source doesn't move. Listeners only need
+ * to validate the paths of the tree, which is much cheaper than building it.
+ */
+typedef struct image_source_tree_t
+{
+    vec3_t   source;  /* Position the tree was built for */
+    int      order;   /* Order the tree was built for, -1 if it was never built */
+    vector_t images;  /* image_source_t. [0] is the real source and parents
+                       * always precede their children */
+} image_source_tree_t;
+
+/*!
+ * A valid specular path from a source to a listener.
+ */
+typedef struct image_source_path_t
+{
+    wsreal_t length;      /* Total length in meters */
+    wsreal_t reflection;  /* Product of the reflection coefficients of all
+                           * faces along the path */
+    wsreal_t band_reflection[ATTRIBUTE_BAND_COUNT]; /* The same per octave band */
+    uint32_t order;       /* Number of reflections */
+} image_source_path_t;
+
+WAVESIM_PRIVATE_API void
+image_source_tree_construct(image_source_tree_t* tree);
+
+WAVESIM_PRIVATE_API void
+image_source_tree_destruct(image_source_tree_t* tree);
+
+/*!
+ * @brief Mirrors the source across all faces, recursively, up to the specified
+ * reflection order. Images that can't lead to a valid path are pruned: an image
+ * is only mirrored across faces that lie at least partially on the reflecting
+ * side of the face it was created by.
+ * @note The number of images grows as face_count^order. Keep the order low.
+ * @return Returns WS_OK on success.
+ */
+WAVESIM_PRIVATE_API wsret WAVESIM_WARN_UNUSED
+image_source_tree_build(image_source_tree_t* tree,
+                        const wsreal_t source[3],
+                        const face_t* faces,
+                        uintptr_t face_count,
+                        int order);
+
+/*!
+ * @brief Returns non-zero if the tree has to be rebuilt for the specified
+ * source position and order.
+ */
+WAVESIM_PRIVATE_API int
+image_source_tree_is_stale(const image_source_tree_t* tree, const wsreal_t source[3], int order);
+
+/*!
+ * @brief Finds all valid paths from the source to the listener. A path is valid
+ * if every reflection point lies within its face and no segment of the path is
+ * occluded by another face.
+ * @param[in] scene Built over the same faces as the tree.
+ * @param[out] paths image_source_path_t are pushed into this vector.
+ * @return Returns WS_OK on success.
+ */
+WAVESIM_PRIVATE_API wsret WAVESIM_WARN_UNUSED
+image_source_tree_find_paths(const image_source_tree_t* tree,
+                             const bvh_scene_t* scene,
+                             const face_t* faces,
+                             const wsreal_t listener[3],
+                             vector_t* paths);
+
+C_END
+
+#endif /* WAVESIM_IMAGE_SOURCE_H */
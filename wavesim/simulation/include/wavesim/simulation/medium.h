@@ -5,19 +5,58 @@
 #include "wavesim/aabb.h"
 #include "wavesim/vector.h"
 #include "wavesim/mesh/attribute.h"
+#include "wavesim/simulation/cost_model.h"
+#include "wavesim/simulation/partition_index.h"
 
 C_BEGIN
 
 typedef struct mesh_t mesh_t;
 typedef struct medium_t medium_t;
-typedef struct octree_t octree_t;
-typedef wsret (*medium_decomposition_func)(medium_t*, const octree_t*, const medium_t*,const wsreal_t[3]);
+typedef struct voxel_grid_t voxel_grid_t;
+typedef wsret (*medium_decomposition_func)(medium_t*, const voxel_grid_t*, const medium_t*);
+
+/*!
+ * Where a partition touches a neighbour. The face is the rectangle both
+ * partitions share, which is flat along axis. Cell offsets and counts are
+ * measured on the lattice the medium was decomposed on.
+ */
+typedef struct medium_interface_t
+{
+    aabb_t face;
+    uint32_t neighbour;           /* Index into medium->partitions */
+    uint32_t cell_offset[3];      /* From the partition's min corner to the
+                                   * face's, in cells */
+    uint32_t cell_count[3];       /* Cells the face covers, 0 along axis */
+    uint8_t axis;
+    uint8_t side;                 /* 1 if the neighbour lies towards +axis */
+} medium_interface_t;
+
+/*!
+ * Exact geometric adjacency of all partitions in compressed sparse row form.
+ * The interfaces of partition p are interfaces[offsets[p]] up to (excluding)
+ * interfaces[offsets[p+1]], sorted by neighbour. Every interface is stored
+ * once for each of the two partitions.
+ */
+typedef struct medium_adjacency_t
+{
+    uint32_t* offsets;            /* partition count + 1, NULL if not built */
+    medium_interface_t* interfaces;
+} medium_adjacency_t;
 
 typedef struct medium_t
 {
     aabb_t                       boundary;
     vector_t                     partitions; /* medium_partition_t */
     medium_decomposition_func    decompose;
+    uint64_t                     seed;       /* Seeds randomized decompositions,
+                                              * so they are reproducible */
+    medium_adjacency_t           adjacency;  /* See medium_build_adjacency() */
+    partition_index_t            index;      /* See medium_build_index() */
+    cost_model_t                 cost_model;
+    medium_cost_func             cost;       /* Rates decompositions, see
+                                              * medium_decompose_cheapest() */
+    char*                        cache_directory; /* See
+                                              * medium_set_cache_directory() */
 } medium_t;
 
 typedef struct medium_partition_t
@@ -27,9 +66,40 @@ typedef struct medium_partition_t
     wsreal_t cell_size;           /* Calculated using simulation->max_frequency */
     wsreal_t time_step;           /* Calculated using simulation->max_frequency */
     uintptr_t cell_count[3];      /* Calculated using simulation->max_frequency */
-    vector_t adjacent_partitions; /* int32_t (indices into medium->partitions) */
 } medium_partition_t;
 
+/*!
+ * Where a point lies within the medium, see medium_locate_points(). Cells are
+ * the partition's simulation cells (see medium_set_resolution()). The point
+ * is interpolated from the 2x2x2 cells starting at cell, each weighted by the
+ * product of weight[i] along the axes it is offset along and 1-weight[i]
+ * along the others.
+ */
+typedef struct medium_location_t
+{
+    int32_t partition;            /* Index into medium->partitions, -1 if the
+                                   * point lies outside of all partitions */
+    uint32_t cell[3];
+    wsreal_t weight[3];           /* Weight of cell+1 along each axis */
+} medium_location_t;
+
+/*!
+ * The decomposition strategies medium_decompose_cheapest() chooses from, in
+ * the order they are tried. Terminated by NULL.
+ */
+WAVESIM_PRIVATE_API extern const medium_decomposition_func medium_decomposition_strategies[];
+
+/*!
+ * Partition and interface reductions achieved by medium_coalesce().
+ */
+typedef struct medium_coalesce_stats_t
+{
+    uintptr_t partitions_before;
+    uintptr_t partitions_after;
+    wsreal_t interface_area_before;
+    wsreal_t interface_area_after;
+} medium_coalesce_stats_t;
+
 WAVESIM_PRIVATE_API wsret WAVESIM_WARN_UNUSED
 medium_create(medium_t** medium);
 
@@ -45,6 +115,10 @@ medium_destruct(medium_t* medium);
 WAVESIM_PRIVATE_API void
 medium_clear(medium_t* medium);
 
+/*!
+ * @brief Appends a partition. Discards the adjacency and the index, which
+ * have to be built again once all partitions were added.
+ */
 WAVESIM_PRIVATE_API int
 medium_add_partition(medium_t* medium, const wsreal_t bounding_box[6], attribute_t attr);
 
@@ -52,18 +126,139 @@ WAVESIM_PRIVATE_API void
 medium_set_decomposition_method(medium_t* medium,
                                 medium_decomposition_func method);
 
+WAVESIM_PRIVATE_API void
+medium_set_seed(medium_t* medium, uint64_t seed);
+
+WAVESIM_PRIVATE_API void
+medium_set_cost_function(medium_t* medium, medium_cost_func cost);
+
+/*!
+ * @brief Makes medium_build_from_mesh() store every decomposition in the
+ * directory, and load it from there instead of decomposing again when the
+ * mesh and all other inputs are the same (see medium_cache_key()). The
+ * directory must exist. medium_decompose_cheapest() is never cached.
+ * @param[in] directory The path is copied. NULL disables caching, which is
+ * the default.
+ */
+WAVESIM_PRIVATE_API wsret
+medium_set_cache_directory(medium_t* medium, const char* directory);
+
+/*!
+ * @brief Decomposes the medium into partitions of cells with the same
+ * attributes, reading the attributes from a voxel grid spanning
+ * medium->boundary (see voxel_grid_build()).
+ */
 WAVESIM_PRIVATE_API wsret
 medium_decompose_systematic(medium_t* medium,
-                            const octree_t* octree,
-                            const medium_t* mediumdef,
-                            const wsreal_t grid_size[3]);
+                            const voxel_grid_t* grid,
+                            const medium_t* mediumdef);
 
+/*!
+ * @brief Decomposes the medium by picking free cells in a random order and
+ * growing each into the largest box of identical material that doesn't
+ * overlap earlier boxes. Summed-area tables over the material edges of the
+ * grid make every growth test O(1), so this runs in near-linear time in the
+ * number of cells. The order only depends on medium->seed, which
+ * medium_build_from_mesh() copies from the definition.
+ */
 WAVESIM_PRIVATE_API wsret
 medium_decompose_greedy_random(medium_t* medium,
-                               const octree_t* octree,
-                               const medium_t* mediumdef,
-                               const wsreal_t grid_size[3]);
+                               const voxel_grid_t* grid,
+                               const medium_t* mediumdef);
 
+/*!
+ * @brief Decomposes the medium top-down, by recursively splitting boxes along
+ * the lattice plane that best separates differing materials until every box
+ * is homogeneous. The summed-area tables of medium_decompose_greedy_random()
+ * rate every candidate plane and test homogeneity in O(1), so this takes
+ * O(n log n) in the number of cells and leaves far fewer slivers than growing
+ * boxes bottom-up.
+ */
+WAVESIM_PRIVATE_API wsret
+medium_decompose_kd_split(medium_t* medium,
+                          const voxel_grid_t* grid,
+                          const medium_t* mediumdef);
+
+/*!
+ * @brief Greedily merges pairs of adjacent partitions with the same attributes
+ * whose union is a box, i.e. which share an entire face, until no such pair is
+ * left. Each partition that disappears saves a DCT plan and the interfaces to
+ * its neighbours.
+ *
+ * Partitions sharing an entire face are found with a hash of their faces, so
+ * merges cost O(1) each. Indices into medium->partitions change, so the
+ * adjacency and the index are discarded and have to be built afterwards.
+ * @param[out] stats Receives the partition count and interface area before
+ * and after merging. May be NULL.
+ */
+WAVESIM_PRIVATE_API wsret
+medium_coalesce(medium_t* medium, medium_coalesce_stats_t* stats);
+
+/*!
+ * @brief Computes which partitions touch and where, replacing any previous
+ * adjacency. Partitions are sorted along x and swept, so only pairs that
+ * overlap along x are ever compared (sweep-and-prune).
+ * @param[in] grid_size Size of the lattice cells the medium was decomposed
+ * on, to express faces in cells.
+ */
+WAVESIM_PRIVATE_API wsret
+medium_build_adjacency(medium_t* medium, const wsreal_t grid_size[3]);
+
+/*!
+ * @brief Builds the index that locates points and boxes in the partitions,
+ * replacing any previous one. medium_build_from_mesh() calls this, media
+ * assembled with medium_add_partition() have to call it before locating
+ * anything.
+ */
+WAVESIM_PRIVATE_API wsret
+medium_build_index(medium_t* medium);
+
+/*!
+ * @brief Finds the partition containing each point and where in its cells the
+ * point lies, in O(log n) per point in the number of partitions.
+ * @param[in] points 3 coordinates per point.
+ * @param[out] locations One per point. Points outside of the medium get a
+ * partition of -1.
+ * @return Returns the number of points that lie within a partition.
+ */
+WAVESIM_PRIVATE_API uintptr_t
+medium_locate_points(const medium_t* medium,
+                     const wsreal_t* points,
+                     uintptr_t count,
+                     medium_location_t* locations);
+
+/*!
+ * @brief Finds all partitions overlapping or touching an AABB.
+ * @param[out] result The indices (uint32_t) of the partitions are pushed into
+ * this vector.
+ */
+WAVESIM_PRIVATE_API wsret
+medium_query_aabb(const medium_t* medium, vector_t* result, const wsreal_t aabb[6]);
+
+/*!
+ * @brief Returns the total area of the faces shared by partitions, assuming
+ * they tile medium->boundary.
+ */
+WAVESIM_PRIVATE_API wsreal_t
+medium_interface_area(const medium_t* medium);
+
+/*!
+ * @brief Decomposes the medium with every strategy in
+ * medium_decomposition_strategies, coalesces each result and keeps the one
+ * medium->cost predicts to run a solver step the fastest. The cost model is
+ * calibrated first if it hasn't been yet.
+ */
+WAVESIM_PRIVATE_API wsret
+medium_decompose_cheapest(medium_t* medium,
+                          const voxel_grid_t* grid,
+                          const medium_t* mediumdef);
+
+/*!
+ * @brief Decomposes the mesh with medium->decompose, coalesces the result
+ * (see medium_coalesce()) and builds the adjacency and the index. If a cache
+ * directory is set, a decomposition of the same inputs is loaded from it
+ * instead, and new decompositions are written to it.
+ */
 WAVESIM_PRIVATE_API wsret
 medium_build_from_mesh(medium_t* medium,
                        const medium_t* mediumdef,
@@ -116,7 +311,13 @@ medium_cell_count(medium_t* medium);
         vector_count(&(medium)->partitions)
 
 #define medium_get_partition(medium, partition_idx) \
-        (medium_partition_t*)vector_get_element(&medium->partitions, partition_idx)
+        (medium_partition_t*)vector_get(&(medium)->partitions, partition_idx)
+
+#define medium_interface_count(medium, partition_idx) \
+        ((medium)->adjacency.offsets[(partition_idx) + 1] - (medium)->adjacency.offsets[partition_idx])
+
+#define medium_get_interfaces(medium, partition_idx) \
+        ((medium)->adjacency.interfaces + (medium)->adjacency.offsets[partition_idx])
 
 C_END
 
@@ -0,0 +1,78 @@
+#ifndef WAVESIM_MEDIUM_CACHE_H
+#define WAVESIM_MEDIUM_CACHE_H
+
+#include "wavesim/config.h"
+
+#define MEDIUM_CACHE_VERSION 1
+
+C_BEGIN
+
+typedef struct medium_t medium_t;
+typedef struct mesh_t mesh_t;
+
+/*!
+ * On-disk header of a decomposed medium. It is followed by the partitions
+ * (AABB and attributes), the adjacency offsets and the interfaces, each
+ * section starting on a 16 byte boundary. Structures are written as they are
+ * laid out in memory, so a file is only valid for builds with the same sizes,
+ * which the header records.
+ */
+typedef struct medium_cache_header_t
+{
+    char     magic[4];              /* "WSMC" */
+    uint32_t version;               /* MEDIUM_CACHE_VERSION */
+    uint64_t key;                   /* See medium_cache_key() */
+    uint32_t real_size;             /* sizeof(wsreal_t) */
+    uint32_t partition_size;        /* Size of one partition record */
+    uint32_t interface_size;        /* sizeof(medium_interface_t) */
+    uint32_t partition_count;
+    uint32_t interface_count;
+    uint32_t reserved;
+} medium_cache_header_t;
+
+/*!
+ * @brief Hashes everything the decomposition of a mesh depends on: the vertex,
+ * index and attribute buffers of the mesh, medium->boundary, grid_size, the
+ * decomposition method and medium->seed. Any change to them changes the key,
+ * so outdated files are never loaded.
+ * @return Returns 0 if the medium can't be cached, because its decomposition
+ * method isn't one of wavesim's or is medium_decompose_cheapest(), whose
+ * result depends on the cost function and the calibration of the machine.
+ */
+WAVESIM_PRIVATE_API int
+medium_cache_key(const medium_t* medium,
+                 const mesh_t* mesh,
+                 const wsreal_t grid_size[3],
+                 uint64_t* key);
+
+/*!
+ * @brief Returns the path of the file of a key in a directory. The string
+ * must be freed with FREE(). Returns NULL if out of memory.
+ */
+WAVESIM_PRIVATE_API char*
+medium_cache_file_name(const char* directory, uint64_t key);
+
+/*!
+ * @brief Writes the partitions and the adjacency of a medium. The file is
+ * written under a temporary name unique to the call first and renamed when
+ * complete, so readers never see a partial file and processes saving the
+ * same key at once don't write into each other's files.
+ * @return Returns WS_ERR_INVALID_STATE if the adjacency wasn't built (see
+ * medium_build_adjacency()).
+ */
+WAVESIM_PRIVATE_API wsret WAVESIM_WARN_UNUSED
+medium_cache_save(const medium_t* medium, const char* file_name, uint64_t key);
+
+/*!
+ * @brief Memory-maps a file written by medium_cache_save() and copies the
+ * partitions and the adjacency into the medium, replacing any previous ones.
+ * @return Returns WS_ERR_FOPEN_FAILED if there is no such file, or
+ * WS_ERR_BAD_FILE_FORMAT if it is corrupt, was written by an incompatible
+ * build or for a different key. The medium is left empty on failure.
+ */
+WAVESIM_PRIVATE_API wsret WAVESIM_WARN_UNUSED
+medium_cache_load(medium_t* medium, const char* file_name, uint64_t key);
+
+C_END
+
+#endif /* WAVESIM_MEDIUM_CACHE_H */
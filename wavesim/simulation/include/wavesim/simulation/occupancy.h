@@ -0,0 +1,81 @@
+#ifndef WAVESIM_OCCUPANCY_H
+#define WAVESIM_OCCUPANCY_H
+
+#include "wavesim/config.h"
+
+#define OCCUPANCY_FREE -1
+
+C_BEGIN
+
+/*!
+ * A range of cells of the lattice, min inclusive, max exclusive.
+ */
+typedef struct occupancy_box_t
+{
+    uintptr_t min[3];
+    uintptr_t max[3];
+} occupancy_box_t;
+
+/*!
+ * Records which partition owns each cell of the lattice of grid_size cells
+ * spanning a medium's boundary, while the medium is being decomposed. Testing
+ * whether a box of cells is free only needs one word operation per 64 cells
+ * along the x axis, instead of an intersection test with every partition.
+ */
+typedef struct occupancy_t
+{
+    wsreal_t origin[3];       /* Minimum corner of the lattice */
+    wsreal_t grid_size[3];
+    uintptr_t dims[3];        /* Whole cells along each axis */
+    uintptr_t words_per_row;
+    uint64_t* bits;           /* One bit per cell, set if owned. Rows along x */
+    int32_t* owners;          /* Partition index per cell, OCCUPANCY_FREE if none.
+                               * Index is x + dims[0] * (y + dims[1] * z) */
+} occupancy_t;
+
+/*!
+ * @brief Creates an empty lattice over the cells that fit entirely into the
+ * boundary.
+ */
+WAVESIM_PRIVATE_API wsret
+occupancy_construct(occupancy_t* occupancy, const wsreal_t boundary[6], const wsreal_t grid_size[3]);
+
+WAVESIM_PRIVATE_API void
+occupancy_destruct(occupancy_t* occupancy);
+
+/*!
+ * @brief Converts an AABB aligned to the lattice into the range of cells it
+ * covers.
+ * @return Returns 0 if the AABB reaches outside of the lattice or is empty,
+ * 1 otherwise.
+ */
+WAVESIM_PRIVATE_API int
+occupancy_box_from_aabb(const occupancy_t* occupancy, const wsreal_t aabb[6], occupancy_box_t* box);
+
+/*!
+ * @brief Converts a range of cells back into an AABB.
+ */
+WAVESIM_PRIVATE_API void
+occupancy_box_to_aabb(const occupancy_t* occupancy, const occupancy_box_t* box, wsreal_t aabb[6]);
+
+/*!
+ * @brief Returns 1 if no cell of the box is owned by a partition.
+ */
+WAVESIM_PRIVATE_API int
+occupancy_box_is_free(const occupancy_t* occupancy, const occupancy_box_t* box);
+
+/*!
+ * @brief Marks all cells of the box as owned by the specified partition.
+ */
+WAVESIM_PRIVATE_API void
+occupancy_mark(occupancy_t* occupancy, const occupancy_box_t* box, int32_t owner);
+
+/*!
+ * @brief Returns the partition owning a cell, or OCCUPANCY_FREE.
+ */
+WAVESIM_PRIVATE_API int32_t
+occupancy_owner(const occupancy_t* occupancy, uintptr_t x, uintptr_t y, uintptr_t z);
+
+C_END
+
+#endif /* WAVESIM_OCCUPANCY_H */
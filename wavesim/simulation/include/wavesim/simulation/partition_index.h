@@ -0,0 +1,77 @@
+#ifndef WAVESIM_PARTITION_INDEX_H
+#define WAVESIM_PARTITION_INDEX_H
+
+#include "wavesim/config.h"
+#include "wavesim/vector.h"
+
+#define PARTITION_INDEX_LEAF_SIZE  4
+#define PARTITION_INDEX_STACK_SIZE 64
+
+C_BEGIN
+
+typedef struct medium_t medium_t;
+
+/*!
+ * Nodes are stored depth-first like bvh_node_t: the first child of an inner
+ * node directly follows it.
+ */
+typedef struct partition_index_node_t
+{
+    wsreal_t aabb[6];
+    uint32_t offset;  /* Inner node: index of the second child.
+                       * Leaf: index of the first slot */
+    uint32_t count;   /* Number of partitions, 0 for inner nodes */
+} partition_index_node_t;
+
+/*!
+ * Bounding volume hierarchy over the AABBs of a medium's partitions, split at
+ * the median partition along the longest axis, so that finding the partitions
+ * containing a point takes O(log n) instead of a scan over all of them.
+ * Partitions may overlap. The boxes are copied into the leaves, so queries
+ * don't touch the medium.
+ */
+typedef struct partition_index_t
+{
+    partition_index_node_t* nodes;
+    uintptr_t node_count;
+    wsreal_t* boxes;          /* 6 per slot */
+    uint32_t* partition_ids;  /* One per slot, index into medium->partitions */
+} partition_index_t;
+
+WAVESIM_PRIVATE_API void
+partition_index_construct(partition_index_t* index);
+
+WAVESIM_PRIVATE_API void
+partition_index_destruct(partition_index_t* index);
+
+/*!
+ * @brief Builds the hierarchy over all partitions of the medium, replacing
+ * any previous contents. Has to be rebuilt whenever partitions change.
+ */
+WAVESIM_PRIVATE_API wsret WAVESIM_WARN_UNUSED
+partition_index_build(partition_index_t* index, const medium_t* medium);
+
+/*!
+ * @brief Finds all partitions whose AABBs overlap the specified AABB,
+ * including ones that only touch it.
+ * @param[out] result The indices (uint32_t) of the partitions are pushed into
+ * this vector, in no particular order.
+ */
+WAVESIM_PRIVATE_API wsret WAVESIM_WARN_UNUSED
+partition_index_query_aabb(const partition_index_t* index, vector_t* result, const wsreal_t aabb[6]);
+
+/*!
+ * @brief Finds the partition containing a point. Points on a face shared by
+ * several partitions belong to the one with the lowest index.
+ * @return Returns the index of the partition, or -1 if no partition contains
+ * the point.
+ */
+WAVESIM_PRIVATE_API int32_t
+partition_index_find(const partition_index_t* index, const wsreal_t point[3]);
+
+#define partition_index_is_built(index) \
+        ((index)->nodes != NULL)
+
+C_END
+
+#endif /* WAVESIM_PARTITION_INDEX_H */
@@ -25,9 +25,75 @@ typedef struct simulation_user_data_t simulation_user_data_t;
 typedef enum simulation_type_e
 {
     WAVESIM_ARD,
-    WAVESIM_RAY
+    WAVESIM_RAY,
+    WAVESIM_HYBRID             /* ARD below a crossover frequency, rays above */
 } simulation_type_e;
 
+/*!
+ * @brief Settings for impulse-response runs. See
+ * simulation_set_impulse_response_mode().
+ */
+typedef struct simulation_ir_mode_t
+{
+    wsreal_t decay_threshold; /* Negative level in dB (e.g. -60) the Schroeder
+                               * integrated energy of every listener must fall
+                               * below before the simulation is stopped */
+    wsreal_t window;          /* Length in seconds of the trailing window that
+                               * is backward-integrated to estimate the decay */
+    wsreal_t max_duration;    /* Hard upper limit in seconds of simulated time,
+                               * in case a listener never decays (e.g. because
+                               * no energy ever reaches it) */
+    char     enabled;
+} simulation_ir_mode_t;
+
+/*!
+ * @brief Settings of the ray tracing backend (WAVESIM_RAY).
+ */
+typedef struct simulation_ray_settings_t
+{
+    uintptr_t ray_count;       /* Rays emitted by every audio source */
+    uintptr_t max_reflections; /* Rays are terminated after this many surface
+                                * interactions */
+    wsreal_t  listener_radius; /* Listeners are spheres of this radius in meters */
+    uint64_t  seed;            /* Every run is seeded with this value, so runs
+                                * are reproducible */
+    int       image_source_order; /* Specular paths with up to this many
+                                * reflections are computed exactly with image
+                                * sources instead of rays. -1 disables image
+                                * sources */
+    uintptr_t thread_count;    /* Threads tracing rays, 0 to use all processors */
+    uintptr_t shared_histogram_listeners; /* With up to this many listeners,
+                                * every thread accumulates energy into its own
+                                * histograms. With more, threads add to the
+                                * listeners' histograms with atomic operations,
+                                * which needs less memory */
+    wsreal_t  scattering;      /* Fraction of the reflected energy that is
+                                * scattered diffusely (Lambertian), 0 to 1 */
+    char      diffuse_rain;    /* Every hit sends the scattered energy directly
+                                * to all visible listeners */
+    char      extrapolate_tail; /* Replace the late, noisy part of the energy
+                                * histograms with a fitted exponential decay */
+    uintptr_t batch_size;      /* Rays per source traced between two checks of
+                                * the time budget of simulation_ray_refine() */
+} simulation_ray_settings_t;
+
+/*!
+ * @brief Settings of the hybrid backend (WAVESIM_HYBRID).
+ */
+typedef struct simulation_hybrid_settings_t
+{
+    wsreal_t crossover_frequency; /* In Hz. max_frequency should be at least
+                                   * this high */
+    wsreal_t ray_gain;         /* Pressure gain applied to the ray traced band.
+                                * Rays assume a source emitting one unit of
+                                * energy, adjust this to match the level of
+                                * the wave based band */
+    /* Backend simulating the low band, defaults to ARD */
+    simulation_prepare_func  wave_prepare;
+    simulation_advance_func  wave_advance;
+    simulation_finalize_func wave_finalize;
+} simulation_hybrid_settings_t;
+
 typedef struct simulation_t
 {
     simulation_state_t*     state;
@@ -38,11 +104,19 @@ typedef struct simulation_t
     vector_t audio_listeners; /* audio_listener_t* */
     wsreal_t max_frequency;
     wsreal_t cell_tolerance;
+    wsreal_t time_step;       /* Defaults to the Nyquist interval of max_frequency.
+                               * Backends may shrink it in their prepare function */
+    wsreal_t time;            /* Simulated time in seconds since execution began */
+    simulation_ir_mode_t ir_mode;
+    simulation_ray_settings_t ray;
+    simulation_hybrid_settings_t hybrid;
 
     simulation_prepare_func   prepare;
     simulation_advance_func   advance;
     simulation_finalize_func  finalize;
     simulation_interrupt_func interrupt;
+
+    simulation_advance_cb_func on_advance; /* Optional, called after every time step */
 } simulation_t;
 
 /*!
@@ -91,6 +165,46 @@ simulation_set_type(simulation_t* simulation, simulation_type_e type);
 WAVESIM_PUBLIC_API void
 simulation_set_resolution(simulation_t* simulation, wsreal_t max_frequency, wsreal_t cell_tolerance);
 
+/*!
+ * @brief Puts the simulation into impulse-response mode. Instead of running
+ * until the backend finishes, simulation_execute() monitors the
+ * Schroeder-integrated energy at every listener and stops as soon as all of
+ * them have decayed past the specified threshold. Afterwards, every listener's
+ * samples are trimmed to the point where their decay curve crosses the
+ * threshold, leaving a compact impulse response.
+ *
+ * Audio sources are typically set up with audio_source_set_dirac() for this
+ * kind of run.
+ * @param[in] simulation The simulation object to modify.
+ * @param[in] decay_threshold Level in dB relative to the total received energy,
+ * e.g. -60 for a T60-length impulse response. Must be negative.
+ * @param[in] max_duration Upper limit of simulated time in seconds. The
+ * simulation is stopped after this much time even if some listeners haven't
+ * decayed yet.
+ */
+WAVESIM_PUBLIC_API void
+simulation_set_impulse_response_mode(simulation_t* simulation,
+                                     wsreal_t decay_threshold,
+                                     wsreal_t max_duration);
+
+/*!
+ * @brief Disables impulse-response mode. simulation_execute() runs until the
+ * backend reports that it is done.
+ */
+WAVESIM_PUBLIC_API void
+simulation_clear_impulse_response_mode(simulation_t* simulation);
+
+/*!
+ * @brief Sets a function that is called by simulation_execute() after every
+ * time step, with the simulated time so far. It can use simulation->user_data
+ * to access client state, e.g. to monitor progress or to publish intermediate
+ * results.
+ * @param[in] simulation The simulation object to modify.
+ * @param[in] callback The function to call, or NULL to disable.
+ */
+WAVESIM_PUBLIC_API void
+simulation_set_advance_callback(simulation_t* simulation, simulation_advance_cb_func callback);
+
 WAVESIM_PUBLIC_API wsret
 simulation_add_mesh(simulation_t* simulation, mesh_t* mesh);
 
@@ -98,7 +212,7 @@ simulation_add_mesh(simulation_t* simulation, mesh_t* mesh);
         vector_count(&sim->meshes)
 
 #define simulation_get_mesh(sim, idx) \
-        *(mesh_t**)vector_get_element(&sim->meshes, idx)
+        *(mesh_t**)vector_get(&sim->meshes, idx)
 
 WAVESIM_PUBLIC_API wsret
 simulation_add_audio_source(simulation_t* simulation, audio_source_t* as);
@@ -107,7 +221,7 @@ simulation_add_audio_source(simulation_t* simulation, audio_source_t* as);
         vector_count(&sim->audio_sources)
 
 #define simulation_get_audio_source(sim, idx) \
-        *(audio_source_t**)vector_get_element(&sim->audio_sources, idx)
+        *(audio_source_t**)vector_get(&sim->audio_sources, idx)
 
 WAVESIM_PUBLIC_API wsret
 simulation_add_audio_listener(simulation_t* simulation, audio_listener_t* al);
@@ -116,8 +230,43 @@ simulation_add_audio_listener(simulation_t* simulation, audio_listener_t* al);
         vector_count(&sim->audio_listeners)
 
 #define simulation_get_audio_listener(sim, idx) \
-        *(audio_listener_t**)vector_get_element(&sim->audio_listeners, idx)
+        *(audio_listener_t**)vector_get(&sim->audio_listeners, idx)
+
+/*!
+ * @brief Calls the backend's prepare function. Together with simulation_run()
+ * and simulation_finalize(), this allows the prepared state (e.g. the
+ * discretized medium) to be reused for many runs. Between prepare and
+ * finalize, only the positions of the audio sources and listeners may be
+ * changed.
+ * @return Returns WS_OK on success.
+ */
+WAVESIM_PUBLIC_API wsret
+simulation_prepare(simulation_t* simulation);
 
+/*!
+ * @brief Resets all sources and listeners and advances a prepared simulation
+ * in steps of simulation->time_step until the backend reports that it is done
+ * (or, in impulse-response mode, until all listeners have decayed).
+ * @return Returns WS_OK on success. WS_ERR_SIM_ADVANCE_FAILED is returned if
+ * the backend reported an error while advancing.
+ */
+WAVESIM_PUBLIC_API wsret
+simulation_run(simulation_t* simulation);
+
+/*!
+ * @brief Calls the backend's finalize function, releasing the prepared state.
+ */
+WAVESIM_PUBLIC_API void
+simulation_finalize(simulation_t* simulation);
+
+/*!
+ * @brief Runs the simulation. Calls the backend's prepare function, advances
+ * the simulation in steps of simulation->time_step until the backend reports
+ * that it is done (or, in impulse-response mode, until all listeners have
+ * decayed), then calls the backend's finalize function.
+ * @return Returns WS_OK on success. WS_ERR_SIM_ADVANCE_FAILED is returned if
+ * the backend reported an error while advancing.
+ */
 WAVESIM_PUBLIC_API wsret
 simulation_execute(simulation_t* simulation);
 
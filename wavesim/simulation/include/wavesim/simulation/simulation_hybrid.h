@@ -0,0 +1,33 @@
+#ifndef WAVESIM_SIMULATION_HYBRID_H
+#define WAVESIM_SIMULATION_HYBRID_H
+
+#include "wavesim/config.h"
+
+C_BEGIN
+
+typedef struct simulation_t simulation_t;
+
+/*
+ * Wave based simulation below the crossover frequency, ray tracing above it.
+ * The cost of the wave based backend grows with the cube of max_frequency,
+ * so it is set to (slightly above) the crossover frequency with
+ * simulation_set_resolution(). The wave backend writes samples to the
+ * listeners as usual. Every time step, the newly written samples are low-pass
+ * filtered and the ray traced energy histograms, rendered as noise with the
+ * same energy envelope, are high-pass filtered and added to them. Both filters
+ * are 4th order Linkwitz-Riley filters at the crossover frequency, so the two
+ * bands sum to a flat magnitude response.
+ */
+
+WAVESIM_PRIVATE_API wsret
+simulation_hybrid_prepare(simulation_t* simulation);
+
+WAVESIM_PRIVATE_API int
+simulation_hybrid_advance(simulation_t* simulation, wsreal_t dt);
+
+WAVESIM_PRIVATE_API void
+simulation_hybrid_finalize(simulation_t* simulation);
+
+C_END
+
+#endif /* WAVESIM_SIMULATION_HYBRID_H */
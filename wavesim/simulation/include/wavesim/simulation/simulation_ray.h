@@ -16,6 +16,84 @@ simulation_ray_advance(simulation_t* simulation, wsreal_t dt);
 WAVESIM_PRIVATE_API void
 simulation_ray_finalize(simulation_t* simulation);
 
+/*!
+ * @brief Traces all rays and image sources and fills in the energy histograms
+ * of the listeners. advance() does this at the start of every run. Exposed
+ * for backends that only need the histograms (see simulation_hybrid.h).
+ *
+ * Rays traced by earlier calls (or by simulation_ray_refine()) are kept as
+ * long as no source or listener moved and the ray settings are the same, in
+ * which case only the remaining rays up to ray.ray_count are traced.
+ * @note The simulation's state must be the state created by
+ * simulation_ray_prepare().
+ */
+WAVESIM_PRIVATE_API wsret
+simulation_ray_trace(simulation_t* simulation);
+
+/*!
+ * @brief Progressively refines the energy histograms of the listeners. Traces
+ * batches of ray.batch_size rays per source until time_budget seconds of
+ * wall clock time have passed or ray.ray_count rays were traced in total,
+ * then updates the listeners' energy histograms with everything traced so far.
+ * Calling it again continues where the last call stopped. Moving a source or
+ * listener, or changing the ray settings, starts over.
+ *
+ * Use simulation_prepare() first and simulation_finalize() when done. At
+ * least one batch is traced per call, so a budget of 0 traces exactly one.
+ * @param[in] time_budget Wall clock time in seconds.
+ * @return Returns WS_OK on success.
+ */
+WAVESIM_PUBLIC_API wsret
+simulation_ray_refine(simulation_t* simulation, wsreal_t time_budget);
+
+/*!
+ * @brief Returns the number of rays per source the histograms of the
+ * listeners are currently based on.
+ */
+WAVESIM_PUBLIC_API uintptr_t
+simulation_ray_rays_traced(const simulation_t* simulation);
+
+/*!
+ * @brief Returns how much the last batch changed the energy histogram of a
+ * listener, as the summed absolute change of all bins relative to the total
+ * energy. It shrinks roughly with the square root of the number of rays,
+ * refining can stop once it falls below the required accuracy. Returns 1 before
+ * the first batch.
+ * @param[in] listener Index of the listener.
+ */
+WAVESIM_PUBLIC_API wsreal_t
+simulation_ray_convergence(const simulation_t* simulation, uintptr_t listener);
+
+/*!
+ * @brief Returns how many energy events of the last batch fell outside of the
+ * shared histograms (see ray.shared_histogram_listeners) and had to be queued
+ * and added after tracing. Zero when every bin was covered in advance.
+ */
+WAVESIM_PRIVATE_API uintptr_t
+simulation_ray_overflow_count(const simulation_t* simulation);
+
+/*!
+ * @brief Updates a mesh whose vertex positions were modified in place, e.g. a
+ * door that swung open. The number of faces and the indices must not have
+ * changed. Only the BLAS of the mesh is refitted, no hierarchy is rebuilt.
+ * @note Must be called between simulation_prepare() and simulation_finalize().
+ * @param[in] mesh_index Index of the mesh in simulation->meshes.
+ * @return Returns WS_OK on success.
+ */
+WAVESIM_PUBLIC_API wsret
+simulation_ray_update_mesh(simulation_t* simulation, uintptr_t mesh_index);
+
+/*!
+ * @brief Moves a mesh as a rigid (or affine) body. Only the top level of the
+ * acceleration structure is refitted. Transforms start out as the identity
+ * after simulation_prepare() and are lost on simulation_finalize().
+ * @param[in] mesh_index Index of the mesh in simulation->meshes.
+ * @param[in] transform Object to world, 3x4 row-major. The left 3x3 part
+ * must be invertible.
+ */
+WAVESIM_PUBLIC_API void
+simulation_ray_set_mesh_transform(simulation_t* simulation, uintptr_t mesh_index, const wsreal_t transform[12]);
+
 C_END
 
 #endif /* WAVESIM_SIMULATION_RAY_H */
@@ -0,0 +1,79 @@
+#ifndef WAVESIM_VOXEL_GRID_H
+#define WAVESIM_VOXEL_GRID_H
+
+#include "wavesim/config.h"
+#include "wavesim/vector.h"
+#include "wavesim/mesh/attribute.h"
+
+/* Material of cells that no face passes through */
+#define VOXEL_AIR 0u
+
+C_BEGIN
+
+typedef struct mesh_t mesh_t;
+
+/*!
+ * The attributes of a mesh sampled onto the lattice of grid_size cells
+ * spanning a boundary (the same lattice occupancy_t uses). Every cell stores
+ * the index of its material, and every distinct attribute is stored once.
+ *
+ * A cell that faces pass through gets the attributes of their vertices,
+ * weighted by the inverse squared distance to the cell's center (Shepard's
+ * method). All other cells are air.
+ */
+typedef struct voxel_grid_t
+{
+    wsreal_t origin[3];       /* Minimum corner of the lattice */
+    wsreal_t grid_size[3];
+    uintptr_t dims[3];        /* Whole cells along each axis */
+    uint32_t* materials;      /* Index into attributes per cell. Index is
+                               * x + dims[0] * (y + dims[1] * z) */
+    vector_t attributes;      /* attribute_t, [VOXEL_AIR] is air */
+} voxel_grid_t;
+
+WAVESIM_PRIVATE_API void
+voxel_grid_construct(voxel_grid_t* grid);
+
+WAVESIM_PRIVATE_API void
+voxel_grid_destruct(voxel_grid_t* grid);
+
+/*!
+ * @brief Rasterizes all faces of the mesh into the lattice. The layers of the
+ * lattice along z are split into one tile per thread. Each thread sweeps the
+ * faces sorted by their lowest layer and rasterizes the ones overlapping the
+ * current layer with conservative triangle-box tests, so every face is only
+ * read by the threads whose tiles it overlaps.
+ * @param[in] thread_count Number of threads, 0 to use all hardware threads.
+ */
+WAVESIM_PRIVATE_API wsret
+voxel_grid_build(voxel_grid_t* grid,
+                 const mesh_t* mesh,
+                 const wsreal_t boundary[6],
+                 const wsreal_t grid_size[3],
+                 uintptr_t thread_count);
+
+/*!
+ * @brief Returns the material index of a cell.
+ */
+WAVESIM_PRIVATE_API uint32_t
+voxel_grid_material(const voxel_grid_t* grid, uintptr_t x, uintptr_t y, uintptr_t z);
+
+/*!
+ * @brief Returns the attributes of a material.
+ */
+WAVESIM_PRIVATE_API const attribute_t*
+voxel_grid_attribute(const voxel_grid_t* grid, uint32_t material);
+
+/*!
+ * @brief Finds the cell containing a point.
+ * @return Returns 0 if the point lies outside of the lattice.
+ */
+WAVESIM_PRIVATE_API int
+voxel_grid_locate(const voxel_grid_t* grid, const wsreal_t point[3], uintptr_t cell[3]);
+
+#define voxel_grid_material_count(grid) \
+        vector_count(&(grid)->attributes)
+
+C_END
+
+#endif /* WAVESIM_VOXEL_GRID_H */
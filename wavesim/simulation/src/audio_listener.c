@@ -1,6 +1,7 @@
 #include "wavesim/memory.h"
 #include "wavesim/simulation/audio_listener.h"
 #include <stddef.h>
+#include <math.h>
 
 /* ------------------------------------------------------------------------- */
 wsret
@@ -25,15 +26,24 @@ audio_listener_destroy(audio_listener_t* al)
 void
 audio_listener_construct(audio_listener_t* al)
 {
+    int band;
     al->fs = 41000;
     al->t = 0.0;
+    al->energy_bin_width = 0.001;
     vector_construct(&al->samples, sizeof(wsreal_t));
+    vector_construct(&al->energy, sizeof(wsreal_t));
+    for (band = 0; band != ATTRIBUTE_BAND_COUNT; ++band)
+        vector_construct(&al->band_energy[band], sizeof(wsreal_t));
 }
 
 /* ------------------------------------------------------------------------- */
 void
 audio_listener_destruct(audio_listener_t* al)
 {
+    int band;
+    for (band = 0; band != ATTRIBUTE_BAND_COUNT; ++band)
+        vector_clear_free(&al->band_energy[band]);
+    vector_clear_free(&al->energy);
     vector_clear_free(&al->samples);
 }
 
@@ -41,8 +51,12 @@ audio_listener_destruct(audio_listener_t* al)
 void
 audio_listener_reset(audio_listener_t* al)
 {
+    int band;
     al->t = 0;
     vector_clear_free(&al->samples);
+    vector_clear_free(&al->energy);
+    for (band = 0; band != ATTRIBUTE_BAND_COUNT; ++band)
+        vector_clear_free(&al->band_energy[band]);
 }
 
 /* ------------------------------------------------------------------------- */
@@ -64,3 +78,229 @@ audio_listener_add_sample(audio_listener_t* al, wsreal_t dt, wsreal_t sample)
 
     WSRET(WS_OK);
 }
+
+/* ------------------------------------------------------------------------- */
+static wsret
+histogram_add(vector_t* histogram, uintptr_t first_bin, const wsreal_t* bins, uintptr_t count)
+{
+    uintptr_t i;
+    wsreal_t* dst;
+
+    while (vector_count(histogram) < first_bin + count)
+    {
+        wsreal_t* e = vector_emplace(histogram);
+        if (e == NULL)
+            WSRET(WS_ERR_OUT_OF_MEMORY);
+        *e = 0.0;
+    }
+
+    dst = (wsreal_t*)histogram->data + first_bin;
+    for (i = 0; i != count; ++i)
+        dst[i] += bins[i];
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+audio_listener_add_energy(audio_listener_t* al, wsreal_t time, wsreal_t energy)
+{
+    uintptr_t bin = (uintptr_t)(time / al->energy_bin_width);
+    return audio_listener_add_energy_bins(al, bin, &energy, 1);
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+audio_listener_add_energy_bins(audio_listener_t* al,
+                               uintptr_t first_bin,
+                               const wsreal_t* bins,
+                               uintptr_t count)
+{
+    return histogram_add(&al->energy, first_bin, bins, count);
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+audio_listener_add_band_energy(audio_listener_t* al,
+                               wsreal_t time,
+                               const wsreal_t energy[ATTRIBUTE_BAND_COUNT])
+{
+    wsret result;
+    int band;
+    wsreal_t mean = 0.0;
+    uintptr_t bin = (uintptr_t)(time / al->energy_bin_width);
+
+    for (band = 0; band != ATTRIBUTE_BAND_COUNT; ++band)
+    {
+        if ((result = histogram_add(&al->band_energy[band], bin, &energy[band], 1)) != WS_OK)
+            return result;
+        mean += energy[band];
+    }
+
+    mean /= ATTRIBUTE_BAND_COUNT;
+    return histogram_add(&al->energy, bin, &mean, 1);
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+audio_listener_add_band_energy_bins(audio_listener_t* al,
+                                    int band,
+                                    uintptr_t first_bin,
+                                    const wsreal_t* bins,
+                                    uintptr_t count)
+{
+    return histogram_add(&al->band_energy[band], first_bin, bins, count);
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+audio_listener_mix_bands(audio_listener_t* al)
+{
+    wsret result;
+    int band;
+
+    vector_clear(&al->energy);
+    for (band = 0; band != ATTRIBUTE_BAND_COUNT; ++band)
+    {
+        const wsreal_t* bins = (const wsreal_t*)al->band_energy[band].data;
+        if ((result = histogram_add(&al->energy, 0, bins, vector_count(&al->band_energy[band]))) != WS_OK)
+            return result;
+    }
+
+    VECTOR_FOR_EACH(&al->energy, wsreal_t, e)
+        *e /= ATTRIBUTE_BAND_COUNT;
+    VECTOR_END_EACH
+
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+uintptr_t
+audio_listener_trim_to_decay(audio_listener_t* al, wsreal_t decay_threshold)
+{
+    uintptr_t i;
+    wsreal_t total, remaining, limit;
+    const wsreal_t* samples = (const wsreal_t*)al->samples.data;
+
+    total = 0.0;
+    for (i = 0; i != vector_count(&al->samples); ++i)
+        total += samples[i] * samples[i];
+    if (total == 0.0)
+        return vector_count(&al->samples);
+
+    /*
+     * Schroeder integration: The energy remaining after sample i is the sum of
+     * all squared samples from i to the end. Walk forwards, subtracting each
+     * sample's energy from the total, until the remaining energy has dropped
+     * below the threshold.
+     */
+    limit = total * pow(10.0, decay_threshold / 10.0);
+    remaining = total;
+    for (i = 0; i != vector_count(&al->samples); ++i)
+    {
+        if (remaining < limit)
+            break;
+        remaining -= samples[i] * samples[i];
+    }
+
+    /* Always keep at least one sample */
+    if (i == 0)
+        i = 1;
+    vector_resize(&al->samples, i); /* shrinking never reallocates */
+    return i;
+}
+
+/* ------------------------------------------------------------------------- */
+static wsret
+extrapolate_histogram(vector_t* histogram,
+                      wsreal_t bw,
+                      wsreal_t fit_begin,
+                      wsreal_t fit_end,
+                      wsreal_t stop,
+                      wsreal_t max_duration)
+{
+    uintptr_t i, count, last_fitted;
+    wsreal_t total, remaining, slope, intercept;
+    wsreal_t sum_x = 0.0, sum_y = 0.0, sum_xx = 0.0, sum_xy = 0.0, n = 0.0;
+    const wsreal_t* bins = (const wsreal_t*)histogram->data;
+
+    count = vector_count(histogram);
+    total = 0.0;
+    for (i = 0; i != count; ++i)
+        total += bins[i];
+    if (total <= 0.0)
+        WSRET(WS_OK);
+
+    /* Least squares fit of the Schroeder curve in dB over the fit range */
+    remaining = total;
+    last_fitted = 0;
+    for (i = 0; i != count && remaining > 0.0; ++i)
+    {
+        wsreal_t level = 10.0 * log10(remaining / total);
+        if (level <= fit_begin && level >= fit_end)
+        {
+            wsreal_t x = (wsreal_t)i * bw;
+            sum_x += x;
+            sum_y += level;
+            sum_xx += x * x;
+            sum_xy += x * level;
+            n += 1.0;
+            last_fitted = i;
+        }
+        remaining -= bins[i];
+    }
+
+    /* Need a few points and an actual decay */
+    if (n < 3.0)
+        WSRET(WS_OK);
+    slope = (n * sum_xy - sum_x * sum_y) / (n * sum_xx - sum_x * sum_x);
+    intercept = (sum_y - slope * sum_x) / n;
+    if (!(slope < 0.0))
+        WSRET(WS_OK);
+
+    /* The energy in a bin is the drop of the model's Schroeder curve over it */
+    for (i = last_fitted + 1; ; ++i)
+    {
+        wsreal_t* bin;
+        wsreal_t start = (wsreal_t)i * bw;
+        wsreal_t level = intercept + slope * start;
+        if (level < stop || start >= max_duration)
+            break;
+
+        if (i < vector_count(histogram))
+            bin = (wsreal_t*)histogram->data + i;
+        else if ((bin = vector_emplace(histogram)) == NULL)
+            WSRET(WS_ERR_OUT_OF_MEMORY);
+        *bin = total * (pow(10.0, level / 10.0) - pow(10.0, (level + slope * bw) / 10.0));
+    }
+
+    if (i < vector_count(histogram))
+        vector_resize(histogram, i); /* shrinking never reallocates */
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+audio_listener_extrapolate_energy_tail(audio_listener_t* al,
+                                       wsreal_t fit_begin,
+                                       wsreal_t fit_end,
+                                       wsreal_t stop,
+                                       wsreal_t max_duration)
+{
+    wsret result;
+    int band, has_bands = 0;
+
+    for (band = 0; band != ATTRIBUTE_BAND_COUNT; ++band)
+    {
+        if (vector_count(&al->band_energy[band]) == 0)
+            continue;
+        if ((result = extrapolate_histogram(&al->band_energy[band], al->energy_bin_width,
+                                            fit_begin, fit_end, stop, max_duration)) != WS_OK)
+            return result;
+        has_bands = 1;
+    }
+
+    if (has_bands)
+        return audio_listener_mix_bands(al);
+    return extrapolate_histogram(&al->energy, al->energy_bin_width,
+                                 fit_begin, fit_end, stop, max_duration);
+}
@@ -0,0 +1,894 @@
+#include "wavesim/atomic.h"
+#include "wavesim/file.h"
+#include "wavesim/log.h"
+#include "wavesim/mapped_file.h"
+#include "wavesim/memory.h"
+#include "wavesim/thread.h"
+#include "wavesim/simulation/audio_listener.h"
+#include "wavesim/simulation/audio_source.h"
+#include "wavesim/simulation/bake.h"
+#include "wavesim/simulation/medium.h"
+#include "wavesim/simulation/partition_index.h"
+#include "wavesim/simulation/simulation.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MANIFEST_MAGIC   "wavesim-bake-manifest"
+#define MANIFEST_VERSION 1
+
+/*!
+ * A shard entry is a uint32_t probe index, 4 reserved bytes, then the block
+ * of records. The reserved bytes keep the records 8-byte aligned.
+ */
+#define ENTRY_HEADER_SIZE 8
+
+/*!
+ * State shared by all worker threads during bake_run().
+ */
+typedef struct bake_context_t
+{
+    bake_t* bake;
+    FILE* shard;
+    FILE* manifest;
+    ws_mutex_t* mutex;
+    char* done;                /* One flag per pending probe */
+    volatile uintptr_t next;   /* Index of the next pending probe to claim */
+    volatile uintptr_t failed;
+} bake_context_t;
+
+typedef struct bake_worker_t
+{
+    bake_context_t* context;
+    simulation_t simulation;
+    audio_source_t source;
+    audio_listener_t* listeners;   /* One per entry in bake->emitters */
+    filter_lattice_record_t* records;
+    wsret result;
+} bake_worker_t;
+
+/* ------------------------------------------------------------------------- */
+void
+bake_settings_set_default(bake_settings_t* settings)
+{
+    settings->probe_spacing = 2.0;
+    settings->emitter_spacing = 1.0;
+    settings->sample_rate = 48000;
+    settings->thread_count = 0;
+    settings->process_index = 0;
+    settings->process_count = 1;
+    settings->output_prefix = "bake";
+}
+
+/* ------------------------------------------------------------------------- */
+static char*
+make_file_name(const char* prefix, uintptr_t process_index, const char* extension)
+{
+    char* name = MALLOC(strlen(prefix) + strlen(extension) + 24);
+    if (name != NULL)
+        sprintf(name, "%s.%lu.%s", prefix, (unsigned long)process_index, extension);
+    return name;
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+make_grid(filter_lattice_grid_t* grid, const aabb_t* bounds, wsreal_t spacing)
+{
+    int i;
+    grid->spacing = spacing;
+    for (i = 0; i != 3; ++i)
+    {
+        wsreal_t extent = bounds->xyzxyz[i+3] - bounds->xyzxyz[i];
+        grid->origin[i] = bounds->xyzxyz[i];
+        grid->dims[i] = (uint32_t)(floor(extent / spacing + 1e-6)) + 1;
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+grid_point_position(wsreal_t pos[3],
+                    const uint32_t dims[3],
+                    const float origin[3],
+                    float spacing,
+                    uintptr_t index)
+{
+    pos[0] = origin[0] + spacing * (wsreal_t)(index % dims[0]);
+    pos[1] = origin[1] + spacing * (wsreal_t)((index / dims[0]) % dims[1]);
+    pos[2] = origin[2] + spacing * (wsreal_t)(index / ((uintptr_t)dims[0] * dims[1]));
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * A point is open if it lies within an air partition, but not strictly
+ * within a solid partition. Sound can't propagate through partitions that
+ * transmit nothing.
+ * @param[in] candidates The partitions (uint32_t) touching the point.
+ */
+static int
+point_is_open(const medium_t* medium, const vector_t* candidates, const wsreal_t p[3])
+{
+    int open = 0;
+    VECTOR_FOR_EACH(candidates, uint32_t, partition_idx)
+        medium_partition_t* partition = medium_get_partition(medium, *partition_idx);
+        const wsreal_t* bb = partition->aabb.xyzxyz;
+        if (partition->attr.transmission <= 0.0)
+        {
+            if (p[0] > bb[0] && p[0] < bb[3] &&
+                p[1] > bb[1] && p[1] < bb[4] &&
+                p[2] > bb[2] && p[2] < bb[5])
+                return 0;
+        }
+        else
+            open = 1;
+    VECTOR_END_EACH
+    return open;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Pushes the indices (uint32_t) of all open points of a grid. The partitions
+ * touching each point are looked up in the medium's index, or in a temporary
+ * one if the medium has none.
+ */
+static wsret
+collect_open_points(const medium_t* medium,
+                    const uint32_t dims[3],
+                    const float origin[3],
+                    float spacing,
+                    uintptr_t count,
+                    vector_t* open_points)
+{
+    partition_index_t local_index;
+    const partition_index_t* index = &medium->index;
+    vector_t candidates;
+    uintptr_t i;
+    wsret result = WS_OK;
+
+    partition_index_construct(&local_index);
+    if (!partition_index_is_built(index))
+    {
+        if ((result = partition_index_build(&local_index, medium)) != WS_OK)
+            return result;
+        index = &local_index;
+    }
+
+    vector_construct(&candidates, sizeof(uint32_t));
+    for (i = 0; i != count; ++i)
+    {
+        wsreal_t pos[6];
+        uint32_t point_idx = (uint32_t)i;
+        grid_point_position(pos, dims, origin, spacing, i);
+        memcpy(pos + 3, pos, sizeof(wsreal_t) * 3);
+
+        vector_clear(&candidates);
+        if ((result = partition_index_query_aabb(index, &candidates, pos)) != WS_OK)
+            break;
+        if (point_is_open(medium, &candidates, pos) && vector_push(open_points, &point_idx) == VECTOR_ERROR)
+        {
+            result = WS_ERR_OUT_OF_MEMORY;
+            break;
+        }
+    }
+
+    vector_clear_free(&candidates);
+    partition_index_destruct(&local_index);
+    WSRET(result);
+}
+
+/* ------------------------------------------------------------------------- */
+static long
+file_size(const char* file_name)
+{
+    long size;
+    FILE* fp = fopen(file_name, "rb");
+    if (fp == NULL)
+        return -1;
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fclose(fp);
+    return size;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Returns WS_ERR_BAD_FILE_FORMAT unless the shard starts with the given
+ * header. The manifest only records the point counts, so this is what catches
+ * a bake resumed with a different sample rate, origin or spacing.
+ */
+static wsret
+check_shard_header(const char* shard_file_name, const filter_lattice_header_t* header)
+{
+    filter_lattice_header_t existing;
+    size_t count;
+    FILE* fp = fopen(shard_file_name, "rb");
+    if (fp == NULL)
+        WSRET(WS_ERR_FOPEN_FAILED);
+    count = fread(&existing, sizeof(existing), 1, fp);
+    fclose(fp);
+
+    if (count != 1 || memcmp(&existing, header, sizeof(existing)) != 0)
+        WSRET(WS_ERR_BAD_FILE_FORMAT);
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Reads the manifest and pushes a bake_entry_t for every probe it lists whose
+ * entry lies within the shard. Returns WS_ERR_FOPEN_FAILED if there is no
+ * manifest (or shard) yet.
+ */
+static wsret
+read_manifest(const char* manifest_file_name,
+              const char* shard_file_name,
+              uintptr_t listener_point_count,
+              uintptr_t emitter_point_count,
+              vector_t* entries)
+{
+    FILE* fp;
+    int version;
+    long shard_size;
+    unsigned long listeners, emitters, probe, offset;
+    uintptr_t size_of_entry = ENTRY_HEADER_SIZE + sizeof(filter_lattice_record_t) * emitter_point_count;
+
+    shard_size = file_size(shard_file_name);
+    fp = fopen(manifest_file_name, "r");
+    if (fp == NULL || shard_size < 0)
+    {
+        if (fp != NULL)
+            fclose(fp);
+        WSRET(WS_ERR_FOPEN_FAILED);
+    }
+
+    if (fscanf(fp, MANIFEST_MAGIC " %d %lu %lu", &version, &listeners, &emitters) != 3 ||
+        version != MANIFEST_VERSION ||
+        listeners != listener_point_count ||
+        emitters != emitter_point_count)
+    {
+        fclose(fp);
+        WSRET(WS_ERR_BAD_FILE_FORMAT);
+    }
+
+    /* A line cut short by a killed bake fails to parse or points past the end
+     * of the shard, and ends the loop */
+    while (fscanf(fp, "%lu %lu", &probe, &offset) == 2)
+    {
+        bake_entry_t entry;
+        if (probe >= listener_point_count ||
+            offset < sizeof(filter_lattice_header_t) ||
+            offset + size_of_entry > (unsigned long)shard_size)
+            break;
+        entry.offset = offset;
+        entry.probe = (uint32_t)probe;
+        if (vector_push(entries, &entry) == VECTOR_ERROR)
+        {
+            fclose(fp);
+            WSRET(WS_ERR_OUT_OF_MEMORY);
+        }
+    }
+
+    fclose(fp);
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+bake_construct(bake_t* bake,
+               const simulation_t* simulation,
+               const medium_t* medium,
+               const bake_settings_t* settings)
+{
+    wsret result;
+    uintptr_t i, pending_count;
+    aabb_t bounds;
+    char* done;
+    filter_lattice_grid_t probe_grid, emitter_grid;
+
+    bake->settings = *settings;
+    bake->simulation = simulation;
+    bake->completed = 0;
+    vector_construct(&bake->pending, sizeof(uint32_t));
+    vector_construct(&bake->emitters, sizeof(uint32_t));
+    vector_construct(&bake->entries, sizeof(bake_entry_t));
+    bake->shard_file_name = make_file_name(settings->output_prefix, settings->process_index, "shard");
+    bake->manifest_file_name = make_file_name(settings->output_prefix, settings->process_index, "manifest");
+    if (bake->shard_file_name == NULL || bake->manifest_file_name == NULL)
+    {
+        bake_destruct(bake);
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+    }
+
+    /* The grids span all partitions */
+    bounds = aabb_reset();
+    VECTOR_FOR_EACH(&medium->partitions, medium_partition_t, partition)
+        aabb_expand_aabb(bounds.xyzxyz, partition->aabb.xyzxyz);
+    VECTOR_END_EACH
+    make_grid(&probe_grid, &bounds, settings->probe_spacing);
+    make_grid(&emitter_grid, &bounds, settings->emitter_spacing);
+    filter_lattice_header_init(&bake->header, &probe_grid, &emitter_grid, settings->sample_rate);
+    bake->listener_point_count = (uintptr_t)probe_grid.dims[0] * probe_grid.dims[1] * probe_grid.dims[2];
+    bake->emitter_point_count = (uintptr_t)emitter_grid.dims[0] * emitter_grid.dims[1] * emitter_grid.dims[2];
+
+    result = collect_open_points(medium, bake->header.emitter_dims, bake->header.emitter_origin, bake->header.emitter_spacing,
+                                 bake->emitter_point_count, &bake->emitters);
+    if (result != WS_OK)
+    {
+        bake_destruct(bake);
+        return result;
+    }
+
+    /* Open probes are dealt out round-robin to the processes */
+    result = collect_open_points(medium, bake->header.listener_dims, bake->header.listener_origin, bake->header.listener_spacing,
+                                 bake->listener_point_count, &bake->pending);
+    if (result != WS_OK)
+    {
+        bake_destruct(bake);
+        return result;
+    }
+
+    /* Resume where a previous bake left off */
+    done = MALLOC(bake->listener_point_count);
+    if (done == NULL)
+    {
+        bake_destruct(bake);
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+    }
+    memset(done, 0, bake->listener_point_count);
+    result = read_manifest(bake->manifest_file_name, bake->shard_file_name,
+                           bake->listener_point_count, bake->emitter_point_count, &bake->entries);
+    if (result == WS_OK && vector_count(&bake->entries) > 0)
+        result = check_shard_header(bake->shard_file_name, &bake->header);
+    if (result != WS_OK && result != WS_ERR_FOPEN_FAILED)
+    {
+        FREE(done);
+        bake_destruct(bake);
+        return result;
+    }
+    VECTOR_FOR_EACH(&bake->entries, bake_entry_t, entry)
+        done[entry->probe] = 1;
+    VECTOR_END_EACH
+
+    pending_count = 0;
+    for (i = 0; i != vector_count(&bake->pending); ++i)
+    {
+        uint32_t index = *(uint32_t*)vector_get(&bake->pending, i);
+        if (i % settings->process_count != settings->process_index)
+            continue;
+
+        if (done[index])
+            bake->completed++;
+        else
+            *(uint32_t*)vector_get(&bake->pending, pending_count++) = index;
+    }
+    vector_resize(&bake->pending, pending_count);
+
+    FREE(done);
+
+    if (bake->completed > 0)
+        log_info(&g_ws_log, "Resuming bake: %lu probes already completed, %lu remaining",
+                 (unsigned long)bake->completed, (unsigned long)bake_remaining(bake));
+
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+bake_destruct(bake_t* bake)
+{
+    if (bake->shard_file_name != NULL)
+        FREE(bake->shard_file_name);
+    if (bake->manifest_file_name != NULL)
+        FREE(bake->manifest_file_name);
+    bake->shard_file_name = NULL;
+    bake->manifest_file_name = NULL;
+    vector_clear_free(&bake->entries);
+    vector_clear_free(&bake->emitters);
+    vector_clear_free(&bake->pending);
+}
+
+/* ------------------------------------------------------------------------- */
+static wsret
+worker_construct(bake_worker_t* worker, bake_context_t* context)
+{
+    uintptr_t i;
+    wsret result;
+    bake_t* bake = context->bake;
+    const simulation_t* tmpl = bake->simulation;
+    uintptr_t emitter_count = vector_count(&bake->emitters);
+
+    worker->context = context;
+    worker->result = WS_OK;
+
+    simulation_construct(&worker->simulation, WAVESIM_ARD);
+    worker->simulation.prepare = tmpl->prepare;
+    worker->simulation.advance = tmpl->advance;
+    worker->simulation.finalize = tmpl->finalize;
+    worker->simulation.user_data = tmpl->user_data;
+    worker->simulation.max_frequency = tmpl->max_frequency;
+    worker->simulation.cell_tolerance = tmpl->cell_tolerance;
+    worker->simulation.time_step = tmpl->time_step;
+    worker->simulation.ir_mode = tmpl->ir_mode;
+    worker->simulation.ray = tmpl->ray;
+    worker->simulation.hybrid = tmpl->hybrid;
+
+    audio_source_construct(&worker->source);
+    worker->listeners = NULL;
+    worker->records = NULL;
+
+    VECTOR_FOR_EACH(&tmpl->meshes, mesh_t*, mesh)
+        if ((result = simulation_add_mesh(&worker->simulation, *mesh)) != WS_OK)
+            return result;
+    VECTOR_END_EACH
+
+    if ((result = audio_source_set_dirac(&worker->source)) != WS_OK)
+        return result;
+    if ((result = simulation_add_audio_source(&worker->simulation, &worker->source)) != WS_OK)
+        return result;
+
+    worker->listeners = MALLOC(sizeof(audio_listener_t) * (emitter_count + 1));
+    worker->records = MALLOC(sizeof(filter_lattice_record_t) * bake->emitter_point_count);
+    if (worker->listeners == NULL || worker->records == NULL)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+
+    for (i = 0; i != emitter_count; ++i)
+    {
+        audio_listener_t* al = &worker->listeners[i];
+        uint32_t emitter = *(uint32_t*)vector_get(&bake->emitters, i);
+        audio_listener_construct(al);
+        al->fs = bake->settings.sample_rate;
+        grid_point_position(al->position.xyz, bake->header.emitter_dims,
+                            bake->header.emitter_origin, bake->header.emitter_spacing, emitter);
+        if ((result = simulation_add_audio_listener(&worker->simulation, al)) != WS_OK)
+            return result;
+    }
+
+    /* Emitter points inside solids are never simulated */
+    for (i = 0; i != bake->emitter_point_count; ++i)
+        filter_lattice_record_set_empty(&worker->records[i]);
+
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+worker_destruct(bake_worker_t* worker)
+{
+    if (worker->listeners != NULL)
+    {
+        VECTOR_FOR_EACH(&worker->simulation.audio_listeners, audio_listener_t*, al)
+            audio_listener_destruct(*al);
+        VECTOR_END_EACH
+        FREE(worker->listeners);
+    }
+    if (worker->records != NULL)
+        FREE(worker->records);
+    audio_source_destruct(&worker->source);
+    simulation_destruct(&worker->simulation);
+}
+
+/* ------------------------------------------------------------------------- */
+static wsret
+write_entry(bake_context_t* context, uint32_t probe, const filter_lattice_record_t* records)
+{
+    long offset;
+    uint32_t entry_header[2];
+    bake_t* bake = context->bake;
+
+    entry_header[0] = probe;
+    entry_header[1] = 0;
+
+    /* The manifest entry is only written once the shard entry is flushed, so a
+     * killed bake never lists a probe whose data is incomplete */
+    ws_mutex_lock(context->mutex);
+        offset = ftell(context->shard);
+        if (offset < 0 ||
+            fwrite(entry_header, sizeof(entry_header), 1, context->shard) != 1 ||
+            fwrite(records, sizeof(filter_lattice_record_t), bake->emitter_point_count, context->shard) != bake->emitter_point_count ||
+            fflush(context->shard) != 0 ||
+            fprintf(context->manifest, "%lu %lu\n", (unsigned long)probe, (unsigned long)offset) < 0 ||
+            fflush(context->manifest) != 0)
+        {
+            ws_mutex_unlock(context->mutex);
+            WSRET(WS_ERR_WRITE_ERROR);
+        }
+        bake->completed++;
+    ws_mutex_unlock(context->mutex);
+
+    log_info(&g_ws_log, "Baked probe %lu (%lu done)", (unsigned long)probe, (unsigned long)bake->completed);
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+static wsret
+bake_probe(bake_worker_t* worker, uint32_t probe)
+{
+    wsret result;
+    uintptr_t i;
+    bake_t* bake = worker->context->bake;
+
+    grid_point_position(worker->source.position.xyz, bake->header.listener_dims,
+                        bake->header.listener_origin, bake->header.listener_spacing, probe);
+
+    if ((result = simulation_run(&worker->simulation)) != WS_OK)
+        return result;
+
+    for (i = 0; i != vector_count(&bake->emitters); ++i)
+    {
+        filter_lattice_filter_t filter;
+        audio_listener_t* al = &worker->listeners[i];
+        uint32_t emitter = *(uint32_t*)vector_get(&bake->emitters, i);
+        filter_lattice_record_t* record = &worker->records[emitter];
+
+        if (vector_count(&al->samples) == 0)
+        {
+            filter_lattice_record_set_empty(record);
+            continue;
+        }
+
+        result = filter_lattice_analyze_ir(&filter, (const wsreal_t*)al->samples.data,
+                                           vector_count(&al->samples), al->fs);
+        if (result != WS_OK)
+            return result;
+        filter_lattice_encode(record, &filter, bake->settings.sample_rate);
+    }
+
+    return write_entry(worker->context, probe, worker->records);
+}
+
+/* ------------------------------------------------------------------------- */
+static void*
+worker_main(void* arg)
+{
+    bake_worker_t* worker = arg;
+    bake_context_t* context = worker->context;
+    bake_t* bake = context->bake;
+
+    /* Prepare once, then reuse the prepared state for every probe */
+    if ((worker->result = simulation_prepare(&worker->simulation)) != WS_OK)
+    {
+        ws_atomic_store_uptr(&context->failed, 1);
+        return NULL;
+    }
+
+    while (!ws_atomic_load_uptr(&context->failed))
+    {
+        uintptr_t idx = ws_atomic_fetch_add_uptr(&context->next, 1);
+        if (idx >= bake_remaining(bake))
+            break;
+
+        worker->result = bake_probe(worker, *(uint32_t*)vector_get(&bake->pending, idx));
+        if (worker->result != WS_OK)
+        {
+            ws_atomic_store_uptr(&context->failed, 1);
+            break;
+        }
+        context->done[idx] = 1;
+    }
+
+    simulation_finalize(&worker->simulation);
+    return NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Writes the manifest of the entries of previous runs from scratch, dropping
+ * a line a killed bake may have cut short. The new manifest replaces the old
+ * one only once it is complete.
+ */
+static wsret
+rewrite_manifest(const bake_t* bake)
+{
+    FILE* fp;
+    char* temp_name = MALLOC(strlen(bake->manifest_file_name) + 5);
+    if (temp_name == NULL)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+    sprintf(temp_name, "%s.tmp", bake->manifest_file_name);
+
+    if ((fp = fopen(temp_name, "w")) == NULL)
+    {
+        FREE(temp_name);
+        WSRET(WS_ERR_FOPEN_FAILED);
+    }
+
+    if (fprintf(fp, MANIFEST_MAGIC " %d %lu %lu\n", MANIFEST_VERSION,
+                (unsigned long)bake->listener_point_count,
+                (unsigned long)bake->emitter_point_count) < 0)
+        goto write_error;
+    VECTOR_FOR_EACH(&bake->entries, bake_entry_t, entry)
+        if (fprintf(fp, "%lu %lu\n", (unsigned long)entry->probe, (unsigned long)entry->offset) < 0)
+            goto write_error;
+    VECTOR_END_EACH
+    if (fclose(fp) != 0)
+    {
+        fp = NULL;
+        goto write_error;
+    }
+
+    /* rename() doesn't replace existing files everywhere */
+    if (rename(temp_name, bake->manifest_file_name) != 0)
+    {
+        remove(bake->manifest_file_name);
+        if (rename(temp_name, bake->manifest_file_name) != 0)
+        {
+            fp = NULL;
+            goto write_error;
+        }
+    }
+
+    FREE(temp_name);
+    WSRET(WS_OK);
+
+    write_error:
+    if (fp != NULL)
+        fclose(fp);
+    remove(temp_name);
+    FREE(temp_name);
+    WSRET(WS_ERR_WRITE_ERROR);
+}
+
+/* ------------------------------------------------------------------------- */
+static wsret
+open_output(bake_context_t* context)
+{
+    bake_t* bake = context->bake;
+    uintptr_t shard_end = 0;
+    wsret result;
+
+    VECTOR_FOR_EACH(&bake->entries, bake_entry_t, entry)
+        uintptr_t end = entry->offset + ENTRY_HEADER_SIZE + sizeof(filter_lattice_record_t) * bake->emitter_point_count;
+        if (shard_end < end)
+            shard_end = end;
+    VECTOR_END_EACH
+
+    if (bake->completed > 0 && shard_end != 0)
+    {
+        /* Whatever follows the last complete entry was cut short by a killed
+         * bake. Appending after it would shift all new entries */
+        if ((result = ws_file_truncate(bake->shard_file_name, shard_end)) != WS_OK)
+            return result;
+        if ((result = rewrite_manifest(bake)) != WS_OK)
+            return result;
+        context->shard = fopen(bake->shard_file_name, "ab");
+        context->manifest = fopen(bake->manifest_file_name, "a");
+    }
+    else
+    {
+        /* Nothing worth keeping, start over */
+        context->shard = fopen(bake->shard_file_name, "wb");
+        context->manifest = fopen(bake->manifest_file_name, "w");
+        if (context->shard != NULL && context->manifest != NULL)
+        {
+            if (fwrite(&bake->header, sizeof(bake->header), 1, context->shard) != 1 ||
+                fprintf(context->manifest, MANIFEST_MAGIC " %d %lu %lu\n", MANIFEST_VERSION,
+                        (unsigned long)bake->listener_point_count,
+                        (unsigned long)bake->emitter_point_count) < 0 ||
+                fflush(context->shard) != 0 ||
+                fflush(context->manifest) != 0)
+                WSRET(WS_ERR_WRITE_ERROR);
+        }
+    }
+
+    if (context->shard == NULL || context->manifest == NULL)
+        WSRET(WS_ERR_FOPEN_FAILED);
+
+    /* "ab" may report position 0 until the first write */
+    fseek(context->shard, 0, SEEK_END);
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+bake_run(bake_t* bake)
+{
+    wsret result;
+    uintptr_t i, thread_count, kept;
+    bake_context_t context;
+    bake_worker_t* workers = NULL;
+    ws_thread_t** threads = NULL;
+
+    context.bake = bake;
+    context.shard = NULL;
+    context.manifest = NULL;
+    context.mutex = NULL;
+    context.next = 0;
+    context.failed = 0;
+    context.done = NULL;
+
+    thread_count = bake->settings.thread_count;
+    if (thread_count == 0)
+        thread_count = ws_thread_hardware_concurrency();
+    if (thread_count > bake_remaining(bake))
+        thread_count = bake_remaining(bake);
+    if (thread_count == 0)
+        WSRET(WS_OK);
+
+    if ((result = open_output(&context)) != WS_OK)
+        goto cleanup;
+    if ((result = ws_mutex_create(&context.mutex)) != WS_OK)
+        goto cleanup;
+
+    result = WS_ERR_OUT_OF_MEMORY;
+    context.done = MALLOC(bake_remaining(bake));
+    workers = MALLOC(sizeof(bake_worker_t) * thread_count);
+    threads = MALLOC(sizeof(ws_thread_t*) * thread_count);
+    if (context.done == NULL || workers == NULL || threads == NULL)
+        goto cleanup;
+    memset(context.done, 0, bake_remaining(bake));
+
+    /* Everything is set up in this thread, the workers only run */
+    for (i = 0; i != thread_count; ++i)
+    {
+        result = worker_construct(&workers[i], &context);
+        if (result != WS_OK)
+        {
+            thread_count = i + 1;
+            goto destruct_workers;
+        }
+    }
+
+    if (thread_count == 1)
+        worker_main(&workers[0]);
+    else
+    {
+        uintptr_t started;
+        for (started = 0; started != thread_count; ++started)
+            if ((result = ws_thread_create(&threads[started], worker_main, &workers[started])) != WS_OK)
+            {
+                ws_atomic_store_uptr(&context.failed, 1);
+                break;
+            }
+        for (i = 0; i != started; ++i)
+            ws_thread_join(threads[i]);
+    }
+
+    result = WS_OK;
+    for (i = 0; i != thread_count; ++i)
+        if (workers[i].result != WS_OK)
+            result = workers[i].result;
+
+    /* Keep only the probes that are still pending */
+    kept = 0;
+    for (i = 0; i != bake_remaining(bake); ++i)
+        if (!context.done[i])
+            *(uint32_t*)vector_get(&bake->pending, kept++) = *(uint32_t*)vector_get(&bake->pending, i);
+    bake->pending.count = kept;
+
+    destruct_workers:
+    for (i = 0; i != thread_count; ++i)
+        worker_destruct(&workers[i]);
+
+    cleanup:
+    if (threads != NULL)        FREE(threads);
+    if (workers != NULL)        FREE(workers);
+    if (context.done != NULL)   FREE(context.done);
+    if (context.mutex != NULL)  ws_mutex_destroy(context.mutex);
+    if (context.shard != NULL)  fclose(context.shard);
+    if (context.manifest != NULL) fclose(context.manifest);
+    return result;
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+grid_from_header(filter_lattice_grid_t* grid,
+                 const uint32_t dims[3],
+                 const float origin[3],
+                 float spacing)
+{
+    int i;
+    grid->spacing = spacing;
+    for (i = 0; i != 3; ++i)
+    {
+        grid->origin[i] = origin[i];
+        grid->dims[i] = dims[i];
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+bake_merge(const char* output_prefix, uintptr_t process_count, const char* file_name)
+{
+    wsret result = WS_OK;
+    uintptr_t p, i, listener_count = 0, emitter_count = 0, record_count = 0;
+    filter_lattice_header_t header;
+    filter_lattice_record_t* records = NULL;
+    filter_lattice_grid_t listener_grid, emitter_grid;
+    vector_t entries;
+
+    vector_construct(&entries, sizeof(bake_entry_t));
+    for (p = 0; p != process_count; ++p)
+    {
+        mapped_file_t shard;
+        const filter_lattice_header_t* shard_header;
+        char* shard_file_name = make_file_name(output_prefix, p, "shard");
+        char* manifest_file_name = make_file_name(output_prefix, p, "manifest");
+        if (shard_file_name == NULL || manifest_file_name == NULL)
+        {
+            if (shard_file_name != NULL) FREE(shard_file_name);
+            if (manifest_file_name != NULL) FREE(manifest_file_name);
+            result = WS_ERR_OUT_OF_MEMORY;
+            break;
+        }
+
+        /* A process that never ran has no shard. Its probes stay empty */
+        if ((result = mapped_file_open(&shard, shard_file_name)) != WS_OK)
+        {
+            if (result == WS_ERR_FOPEN_FAILED)
+                result = WS_OK;
+            goto next_shard;
+        }
+        shard_header = shard.data;
+        if (shard.size < sizeof(header) ||
+            (records != NULL && memcmp(&header, shard_header, sizeof(header)) != 0))
+        {
+            result = WS_ERR_BAD_FILE_FORMAT;
+            goto close_shard;
+        }
+
+        if (records == NULL)
+        {
+            header = *shard_header;
+            listener_count = (uintptr_t)header.listener_dims[0] * header.listener_dims[1] * header.listener_dims[2];
+            emitter_count = (uintptr_t)header.emitter_dims[0] * header.emitter_dims[1] * header.emitter_dims[2];
+            record_count = listener_count * emitter_count;
+            records = MALLOC(sizeof(filter_lattice_record_t) * record_count);
+            if (records == NULL)
+            {
+                result = WS_ERR_OUT_OF_MEMORY;
+                goto close_shard;
+            }
+            for (i = 0; i != record_count; ++i)
+                filter_lattice_record_set_empty(&records[i]);
+        }
+
+        /* Only entries listed in the manifest are complete */
+        vector_clear(&entries);
+        if ((result = read_manifest(manifest_file_name, shard_file_name, listener_count, emitter_count, &entries)) != WS_OK)
+        {
+            if (result == WS_ERR_FOPEN_FAILED)
+                result = WS_OK;
+            goto close_shard;
+        }
+
+        /* Entries are read where the manifest says they start. The probe
+         * index at the start of each entry has to agree */
+        VECTOR_FOR_EACH(&entries, bake_entry_t, entry)
+            const char* data = (const char*)shard.data + entry->offset;
+            uint32_t probe;
+            if (entry->offset + ENTRY_HEADER_SIZE + sizeof(filter_lattice_record_t) * emitter_count > shard.size)
+            {
+                result = WS_ERR_BAD_FILE_FORMAT;
+                goto close_shard;
+            }
+            memcpy(&probe, data, sizeof(probe));
+            if (probe != entry->probe)
+            {
+                result = WS_ERR_BAD_FILE_FORMAT;
+                goto close_shard;
+            }
+            memcpy(records + probe * emitter_count, data + ENTRY_HEADER_SIZE,
+                   sizeof(filter_lattice_record_t) * emitter_count);
+        VECTOR_END_EACH
+
+        close_shard:
+        mapped_file_close(&shard);
+        next_shard:
+        FREE(shard_file_name);
+        FREE(manifest_file_name);
+        if (result != WS_OK)
+            break;
+    }
+
+    if (result == WS_OK && records == NULL)
+        result = WS_ERR_FOPEN_FAILED;
+
+    if (result == WS_OK)
+    {
+        grid_from_header(&listener_grid, header.listener_dims, header.listener_origin, header.listener_spacing);
+        grid_from_header(&emitter_grid, header.emitter_dims, header.emitter_origin, header.emitter_spacing);
+        result = filter_lattice_save(file_name, &listener_grid, &emitter_grid, header.sample_rate, records);
+    }
+
+    vector_clear_free(&entries);
+    if (records != NULL)
+        FREE(records);
+    return result;
+}
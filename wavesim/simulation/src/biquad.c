@@ -0,0 +1,71 @@
+#include "wavesim/simulation/biquad.h"
+#include <math.h>
+
+#define PI 3.14159265358979323846
+
+/* ------------------------------------------------------------------------- */
+void
+biquad_set_bandpass(biquad_t* bq, wsreal_t center_frequency, wsreal_t sample_rate, wsreal_t bandwidth)
+{
+    /* See Robert Bristow-Johnson's Audio EQ Cookbook */
+    wsreal_t w0 = 2.0 * PI * center_frequency / sample_rate;
+    wsreal_t alpha = sin(w0) * sinh(log(2.0) / 2.0 * bandwidth * w0 / sin(w0));
+    wsreal_t a0 = 1.0 + alpha;
+
+    bq->b0 = alpha / a0;
+    bq->b1 = 0.0;
+    bq->b2 = -alpha / a0;
+    bq->a1 = -2.0 * cos(w0) / a0;
+    bq->a2 = (1.0 - alpha) / a0;
+    biquad_reset(bq);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+biquad_set_lowpass(biquad_t* bq, wsreal_t cutoff_frequency, wsreal_t sample_rate, wsreal_t q)
+{
+    wsreal_t w0 = 2.0 * PI * cutoff_frequency / sample_rate;
+    wsreal_t alpha = sin(w0) / (2.0 * q);
+    wsreal_t a0 = 1.0 + alpha;
+
+    bq->b0 = (1.0 - cos(w0)) / 2.0 / a0;
+    bq->b1 = (1.0 - cos(w0)) / a0;
+    bq->b2 = bq->b0;
+    bq->a1 = -2.0 * cos(w0) / a0;
+    bq->a2 = (1.0 - alpha) / a0;
+    biquad_reset(bq);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+biquad_set_highpass(biquad_t* bq, wsreal_t cutoff_frequency, wsreal_t sample_rate, wsreal_t q)
+{
+    wsreal_t w0 = 2.0 * PI * cutoff_frequency / sample_rate;
+    wsreal_t alpha = sin(w0) / (2.0 * q);
+    wsreal_t a0 = 1.0 + alpha;
+
+    bq->b0 = (1.0 + cos(w0)) / 2.0 / a0;
+    bq->b1 = -(1.0 + cos(w0)) / a0;
+    bq->b2 = bq->b0;
+    bq->a1 = -2.0 * cos(w0) / a0;
+    bq->a2 = (1.0 - alpha) / a0;
+    biquad_reset(bq);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+biquad_reset(biquad_t* bq)
+{
+    bq->z1 = 0.0;
+    bq->z2 = 0.0;
+}
+
+/* ------------------------------------------------------------------------- */
+wsreal_t
+biquad_process(biquad_t* bq, wsreal_t x)
+{
+    wsreal_t y = bq->b0 * x + bq->z1;
+    bq->z1 = bq->b1 * x - bq->a1 * y + bq->z2;
+    bq->z2 = bq->b2 * x - bq->a2 * y;
+    return y;
+}
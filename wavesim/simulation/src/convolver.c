@@ -0,0 +1,315 @@
+#include "wavesim/simulation/convolver.h"
+#include "fftw3.h"
+#include <string.h>
+#if defined(__AVX__) || defined(__SSE2__)
+#   include <immintrin.h>
+#endif
+
+/*
+ * Spectra are stored in split format (separate real and imaginary arrays) so
+ * the complex multiply-accumulate can be done on whole SIMD registers without
+ * shuffling. The stride is rounded up to 4 doubles (32 bytes) so every
+ * partition has the same alignment as the first, which is required for FFTW's
+ * new-array execute functions to accept the partitions. Unaligned loads are
+ * used anyway, because fftw_malloc() only guarantees 16 byte alignment
+ * depending on how FFTW was configured.
+ */
+#define STRIDE_ALIGN 4
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * acc += x * h for split complex arrays of length n.
+ */
+static void
+complex_multiply_accumulate(double* WAVESIM_RESTRICT acc_re,
+                            double* WAVESIM_RESTRICT acc_im,
+                            const double* WAVESIM_RESTRICT x_re,
+                            const double* WAVESIM_RESTRICT x_im,
+                            const double* WAVESIM_RESTRICT h_re,
+                            const double* WAVESIM_RESTRICT h_im,
+                            uintptr_t n)
+{
+    uintptr_t i = 0;
+
+#if defined(__AVX__)
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256d xr = _mm256_loadu_pd(x_re + i);
+        __m256d xi = _mm256_loadu_pd(x_im + i);
+        __m256d hr = _mm256_loadu_pd(h_re + i);
+        __m256d hi = _mm256_loadu_pd(h_im + i);
+        __m256d ar = _mm256_loadu_pd(acc_re + i);
+        __m256d ai = _mm256_loadu_pd(acc_im + i);
+        ar = _mm256_add_pd(ar, _mm256_sub_pd(_mm256_mul_pd(xr, hr), _mm256_mul_pd(xi, hi)));
+        ai = _mm256_add_pd(ai, _mm256_add_pd(_mm256_mul_pd(xr, hi), _mm256_mul_pd(xi, hr)));
+        _mm256_storeu_pd(acc_re + i, ar);
+        _mm256_storeu_pd(acc_im + i, ai);
+    }
+#elif defined(__SSE2__)
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128d xr = _mm_loadu_pd(x_re + i);
+        __m128d xi = _mm_loadu_pd(x_im + i);
+        __m128d hr = _mm_loadu_pd(h_re + i);
+        __m128d hi = _mm_loadu_pd(h_im + i);
+        __m128d ar = _mm_loadu_pd(acc_re + i);
+        __m128d ai = _mm_loadu_pd(acc_im + i);
+        ar = _mm_add_pd(ar, _mm_sub_pd(_mm_mul_pd(xr, hr), _mm_mul_pd(xi, hi)));
+        ai = _mm_add_pd(ai, _mm_add_pd(_mm_mul_pd(xr, hi), _mm_mul_pd(xi, hr)));
+        _mm_storeu_pd(acc_re + i, ar);
+        _mm_storeu_pd(acc_im + i, ai);
+    }
+#endif
+
+    for (; i != n; ++i)
+    {
+        acc_re[i] += x_re[i] * h_re[i] - x_im[i] * h_im[i];
+        acc_im[i] += x_re[i] * h_im[i] + x_im[i] * h_re[i];
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+convolver_ir_construct(convolver_ir_t* ir,
+                       const wsreal_t* samples,
+                       uintptr_t sample_count,
+                       uintptr_t block_size)
+{
+    uintptr_t p, i;
+    double* time_buffer;
+    fftw_iodim dim;
+
+    ir->block_size = block_size;
+    ir->partition_count = (sample_count + block_size - 1) / block_size;
+    if (ir->partition_count == 0)
+        ir->partition_count = 1;
+    ir->bin_count = block_size + 1;
+    ir->stride = (ir->bin_count + STRIDE_ALIGN - 1) / STRIDE_ALIGN * STRIDE_ALIGN;
+    ir->forward_plan = NULL;
+    ir->inverse_plan = NULL;
+
+    ir->re = fftw_malloc(sizeof(double) * ir->partition_count * ir->stride);
+    ir->im = fftw_malloc(sizeof(double) * ir->partition_count * ir->stride);
+    time_buffer = fftw_malloc(sizeof(double) * block_size * 2);
+    if (ir->re == NULL || ir->im == NULL || time_buffer == NULL)
+        goto alloc_failed;
+
+    /*
+     * Plans are created with FFTW_ESTIMATE so the arrays aren't overwritten
+     * during planning. The inverse plan is created on the IR's own arrays,
+     * convolvers execute it on theirs via the new-array execute interface,
+     * which only requires identical alignment.
+     */
+    dim.n = (int)(block_size * 2);
+    dim.is = 1;
+    dim.os = 1;
+    ir->forward_plan = fftw_plan_guru_split_dft_r2c(1, &dim, 0, NULL,
+                                                   time_buffer, ir->re, ir->im,
+                                                   FFTW_ESTIMATE);
+    ir->inverse_plan = fftw_plan_guru_split_dft_c2r(1, &dim, 0, NULL,
+                                                   ir->re, ir->im, time_buffer,
+                                                   FFTW_ESTIMATE);
+    if (ir->forward_plan == NULL || ir->inverse_plan == NULL)
+        goto alloc_failed;
+
+    /*
+     * Each partition is zero-padded to twice the block size before
+     * transforming, so the circular convolution performed in the frequency
+     * domain doesn't wrap around into the half of the output we keep.
+     */
+    memset(ir->re, 0, sizeof(double) * ir->partition_count * ir->stride);
+    memset(ir->im, 0, sizeof(double) * ir->partition_count * ir->stride);
+    for (p = 0; p != ir->partition_count; ++p)
+    {
+        for (i = 0; i != block_size * 2; ++i)
+        {
+            uintptr_t src = p * block_size + i;
+            time_buffer[i] = (i < block_size && src < sample_count) ? (double)samples[src] : 0.0;
+        }
+        fftw_execute_split_dft_r2c(ir->forward_plan, time_buffer,
+                                   ir->re + p * ir->stride,
+                                   ir->im + p * ir->stride);
+    }
+
+    fftw_free(time_buffer);
+    WSRET(WS_OK);
+
+    alloc_failed:
+    if (time_buffer != NULL)
+        fftw_free(time_buffer);
+    convolver_ir_destruct(ir);
+    WSRET(WS_ERR_OUT_OF_MEMORY);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+convolver_ir_destruct(convolver_ir_t* ir)
+{
+    if (ir->forward_plan != NULL)
+        fftw_destroy_plan(ir->forward_plan);
+    if (ir->inverse_plan != NULL)
+        fftw_destroy_plan(ir->inverse_plan);
+    if (ir->re != NULL)
+        fftw_free(ir->re);
+    if (ir->im != NULL)
+        fftw_free(ir->im);
+    ir->forward_plan = NULL;
+    ir->inverse_plan = NULL;
+    ir->re = NULL;
+    ir->im = NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+convolver_construct(convolver_t* convolver, const convolver_ir_t* ir)
+{
+    uintptr_t fdl_size = ir->partition_count * ir->stride;
+
+    convolver->ir = ir;
+    convolver->fdl_re = fftw_malloc(sizeof(double) * fdl_size);
+    convolver->fdl_im = fftw_malloc(sizeof(double) * fdl_size);
+    convolver->acc_re = fftw_malloc(sizeof(double) * ir->stride);
+    convolver->acc_im = fftw_malloc(sizeof(double) * ir->stride);
+    convolver->input = fftw_malloc(sizeof(double) * ir->block_size * 2);
+    convolver->output = fftw_malloc(sizeof(double) * ir->block_size * 2);
+    if (convolver->fdl_re == NULL || convolver->fdl_im == NULL ||
+        convolver->acc_re == NULL || convolver->acc_im == NULL ||
+        convolver->input == NULL || convolver->output == NULL)
+    {
+        convolver_destruct(convolver);
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+    }
+
+    convolver_reset(convolver);
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+convolver_destruct(convolver_t* convolver)
+{
+    if (convolver->fdl_re != NULL) fftw_free(convolver->fdl_re);
+    if (convolver->fdl_im != NULL) fftw_free(convolver->fdl_im);
+    if (convolver->acc_re != NULL) fftw_free(convolver->acc_re);
+    if (convolver->acc_im != NULL) fftw_free(convolver->acc_im);
+    if (convolver->input != NULL)  fftw_free(convolver->input);
+    if (convolver->output != NULL) fftw_free(convolver->output);
+    convolver->fdl_re = NULL;
+    convolver->fdl_im = NULL;
+    convolver->acc_re = NULL;
+    convolver->acc_im = NULL;
+    convolver->input = NULL;
+    convolver->output = NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+void
+convolver_reset(convolver_t* convolver)
+{
+    const convolver_ir_t* ir = convolver->ir;
+    memset(convolver->fdl_re, 0, sizeof(double) * ir->partition_count * ir->stride);
+    memset(convolver->fdl_im, 0, sizeof(double) * ir->partition_count * ir->stride);
+    memset(convolver->input, 0, sizeof(double) * ir->block_size * 2);
+    convolver->fdl_head = 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Slides the new input block into the time buffer, transforms it and stores
+ * the spectrum in the next slot of the delay line. Also clears the
+ * accumulator so the partitions can be summed into it.
+ */
+static void
+push_input_block(convolver_t* convolver, const wsreal_t* input)
+{
+    uintptr_t i;
+    const convolver_ir_t* ir = convolver->ir;
+    uintptr_t B = ir->block_size;
+
+    memmove(convolver->input, convolver->input + B, sizeof(double) * B);
+    for (i = 0; i != B; ++i)
+        convolver->input[B + i] = (double)input[i];
+
+    /* The delay line is a ring buffer. Move backwards, so that slot
+     * (head + p) % P always holds the spectrum from p blocks ago */
+    convolver->fdl_head = (convolver->fdl_head + ir->partition_count - 1) % ir->partition_count;
+    fftw_execute_split_dft_r2c(ir->forward_plan, convolver->input,
+                               convolver->fdl_re + convolver->fdl_head * ir->stride,
+                               convolver->fdl_im + convolver->fdl_head * ir->stride);
+
+    memset(convolver->acc_re, 0, sizeof(double) * ir->stride);
+    memset(convolver->acc_im, 0, sizeof(double) * ir->stride);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Accumulates the product of the input spectrum from p blocks ago with IR
+ * partition p.
+ */
+static void
+accumulate_partition(convolver_t* convolver, uintptr_t p)
+{
+    const convolver_ir_t* ir = convolver->ir;
+    uintptr_t slot = (convolver->fdl_head + p) % ir->partition_count;
+    complex_multiply_accumulate(convolver->acc_re, convolver->acc_im,
+                                convolver->fdl_re + slot * ir->stride,
+                                convolver->fdl_im + slot * ir->stride,
+                                ir->re + p * ir->stride,
+                                ir->im + p * ir->stride,
+                                ir->bin_count);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Transforms the accumulated spectrum back into the time domain. Overlap-save
+ * discards the first half of the result, which is corrupted by circular
+ * wrap-around.
+ */
+static void
+pop_output_block(convolver_t* convolver, wsreal_t* output)
+{
+    uintptr_t i;
+    const convolver_ir_t* ir = convolver->ir;
+    uintptr_t B = ir->block_size;
+    double scale = 1.0 / (double)(B * 2); /* FFTW doesn't normalize */
+
+    fftw_execute_split_dft_c2r(ir->inverse_plan, convolver->acc_re, convolver->acc_im,
+                               convolver->output);
+    for (i = 0; i != B; ++i)
+        output[i] = (wsreal_t)(convolver->output[B + i] * scale);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+convolver_process(convolver_t* convolver, const wsreal_t* input, wsreal_t* output)
+{
+    uintptr_t p;
+
+    push_input_block(convolver, input);
+    for (p = 0; p != convolver->ir->partition_count; ++p)
+        accumulate_partition(convolver, p);
+    pop_output_block(convolver, output);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+convolver_process_batch(const convolver_ir_t* ir,
+                        convolver_t* convolvers,
+                        const wsreal_t* const* inputs,
+                        wsreal_t* const* outputs,
+                        uintptr_t voice_count)
+{
+    uintptr_t v, p;
+
+    for (v = 0; v != voice_count; ++v)
+        push_input_block(&convolvers[v], inputs[v]);
+
+    /* Partition-major order, so each IR partition is fetched once and then
+     * stays in cache while it is applied to every voice */
+    for (p = 0; p != ir->partition_count; ++p)
+        for (v = 0; v != voice_count; ++v)
+            accumulate_partition(&convolvers[v], p);
+
+    for (v = 0; v != voice_count; ++v)
+        pop_output_block(&convolvers[v], outputs[v]);
+}
@@ -0,0 +1,193 @@
+#include "wavesim/clock.h"
+#include "wavesim/memory.h"
+#include "wavesim/simulation/cost_model.h"
+#include "wavesim/simulation/medium.h"
+#include "fftw3.h"
+#include <math.h>
+#include <stddef.h>
+
+/* Partition edge lengths (in cells) timed during calibration */
+#define CALIBRATE_SMALL_EDGE  2
+#define CALIBRATE_LARGE_EDGE  32
+/* Interface cells timed during calibration */
+#define CALIBRATE_INTERFACE_CELLS 4096
+/* Every measurement repeats until it took at least this long */
+#define CALIBRATE_MIN_SECONDS 0.004
+
+/* ------------------------------------------------------------------------- */
+void
+cost_model_construct(cost_model_t* model)
+{
+    model->partition = 1e-6;
+    model->transform = 4e-9;
+    model->interface = 1e-8;
+    model->calibrated = 0;
+}
+
+/* ------------------------------------------------------------------------- */
+static wsreal_t
+n_log2_n(wsreal_t n)
+{
+    return n > 1.0 ? n * log(n) / log(2.0) : 0.0;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Seconds per DCT/IDCT pair of a cube of edge^3 cells, or a negative value if
+ * fftw ran out of memory.
+ */
+static wsreal_t
+time_transform_pair(int edge)
+{
+    uintptr_t i, cell_count = (uintptr_t)(edge * edge * edge);
+    uintptr_t repeats;
+    wsreal_t start, elapsed;
+    double* cells = fftw_malloc(sizeof(double) * cell_count);
+    double* modes = fftw_malloc(sizeof(double) * cell_count);
+    fftw_plan dct, idct;
+
+    if (cells == NULL || modes == NULL)
+    {
+        if (cells != NULL) fftw_free(cells);
+        if (modes != NULL) fftw_free(modes);
+        return -1.0;
+    }
+
+    dct = fftw_plan_r2r_3d(edge, edge, edge, cells, modes, FFTW_REDFT10, FFTW_REDFT10, FFTW_REDFT10, FFTW_ESTIMATE);
+    idct = fftw_plan_r2r_3d(edge, edge, edge, modes, cells, FFTW_REDFT01, FFTW_REDFT01, FFTW_REDFT01, FFTW_ESTIMATE);
+    for (i = 0; i != cell_count; ++i)
+        cells[i] = (double)(i % 7) - 3.0;
+
+    /* Normalize after every pair so the values neither blow up nor vanish */
+    repeats = 0;
+    start = ws_clock_seconds();
+    do
+    {
+        fftw_execute(dct);
+        fftw_execute(idct);
+        for (i = 0; i != cell_count; ++i)
+            cells[i] /= (double)(8 * cell_count);
+        ++repeats;
+        elapsed = ws_clock_seconds() - start;
+    } while (elapsed < CALIBRATE_MIN_SECONDS);
+
+    fftw_destroy_plan(idct);
+    fftw_destroy_plan(dct);
+    fftw_free(modes);
+    fftw_free(cells);
+    return elapsed / (wsreal_t)repeats;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Seconds per interface cell of the 6th order stencil ARD uses to compute the
+ * forcing terms on both sides of an interface. Returns -1 if out of memory.
+ */
+static wsreal_t
+time_interface(void)
+{
+    static const double stencil[7] = {2.0, -27.0, 270.0, -490.0, 270.0, -27.0, 2.0};
+    double (*pressure)[6] = MALLOC(sizeof(double) * 6 * CALIBRATE_INTERFACE_CELLS);
+    double (*forcing)[6] = MALLOC(sizeof(double) * 6 * CALIBRATE_INTERFACE_CELLS);
+    uintptr_t i, repeats;
+    wsreal_t start, elapsed;
+    int j, k;
+
+    if (pressure == NULL || forcing == NULL)
+    {
+        if (pressure != NULL) FREE(pressure);
+        if (forcing != NULL)  FREE(forcing);
+        return -1.0;
+    }
+
+    for (i = 0; i != CALIBRATE_INTERFACE_CELLS; ++i)
+        for (j = 0; j != 6; ++j)
+            pressure[i][j] = (double)((i + (uintptr_t)j) % 5) - 2.0;
+
+    repeats = 0;
+    start = ws_clock_seconds();
+    do
+    {
+        for (i = 0; i != CALIBRATE_INTERFACE_CELLS; ++i)
+            for (j = 0; j != 6; ++j)
+            {
+                double sum = 0.0;
+                for (k = 0; k != 7; ++k)
+                {
+                    int cell = j + k - 3;
+                    if (cell >= 0 && cell < 6)
+                        sum += stencil[k] * pressure[i][cell];
+                }
+                forcing[i][j] = sum / 180.0;
+            }
+        /* Feed the result back, so the loop can't be optimized away */
+        for (i = 0; i != CALIBRATE_INTERFACE_CELLS; ++i)
+            pressure[i][(i + repeats) % 6] += forcing[i][repeats % 6] * 1e-9;
+        ++repeats;
+        elapsed = ws_clock_seconds() - start;
+    } while (elapsed < CALIBRATE_MIN_SECONDS);
+
+    FREE(forcing);
+    FREE(pressure);
+    return elapsed / (wsreal_t)(repeats * CALIBRATE_INTERFACE_CELLS);
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+cost_model_calibrate(cost_model_t* model)
+{
+    wsreal_t small_n = CALIBRATE_SMALL_EDGE * CALIBRATE_SMALL_EDGE * CALIBRATE_SMALL_EDGE;
+    wsreal_t large_n = CALIBRATE_LARGE_EDGE * CALIBRATE_LARGE_EDGE * CALIBRATE_LARGE_EDGE;
+    wsreal_t small_t = time_transform_pair(CALIBRATE_SMALL_EDGE);
+    wsreal_t large_t = time_transform_pair(CALIBRATE_LARGE_EDGE);
+    wsreal_t interface_t = time_interface();
+    if (small_t < 0.0 || large_t < 0.0 || interface_t < 0.0)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+
+    /* Fit t = partition + transform * N*log2(N) through both measurements */
+    model->transform = (large_t - small_t) / (n_log2_n(large_n) - n_log2_n(small_n));
+    if (model->transform <= 0.0)
+        model->transform = large_t / n_log2_n(large_n);
+    model->partition = small_t - model->transform * n_log2_n(small_n);
+    if (model->partition < 0.0)
+        model->partition = 0.0;
+
+    model->interface = interface_t;
+    model->calibrated = 1;
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+wsreal_t
+cost_model_predict(const cost_model_t* model,
+                   const medium_t* medium,
+                   const wsreal_t grid_size[3])
+{
+    wsreal_t time = 0.0;
+    wsreal_t face_cells = 0.0;
+    wsreal_t boundary_cells[3];
+    vec3_t dims;
+    int i;
+
+    VECTOR_FOR_EACH(&medium->partitions, medium_partition_t, partition)
+        wsreal_t cells[3];
+        dims = AABB_DIMS(partition->aabb);
+        for (i = 0; i != 3; ++i)
+            cells[i] = floor(dims.xyz[i] / grid_size[i] + 0.5);
+        time += model->partition + model->transform * n_log2_n(cells[0] * cells[1] * cells[2]);
+        face_cells += 2.0 * (cells[0]*cells[1] + cells[1]*cells[2] + cells[0]*cells[2]);
+    VECTOR_END_EACH
+
+    /* Faces on the boundary are no interfaces. Every other face cell is shared
+     * by two partitions */
+    dims = AABB_DIMS(medium->boundary);
+    for (i = 0; i != 3; ++i)
+        boundary_cells[i] = floor(dims.xyz[i] / grid_size[i] + 0.5);
+    face_cells -= 2.0 * (boundary_cells[0]*boundary_cells[1] +
+                         boundary_cells[1]*boundary_cells[2] +
+                         boundary_cells[0]*boundary_cells[2]);
+    if (face_cells > 0.0)
+        time += model->interface * face_cells / 2.0;
+
+    return time;
+}
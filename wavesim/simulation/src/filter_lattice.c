@@ -0,0 +1,567 @@
+#include "wavesim/memory.h"
+#include "wavesim/simulation/biquad.h"
+#include "wavesim/simulation/filter_lattice.h"
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#define EMPTY_DELAY      0xFFFF
+#define MAX_DELAY        0xFFFE
+#define SILENT_LEVEL     255
+#define LEVEL_STEP_DB    0.5
+#define DECAY_MIN        0.01
+#define DECAY_STEPS_PER_OCTAVE 24.0
+#define EARLY_WINDOW     0.08
+
+static const char MAGIC[4] = {'W', 'S', 'F', 'L'};
+
+/* ------------------------------------------------------------------------- */
+static wsreal_t
+dequantize_level(uint8_t q)
+{
+    if (q == SILENT_LEVEL)
+        return 0.0;
+    return pow(10.0, -LEVEL_STEP_DB * q / 20.0);
+}
+
+/* ------------------------------------------------------------------------- */
+static wsreal_t
+dequantize_decay(uint8_t q)
+{
+    return DECAY_MIN * pow(2.0, q / DECAY_STEPS_PER_OCTAVE);
+}
+
+/* ------------------------------------------------------------------------- */
+static int
+is_finite(float value)
+{
+    return value >= -FLT_MAX && value <= FLT_MAX;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Lookups divide by the spacing and cast the result to lattice points, so
+ * it has to be positive and the origin has to be finite.
+ */
+static int
+grid_is_valid(const float origin[3], float spacing)
+{
+    return is_finite(origin[0]) && is_finite(origin[1]) && is_finite(origin[2]) &&
+           spacing > 0.0f && is_finite(spacing);
+}
+
+/* ------------------------------------------------------------------------- */
+static wsret
+validate_header(filter_lattice_t* fl, const void* data, uintptr_t size)
+{
+    const filter_lattice_header_t* header = data;
+    uintptr_t listener_count, record_count;
+
+    if (size < sizeof(filter_lattice_header_t))
+        WSRET(WS_ERR_BAD_FILE_FORMAT);
+    if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 ||
+        header->version != FILTER_LATTICE_VERSION ||
+        header->byte_order != FILTER_LATTICE_BYTE_ORDER ||
+        header->tap_count != FILTER_LATTICE_TAP_COUNT ||
+        header->band_count != FILTER_LATTICE_BAND_COUNT ||
+        !(header->sample_rate > 0.0f && is_finite(header->sample_rate)) ||
+        !grid_is_valid(header->listener_origin, header->listener_spacing) ||
+        !grid_is_valid(header->emitter_origin, header->emitter_spacing))
+        WSRET(WS_ERR_BAD_FILE_FORMAT);
+
+    listener_count = (uintptr_t)header->listener_dims[0] * header->listener_dims[1] * header->listener_dims[2];
+    fl->emitter_point_count = (uintptr_t)header->emitter_dims[0] * header->emitter_dims[1] * header->emitter_dims[2];
+    if (listener_count == 0 || fl->emitter_point_count == 0)
+        WSRET(WS_ERR_BAD_FILE_FORMAT);
+
+    record_count = listener_count * fl->emitter_point_count;
+    if (record_count / listener_count != fl->emitter_point_count ||
+        (size - sizeof(filter_lattice_header_t)) / sizeof(filter_lattice_record_t) < record_count)
+        WSRET(WS_ERR_BAD_FILE_FORMAT);
+
+    fl->header = header;
+    fl->records = (const filter_lattice_record_t*)(header + 1);
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+filter_lattice_build_tables(wsreal_t level_table[256], wsreal_t decay_table[256])
+{
+    int i;
+    for (i = 0; i != 256; ++i)
+    {
+        level_table[i] = dequantize_level((uint8_t)i);
+        decay_table[i] = dequantize_decay((uint8_t)i);
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+void
+filter_lattice_header_init(filter_lattice_header_t* header,
+                           const filter_lattice_grid_t* listener_grid,
+                           const filter_lattice_grid_t* emitter_grid,
+                           wsreal_t sample_rate)
+{
+    int i;
+
+    memset(header, 0, sizeof *header);
+    memcpy(header->magic, MAGIC, sizeof(MAGIC));
+    header->version = FILTER_LATTICE_VERSION;
+    header->byte_order = FILTER_LATTICE_BYTE_ORDER;
+    header->tap_count = FILTER_LATTICE_TAP_COUNT;
+    header->band_count = FILTER_LATTICE_BAND_COUNT;
+    header->sample_rate = (float)sample_rate;
+    header->listener_spacing = (float)listener_grid->spacing;
+    header->emitter_spacing = (float)emitter_grid->spacing;
+    for (i = 0; i != 3; ++i)
+    {
+        header->listener_dims[i] = listener_grid->dims[i];
+        header->emitter_dims[i] = emitter_grid->dims[i];
+        header->listener_origin[i] = (float)listener_grid->origin[i];
+        header->emitter_origin[i] = (float)emitter_grid->origin[i];
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+filter_lattice_open(filter_lattice_t* fl, const char* file_name)
+{
+    wsret result;
+
+    if ((result = mapped_file_open(&fl->file, file_name)) != WS_OK)
+        return result;
+
+    if ((result = validate_header(fl, fl->file.data, fl->file.size)) != WS_OK)
+    {
+        mapped_file_close(&fl->file);
+        return result;
+    }
+
+    filter_lattice_build_tables(fl->level_table, fl->decay_table);
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+filter_lattice_open_memory(filter_lattice_t* fl, const void* data, uintptr_t size)
+{
+    wsret result;
+
+    fl->file.data = NULL;
+    fl->file.size = 0;
+    if ((result = validate_header(fl, data, size)) != WS_OK)
+        return result;
+
+    filter_lattice_build_tables(fl->level_table, fl->decay_table);
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+filter_lattice_close(filter_lattice_t* fl)
+{
+    mapped_file_close(&fl->file);
+    fl->header = NULL;
+    fl->records = NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+filter_lattice_save(const char* file_name,
+                    const filter_lattice_grid_t* listener_grid,
+                    const filter_lattice_grid_t* emitter_grid,
+                    wsreal_t sample_rate,
+                    const filter_lattice_record_t* records)
+{
+    FILE* fp;
+    filter_lattice_header_t header;
+    uintptr_t record_count;
+
+    filter_lattice_header_init(&header, listener_grid, emitter_grid, sample_rate);
+
+    record_count =
+        (uintptr_t)listener_grid->dims[0] * listener_grid->dims[1] * listener_grid->dims[2] *
+        emitter_grid->dims[0] * emitter_grid->dims[1] * emitter_grid->dims[2];
+
+    fp = fopen(file_name, "wb");
+    if (fp == NULL)
+        WSRET(WS_ERR_FOPEN_FAILED);
+
+    if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+        fwrite(records, sizeof(filter_lattice_record_t), record_count, fp) != record_count)
+    {
+        fclose(fp);
+        WSRET(WS_ERR_WRITE_ERROR);
+    }
+
+    if (fclose(fp) != 0)
+        WSRET(WS_ERR_WRITE_ERROR);
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+static uintptr_t
+point_index(const uint32_t dims[3], const uint32_t point[3])
+{
+    return point[0] + (uintptr_t)dims[0] * (point[1] + (uintptr_t)dims[1] * point[2]);
+}
+
+/* ------------------------------------------------------------------------- */
+const filter_lattice_record_t*
+filter_lattice_get_record(const filter_lattice_t* fl,
+                          const uint32_t listener_point[3],
+                          const uint32_t emitter_point[3])
+{
+    return fl->records +
+        point_index(fl->header->listener_dims, listener_point) * fl->emitter_point_count +
+        point_index(fl->header->emitter_dims, emitter_point);
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+accumulate_record(const filter_lattice_header_t* h,
+                  const wsreal_t* level_table,
+                  const wsreal_t* decay_table,
+                  filter_lattice_filter_t* filter,
+                  const filter_lattice_record_t* record,
+                  wsreal_t weight)
+{
+    int i;
+    wsreal_t delay_scale = weight / h->sample_rate;
+    wsreal_t gain_scale = weight / 32768.0;
+
+    for (i = 0; i != FILTER_LATTICE_TAP_COUNT; ++i)
+    {
+        filter->tap_delay[i] += record->tap_delay[i] * delay_scale;
+        filter->tap_gain[i] += record->tap_gain[i] * gain_scale;
+    }
+    for (i = 0; i != FILTER_LATTICE_BAND_COUNT; ++i)
+    {
+        filter->band_level[i] += level_table[record->band_level[i]] * weight;
+        filter->band_decay[i] += decay_table[record->band_decay[i]] * weight;
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+uintptr_t
+filter_lattice_nearest_listener_point(const filter_lattice_header_t* h,
+                                      const wsreal_t listener[3])
+{
+    int i;
+    uint32_t point[3];
+
+    for (i = 0; i != 3; ++i)
+    {
+        wsreal_t u = (listener[i] - h->listener_origin[i]) / h->listener_spacing + 0.5;
+        wsreal_t max = (wsreal_t)(h->listener_dims[i] - 1);
+        point[i] = (uint32_t)(u < 0.0 ? 0.0 : u > max ? max : u);
+    }
+
+    return point_index(h->listener_dims, point);
+}
+
+/* ------------------------------------------------------------------------- */
+int
+filter_lattice_interpolate(const filter_lattice_header_t* h,
+                           const wsreal_t* level_table,
+                           const wsreal_t* decay_table,
+                           const filter_lattice_record_t* block,
+                           const wsreal_t emitter[3],
+                           filter_lattice_filter_t* filter)
+{
+    int i, corner;
+    uint32_t base[3];
+    wsreal_t frac[3], total_weight;
+    filter_lattice_filter_t result;
+
+    /* Lower emitter lattice point of the surrounding cell */
+    for (i = 0; i != 3; ++i)
+    {
+        wsreal_t u = (emitter[i] - h->emitter_origin[i]) / h->emitter_spacing;
+        wsreal_t max = (wsreal_t)(h->emitter_dims[i] - 1);
+        u = u < 0.0 ? 0.0 : u > max ? max : u;
+        base[i] = (uint32_t)u;
+        if (base[i] > 0 && base[i] == h->emitter_dims[i] - 1)
+            base[i]--;
+        frac[i] = u - base[i];
+    }
+
+    memset(&result, 0, sizeof(result));
+    total_weight = 0.0;
+    for (corner = 0; corner != 8; ++corner)
+    {
+        uint32_t point[3];
+        wsreal_t weight = 1.0;
+        const filter_lattice_record_t* record;
+
+        for (i = 0; i != 3; ++i)
+        {
+            int upper = (corner >> i) & 1;
+            weight *= upper ? frac[i] : 1.0 - frac[i];
+            point[i] = base[i] + (uint32_t)upper;
+        }
+        if (weight <= 0.0)
+            continue;
+
+        record = block + point_index(h->emitter_dims, point);
+        if (filter_lattice_record_is_empty(record))
+            continue;
+
+        accumulate_record(h, level_table, decay_table, &result, record, weight);
+        total_weight += weight;
+    }
+
+    if (total_weight <= 0.0)
+        return 0;
+
+    /* Renormalize in case some of the corners had no data */
+    for (i = 0; i != FILTER_LATTICE_TAP_COUNT; ++i)
+    {
+        filter->tap_delay[i] = result.tap_delay[i] / total_weight;
+        filter->tap_gain[i] = result.tap_gain[i] / total_weight;
+    }
+    for (i = 0; i != FILTER_LATTICE_BAND_COUNT; ++i)
+    {
+        filter->band_level[i] = result.band_level[i] / total_weight;
+        filter->band_decay[i] = result.band_decay[i] / total_weight;
+    }
+
+    return 1;
+}
+
+/* ------------------------------------------------------------------------- */
+int
+filter_lattice_lookup(const filter_lattice_t* fl,
+                      const wsreal_t listener[3],
+                      const wsreal_t emitter[3],
+                      filter_lattice_filter_t* filter)
+{
+    uintptr_t listener_point = filter_lattice_nearest_listener_point(fl->header, listener);
+    return filter_lattice_interpolate(fl->header, fl->level_table, fl->decay_table,
+                                      fl->records + listener_point * fl->emitter_point_count,
+                                      emitter, filter);
+}
+
+/* ------------------------------------------------------------------------- */
+uintptr_t
+filter_lattice_lookup_batch(const filter_lattice_t* fl,
+                            const wsreal_t* listeners,
+                            const wsreal_t* emitters,
+                            uintptr_t count,
+                            filter_lattice_filter_t* filters,
+                            char* found)
+{
+    uintptr_t i, found_count = 0;
+    for (i = 0; i != count; ++i)
+    {
+        int result = filter_lattice_lookup(fl, listeners + i*3, emitters + i*3, filters + i);
+        if (found != NULL)
+            found[i] = (char)result;
+        found_count += (uintptr_t)result;
+    }
+    return found_count;
+}
+
+/* ------------------------------------------------------------------------- */
+void
+filter_lattice_encode(filter_lattice_record_t* record,
+                      const filter_lattice_filter_t* filter,
+                      wsreal_t sample_rate)
+{
+    int i;
+
+    for (i = 0; i != FILTER_LATTICE_TAP_COUNT; ++i)
+    {
+        wsreal_t delay = floor(filter->tap_delay[i] * sample_rate + 0.5);
+        wsreal_t gain = floor(filter->tap_gain[i] * 32768.0 + 0.5);
+        record->tap_delay[i] = (uint16_t)(delay < 0.0 ? 0.0 : delay > MAX_DELAY ? MAX_DELAY : delay);
+        record->tap_gain[i] = (int16_t)(gain < -32768.0 ? -32768.0 : gain > 32767.0 ? 32767.0 : gain);
+    }
+
+    for (i = 0; i != FILTER_LATTICE_BAND_COUNT; ++i)
+    {
+        wsreal_t level = filter->band_level[i];
+        wsreal_t decay = filter->band_decay[i];
+
+        if (level <= 0.0)
+            record->band_level[i] = SILENT_LEVEL;
+        else
+        {
+            wsreal_t q = floor(-20.0 * log10(level) / LEVEL_STEP_DB + 0.5);
+            record->band_level[i] = (uint8_t)(q < 0.0 ? 0.0 : q > SILENT_LEVEL - 1 ? SILENT_LEVEL - 1 : q);
+        }
+
+        if (decay <= DECAY_MIN)
+            record->band_decay[i] = 0;
+        else
+        {
+            wsreal_t q = floor(DECAY_STEPS_PER_OCTAVE * log(decay / DECAY_MIN) / log(2.0) + 0.5);
+            record->band_decay[i] = (uint8_t)(q > 255.0 ? 255.0 : q);
+        }
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+void
+filter_lattice_decode(filter_lattice_filter_t* filter,
+                      const filter_lattice_record_t* record,
+                      wsreal_t sample_rate)
+{
+    int i;
+    for (i = 0; i != FILTER_LATTICE_TAP_COUNT; ++i)
+    {
+        filter->tap_delay[i] = record->tap_delay[i] / sample_rate;
+        filter->tap_gain[i] = record->tap_gain[i] / 32768.0;
+    }
+    for (i = 0; i != FILTER_LATTICE_BAND_COUNT; ++i)
+    {
+        filter->band_level[i] = dequantize_level(record->band_level[i]);
+        filter->band_decay[i] = dequantize_decay(record->band_decay[i]);
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+void
+filter_lattice_record_set_empty(filter_lattice_record_t* record)
+{
+    memset(record, 0, sizeof *record);
+    record->tap_delay[0] = EMPTY_DELAY;
+}
+
+/* ------------------------------------------------------------------------- */
+int
+filter_lattice_record_is_empty(const filter_lattice_record_t* record)
+{
+    return record->tap_delay[0] == EMPTY_DELAY;
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+find_taps(filter_lattice_filter_t* filter,
+          const wsreal_t* samples,
+          uintptr_t sample_count,
+          wsreal_t sample_rate)
+{
+    uintptr_t i, window, tap_index[FILTER_LATTICE_TAP_COUNT];
+    int t, taps_found = 0;
+
+    window = (uintptr_t)(EARLY_WINDOW * sample_rate);
+    if (window > sample_count)
+        window = sample_count;
+
+    /* Keep the strongest local maxima, sorted by descending magnitude */
+    for (i = 0; i != window; ++i)
+    {
+        wsreal_t m = fabs(samples[i]);
+        if (m <= 0.0 ||
+            (i > 0 && fabs(samples[i-1]) > m) ||
+            (i + 1 < sample_count && fabs(samples[i+1]) >= m))
+            continue;
+
+        for (t = taps_found; t > 0 && fabs(samples[tap_index[t-1]]) < m; --t)
+            if (t < FILTER_LATTICE_TAP_COUNT)
+                tap_index[t] = tap_index[t-1];
+        if (t < FILTER_LATTICE_TAP_COUNT)
+        {
+            tap_index[t] = i;
+            if (taps_found < FILTER_LATTICE_TAP_COUNT)
+                taps_found++;
+        }
+    }
+
+    /* Now sort by delay */
+    for (t = 1; t < taps_found; ++t)
+    {
+        uintptr_t idx = tap_index[t];
+        int j = t;
+        for (; j > 0 && tap_index[j-1] > idx; --j)
+            tap_index[j] = tap_index[j-1];
+        tap_index[j] = idx;
+    }
+
+    for (t = 0; t != FILTER_LATTICE_TAP_COUNT; ++t)
+    {
+        filter->tap_delay[t] = t < taps_found ? (wsreal_t)tap_index[t] / sample_rate : 0.0;
+        filter->tap_gain[t] = t < taps_found ? samples[tap_index[t]] : 0.0;
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Returns the first sample at which the Schroeder curve falls below the
+ * specified level, or sample_count if it never does.
+ */
+static uintptr_t
+find_decay_point(const wsreal_t* schroeder, uintptr_t sample_count, wsreal_t db)
+{
+    uintptr_t i;
+    wsreal_t threshold = schroeder[0] * pow(10.0, db / 10.0);
+    for (i = 0; i != sample_count; ++i)
+        if (schroeder[i] <= threshold)
+            return i;
+    return sample_count;
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+filter_lattice_analyze_ir(filter_lattice_filter_t* filter,
+                          const wsreal_t* samples,
+                          uintptr_t sample_count,
+                          wsreal_t sample_rate)
+{
+    int band;
+    uintptr_t i;
+    wsreal_t* schroeder;
+
+    find_taps(filter, samples, sample_count, sample_rate);
+
+    schroeder = MALLOC(sizeof(wsreal_t) * (sample_count + 1));
+    if (schroeder == NULL)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+
+    for (band = 0; band != FILTER_LATTICE_BAND_COUNT; ++band)
+    {
+        biquad_t bq;
+        uintptr_t start, end;
+        wsreal_t end_db;
+        wsreal_t center = FILTER_LATTICE_LOWEST_BAND * pow(2.0, band);
+
+        filter->band_level[band] = 0.0;
+        filter->band_decay[band] = 0.0;
+        if (center >= sample_rate * 0.45 || sample_count == 0)
+            continue;
+
+        /* Energy of the band, integrated backwards (Schroeder integral) */
+        biquad_set_bandpass(&bq, center, sample_rate, 1.0);
+        for (i = 0; i != sample_count; ++i)
+        {
+            wsreal_t y = biquad_process(&bq, samples[i]);
+            schroeder[i] = y * y;
+        }
+        schroeder[sample_count] = 0.0;
+        for (i = sample_count; i-- > 0; )
+            schroeder[i] += schroeder[i+1];
+        if (schroeder[0] <= 0.0)
+            continue;
+
+        filter->band_level[band] = sqrt(schroeder[0]);
+
+        /* Use the range from -5 dB to -25 dB (T20). Fall back to T10 if the
+         * impulse response is too short */
+        start = find_decay_point(schroeder, sample_count, -5.0);
+        end_db = -25.0;
+        end = find_decay_point(schroeder, sample_count, end_db);
+        if (end == sample_count)
+        {
+            end_db = -15.0;
+            end = find_decay_point(schroeder, sample_count, end_db);
+        }
+        if (end < sample_count && end > start)
+            filter->band_decay[band] = 60.0 / (-5.0 - end_db) * (wsreal_t)(end - start) / sample_rate;
+    }
+
+    FREE(schroeder);
+    WSRET(WS_OK);
+}
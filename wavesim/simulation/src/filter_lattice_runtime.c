@@ -0,0 +1,300 @@
+#include "wavesim/atomic.h"
+#include "wavesim/memory.h"
+#include "wavesim/simulation/audio_listener.h"
+#include "wavesim/simulation/filter_lattice_runtime.h"
+#include "wavesim/simulation/simulation.h"
+#include <assert.h>
+#include <string.h>
+
+/* ------------------------------------------------------------------------- */
+wsret
+filter_lattice_runtime_create(filter_lattice_runtime_t** runtime,
+                              const filter_lattice_grid_t* listener_grid,
+                              const filter_lattice_grid_t* emitter_grid,
+                              wsreal_t sample_rate,
+                              uintptr_t spare_blocks)
+{
+    uintptr_t i, block_count;
+    filter_lattice_runtime_t* rt;
+
+    assert(spare_blocks > 0);
+
+    *runtime = rt = MALLOC(sizeof *rt);
+    if (rt == NULL)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+    memset(rt, 0, sizeof *rt);
+
+    filter_lattice_header_init(&rt->header, listener_grid, emitter_grid, sample_rate);
+    filter_lattice_build_tables(rt->level_table, rt->decay_table);
+    rt->listener_point_count = (uintptr_t)listener_grid->dims[0] * listener_grid->dims[1] * listener_grid->dims[2];
+    rt->emitter_point_count = (uintptr_t)emitter_grid->dims[0] * emitter_grid->dims[1] * emitter_grid->dims[2];
+    rt->epoch = 1;
+
+    block_count = rt->listener_point_count + spare_blocks;
+    rt->blocks = MALLOC(sizeof(*rt->blocks) * rt->listener_point_count);
+    rt->pool = MALLOC(sizeof(filter_lattice_record_t) * rt->emitter_point_count * block_count);
+    rt->free_blocks = MALLOC(sizeof(*rt->free_blocks) * block_count);
+    rt->retired = MALLOC(sizeof(*rt->retired) * block_count);
+    if (rt->blocks == NULL || rt->pool == NULL || rt->free_blocks == NULL || rt->retired == NULL)
+    {
+        filter_lattice_runtime_destroy(rt);
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+    }
+
+    for (i = 0; i != rt->listener_point_count; ++i)
+        rt->blocks[i] = NULL;
+    for (i = 0; i != block_count; ++i)
+        rt->free_blocks[i] = rt->pool + i * rt->emitter_point_count;
+    rt->free_count = block_count;
+    rt->retired_count = 0;
+
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+filter_lattice_runtime_destroy(filter_lattice_runtime_t* runtime)
+{
+    if (runtime->retired != NULL)     FREE(runtime->retired);
+    if (runtime->free_blocks != NULL) FREE(runtime->free_blocks);
+    if (runtime->pool != NULL)        FREE(runtime->pool);
+    if (runtime->blocks != NULL)      FREE((void*)runtime->blocks);
+    FREE(runtime);
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+filter_lattice_runtime_register_reader(filter_lattice_runtime_t* runtime,
+                                       filter_lattice_reader_t* reader)
+{
+    int i;
+    for (i = 0; i != FILTER_LATTICE_RUNTIME_MAX_READERS; ++i)
+        if (ws_atomic_cas_uptr(&runtime->readers[i].in_use, 0, 1))
+        {
+            reader->slot = &runtime->readers[i];
+            WSRET(WS_OK);
+        }
+
+    reader->slot = NULL;
+    WSRET(WS_ERR_WOULD_BLOCK);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+filter_lattice_runtime_unregister_reader(filter_lattice_runtime_t* runtime,
+                                         filter_lattice_reader_t* reader)
+{
+    (void)runtime;
+    ws_atomic_store_uptr(&reader->slot->epoch, 0);
+    ws_atomic_store_uptr(&reader->slot->in_use, 0);
+    reader->slot = NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+uintptr_t
+filter_lattice_runtime_query(filter_lattice_runtime_t* runtime,
+                             filter_lattice_reader_t* reader,
+                             const wsreal_t* listeners,
+                             const wsreal_t* emitters,
+                             uintptr_t count,
+                             filter_lattice_filter_t* filters,
+                             char* found)
+{
+    uintptr_t i, found_count = 0;
+
+    /* Announce the epoch. The fence orders the announcement before any of the
+     * block pointers are loaded, which is what the writer relies on when it
+     * decides whether the epoch can be advanced */
+    ws_atomic_store_uptr(&reader->slot->epoch, (ws_atomic_load_uptr(&runtime->epoch) << 1) | 1);
+    ws_atomic_fence();
+
+    for (i = 0; i != count; ++i)
+    {
+        int result = 0;
+        uintptr_t listener_point = filter_lattice_nearest_listener_point(&runtime->header, listeners + i*3);
+        const filter_lattice_record_t* block = ws_atomic_load_ptr(&runtime->blocks[listener_point]);
+        if (block != NULL)
+            result = filter_lattice_interpolate(&runtime->header,
+                                                runtime->level_table,
+                                                runtime->decay_table,
+                                                block, emitters + i*3, filters + i);
+        if (found != NULL)
+            found[i] = (char)result;
+        found_count += (uintptr_t)result;
+    }
+
+    ws_atomic_store_uptr(&reader->slot->epoch, 0);
+    return found_count;
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+try_advance_epoch(filter_lattice_runtime_t* runtime)
+{
+    int i;
+    uintptr_t epoch = runtime->epoch; /* Only the writer modifies it */
+    uintptr_t current = (epoch << 1) | 1;
+
+    for (i = 0; i != FILTER_LATTICE_RUNTIME_MAX_READERS; ++i)
+    {
+        uintptr_t reader_epoch = ws_atomic_load_uptr(&runtime->readers[i].epoch);
+        if (reader_epoch != 0 && reader_epoch != current)
+            return;
+    }
+
+    ws_atomic_store_uptr(&runtime->epoch, epoch + 1);
+    ws_atomic_fence();
+}
+
+/* ------------------------------------------------------------------------- */
+void
+filter_lattice_runtime_collect(filter_lattice_runtime_t* runtime)
+{
+    uintptr_t i, kept = 0;
+
+    ws_atomic_fence();
+    try_advance_epoch(runtime);
+
+    for (i = 0; i != runtime->retired_count; ++i)
+    {
+        if (runtime->retired[i].epoch + 2 <= runtime->epoch)
+            runtime->free_blocks[runtime->free_count++] = runtime->retired[i].block;
+        else
+            runtime->retired[kept++] = runtime->retired[i];
+    }
+    runtime->retired_count = kept;
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+filter_lattice_runtime_publish(filter_lattice_runtime_t* runtime,
+                               uintptr_t listener_point,
+                               const filter_lattice_record_t* records)
+{
+    filter_lattice_record_t* block;
+    filter_lattice_record_t* old;
+
+    assert(listener_point < runtime->listener_point_count);
+
+    if (runtime->free_count == 0)
+    {
+        filter_lattice_runtime_collect(runtime);
+        /* Two advances are needed before a block retired in the current epoch
+         * can be reused */
+        filter_lattice_runtime_collect(runtime);
+        if (runtime->free_count == 0)
+            WSRET(WS_ERR_WOULD_BLOCK);
+    }
+
+    block = runtime->free_blocks[--runtime->free_count];
+    memcpy(block, records, sizeof(filter_lattice_record_t) * runtime->emitter_point_count);
+
+    old = ws_atomic_exchange_ptr(&runtime->blocks[listener_point], block);
+    if (old != NULL)
+    {
+        runtime->retired[runtime->retired_count].block = old;
+        runtime->retired[runtime->retired_count].epoch = runtime->epoch;
+        runtime->retired_count++;
+    }
+
+    filter_lattice_runtime_collect(runtime);
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+filter_lattice_runtime_load(filter_lattice_runtime_t* runtime,
+                            const filter_lattice_t* fl)
+{
+    uintptr_t i;
+    wsret result;
+
+    if (memcmp(fl->header->listener_dims, runtime->header.listener_dims, sizeof(runtime->header.listener_dims)) != 0 ||
+        memcmp(fl->header->emitter_dims, runtime->header.emitter_dims, sizeof(runtime->header.emitter_dims)) != 0)
+        WSRET(WS_ERR_BAD_FILE_FORMAT);
+
+    for (i = 0; i != runtime->listener_point_count; ++i)
+        if ((result = filter_lattice_runtime_publish(runtime, i, fl->records + i * runtime->emitter_point_count)) != WS_OK)
+            return result;
+
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+filter_lattice_progress_construct(filter_lattice_progress_t* progress,
+                                  filter_lattice_runtime_t* runtime,
+                                  uintptr_t listener_point,
+                                  wsreal_t publish_interval)
+{
+    uintptr_t i;
+
+    progress->runtime = runtime;
+    progress->listener_point = listener_point;
+    progress->publish_interval = publish_interval;
+    progress->next_publish = publish_interval;
+    progress->records = MALLOC(sizeof(filter_lattice_record_t) * runtime->emitter_point_count);
+    if (progress->records == NULL)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+
+    for (i = 0; i != runtime->emitter_point_count; ++i)
+        filter_lattice_record_set_empty(&progress->records[i]);
+
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+filter_lattice_progress_destruct(filter_lattice_progress_t* progress)
+{
+    FREE(progress->records);
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+filter_lattice_progress_publish(filter_lattice_progress_t* progress,
+                                const simulation_t* simulation)
+{
+    wsret result;
+    uintptr_t i, count;
+    filter_lattice_runtime_t* runtime = progress->runtime;
+
+    count = simulation_audio_listener_count(simulation);
+    if (count > runtime->emitter_point_count)
+        count = runtime->emitter_point_count;
+
+    for (i = 0; i != count; ++i)
+    {
+        filter_lattice_filter_t filter;
+        const audio_listener_t* al = simulation_get_audio_listener(simulation, i);
+        uintptr_t sample_count = vector_count(&al->samples);
+
+        /* Nothing has arrived yet, keep the record empty */
+        if (sample_count == 0)
+            continue;
+
+        result = filter_lattice_analyze_ir(&filter,
+                                           (const wsreal_t*)al->samples.data,
+                                           sample_count,
+                                           al->fs);
+        if (result != WS_OK)
+            return result;
+        filter_lattice_encode(&progress->records[i], &filter, runtime->header.sample_rate);
+    }
+
+    return filter_lattice_runtime_publish(runtime, progress->listener_point, progress->records);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+filter_lattice_runtime_on_advance(const simulation_t* simulation, wsreal_t time)
+{
+    filter_lattice_progress_t* progress = (filter_lattice_progress_t*)simulation->user_data;
+
+    if (time < progress->next_publish)
+        return;
+
+    /* If publishing fails, try again on the next step */
+    if (filter_lattice_progress_publish(progress, simulation) == WS_OK)
+        progress->next_publish = time + progress->publish_interval;
+}
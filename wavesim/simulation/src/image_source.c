@@ -0,0 +1,254 @@
+#include "wavesim/mesh/bvh.h"
+#include "wavesim/mesh/face.h"
+#include "wavesim/mesh/intersections.h"
+#include "wavesim/simulation/image_source.h"
+#include <math.h>
+#include <stddef.h>
+
+/* Points closer than this to a plane count as lying in it */
+#define PLANE_EPSILON 1e-9
+
+/* Occlusion tests stop this fraction of a segment short of its end, so the
+ * face the segment ends on isn't reported as an occluder */
+#define SEGMENT_EPSILON 1e-6
+
+/* ------------------------------------------------------------------------- */
+void
+image_source_tree_construct(image_source_tree_t* tree)
+{
+    tree->source = vec3(0, 0, 0);
+    tree->order = -1;
+    vector_construct(&tree->images, sizeof(image_source_t));
+}
+
+/* ------------------------------------------------------------------------- */
+void
+image_source_tree_destruct(image_source_tree_t* tree)
+{
+    vector_clear_free(&tree->images);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Calculates the (non-normalized) normal n and distance d of the plane of a
+ * face, such that n.x = d for all points x in the plane.
+ */
+static wsreal_t
+face_plane(const face_t* face, vec3_t* normal)
+{
+    vec3_t e2;
+    vec3_copy(normal, face->vertices[1].position.xyz);
+    vec3_sub_vec3(normal->xyz, face->vertices[0].position.xyz);
+    vec3_copy(&e2, face->vertices[2].position.xyz);
+    vec3_sub_vec3(e2.xyz, face->vertices[0].position.xyz);
+    vec3_cross(normal->xyz, e2.xyz);
+    return vec3_dot(normal->xyz, face->vertices[0].position.xyz);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Sound reflected by a face leaves it on the side opposite of the image that
+ * was created by the face. Faces entirely on the image's side can't be reached.
+ */
+static int
+face_is_reachable(const face_t* face, const image_source_t* image, const face_t* image_face)
+{
+    vec3_t normal;
+    wsreal_t d, side;
+    int v;
+
+    if (image_face == NULL)
+        return 1;
+
+    d = face_plane(image_face, &normal);
+    side = vec3_dot(normal.xyz, image->position.xyz) - d;
+    for (v = 0; v != 3; ++v)
+    {
+        wsreal_t vertex_side = vec3_dot(normal.xyz, face->vertices[v].position.xyz) - d;
+        if (vertex_side * side < 0.0 && fabs(vertex_side) > PLANE_EPSILON)
+            return 1;
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+image_source_tree_build(image_source_tree_t* tree,
+                        const wsreal_t source[3],
+                        const face_t* faces,
+                        uintptr_t face_count,
+                        int order)
+{
+    int current_order;
+    uintptr_t begin, end, i;
+    uint32_t f;
+    image_source_t* root;
+
+    vector_clear_free(&tree->images);
+    tree->order = -1;
+    vec3_copy(&tree->source, source);
+
+    if ((root = vector_emplace(&tree->images)) == NULL)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+    vec3_copy(&root->position, source);
+    root->face = IMAGE_SOURCE_NONE;
+    root->parent = IMAGE_SOURCE_NONE;
+
+    /* Breadth first, the images of each order are mirrored to create the
+     * images of the next order */
+    begin = 0;
+    end = 1;
+    for (current_order = 1; current_order <= order; ++current_order)
+    {
+        for (i = begin; i != end; ++i)
+            for (f = 0; f != face_count; ++f)
+            {
+                vec3_t normal, mirrored;
+                wsreal_t d, side;
+                image_source_t* image;
+                const image_source_t* parent = vector_get(&tree->images, i);
+                const face_t* parent_face = parent->face == IMAGE_SOURCE_NONE ? NULL : &faces[parent->face];
+
+                if (f == parent->face || !face_is_reachable(&faces[f], parent, parent_face))
+                    continue;
+
+                d = face_plane(&faces[f], &normal);
+                if (vec3_length_squared(normal.xyz) == 0.0)
+                    continue; /* degenerate */
+                side = vec3_dot(normal.xyz, parent->position.xyz) - d;
+                if (fabs(side) <= PLANE_EPSILON)
+                    continue;
+
+                /* x' = x - 2 (n.x - d) / (n.n) n */
+                vec3_copy(&mirrored, normal.xyz);
+                vec3_mul_scalar(mirrored.xyz, -2.0 * side / vec3_length_squared(normal.xyz));
+                vec3_add_vec3(mirrored.xyz, parent->position.xyz);
+
+                /* Emplacing may move the parent, don't use it afterwards */
+                if ((image = vector_emplace(&tree->images)) == NULL)
+                {
+                    vector_clear_free(&tree->images);
+                    WSRET(WS_ERR_OUT_OF_MEMORY);
+                }
+                image->position = mirrored;
+                image->face = f;
+                image->parent = (uint32_t)i;
+            }
+
+        begin = end;
+        end = vector_count(&tree->images);
+    }
+
+    tree->order = order;
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+int
+image_source_tree_is_stale(const image_source_tree_t* tree, const wsreal_t source[3], int order)
+{
+    return tree->order != order ||
+           tree->source.xyz[0] != source[0] ||
+           tree->source.xyz[1] != source[1] ||
+           tree->source.xyz[2] != source[2];
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Walks from the listener back to the real source through the reflection
+ * points of an image. Returns 1 and fills in the path if it is valid.
+ */
+static int
+validate_path(const image_source_tree_t* tree,
+              const bvh_scene_t* scene,
+              const face_t* faces,
+              const wsreal_t listener[3],
+              uint32_t index,
+              image_source_path_t* path)
+{
+    vec3_t point;
+    int band;
+    uint32_t last_face = BVH_NO_TRIANGLE;
+    const image_source_t* images = (const image_source_t*)tree->images.data;
+
+    vec3_copy(&point, listener);
+    path->length = 0.0;
+    path->reflection = 1.0;
+    for (band = 0; band != ATTRIBUTE_BAND_COUNT; ++band)
+        path->band_reflection[band] = 1.0;
+    path->order = 0;
+
+    while (1)
+    {
+        vec3_t direction;
+        const image_source_t* image = &images[index];
+
+        vec3_copy(&direction, image->position.xyz);
+        vec3_sub_vec3(direction.xyz, point.xyz);
+
+        if (image->face == IMAGE_SOURCE_NONE)
+        {
+            /* Last segment, to the real source */
+            if (bvh_scene_ray_any_hit(scene, point.xyz, direction.xyz, 1.0 - SEGMENT_EPSILON, last_face))
+                return 0;
+            path->length += vec3_length(direction.xyz);
+            return 1;
+        }
+        else
+        {
+            attribute_t attr;
+            wsreal_t t, bary[3], weights[3];
+            const face_t* face = &faces[image->face];
+
+            /* The line towards the image has to pass through the face */
+            if (!intersect_ray_triangle(&t, bary,
+                                        point.xyz, direction.xyz,
+                                        face->vertices[0].position.xyz,
+                                        face->vertices[1].position.xyz,
+                                        face->vertices[2].position.xyz) || t >= 1.0)
+                return 0;
+            if (bvh_scene_ray_any_hit(scene, point.xyz, direction.xyz, t * (1.0 - SEGMENT_EPSILON), last_face))
+                return 0;
+
+            /* bary holds the weights of v1, v2, v0 */
+            weights[0] = bary[2];
+            weights[1] = bary[0];
+            weights[2] = bary[1];
+            face_interpolate_attributes_barycentric(face, &attr, weights);
+            if (attr.reflection <= 0.0)
+                return 0;
+            path->reflection *= attr.reflection / (attr.reflection + attr.transmission + attr.absorption);
+            for (band = 0; band != ATTRIBUTE_BAND_COUNT; ++band)
+                path->band_reflection[band] *= attribute_band_reflection(&attr, band);
+
+            vec3_mul_scalar(direction.xyz, t);
+            path->length += vec3_length(direction.xyz);
+            vec3_add_vec3(point.xyz, direction.xyz);
+            path->order++;
+            last_face = image->face;
+            index = image->parent;
+        }
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+image_source_tree_find_paths(const image_source_tree_t* tree,
+                             const bvh_scene_t* scene,
+                             const face_t* faces,
+                             const wsreal_t listener[3],
+                             vector_t* paths)
+{
+    uint32_t i;
+    for (i = 0; i != vector_count(&tree->images); ++i)
+    {
+        image_source_path_t path;
+        if (validate_path(tree, scene, faces, listener, i, &path) &&
+            vector_push(paths, &path) == VECTOR_ERROR)
+        {
+            WSRET(WS_ERR_OUT_OF_MEMORY);
+        }
+    }
+
+    WSRET(WS_OK);
+}
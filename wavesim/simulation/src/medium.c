@@ -1,486 +1,1413 @@
 #include "wavesim/memory.h"
+#include "wavesim/hashmap.h"
 #include "wavesim/log.h"
+#include "wavesim/random.h"
+#include "wavesim/thread.h"
 #include "wavesim/mesh/attribute.h"
 #include "wavesim/mesh/mesh.h"
-#include "wavesim/mesh/octree.h"
-#include "wavesim/mesh/intersections.h"
 #include "wavesim/simulation/medium.h"
+#include "wavesim/simulation/medium_cache.h"
+#include "wavesim/simulation/occupancy.h"
+#include "wavesim/simulation/voxel_grid.h"
 #include <string.h>
 #include <assert.h>
 #include <math.h>
+#include <stdlib.h>
+
+/* The systematic decomposition splits the lattice into at most this many
+ * regions along z, each at least this many layers thick */
+#define SYSTEMATIC_MAX_REGIONS 64
+#define SYSTEMATIC_MIN_LAYERS  16
 
 static const wsreal_t sqrt_3 = 1.73205080757;
 
+/* ------------------------------------------------------------------------- */
+wsret
+medium_create(medium_t** medium)
+{
+    *medium = MALLOC(sizeof **medium);
+    if (*medium == NULL)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+    medium_construct(*medium);
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+medium_destroy(medium_t* medium)
+{
+    medium_destruct(medium);
+    FREE(medium);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+medium_construct(medium_t* medium)
+{
+    vector_construct(&medium->partitions, sizeof(medium_partition_t));
+    medium->boundary = aabb_reset();
+    medium->decompose = medium_decompose_systematic;
+    medium->seed = 0;
+    medium->adjacency.offsets = NULL;
+    medium->adjacency.interfaces = NULL;
+    partition_index_construct(&medium->index);
+    cost_model_construct(&medium->cost_model);
+    medium->cost = cost_model_predict;
+    medium->cache_directory = NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+void
+medium_destruct(medium_t* medium)
+{
+    medium_clear(medium);
+    if (medium->cache_directory != NULL)
+        FREE(medium->cache_directory);
+    medium->cache_directory = NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+clear_adjacency(medium_adjacency_t* adjacency)
+{
+    if (adjacency->offsets != NULL)
+        FREE(adjacency->offsets);
+    if (adjacency->interfaces != NULL)
+        FREE(adjacency->interfaces);
+    adjacency->offsets = NULL;
+    adjacency->interfaces = NULL;
+}
+
 /* ------------------------------------------------------------------------- */
 /*!
- * Subdivides an AABB into smaller "cells" and iterates through every cell.
- * This function begins a new iteration. Thereafter, call iterate_cells_next()
- * to get to the next cell.
- * @param[out] cell The first cell to be iterated is written to this paramter.
- * @param[in] extents The AABB to subdivide.
- * @param[in] cell_size The x,y,z dimensions of a single cell.
+ * The adjacency and the index refer to partitions by index and have to be
+ * built again after any partition was added, moved or removed.
  */
 static void
-iterate_cells_begin(wsreal_t cell[6], const wsreal_t extents[6], const wsreal_t cell_size[3])
+discard_partition_lookups(medium_t* medium)
+{
+    clear_adjacency(&medium->adjacency);
+    partition_index_destruct(&medium->index);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+medium_clear(medium_t* medium)
+{
+    discard_partition_lookups(medium);
+    vector_clear_free(&medium->partitions);
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+medium_add_partition(medium_t* medium, const wsreal_t bb[6], attribute_t attr)
+{
+    medium_partition_t* partition = vector_emplace(&medium->partitions);
+    if (partition == NULL)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+
+    discard_partition_lookups(medium);
+
+    partition->aabb = aabb(bb[0], bb[1], bb[2], bb[3], bb[4], bb[5]);
+    partition->attr = attr;
+    partition->cell_size = INFINITY;
+    partition->time_step = INFINITY;
+    memset(&partition->cell_count, 0, sizeof(partition->cell_count));
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+void
+medium_set_decomposition_method(medium_t* medium,
+                                medium_decomposition_func method)
+{
+    medium->decompose = method;
+}
+
+/* ------------------------------------------------------------------------- */
+void
+medium_set_seed(medium_t* medium, uint64_t seed)
+{
+    medium->seed = seed;
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+medium_set_cache_directory(medium_t* medium, const char* directory)
 {
-    /* Begin in lower left corner... */
-    memcpy(cell, extents, sizeof(wsreal_t)*3);
-    memcpy(cell+3, extents, sizeof(wsreal_t)*3);
-    vec3_add_vec3(cell+3, cell_size);
+    char* copy = NULL;
+    if (directory != NULL)
+    {
+        if ((copy = MALLOC(strlen(directory) + 1)) == NULL)
+            WSRET(WS_ERR_OUT_OF_MEMORY);
+        strcpy(copy, directory);
+    }
+
+    if (medium->cache_directory != NULL)
+        FREE(medium->cache_directory);
+    medium->cache_directory = copy;
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+medium_set_cost_function(medium_t* medium, medium_cost_func cost)
+{
+    medium->cost = cost;
 }
 
 /* ------------------------------------------------------------------------- */
+typedef enum direction_e
+{
+    UP    = 0x01,
+    DOWN  = 0x02,
+    LEFT  = 0x04,
+    RIGHT = 0x08,
+    FRONT = 0x10,
+    BACK  = 0x20,
+    DIR_ITER_START = 0x01,
+    DIR_ITER_END   = 0x40,
+    ALL_DIRECTIONS = UP | DOWN | LEFT | RIGHT | FRONT | BACK,
+    DIRECTION_COUNT = 6
+} direction_e;
 /*!
- * Subdivides an AABB into smaller "cells" and iterates through every cell.
- * This function continues to the next cell after having begun an iteration
- * with iterate_cells_begin().
- * @param[out] cell The next cell AABB will be written to this parameter.
- * @param[in] extents The AABB to subdivide.
- * @return Returns 1 if the cell written to "cell" is still within the extents.
- * Returns 0 if all cells have been iterated.
+ * Calculates the one cell thick slice of cells adjacent to a box. Returns 0 if
+ * the slice lies outside of the bounds.
  */
 static int
-iterate_cells_next(wsreal_t cell[6], const wsreal_t extents[6])
+get_adjacent_slice(const occupancy_box_t* box, const occupancy_box_t* bounds, direction_e direction, occupancy_box_t* slice)
 {
-    /* Advance on the Z axis */
-    wsreal_t z_size = cell[5] - cell[2];
-    cell[2] = cell[5];
-    cell[5] += z_size;
+    int axis;
+    *slice = *box;
+    switch (direction)
+    {
+        case UP    : axis = 1; break;
+        case DOWN  : axis = 1; break;
+        case LEFT  : axis = 0; break;
+        case RIGHT : axis = 0; break;
+        case FRONT : axis = 2; break;
+        case BACK  : axis = 2; break;
+        default: return 0;
+    }
 
-    if (cell[5] > extents[5])
+    if (direction == UP || direction == RIGHT || direction == BACK)
+    {
+        if (box->max[axis] >= bounds->max[axis])
+            return 0;
+        slice->min[axis] = box->max[axis];
+        slice->max[axis] = box->max[axis] + 1;
+    }
+    else
     {
-        /* Reset Z axis and advance on the Y axis */
-        wsreal_t y_size = cell[4] - cell[1];
-        cell[1] = cell[4];
-        cell[4] += y_size;
-        cell[2] = extents[2];
-        cell[5] = extents[2] + z_size;
+        if (box->min[axis] <= bounds->min[axis])
+            return 0;
+        slice->min[axis] = box->min[axis] - 1;
+        slice->max[axis] = box->min[axis];
+    }
+
+    return 1;
+}
+
+/* ------------------------------------------------------------------------- */
+typedef struct systematic_box_t
+{
+    occupancy_box_t box;
+    uint32_t material;
+} systematic_box_t;
+
+/*!
+ * A range of layers along z decomposed by one thread. Regions only ever read
+ * and write their own layers of the occupancy, and record owners as indices
+ * into their own boxes.
+ */
+typedef struct systematic_region_t
+{
+    occupancy_t* occupancy;
+    const voxel_grid_t* grid;
+    occupancy_box_t bounds;
+    vector_t boxes;               /* systematic_box_t */
+    vector_t queue;               /* occupancy_box_t, single cells whose material
+                                   * differs from a box they are adjacent to */
+    vector_t new_seeds;           /* occupancy_box_t */
+    wsret result;
+} systematic_region_t;
+
+typedef struct systematic_worker_t
+{
+    systematic_region_t* regions;
+    uintptr_t region_count;
+    uintptr_t first, step;        /* Regions this worker decomposes */
+} systematic_worker_t;
+
+/*!
+ * Expands the seed evenly in all directions, until every direction hits a
+ * cell that has different attributes, is owned by a partition or lies outside
+ * of the region. All differing cells the expansion runs into are recorded as
+ * new seeds.
+ */
+static wsret
+grow_seed(systematic_region_t* region, occupancy_box_t* seed, uint32_t seed_material)
+{
+    uintptr_t direction;
+    uintptr_t occupied_direction_flags;
 
-        if (cell[4] > extents[4])
+    vector_clear(&region->new_seeds);
+    do
+    {
+        occupied_direction_flags = 0;
+        for (direction = DIR_ITER_START; direction != DIR_ITER_END; direction <<= 1)
         {
-            /* Reset Y axis and advance on the X axis */
-            wsreal_t x_size = cell[3] - cell[0];
-            cell[0] = cell[3];
-            cell[3] += x_size;
-            cell[1] = extents[1];
-            cell[4] = extents[1] + y_size;
-
-            if (cell[3] > extents[3])
+            occupancy_box_t slice;
+            uintptr_t x, y, z;
+            int slice_is_same_as_seed;
+
+            /* Check if this direction has been flagged as occupied. If so, no
+             * need to do anything */
+            if (occupied_direction_flags & direction)
+                continue;
+
+            /* Calculate a slice adjacent to this seed and make sure it doesn't
+             * already exist in the medium. */
+            if (get_adjacent_slice(seed, &region->bounds, (direction_e)direction, &slice) == 0 ||
+                occupancy_box_is_free(region->occupancy, &slice) == 0)
+            {
+                occupied_direction_flags |= direction;
+                continue;
+            }
+
+            /* Iterate through all cells in the slice and confirm that these cells
+             * have the same attributes as our seed cell */
+            slice_is_same_as_seed = 1;
+            for (z = slice.min[2]; z != slice.max[2]; ++z)
+                for (y = slice.min[1]; y != slice.max[1]; ++y)
+                    for (x = slice.min[0]; x != slice.max[0]; ++x)
+                        if (voxel_grid_material(region->grid, x, y, z) != seed_material)
+                        {
+                            occupancy_box_t* new_seed = vector_emplace(&region->new_seeds);
+                            if (new_seed == NULL)
+                                WSRET(WS_ERR_OUT_OF_MEMORY);
+                            new_seed->min[0] = x; new_seed->max[0] = x + 1;
+                            new_seed->min[1] = y; new_seed->max[1] = y + 1;
+                            new_seed->min[2] = z; new_seed->max[2] = z + 1;
+                            slice_is_same_as_seed = 0;
+                        }
+            if (slice_is_same_as_seed == 0)
+            {
+                occupied_direction_flags |= direction;
+                continue;
+            }
+
+            /* Since slice has the same attributes, we can merge it with our
+             * seed now */
+            for (x = 0; x != 3; ++x)
             {
-                /* Done */
-                return 0;
+                if (seed->min[x] > slice.min[x]) seed->min[x] = slice.min[x];
+                if (seed->max[x] < slice.max[x]) seed->max[x] = slice.max[x];
             }
         }
+    } while (occupied_direction_flags != ALL_DIRECTIONS);
+
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Decomposes a region by taking seeds off the front of a work queue, growing
+ * them into boxes and queueing the differing cells each box ran into. Growth
+ * stops at owned cells without seeding beyond them, so once the queue runs dry
+ * the region is scanned for a cell nothing has reached yet.
+ */
+static wsret
+decompose_region(systematic_region_t* region)
+{
+    occupancy_t* occupancy = region->occupancy;
+    uintptr_t layer_size = occupancy->dims[0] * occupancy->dims[1];
+    uintptr_t scan = region->bounds.min[2] * layer_size;
+    uintptr_t scan_end = region->bounds.max[2] * layer_size;
+    uintptr_t head = 0;
+
+    while (1)
+    {
+        occupancy_box_t seed;
+        systematic_box_t* grown;
+        uintptr_t this_box_idx;
+        uint32_t seed_material;
+        wsret result;
+
+        if (head != vector_count(&region->queue))
+        {
+            seed = *(occupancy_box_t*)vector_get(&region->queue, head++);
+            if (occupancy_box_is_free(occupancy, &seed) == 0)
+                continue;
+        }
+        else
+        {
+            /* Consumed seeds are dropped once the whole queue has been taken */
+            vector_clear(&region->queue);
+            head = 0;
+
+            /* Start from the bottom, left, front-most cell nothing reached */
+            for (; scan != scan_end; ++scan)
+                if (occupancy->owners[scan] == OCCUPANCY_FREE)
+                    break;
+            if (scan == scan_end)
+                break;
+            seed.min[0] = scan % occupancy->dims[0];
+            seed.min[1] = scan / occupancy->dims[0] % occupancy->dims[1];
+            seed.min[2] = scan / layer_size;
+            seed.max[0] = seed.min[0] + 1;
+            seed.max[1] = seed.min[1] + 1;
+            seed.max[2] = seed.min[2] + 1;
+        }
+
+        /* Determine the cell type of our seed and expand it */
+        seed_material = voxel_grid_material(region->grid, seed.min[0], seed.min[1], seed.min[2]);
+        if ((result = grow_seed(region, &seed, seed_material)) != WS_OK)
+            return result;
+
+        /* Add it to the region as a new box */
+        this_box_idx = vector_count(&region->boxes);
+        if ((grown = vector_emplace(&region->boxes)) == NULL)
+            WSRET(WS_ERR_OUT_OF_MEMORY);
+        grown->box = seed;
+        grown->material = seed_material;
+        occupancy_mark(occupancy, &seed, (int32_t)this_box_idx);
+
+        /* All differing cells are potential new seeds */
+        if (vector_push_vector(&region->queue, &region->new_seeds) != 0)
+            WSRET(WS_ERR_OUT_OF_MEMORY);
     }
 
-    return 1;
+    WSRET(WS_OK);
 }
 
 /* ------------------------------------------------------------------------- */
-static int
-determine_cell_attribute(attribute_t* cell_attribute,
-                         const octree_t* octree,
-                         const wsreal_t cell_aabb[6])
+static void*
+decompose_regions_main(void* arg)
 {
+    systematic_worker_t* worker = arg;
     uintptr_t i;
-    wsreal_t weights_sum;
-    vector_t query_result;
-    vec3_t cell_center;
+    for (i = worker->first; i < worker->region_count; i += worker->step)
+        worker->regions[i].result = decompose_region(&worker->regions[i]);
+    return NULL;
+}
 
-    /* XXX This is super ugly, maybe add a result_construct() function that takes a mesh? */
-    vector_construct(&query_result, octree->mesh->ib_size);
-    if (octree_query_potential_faces(octree, &query_result, cell_aabb) < 1)
-        goto octree_query_failed;
+/* ------------------------------------------------------------------------- */
+/*!
+ * Adds the boxes of all regions to the medium, in region order. A box whose
+ * bottom lies on the seam to the region below continues the box it sits on if
+ * both have the same footprint and material, which removes most of the seams
+ * the split into regions introduced.
+ */
+static wsret
+commit_regions(medium_t* medium,
+               occupancy_t* occupancy,
+               const voxel_grid_t* grid,
+               systematic_region_t* regions,
+               uintptr_t region_count)
+{
+    vector_t partition_boxes;     /* occupancy_box_t per partition */
+    vector_t partition_of[SYSTEMATIC_MAX_REGIONS]; /* uintptr_t per region box */
+    uintptr_t r, i;
+    wsret result = WS_OK;
 
-    /* Calculate the center of the AABB, required for attribute interpolation */
-    vec3_copy(&cell_center, cell_aabb);
-    vec3_add_vec3(cell_center.xyz, cell_aabb+3);
-    vec3_mul_scalar(cell_center.xyz, 0.5);
+    vector_construct(&partition_boxes, sizeof(occupancy_box_t));
+    for (r = 0; r != region_count; ++r)
+        vector_construct(&partition_of[r], sizeof(uintptr_t));
 
-    /*
-     * Octree delivers a number of faces that *might* intersect the cell AABB,
-     * but we cannot be sure until we do a proper intersection test.
-     */
-    attribute_set_zero(cell_attribute);
-    weights_sum = 0.0;
-    for (i = 0; i != vector_count(&query_result) / 3; ++i)
-    {
-        int v;
-
-        /* Do intersection test of face with our cell */
-        face_t face;
-        const mesh_t* m = octree->mesh;
-        mesh_get_face_from_buffers(&face, m->vb, query_result.data, m->ab,
-                                   i, m->vb_type, m->ib_type);
-        if (intersect_triangle_aabb_test(
-                face.vertices[0].position.xyz,
-                face.vertices[1].position.xyz,
-                face.vertices[2].position.xyz,
-                cell_aabb) == 0)
-            continue; /* face doesn't intersect our cell, so ignore it */
+    for (r = 0; r != region_count; ++r)
+    {
+        if (vector_resize(&partition_of[r], vector_count(&regions[r].boxes)) == VECTOR_ERROR)
+            goto ran_out_of_memory;
 
-        /*
-         * Using Shepard's method, weight all vertex attributes according to
-         * their distance to the cell's AABB center.
-         *
-         * https://en.wikipedia.org/wiki/Inverse_distance_weighting
-         */
-        for (v = 0; v != 3; ++v)
+        for (i = 0; i != vector_count(&regions[r].boxes); ++i)
         {
-            wsreal_t weight;
-            vec3_t distance = face.vertices[v].position;
-            vec3_sub_vec3(distance.xyz, cell_center.xyz);
-            weight = vec3_length_squared(distance.xyz);
-            if (weight == 0.0) /* catch division by 0, if the cell center is  right on top of a vertex */
+            const systematic_box_t* b = vector_get(&regions[r].boxes, i);
+            uintptr_t* partition_idx = vector_get(&partition_of[r], i);
+            occupancy_box_t* below = NULL;
+            wsreal_t bb[6];
+
+            *partition_idx = VECTOR_ERROR;
+            if (r > 0 && b->box.min[2] == regions[r].bounds.min[2])
+            {
+                int32_t owner = occupancy_owner(occupancy, b->box.min[0], b->box.min[1], b->box.min[2] - 1);
+                uintptr_t candidate = *(uintptr_t*)vector_get(&partition_of[r-1], (uintptr_t)owner);
+                const systematic_box_t* under = vector_get(&regions[r-1].boxes, (uintptr_t)owner);
+                below = vector_get(&partition_boxes, candidate);
+                if (under->material == b->material &&
+                    below->max[2] == b->box.min[2] &&
+                    below->min[0] == b->box.min[0] && below->max[0] == b->box.max[0] &&
+                    below->min[1] == b->box.min[1] && below->max[1] == b->box.max[1])
+                {
+                    medium_partition_t* partition = vector_get(&medium->partitions, candidate);
+                    below->max[2] = b->box.max[2];
+                    occupancy_box_to_aabb(occupancy, below, bb);
+                    partition->aabb = aabb(bb[0], bb[1], bb[2], bb[3], bb[4], bb[5]);
+                    *partition_idx = candidate;
+                }
+            }
+
+            if (*partition_idx == VECTOR_ERROR)
             {
-                *cell_attribute = face.vertices[v].attr;
-                goto only_one_vertex_matters;
+                *partition_idx = vector_count(&medium->partitions);
+                occupancy_box_to_aabb(occupancy, &b->box, bb);
+                if (medium_add_partition(medium, bb, *voxel_grid_attribute(grid, b->material)) != 0)
+                    goto ran_out_of_memory;
+                if (vector_push(&partition_boxes, (void*)&b->box) == VECTOR_ERROR)
+                    goto ran_out_of_memory;
             }
-            weight = 1.0 / weight; /* We're using p=2, since weight is the squared length */
-            cell_attribute->reflection   += face.vertices[v].attr.reflection * weight;
-            cell_attribute->transmission += face.vertices[v].attr.transmission * weight;
-            cell_attribute->absorption   += face.vertices[v].attr.absorption * weight;
-            weights_sum += weight;
         }
     }
+    goto out;
+
+    ran_out_of_memory:
+    result = WS_ERR_OUT_OF_MEMORY;
+
+    out:
+    for (r = 0; r != region_count; ++r)
+        vector_clear_free(&partition_of[r]);
+    vector_clear_free(&partition_boxes);
+    WSRET(result);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Splits the lattice into regions of at least SYSTEMATIC_MIN_LAYERS layers
+ * along z, decomposes them concurrently and stitches them back together. The
+ * number of regions only depends on the lattice, so the result is the same for
+ * any number of threads.
+ */
+static wsret
+decompose_systematic(medium_t* medium,
+                     occupancy_t* occupancy,
+                     const voxel_grid_t* grid,
+                     uintptr_t thread_count)
+{
+    systematic_region_t regions[SYSTEMATIC_MAX_REGIONS];
+    systematic_worker_t workers[SYSTEMATIC_MAX_REGIONS];
+    uintptr_t region_count, i;
+    wsret result;
+
+    region_count = occupancy->dims[2] / SYSTEMATIC_MIN_LAYERS;
+    if (region_count > SYSTEMATIC_MAX_REGIONS) region_count = SYSTEMATIC_MAX_REGIONS;
+    if (region_count == 0)                     region_count = 1;
+    if (thread_count > region_count)           thread_count = region_count;
+    if (thread_count == 0)                     thread_count = 1;
 
-    /* It's possible that no faces intersected, in which case we assume it's air */
-    if (weights_sum == 0.0)
+    for (i = 0; i != region_count; ++i)
     {
-        attribute_set_default_air(cell_attribute);
+        systematic_region_t* region = &regions[i];
+        region->occupancy = occupancy;
+        region->grid = grid;
+        region->bounds.min[0] = 0; region->bounds.max[0] = occupancy->dims[0];
+        region->bounds.min[1] = 0; region->bounds.max[1] = occupancy->dims[1];
+        region->bounds.min[2] = occupancy->dims[2] * i / region_count;
+        region->bounds.max[2] = occupancy->dims[2] * (i + 1) / region_count;
+        vector_construct(&region->boxes, sizeof(systematic_box_t));
+        vector_construct(&region->queue, sizeof(occupancy_box_t));
+        vector_construct(&region->new_seeds, sizeof(occupancy_box_t));
+        region->result = WS_OK;
     }
-    else
+    for (i = 0; i != thread_count; ++i)
     {
-        weights_sum = 1.0 / weights_sum;
-        cell_attribute->absorption *= weights_sum;
-        cell_attribute->reflection *= weights_sum;
-        cell_attribute->transmission *= weights_sum;
-        /* Need to normalize it so 1 = reflection + transmission + absorption */
-        weights_sum = cell_attribute->reflection + cell_attribute->transmission + cell_attribute->absorption;
-        weights_sum = 1.0 / weights_sum;
-        cell_attribute->absorption *= weights_sum;
-        cell_attribute->reflection *= weights_sum;
-        cell_attribute->transmission *= weights_sum;
+        workers[i].regions = regions;
+        workers[i].region_count = region_count;
+        workers[i].first = i;
+        workers[i].step = thread_count;
     }
 
-    only_one_vertex_matters:
-    octree_query_failed : vector_clear_free(&query_result);
-    return -1;
+    if ((result = ws_thread_run_parallel(decompose_regions_main, workers, sizeof(systematic_worker_t), thread_count)) != WS_OK)
+        goto out;
+    for (i = 0; i != region_count; ++i)
+        if ((result = regions[i].result) != WS_OK)
+            goto out;
+
+    result = commit_regions(medium, occupancy, grid, regions, region_count);
+
+    out:
+    for (i = 0; i != region_count; ++i)
+    {
+        vector_clear_free(&regions[i].new_seeds);
+        vector_clear_free(&regions[i].queue);
+        vector_clear_free(&regions[i].boxes);
+    }
+    WSRET(result);
 }
 
 /* ------------------------------------------------------------------------- */
 wsret
-medium_create(medium_t** medium)
+medium_decompose_systematic(medium_t* medium,
+                            const voxel_grid_t* grid,
+                            const medium_t* mediumdef)
 {
-    *medium = MALLOC(sizeof **medium);
-    if (*medium == NULL)
-        WSRET(WS_ERR_OUT_OF_MEMORY);
-    medium_construct(*medium);
+    wsret result;
+    occupancy_t occupancy;
+
+    (void)mediumdef;
+    if ((result = occupancy_construct(&occupancy, medium->boundary.xyzxyz, grid->grid_size)) != WS_OK)
+        return result;
+    result = decompose_systematic(medium, &occupancy, grid, ws_thread_hardware_concurrency());
+    occupancy_destruct(&occupancy);
+    return result;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Summed-area tables of the material edges of a voxel grid. Cell (x,y,z) has
+ * an edge along an axis if its material differs from the previous cell along
+ * that axis. A slab of cells continues the box next to it along the slab's
+ * axis exactly when no cell on the box's side of the interface has an edge.
+ *
+ * The tables are padded by one on each axis so sums never need bounds checks.
+ * Sums are computed modulo 2^32, which is exact for any box of less than 2^32
+ * cells.
+ */
+typedef struct material_edges_t
+{
+    uintptr_t dims[3];        /* Padded dimensions, grid dims + 1 */
+    uint32_t* sat[3];         /* One table per axis */
+} material_edges_t;
+
+static void
+material_edges_destruct(material_edges_t* edges)
+{
+    int axis;
+    for (axis = 0; axis != 3; ++axis)
+        if (edges->sat[axis] != NULL)
+            FREE(edges->sat[axis]);
+}
+
+static wsret
+material_edges_construct(material_edges_t* edges, const voxel_grid_t* grid)
+{
+    uintptr_t x, y, z, count;
+    uintptr_t sx, sy;
+    int axis;
+
+    for (axis = 0; axis != 3; ++axis)
+    {
+        edges->dims[axis] = grid->dims[axis] + 1;
+        edges->sat[axis] = NULL;
+    }
+    count = edges->dims[0] * edges->dims[1] * edges->dims[2];
+    for (axis = 0; axis != 3; ++axis)
+    {
+        if ((edges->sat[axis] = MALLOC(sizeof(uint32_t) * count)) == NULL)
+        {
+            material_edges_destruct(edges);
+            WSRET(WS_ERR_OUT_OF_MEMORY);
+        }
+        memset(edges->sat[axis], 0, sizeof(uint32_t) * count);
+    }
+
+    sx = 1;
+    sy = edges->dims[0];
+    for (z = 0; z != grid->dims[2]; ++z)
+        for (y = 0; y != grid->dims[1]; ++y)
+            for (x = 0; x != grid->dims[0]; ++x)
+            {
+                uint32_t material = voxel_grid_material(grid, x, y, z);
+                uint32_t edge[3];
+                uintptr_t i = (x + 1) + sy * ((y + 1) + edges->dims[1] * (z + 1));
+                uintptr_t sz = sy * edges->dims[1];
+                edge[0] = x > 0 && voxel_grid_material(grid, x - 1, y, z) != material;
+                edge[1] = y > 0 && voxel_grid_material(grid, x, y - 1, z) != material;
+                edge[2] = z > 0 && voxel_grid_material(grid, x, y, z - 1) != material;
+                for (axis = 0; axis != 3; ++axis)
+                {
+                    uint32_t* s = edges->sat[axis];
+                    s[i] = edge[axis]
+                         + s[i-sx] + s[i-sy] + s[i-sz]
+                         - s[i-sx-sy] - s[i-sx-sz] - s[i-sy-sz]
+                         + s[i-sx-sy-sz];
+                }
+            }
+
     WSRET(WS_OK);
 }
 
+/*!
+ * Number of edges along an axis within a box of cells.
+ */
+static uint32_t
+material_edges_in_box(const material_edges_t* edges, int axis, const occupancy_box_t* box)
+{
+    const uint32_t* s = edges->sat[axis];
+    uintptr_t sy = edges->dims[0], sz = edges->dims[0] * edges->dims[1];
+    uintptr_t x0 = box->min[0], y0 = box->min[1] * sy, z0 = box->min[2] * sz;
+    uintptr_t x1 = box->max[0], y1 = box->max[1] * sy, z1 = box->max[2] * sz;
+    return s[x1+y1+z1] - s[x0+y1+z1] - s[x1+y0+z1] - s[x1+y1+z0]
+         + s[x0+y0+z1] + s[x0+y1+z0] + s[x1+y0+z0] - s[x0+y0+z0];
+}
+
+/*!
+ * Returns 1 if the slab adjacent to the box in the specified direction has the
+ * box's material throughout.
+ */
+static int
+slab_continues_box(const material_edges_t* edges,
+                   const occupancy_box_t* box,
+                   const occupancy_box_t* slab,
+                   direction_e direction)
+{
+    occupancy_box_t interface = *slab;
+    int axis = (direction & (LEFT | RIGHT)) ? 0 : (direction & (UP | DOWN)) ? 1 : 2;
+
+    /* Edges are stored on the cell with the higher coordinate. Growing towards
+     * lower coordinates has to check the box's first layer instead */
+    if (direction == DOWN || direction == LEFT || direction == FRONT)
+    {
+        interface.min[axis] = box->min[axis];
+        interface.max[axis] = box->min[axis] + 1;
+    }
+
+    return material_edges_in_box(edges, axis, &interface) == 0;
+}
+
 /* ------------------------------------------------------------------------- */
-void
-medium_destroy(medium_t* medium)
+static uintptr_t
+greatest_common_divisor(uintptr_t a, uintptr_t b)
 {
-    medium_destruct(medium);
-    FREE(medium);
+    while (b != 0)
+    {
+        uintptr_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
 }
 
 /* ------------------------------------------------------------------------- */
-void
-medium_construct(medium_t* medium)
+wsret
+medium_decompose_greedy_random(medium_t* medium,
+                               const voxel_grid_t* grid,
+                               const medium_t* mediumdef)
 {
-    vector_construct(&medium->partitions, sizeof(medium_partition_t));
-    medium->boundary = aabb_reset();
-    medium->decompose = medium_decompose_systematic;
+    material_edges_t edges;
+    occupancy_t occupancy;
+    occupancy_box_t lattice;
+    random_t rng;
+    uintptr_t cell_count, cell, stride, i;
+    wsret result;
+
+    (void)mediumdef;
+    if ((result = occupancy_construct(&occupancy, medium->boundary.xyzxyz, grid->grid_size)) != WS_OK)
+        return result;
+    if ((result = material_edges_construct(&edges, grid)) != WS_OK)
+    {
+        occupancy_destruct(&occupancy);
+        return result;
+    }
+
+    /*
+     * Visit every cell exactly once in a pseudo-random order, without having
+     * to store a permutation: stepping by a stride coprime to the cell count
+     * cycles through all cells.
+     */
+    cell_count = occupancy.dims[0] * occupancy.dims[1] * occupancy.dims[2];
+    for (i = 0; i != 3; ++i)
+    {
+        lattice.min[i] = 0;
+        lattice.max[i] = occupancy.dims[i];
+    }
+    random_seed(&rng, medium->seed);
+    cell = cell_count > 0 ? (uintptr_t)(random_next(&rng) % cell_count) : 0;
+    stride = 1;
+    if (cell_count > 2)
+        do
+            stride = 1 + (uintptr_t)(random_next(&rng) % (cell_count - 1));
+        while (greatest_common_divisor(stride, cell_count) != 1);
+
+    for (i = 0; i != cell_count; ++i, cell = (cell + stride) % cell_count)
+    {
+        occupancy_box_t box;
+        uintptr_t direction, blocked_direction_flags;
+        uint32_t material;
+        wsreal_t bb[6];
+
+        box.min[0] = cell % occupancy.dims[0];
+        box.min[1] = cell / occupancy.dims[0] % occupancy.dims[1];
+        box.min[2] = cell / occupancy.dims[0] / occupancy.dims[1];
+        if (occupancy_owner(&occupancy, box.min[0], box.min[1], box.min[2]) != OCCUPANCY_FREE)
+            continue;
+        box.max[0] = box.min[0] + 1;
+        box.max[1] = box.min[1] + 1;
+        box.max[2] = box.min[2] + 1;
+
+        /*
+         * Grow one slab at a time in all directions, so boxes stay roughly
+         * cubic. A blocked direction stays blocked, because its slab only
+         * gets larger as the box grows.
+         */
+        blocked_direction_flags = 0;
+        while (blocked_direction_flags != ALL_DIRECTIONS)
+            for (direction = DIR_ITER_START; direction != DIR_ITER_END; direction <<= 1)
+            {
+                occupancy_box_t slab;
+                int axis;
+
+                if (blocked_direction_flags & direction)
+                    continue;
+                if (get_adjacent_slice(&box, &lattice, (direction_e)direction, &slab) == 0 ||
+                    slab_continues_box(&edges, &box, &slab, (direction_e)direction) == 0 ||
+                    occupancy_box_is_free(&occupancy, &slab) == 0)
+                {
+                    blocked_direction_flags |= direction;
+                    continue;
+                }
+
+                for (axis = 0; axis != 3; ++axis)
+                {
+                    if (box.min[axis] > slab.min[axis]) box.min[axis] = slab.min[axis];
+                    if (box.max[axis] < slab.max[axis]) box.max[axis] = slab.max[axis];
+                }
+            }
+
+        material = voxel_grid_material(grid, box.min[0], box.min[1], box.min[2]);
+        occupancy_box_to_aabb(&occupancy, &box, bb);
+        if (medium_add_partition(medium, bb, *voxel_grid_attribute(grid, material)) != 0)
+        {
+            result = WS_ERR_OUT_OF_MEMORY;
+            break;
+        }
+        occupancy_mark(&occupancy, &box, (int32_t)(vector_count(&medium->partitions) - 1));
+    }
+
+    material_edges_destruct(&edges);
+    occupancy_destruct(&occupancy);
+    WSRET(result);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Identifies a face of a partition. Partitions on the same lattice have
+ * bitwise identical coordinates where they touch, so two partitions share an
+ * entire face exactly when the high face key of one equals the low face key
+ * of the other. Only wsreal_t members, so keys have no padding to hash.
+ */
+typedef struct face_key_t
+{
+    wsreal_t axis;
+    wsreal_t plane;
+    wsreal_t extent[4];       /* Ranges along the two other axes */
+} face_key_t;
+
+static void
+make_face_key(face_key_t* key, const aabb_t* box, int axis, int high)
+{
+    int a = (axis + 1) % 3, b = (axis + 2) % 3;
+    key->axis = (wsreal_t)axis;
+    key->plane = box->xyzxyz[axis + (high ? 3 : 0)];
+    key->extent[0] = box->xyzxyz[a];
+    key->extent[1] = box->xyzxyz[a + 3];
+    key->extent[2] = box->xyzxyz[b];
+    key->extent[3] = box->xyzxyz[b + 3];
 }
 
-/* ------------------------------------------------------------------------- */
-void
-medium_destruct(medium_t* medium)
-{
-    medium_clear(medium);
-}
+/*!
+ * Inserts or erases the six faces of a partition. faces[0] maps low faces,
+ * faces[1] high faces, to partition indices.
+ */
+static wsret
+insert_faces(hashmap_t faces[2], const aabb_t* box, uintptr_t partition_idx)
+{
+    int axis, high;
+    for (axis = 0; axis != 3; ++axis)
+        for (high = 0; high != 2; ++high)
+        {
+            face_key_t key;
+            make_face_key(&key, box, axis, high);
+            if (hashmap_insert(&faces[high], &key, &partition_idx) == WS_ERR_OUT_OF_MEMORY)
+                WSRET(WS_ERR_OUT_OF_MEMORY);
+        }
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+erase_faces(hashmap_t faces[2], const aabb_t* box)
+{
+    int axis, high;
+    for (axis = 0; axis != 3; ++axis)
+        for (high = 0; high != 2; ++high)
+        {
+            face_key_t key;
+            make_face_key(&key, box, axis, high);
+            hashmap_erase(&faces[high], &key);
+        }
+}
+
+/* ------------------------------------------------------------------------- */
+static int
+partitions_are_alike(const medium_partition_t* a, const medium_partition_t* b)
+{
+    return attribute_is_same(&a->attr, &b->attr) &&
+           a->attr.sound_velocity == b->attr.sound_velocity;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Finds the plane inside the box that best separates differing materials: the
+ * layer whose cross-section of the box is covered by the largest fraction of
+ * material edges. Ties go to the most central plane, to keep the tree
+ * balanced. Returns 0 if the box is homogeneous.
+ */
+static int
+find_split_plane(const material_edges_t* edges, const occupancy_box_t* box, int* split_axis, uintptr_t* split_at)
+{
+    wsreal_t best_score = 0;
+    uintptr_t best_distance = 0;
+    int axis;
+
+    for (axis = 0; axis != 3; ++axis)
+    {
+        occupancy_box_t layer = *box;
+        wsreal_t area = (wsreal_t)((box->max[0] - box->min[0]) *
+                                   (box->max[1] - box->min[1]) *
+                                   (box->max[2] - box->min[2]) /
+                                   (box->max[axis] - box->min[axis]));
+        uintptr_t twice_center = box->min[axis] + box->max[axis];
+        uintptr_t p;
+
+        /* Edges are stored on the cell with the higher coordinate, so the
+         * layer starting at p holds the edges of the plane at p */
+        for (p = box->min[axis] + 1; p < box->max[axis]; ++p)
+        {
+            uintptr_t distance = 2*p > twice_center ? 2*p - twice_center : twice_center - 2*p;
+            wsreal_t score;
+            layer.min[axis] = p;
+            layer.max[axis] = p + 1;
+            score = (wsreal_t)material_edges_in_box(edges, axis, &layer) / area;
+            if (score > best_score || (score == best_score && score > 0 && distance < best_distance))
+            {
+                best_score = score;
+                best_distance = distance;
+                *split_axis = axis;
+                *split_at = p;
+            }
+        }
+    }
+
+    return best_score > 0;
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+medium_decompose_kd_split(medium_t* medium,
+                          const voxel_grid_t* grid,
+                          const medium_t* mediumdef)
+{
+    material_edges_t edges;
+    occupancy_t occupancy;
+    vector_t stack;
+    occupancy_box_t* root;
+    wsret result;
+    int i;
+
+    (void)mediumdef;
+    if ((result = occupancy_construct(&occupancy, medium->boundary.xyzxyz, grid->grid_size)) != WS_OK)
+        return result;
+    if (occupancy.dims[0] == 0 || occupancy.dims[1] == 0 || occupancy.dims[2] == 0)
+        goto empty;
+    if ((result = material_edges_construct(&edges, grid)) != WS_OK)
+        goto empty;
+
+    /* Split boxes from an explicit stack rather than recursing, the tree can
+     * get deep */
+    vector_construct(&stack, sizeof(occupancy_box_t));
+    if ((root = vector_emplace(&stack)) == NULL)
+        goto ran_out_of_memory;
+    for (i = 0; i != 3; ++i)
+    {
+        root->min[i] = 0;
+        root->max[i] = occupancy.dims[i];
+    }
+
+    while (vector_count(&stack) > 0)
+    {
+        occupancy_box_t box = *(occupancy_box_t*)vector_back(&stack);
+        occupancy_box_t* half;
+        uintptr_t split_at;
+        int split_axis;
+        vector_pop(&stack);
+
+        if (find_split_plane(&edges, &box, &split_axis, &split_at) == 0)
+        {
+            wsreal_t bb[6];
+            uint32_t material = voxel_grid_material(grid, box.min[0], box.min[1], box.min[2]);
+            occupancy_box_to_aabb(&occupancy, &box, bb);
+            if (medium_add_partition(medium, bb, *voxel_grid_attribute(grid, material)) != 0)
+                goto ran_out_of_memory;
+            continue;
+        }
+
+        /* Push the upper half first, so partitions come out in lattice order */
+        if ((half = vector_emplace(&stack)) == NULL)
+            goto ran_out_of_memory;
+        *half = box;
+        half->min[split_axis] = split_at;
+        if ((half = vector_emplace(&stack)) == NULL)
+            goto ran_out_of_memory;
+        *half = box;
+        half->max[split_axis] = split_at;
+    }
+    goto out;
 
-/* ------------------------------------------------------------------------- */
-void
-medium_clear(medium_t* medium)
-{
-    VECTOR_FOR_EACH(&medium->partitions, medium_partition_t, partition)
-        vector_clear_free(&partition->adjacent_partitions);
-    VECTOR_END_EACH
-    vector_clear_free(&medium->partitions);
+    ran_out_of_memory:
+    result = WS_ERR_OUT_OF_MEMORY;
+    out:
+    vector_clear_free(&stack);
+    material_edges_destruct(&edges);
+    empty:
+    occupancy_destruct(&occupancy);
+    WSRET(result);
 }
 
 /* ------------------------------------------------------------------------- */
-wsret
-medium_add_partition(medium_t* medium, const wsreal_t bb[6], attribute_t attr)
+/*!
+ * A pair of touching partitions found by the sweep, a < b.
+ */
+typedef struct contact_t
 {
-    medium_partition_t* partition = vector_emplace(&medium->partitions);
-    if (partition == NULL)
-        WSRET(WS_ERR_OUT_OF_MEMORY);
+    aabb_t face;
+    uint32_t a, b;
+    uint8_t axis;
+} contact_t;
 
-    partition->aabb = aabb(bb[0], bb[1], bb[2], bb[3], bb[4], bb[5]);
-    partition->attr = attr;
-    partition->cell_size = INFINITY;
-    partition->time_step = INFINITY;
-    memset(&partition->cell_count, 0, sizeof(partition->cell_count));
-    vector_construct(&partition->adjacent_partitions, sizeof(int32_t));
+typedef struct sweep_entry_t
+{
+    wsreal_t min_x;
+    uint32_t partition_idx;
+} sweep_entry_t;
 
-    return 0;
+static int
+compare_sweep_entries(const void* a, const void* b)
+{
+    const sweep_entry_t* e1 = a;
+    const sweep_entry_t* e2 = b;
+    if (e1->min_x != e2->min_x)
+        return e1->min_x < e2->min_x ? -1 : 1;
+    return (e1->partition_idx > e2->partition_idx) - (e1->partition_idx < e2->partition_idx);
 }
 
-/* ------------------------------------------------------------------------- */
-void
-medium_set_decomposition_method(medium_t* medium,
-                                medium_decomposition_func method)
+static int
+compare_interfaces(const void* a, const void* b)
 {
-    medium->decompose = method;
+    uint32_t n1 = ((const medium_interface_t*)a)->neighbour;
+    uint32_t n2 = ((const medium_interface_t*)b)->neighbour;
+    return (n1 > n2) - (n1 < n2);
 }
 
-/* ------------------------------------------------------------------------- */
-typedef enum direction_e
-{
-    UP    = 0x01,
-    DOWN  = 0x02,
-    LEFT  = 0x04,
-    RIGHT = 0x08,
-    FRONT = 0x10,
-    BACK  = 0x20,
-    DIR_ITER_START = 0x01,
-    DIR_ITER_END   = 0x40,
-    ALL_DIRECTIONS = UP | DOWN | LEFT | RIGHT | FRONT | BACK,
-    DIRECTION_COUNT = 6
-} direction_e;
-static aabb_t
-get_adjacent_slice(const wsreal_t aabb[6], const wsreal_t grid_size[3], direction_e direction)
+/*!
+ * Partitions touch if their AABBs meet on exactly one axis and overlap with
+ * a positive length on the other two. Returns 0 otherwise, or if they
+ * overlap, which can't happen if they tile the medium.
+ */
+static int
+find_contact(const aabb_t* a, const aabb_t* b, wsreal_t epsilon, contact_t* contact)
 {
-    aabb_t adjacent;
-    memcpy(adjacent.xyzxyz, aabb, sizeof(adjacent.xyzxyz));
-    switch (direction)
+    int axis, touch_axis = -1;
+    for (axis = 0; axis != 3; ++axis)
     {
-        case UP :
-            AABB_AY(adjacent) = aabb[4];
-            AABB_BY(adjacent) = aabb[4] + grid_size[1];
-            break;
-        case DOWN:
-            AABB_AY(adjacent) = aabb[1] - grid_size[1];
-            AABB_BY(adjacent) = aabb[1];
-            break;
-        case LEFT :
-            AABB_AX(adjacent) = aabb[0] - grid_size[0];
-            AABB_BX(adjacent) = aabb[0];
-            break;
-        case RIGHT:
-            AABB_AX(adjacent) = aabb[3];
-            AABB_BX(adjacent) = aabb[3] + grid_size[0];
-            break;
-        case FRONT :
-            AABB_AZ(adjacent) = aabb[2] - grid_size[2];
-            AABB_BZ(adjacent) = aabb[2];
-            break;
-        case BACK:
-            AABB_AZ(adjacent) = aabb[5];
-            AABB_BZ(adjacent) = aabb[5] + grid_size[2];
-            break;
-        default: break;
+        wsreal_t lo = a->xyzxyz[axis] > b->xyzxyz[axis] ? a->xyzxyz[axis] : b->xyzxyz[axis];
+        wsreal_t hi = a->xyzxyz[axis+3] < b->xyzxyz[axis+3] ? a->xyzxyz[axis+3] : b->xyzxyz[axis+3];
+        if (hi - lo < -epsilon)
+            return 0;
+        if (hi - lo <= epsilon)
+        {
+            if (touch_axis != -1)
+                return 0; /* Only an edge or a corner */
+            touch_axis = axis;
+            lo = hi = a->xyzxyz[axis+3] <= b->xyzxyz[axis] + epsilon ? a->xyzxyz[axis+3] : a->xyzxyz[axis];
+        }
+        contact->face.xyzxyz[axis] = lo;
+        contact->face.xyzxyz[axis+3] = hi;
     }
 
-    return adjacent;
+    if (touch_axis == -1)
+        return 0;
+    contact->axis = (uint8_t)touch_axis;
+    return 1;
 }
-static int
-medium_partition_already_occupied(const medium_t* medium, const wsreal_t aabb[6])
+
+/* ------------------------------------------------------------------------- */
+static void
+fill_interface(medium_interface_t* interface,
+               const contact_t* contact,
+               const aabb_t* partition,
+               const aabb_t* neighbour,
+               uint32_t neighbour_idx,
+               const wsreal_t grid_size[3])
 {
-    /* First make sure it's within bounds */
     int i;
+    interface->face = contact->face;
+    interface->neighbour = neighbour_idx;
+    interface->axis = contact->axis;
+    interface->side = neighbour->xyzxyz[contact->axis] >= partition->xyzxyz[contact->axis+3] - grid_size[contact->axis] * 1e-6;
     for (i = 0; i != 3; ++i)
-        if (aabb[i+0] < medium->boundary.b.min.xyz[i] ||
-            aabb[i+3] > medium->boundary.b.max.xyz[i])
-        {
-            return 1;
-        }
-
-    /* Next, check if it intersects with any other partition in the medium */
-    VECTOR_FOR_EACH(&medium->partitions, medium_partition_t, partition)
-        if (intersect_aabb_aabb_test(partition->aabb.xyzxyz, aabb))
-            return 1;
-    VECTOR_END_EACH
-
-    return 0;
+    {
+        interface->cell_offset[i] = (uint32_t)floor((contact->face.xyzxyz[i] - partition->xyzxyz[i]) / grid_size[i] + 0.5);
+        interface->cell_count[i] = (uint32_t)floor((contact->face.xyzxyz[i+3] - contact->face.xyzxyz[i]) / grid_size[i] + 0.5);
+    }
 }
-static wsret
-decompose_systematic_recursive(medium_t* medium,
-                               uintptr_t parent_partition_idx,
-                               const octree_t* octree,
-                               const medium_t* mediumdef,
-                               const wsreal_t grid_size[3],
-                               aabb_t seed)
+
+/* ------------------------------------------------------------------------- */
+wsret
+medium_build_adjacency(medium_t* medium, const wsreal_t grid_size[3])
 {
-    uintptr_t direction;
-    uintptr_t occupied_direction_flags;
-    vector_t potential_new_seeds;
-    uintptr_t this_partition_idx;
+    medium_adjacency_t* adjacency = &medium->adjacency;
+    uintptr_t count = vector_count(&medium->partitions);
+    sweep_entry_t* sweep;
+    uint32_t* fill;
+    vector_t active;              /* uint32_t, partitions the sweep overlaps */
+    vector_t contacts;            /* contact_t */
+    wsreal_t epsilon;
+    uintptr_t i, j;
+    wsret result = WS_OK;
+
+    clear_adjacency(adjacency);
+    if ((adjacency->offsets = MALLOC(sizeof(uint32_t) * (count + 1))) == NULL)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+    memset(adjacency->offsets, 0, sizeof(uint32_t) * (count + 1));
+    if (count == 0)
+        WSRET(WS_OK);
+    if ((sweep = MALLOC(sizeof(sweep_entry_t) * count)) == NULL)
+    {
+        clear_adjacency(adjacency);
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+    }
 
-    /* Determine the cell type of our seed */
-    attribute_t seed_attr;
-    determine_cell_attribute(&seed_attr, octree, seed.xyzxyz);
+    epsilon = grid_size[0];
+    for (i = 1; i != 3; ++i)
+        if (epsilon > grid_size[i])
+            epsilon = grid_size[i];
+    epsilon *= 1e-6;
 
-    /*
-     * Try to expand the seed evenly in all directions, until we hit an adjacent
-     * cell that has different attributes.
-     */
-    vector_construct(&potential_new_seeds, sizeof(aabb_t));
-    do
+    /* Sort along x */
+    for (i = 0; i != count; ++i)
     {
-        occupied_direction_flags = 0;
-        for (direction = DIR_ITER_START; direction != DIR_ITER_END; direction <<= 1)
-        {
-            aabb_t slice;
-            aabb_t cell;
-            int slice_is_same_as_seed;
+        medium_partition_t* partition = vector_get(&medium->partitions, i);
+        sweep[i].min_x = partition->aabb.xyzxyz[0];
+        sweep[i].partition_idx = (uint32_t)i;
+    }
+    qsort(sweep, count, sizeof(sweep_entry_t), compare_sweep_entries);
 
-            /* Check if this direction has been flagged as occupied. If so, no
-             * need to do anything */
-            if (occupied_direction_flags & direction)
-                continue;
+    /* Sweep, comparing every partition with the ones whose x range it
+     * reaches */
+    vector_construct(&active, sizeof(uint32_t));
+    vector_construct(&contacts, sizeof(contact_t));
+    for (i = 0; i != count; ++i)
+    {
+        uint32_t idx = sweep[i].partition_idx;
+        medium_partition_t* partition = vector_get(&medium->partitions, idx);
 
-            /* Calculate a slice adjacent to this seed and make sure it doesn't
-             * already exist in the medium. */
-            slice = get_adjacent_slice(seed.xyzxyz, grid_size, direction);
-            if (medium_partition_already_occupied(medium, slice.xyzxyz))
+        for (j = 0; j < vector_count(&active);)
+        {
+            uint32_t other_idx = *(uint32_t*)vector_get(&active, j);
+            medium_partition_t* other = vector_get(&medium->partitions, other_idx);
+            contact_t* contact;
+
+            if (other->aabb.xyzxyz[3] < sweep[i].min_x - epsilon)
             {
-                occupied_direction_flags |= direction;
+                /* Passed it, nothing further along x can touch it */
+                *(uint32_t*)vector_get(&active, j) = *(uint32_t*)vector_back(&active);
+                vector_pop(&active);
                 continue;
             }
+            ++j;
 
-            /* Iterate through all cells in the slice and confirm that these cells
-             * have the same attributes as our seed cell */
-            slice_is_same_as_seed = 1;
-            iterate_cells_begin(cell.xyzxyz, slice.xyzxyz, grid_size);
-            do
-            {
-                attribute_t cell_attribute;
-                determine_cell_attribute(&cell_attribute, octree, cell.xyzxyz);
-                if (attribute_is_same(&seed_attr, &cell_attribute) == 0)
-                {
-                    aabb_t* new_seed = vector_emplace(&potential_new_seeds);
-                    if (new_seed == NULL)
-                        goto ran_out_of_memory;
-                    *new_seed = cell;
-                    slice_is_same_as_seed = 0;
-                }
-            } while(iterate_cells_next(cell.xyzxyz, slice.xyzxyz));
-            if (slice_is_same_as_seed == 0)
+            if ((contact = vector_emplace(&contacts)) == NULL)
+                goto ran_out_of_memory;
+            if (find_contact(&partition->aabb, &other->aabb, epsilon, contact) == 0)
             {
-                occupied_direction_flags |= direction;
+                vector_pop(&contacts);
                 continue;
             }
-
-            /* Since slice has the same attributes, we can merge it with our
-             * seed now */
-            aabb_expand_aabb(seed.xyzxyz, slice.xyzxyz);
+            contact->a = idx < other_idx ? idx : other_idx;
+            contact->b = idx < other_idx ? other_idx : idx;
+            adjacency->offsets[contact->a + 1]++;
+            adjacency->offsets[contact->b + 1]++;
         }
-    } while (occupied_direction_flags != ALL_DIRECTIONS);
 
-    /*
-     * At this point, the seed has been expanded as much as possible without
-     * intersecting existing partitions in the medium. Add it to the medium as
-     * a new partition.
-     */
-    assert(medium_partition_already_occupied(medium, seed.xyzxyz) == 0);
-    this_partition_idx = vector_count(&medium->partitions);
-    if (medium_add_partition(medium, seed.xyzxyz, attribute_default_air()) != 0)
+        if (vector_push(&active, &idx) == VECTOR_ERROR)
+            goto ran_out_of_memory;
+    }
+
+    /* Lay out both directions of every contact in CSR form */
+    for (i = 0; i != count; ++i)
+        adjacency->offsets[i + 1] += adjacency->offsets[i];
+    adjacency->interfaces = MALLOC(sizeof(medium_interface_t) * (adjacency->offsets[count] + 1));
+    fill = MALLOC(sizeof(uint32_t) * count);
+    if (adjacency->interfaces == NULL || fill == NULL)
+    {
+        if (fill != NULL)
+            FREE(fill);
         goto ran_out_of_memory;
-    log_info(&g_ws_log, "Adding partition #%d (%f,%f,%f,%f,%f,%f)", this_partition_idx, seed.xyzxyz[0], seed.xyzxyz[1], seed.xyzxyz[2], seed.xyzxyz[3], seed.xyzxyz[4], seed.xyzxyz[5]);
+    }
+    memcpy(fill, adjacency->offsets, sizeof(uint32_t) * count);
+
+    VECTOR_FOR_EACH(&contacts, contact_t, contact)
+        medium_partition_t* a = vector_get(&medium->partitions, contact->a);
+        medium_partition_t* b = vector_get(&medium->partitions, contact->b);
+        fill_interface(&adjacency->interfaces[fill[contact->a]++], contact, &a->aabb, &b->aabb, contact->b, grid_size);
+        fill_interface(&adjacency->interfaces[fill[contact->b]++], contact, &b->aabb, &a->aabb, contact->a, grid_size);
+    VECTOR_END_EACH
+    FREE(fill);
+
+    for (i = 0; i != count; ++i)
+        qsort(adjacency->interfaces + adjacency->offsets[i],
+              adjacency->offsets[i + 1] - adjacency->offsets[i],
+              sizeof(medium_interface_t), compare_interfaces);
+    goto out;
+
+    ran_out_of_memory:
+    clear_adjacency(adjacency);
+    result = WS_ERR_OUT_OF_MEMORY;
+
+    out:
+    vector_clear_free(&contacts);
+    vector_clear_free(&active);
+    FREE(sweep);
+    WSRET(result);
+}
+
+/* ------------------------------------------------------------------------- */
+wsreal_t
+medium_interface_area(const medium_t* medium)
+{
+    /* Every interface is counted twice by the partitions' surfaces, the
+     * boundary's surface once */
+    wsreal_t area = 0;
+    vec3_t dims = AABB_DIMS(medium->boundary);
+    VECTOR_FOR_EACH(&medium->partitions, medium_partition_t, partition)
+        vec3_t d = AABB_DIMS(partition->aabb);
+        area += 2.0 * (d.v.x*d.v.y + d.v.y*d.v.z + d.v.x*d.v.z);
+    VECTOR_END_EACH
+    area -= 2.0 * (dims.v.x*dims.v.y + dims.v.y*dims.v.z + dims.v.x*dims.v.z);
+    return area > 0 ? area / 2.0 : 0;
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+medium_coalesce(medium_t* medium, medium_coalesce_stats_t* stats)
+{
+    hashmap_t faces[2];
+    char* absorbed;
+    uintptr_t count = vector_count(&medium->partitions);
+    uintptr_t p, survivors;
+    wsret result = WS_OK;
 
-    /* Add ourselves to the parent partition's adjacent list, if possible */
-    if (parent_partition_idx != VECTOR_ERROR)
+    discard_partition_lookups(medium);
+    if (stats != NULL)
     {
-        medium_partition_t* parent_partition = vector_get(&medium->partitions, parent_partition_idx);
-        uintptr_t* adjacent_partition_idx = vector_emplace(&parent_partition->adjacent_partitions);
-        if (adjacent_partition_idx == NULL)
-            goto ran_out_of_memory;
-        *adjacent_partition_idx = this_partition_idx;
+        stats->partitions_before = count;
+        stats->interface_area_before = medium_interface_area(medium);
+    }
+    if (count == 0)
+        goto out;
+
+    if ((absorbed = MALLOC(count)) == NULL)
+    {
+        result = WS_ERR_OUT_OF_MEMORY;
+        goto out;
+    }
+    memset(absorbed, 0, count);
+    if ((result = hashmap_construct(&faces[0], sizeof(face_key_t), sizeof(uintptr_t))) != WS_OK)
+        goto construct_faces_0_failed;
+    if ((result = hashmap_construct(&faces[1], sizeof(face_key_t), sizeof(uintptr_t))) != WS_OK)
+        goto construct_faces_1_failed;
+
+    for (p = 0; p != count; ++p)
+    {
+        medium_partition_t* partition = vector_get(&medium->partitions, p);
+        if ((result = insert_faces(faces, &partition->aabb, p)) != WS_OK)
+            goto compact;
     }
 
     /*
-     * During expansion, we tracked which cells had different attributes than
-     * our own. All of these cells are potential new seeds from which we can
-     * expand new partitions.
+     * Grow each partition by absorbing neighbours until none of them share an
+     * entire face with it. A neighbour that only starts to match after this
+     * partition is done can only do so by growing itself, and will then find
+     * this partition from its side.
      */
-    VECTOR_FOR_EACH(&potential_new_seeds, aabb_t, new_seed)
-        wsret result;
-        if (medium_partition_already_occupied(medium, new_seed->xyzxyz))
+    for (p = 0; p != count; ++p)
+    {
+        medium_partition_t* partition = vector_get(&medium->partitions, p);
+        int merged;
+        if (absorbed[p])
             continue;
-        result = decompose_systematic_recursive(medium, this_partition_idx, octree, mediumdef, grid_size, *new_seed);
-        if (result != WS_OK)
+
+        do
         {
-            vector_clear_free(&potential_new_seeds);
-            return result;
-        }
-    VECTOR_END_EACH
+            int axis, high;
+            merged = 0;
+            for (axis = 0; axis != 3; ++axis)
+                for (high = 0; high != 2; ++high)
+                {
+                    face_key_t key;
+                    uintptr_t* found;
+                    uintptr_t q;
+                    medium_partition_t* neighbour;
 
-    vector_clear_free(&potential_new_seeds);
-    (void)mediumdef;
-    WSRET(WS_OK);
+                    make_face_key(&key, &partition->aabb, axis, high);
+                    if ((found = hashmap_find(&faces[!high], &key)) == NULL)
+                        continue;
+                    q = *found;
+                    neighbour = vector_get(&medium->partitions, q);
+                    if (partitions_are_alike(partition, neighbour) == 0)
+                        continue;
+
+                    erase_faces(faces, &partition->aabb);
+                    erase_faces(faces, &neighbour->aabb);
+                    partition->aabb.xyzxyz[axis + (high ? 3 : 0)] = neighbour->aabb.xyzxyz[axis + (high ? 3 : 0)];
+                    absorbed[q] = 1;
+                    merged = 1;
+                    if ((result = insert_faces(faces, &partition->aabb, p)) != WS_OK)
+                        goto compact;
+                }
+        } while (merged);
+    }
+
+    /* Move the surviving partitions to the front */
+    compact:
+    survivors = 0;
+    for (p = 0; p != count; ++p)
+    {
+        if (absorbed[p])
+            continue;
+        if (survivors != p)
+            memcpy(vector_get(&medium->partitions, survivors), vector_get(&medium->partitions, p), sizeof(medium_partition_t));
+        ++survivors;
+    }
+    vector_resize(&medium->partitions, survivors);
 
-    ran_out_of_memory: WSRET(WS_ERR_OUT_OF_MEMORY);
+    hashmap_destruct(&faces[1]);
+    construct_faces_1_failed : hashmap_destruct(&faces[0]);
+    construct_faces_0_failed : FREE(absorbed);
+    out:
+    if (stats != NULL)
+    {
+        stats->partitions_after = vector_count(&medium->partitions);
+        stats->interface_area_after = medium_interface_area(medium);
+    }
+    WSRET(result);
 }
+
+/* ------------------------------------------------------------------------- */
+const medium_decomposition_func medium_decomposition_strategies[] = {
+    medium_decompose_systematic,
+    medium_decompose_greedy_random,
+    medium_decompose_kd_split,
+    NULL
+};
+
+/* ------------------------------------------------------------------------- */
 wsret
-medium_decompose_systematic(medium_t* medium,
-                            const octree_t* octree,
-                            const medium_t* mediumdef,
-                            const wsreal_t grid_size[3])
+medium_decompose_cheapest(medium_t* medium,
+                          const voxel_grid_t* grid,
+                          const medium_t* mediumdef)
 {
-    /* Start at the bottom, left, front corner */
-    aabb_t seed = aabb(
-        AABB_AX(medium->boundary),
-        AABB_AY(medium->boundary),
-        AABB_AZ(medium->boundary),
-        AABB_AX(medium->boundary) + grid_size[0],
-        AABB_AY(medium->boundary) + grid_size[1],
-        AABB_AZ(medium->boundary) + grid_size[2]
-    );
-    return decompose_systematic_recursive(medium, VECTOR_ERROR, octree, mediumdef, grid_size, seed);
+    medium_t trial;
+    vector_t swap;
+    wsreal_t best_time = INFINITY;
+    uintptr_t i;
+    wsret result;
+
+    if (medium->cost_model.calibrated == 0)
+    {
+        if ((result = cost_model_calibrate(&medium->cost_model)) != WS_OK)
+            return result;
+        log_info(&g_ws_log, "Calibrated cost model: %g s/partition, %g s/(N log N), %g s/interface cell",
+                 medium->cost_model.partition, medium->cost_model.transform, medium->cost_model.interface);
+    }
+
+    medium_construct(&trial);
+    trial.boundary = medium->boundary;
+    trial.seed = medium->seed;
+    for (i = 0; medium_decomposition_strategies[i] != NULL; ++i)
+    {
+        wsreal_t time;
+        medium_clear(&trial);
+        if ((result = medium_decomposition_strategies[i](&trial, grid, mediumdef)) != WS_OK)
+            goto out;
+        if ((result = medium_coalesce(&trial, NULL)) != WS_OK)
+            goto out;
+
+        time = medium->cost(&medium->cost_model, &trial, grid->grid_size);
+        log_info(&g_ws_log, "Decomposition strategy %d: %d partitions, predicted %g s/step",
+                 (int)i, (int)vector_count(&trial.partitions), time);
+        if (time >= best_time)
+            continue;
+
+        /* Keep this one, the previous best is cleared by the next trial */
+        best_time = time;
+        swap = medium->partitions;
+        medium->partitions = trial.partitions;
+        trial.partitions = swap;
+        discard_partition_lookups(medium);
+    }
+
+    out:
+    medium_destruct(&trial);
+    return result;
 }
 
 /* ------------------------------------------------------------------------- */
-wsret
-medium_decompose_greedy_random(medium_t* medium,
-                               const octree_t* octree,
-                               const medium_t* mediumdef,
-                               const wsreal_t grid_size[3])
+#ifdef DEBUG
+/*!
+ * Returns 1 if the AABB reaches outside of the medium's boundary or overlaps
+ * a partition that was already added. Costs one word operation per 64 cells
+ * along x, regardless of how many partitions exist.
+ */
+static int
+medium_partition_already_occupied(const occupancy_t* occupancy, const wsreal_t aabb[6])
 {
-    (void)medium;
-    (void)octree;
-    (void)mediumdef;
-    (void)grid_size;
-    WSRET(WS_OK);
+    occupancy_box_t box;
+    if (occupancy_box_from_aabb(occupancy, aabb, &box) == 0)
+        return 1;
+    return !occupancy_box_is_free(occupancy, &box);
 }
 
 /* ------------------------------------------------------------------------- */
-#ifdef DEBUG
 static int
 integrity_checks_out(const medium_t* medium, const medium_t* mediumdef, const wsreal_t grid_size[3])
 {
-    aabb_t cell;
+    occupancy_t occupancy;
+    uintptr_t x, y, z;
     int integrity = 1;
     (void)mediumdef;
-    ws_log_info(&g_ws_log, "Integrity check...");
+    log_info(&g_ws_log, "Integrity check...");
 
-    iterate_cells_begin(cell.xyzxyz, medium->boundary.xyzxyz, grid_size);
-    do
-    {
-        if (medium_partition_already_occupied(medium, cell.xyzxyz))
+    if (occupancy_construct(&occupancy, medium->boundary.xyzxyz, grid_size) != WS_OK)
+        return 0;
+
+    /* Partitions have to lie on the lattice and must not overlap */
+    VECTOR_FOR_EACH(&medium->partitions, medium_partition_t, partition)
+        occupancy_box_t box;
+        if (medium_partition_already_occupied(&occupancy, partition->aabb.xyzxyz))
         {
             integrity = 0;
-            ws_log_info(&g_ws_log, "Integrity failure, missing partition at (%f,%f,%f,%f,%f,%f)", AABB_AX(cell), AABB_AY(cell), AABB_AZ(cell), AABB_BX(cell), AABB_BY(cell), AABB_BZ(cell));
+            log_info(&g_ws_log, "Integrity failure, overlapping partition at (%f,%f,%f,%f,%f,%f)", AABB_AX(partition->aabb), AABB_AY(partition->aabb), AABB_AZ(partition->aabb), AABB_BX(partition->aabb), AABB_BY(partition->aabb), AABB_BZ(partition->aabb));
+            continue;
         }
-    } while(iterate_cells_next(cell.xyzxyz, medium->boundary.xyzxyz));
+        occupancy_box_from_aabb(&occupancy, partition->aabb.xyzxyz, &box);
+        occupancy_mark(&occupancy, &box, 0);
+    VECTOR_END_EACH
+
+    /* And cover every cell */
+    for (z = 0; z != occupancy.dims[2]; ++z)
+        for (y = 0; y != occupancy.dims[1]; ++y)
+            for (x = 0; x != occupancy.dims[0]; ++x)
+                if (occupancy_owner(&occupancy, x, y, z) == OCCUPANCY_FREE)
+                {
+                    integrity = 0;
+                    log_info(&g_ws_log, "Integrity failure, missing partition at cell (%d,%d,%d)", (int)x, (int)y, (int)z);
+                }
 
+    occupancy_destruct(&occupancy);
     if (integrity)
-        ws_log_info(&g_ws_log, "Integrity check successful");
+        log_info(&g_ws_log, "Integrity check successful");
     return integrity;
 }
 #endif
@@ -492,7 +1419,10 @@ medium_build_from_mesh(medium_t* medium,
                        const mesh_t* mesh,
                        const wsreal_t grid_size[3])
 {
-    octree_t octree;
+    voxel_grid_t grid;
+    medium_coalesce_stats_t stats;
+    char* cache_file_name = NULL;
+    uint64_t cache_key;
     wsret result;
 
     /* Clear partitions from last time */
@@ -508,14 +1438,51 @@ medium_build_from_mesh(medium_t* medium,
     else
     {
         medium->boundary = mediumdef->boundary;
+        medium->seed = mediumdef->seed;
+        medium->cost = mediumdef->cost;
+        if (mediumdef->cost_model.calibrated)
+            medium->cost_model = mediumdef->cost_model;
+    }
+
+    /* Skip everything below if the same inputs were decomposed before */
+    if (medium->cache_directory != NULL && medium_cache_key(medium, mesh, grid_size, &cache_key))
+    {
+        if ((cache_file_name = medium_cache_file_name(medium->cache_directory, cache_key)) == NULL)
+            WSRET(WS_ERR_OUT_OF_MEMORY);
+        result = medium_cache_load(medium, cache_file_name, cache_key);
+        if (result == WS_OK && (result = medium_build_index(medium)) == WS_OK)
+        {
+            log_info(&g_ws_log, "Loaded %d partitions from %s", (int)medium_partition_count(medium), cache_file_name);
+            FREE(cache_file_name);
+            WSRET(WS_OK);
+        }
+        if (result == WS_ERR_OUT_OF_MEMORY)
+        {
+            FREE(cache_file_name);
+            return result;
+        }
+        if (result == WS_ERR_BAD_FILE_FORMAT)
+            log_info(&g_ws_log, "[warning] Ignoring outdated or corrupt medium cache %s", cache_file_name);
     }
 
-    /* Need an octree */
-    octree_construct(&octree);
-    if ((result = octree_build_from_mesh(&octree, mesh, 2)) != WS_OK)
+    /* Sample the mesh onto the lattice once, decomposition only reads the
+     * grid from here on */
+    voxel_grid_construct(&grid);
+    if ((result = voxel_grid_build(&grid, mesh, medium->boundary.xyzxyz, grid_size, 0)) != WS_OK)
         goto bail;
 
-    if ((result = medium->decompose(medium, &octree, mediumdef, grid_size)) != WS_OK)
+    if ((result = medium->decompose(medium, &grid, mediumdef)) != WS_OK)
+        goto bail;
+    if ((result = medium_coalesce(medium, &stats)) != WS_OK)
+        goto bail;
+    log_info(&g_ws_log, "Coalesced %d partitions into %d, interface area %f -> %f",
+             (int)stats.partitions_before, (int)stats.partitions_after,
+             stats.interface_area_before, stats.interface_area_after);
+    if ((result = medium_build_adjacency(medium, grid_size)) != WS_OK)
+        goto bail;
+    log_info(&g_ws_log, "Found %d interfaces between partitions",
+             (int)(medium->adjacency.offsets[medium_partition_count(medium)] / 2));
+    if ((result = medium_build_index(medium)) != WS_OK)
         goto bail;
 
 #ifdef DEBUG
@@ -524,7 +1491,13 @@ medium_build_from_mesh(medium_t* medium,
 
     log_info(&g_ws_log, "Decomposed mesh into %d partitions", (int)vector_count(&medium->partitions));
 
-    bail : octree_destruct(&octree);
+    /* Failing to cache only costs time on the next run */
+    if (cache_file_name != NULL && medium_cache_save(medium, cache_file_name, cache_key) != WS_OK)
+        log_info(&g_ws_log, "[warning] Failed to write medium cache %s", cache_file_name);
+
+    bail : voxel_grid_destruct(&grid);
+    if (cache_file_name != NULL)
+        FREE(cache_file_name);
     return result;
 }
 
@@ -566,7 +1539,7 @@ medium_set_resolution(medium_t* medium, wsreal_t max_frequency, wsreal_t cell_to
             success = 1;
             for (i = 0; i != 3; ++i)
             {
-                partition->cell_count[i] = (uintptr_t)ceil(dims.v.x / partition->cell_size);
+                partition->cell_count[i] = (uintptr_t)ceil(dims.xyz[i] / partition->cell_size);
                 if ((wsreal_t)partition->cell_count[i]*partition->cell_size > dims.xyz[i]+cell_tolerance*partition->cell_size)
                 {
                     partition->cell_size = dims.xyz[i] / ((wsreal_t)partition->cell_count[i] - cell_tolerance/2.0);
@@ -597,3 +1570,76 @@ medium_cell_count(medium_t* medium)
     VECTOR_END_EACH
     return total_cell_count;
 }
+
+/* ------------------------------------------------------------------------- */
+wsret
+medium_build_index(medium_t* medium)
+{
+    return partition_index_build(&medium->index, medium);
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+locate_in_partition(const medium_partition_t* partition, const wsreal_t point[3], medium_location_t* location)
+{
+    int i;
+    for (i = 0; i != 3; ++i)
+    {
+        wsreal_t u;
+        uintptr_t cell;
+
+        location->cell[i] = 0;
+        location->weight[i] = 0.0;
+        if (partition->cell_size <= 0.0 || partition->cell_count[i] < 2)
+            continue;
+
+        /* Position in cells, relative to the center of the first cell */
+        u = (point[i] - partition->aabb.xyzxyz[i]) / partition->cell_size - 0.5;
+        if (u <= 0.0)
+            continue;
+        cell = (uintptr_t)u;
+        if (cell >= partition->cell_count[i] - 1)
+        {
+            location->cell[i] = (uint32_t)(partition->cell_count[i] - 2);
+            location->weight[i] = 1.0;
+            continue;
+        }
+        location->cell[i] = (uint32_t)cell;
+        location->weight[i] = u - (wsreal_t)cell;
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+uintptr_t
+medium_locate_points(const medium_t* medium,
+                     const wsreal_t* points,
+                     uintptr_t count,
+                     medium_location_t* locations)
+{
+    uintptr_t i, found = 0;
+    for (i = 0; i != count; ++i)
+    {
+        const wsreal_t* point = points + i * 3;
+        medium_location_t* location = &locations[i];
+
+        location->partition = partition_index_find(&medium->index, point);
+        if (location->partition < 0)
+        {
+            memset(location->cell, 0, sizeof(location->cell));
+            memset(location->weight, 0, sizeof(location->weight));
+            continue;
+        }
+
+        locate_in_partition(vector_get(&medium->partitions, (uintptr_t)location->partition), point, location);
+        ++found;
+    }
+
+    return found;
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+medium_query_aabb(const medium_t* medium, vector_t* result, const wsreal_t aabb[6])
+{
+    return partition_index_query_aabb(&medium->index, result, aabb);
+}
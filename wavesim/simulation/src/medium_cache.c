@@ -0,0 +1,306 @@
+#include "wavesim/file.h"
+#include "wavesim/hash.h"
+#include "wavesim/mapped_file.h"
+#include "wavesim/memory.h"
+#include "wavesim/mesh/mesh.h"
+#include "wavesim/simulation/medium.h"
+#include "wavesim/simulation/medium_cache.h"
+#include <stdio.h>
+#include <string.h>
+
+#define SECTION_ALIGNMENT 16
+
+typedef struct cache_partition_t
+{
+    aabb_t aabb;
+    attribute_t attr;
+} cache_partition_t;
+
+typedef struct cache_layout_t
+{
+    uintptr_t partitions;
+    uintptr_t offsets;
+    uintptr_t interfaces;
+    uintptr_t size;
+} cache_layout_t;
+
+/* ------------------------------------------------------------------------- */
+static uintptr_t
+align_section(uintptr_t offset)
+{
+    return (offset + SECTION_ALIGNMENT - 1) & ~(uintptr_t)(SECTION_ALIGNMENT - 1);
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+compute_layout(cache_layout_t* layout, uintptr_t partition_count, uintptr_t interface_count)
+{
+    layout->partitions = align_section(sizeof(medium_cache_header_t));
+    layout->offsets = align_section(layout->partitions + sizeof(cache_partition_t) * partition_count);
+    layout->interfaces = align_section(layout->offsets + sizeof(uint32_t) * (partition_count + 1));
+    layout->size = layout->interfaces + sizeof(medium_interface_t) * interface_count;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Function pointers differ between runs, so methods are hashed by name.
+ * medium_decompose_cheapest() has none: which strategy wins depends on
+ * medium->cost and the cost model calibrated on this machine, and neither
+ * can be hashed.
+ */
+static const char*
+method_name(medium_decomposition_func method)
+{
+    if (method == medium_decompose_systematic)    return "systematic";
+    if (method == medium_decompose_greedy_random) return "greedy_random";
+    if (method == medium_decompose_kd_split)      return "kd_split";
+    return NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+int
+medium_cache_key(const medium_t* medium,
+                 const mesh_t* mesh,
+                 const wsreal_t grid_size[3],
+                 uint64_t* key)
+{
+    const char* method = method_name(medium->decompose);
+    uint32_t version = MEDIUM_CACHE_VERSION;
+    uint32_t types[2];
+    hash64_t hash = HASH64_FNV1A_INIT;
+
+    if (method == NULL)
+        return 0;
+
+    types[0] = (uint32_t)mesh->vb_type;
+    types[1] = (uint32_t)mesh->ib_type;
+    hash = hash64_fnv1a(&version, sizeof(version), hash);
+    hash = hash64_fnv1a(method, strlen(method) + 1, hash);
+    hash = hash64_fnv1a(&medium->seed, sizeof(medium->seed), hash);
+    hash = hash64_fnv1a(medium->boundary.xyzxyz, sizeof(wsreal_t) * 6, hash);
+    hash = hash64_fnv1a(grid_size, sizeof(wsreal_t) * 3, hash);
+    hash = hash64_fnv1a(types, sizeof(types), hash);
+    hash = hash64_fnv1a(&mesh->vb_vertices, sizeof(mesh->vb_vertices), hash);
+    hash = hash64_fnv1a(&mesh->ib_indices, sizeof(mesh->ib_indices), hash);
+    if (mesh->vb_vertices != 0)
+    {
+        hash = hash64_fnv1a(mesh->vb, mesh->vb_vertices * 3 * mesh->vb_size, hash);
+        if (mesh->ab != NULL)
+            hash = hash64_fnv1a(mesh->ab, mesh->vb_vertices * sizeof(attribute_t), hash);
+    }
+    if (mesh->ib_indices != 0)
+        hash = hash64_fnv1a(mesh->ib, mesh->ib_indices * mesh->ib_size, hash);
+
+    *key = hash;
+    return 1;
+}
+
+/* ------------------------------------------------------------------------- */
+char*
+medium_cache_file_name(const char* directory, uint64_t key)
+{
+    char* name = MALLOC(strlen(directory) + 32);
+    if (name != NULL)
+        sprintf(name, "%s/%08lx%08lx.wsmedium", directory,
+                (unsigned long)(key >> 32), (unsigned long)(key & 0xFFFFFFFFu));
+    return name;
+}
+
+/* ------------------------------------------------------------------------- */
+static int
+write_padding(FILE* fp, uintptr_t* written, uintptr_t offset)
+{
+    static const char zeros[SECTION_ALIGNMENT] = {0};
+    uintptr_t count = offset - *written;
+    *written = offset;
+    return count == 0 || fwrite(zeros, 1, count, fp) == count;
+}
+
+/* ------------------------------------------------------------------------- */
+static wsret
+write_file(const medium_t* medium, const char* file_name, uint64_t key)
+{
+    medium_cache_header_t header;
+    cache_layout_t layout;
+    uintptr_t written;
+    uintptr_t partition_count = medium_partition_count(medium);
+    uint32_t interface_count = medium->adjacency.offsets[partition_count];
+    FILE* fp;
+
+    compute_layout(&layout, partition_count, interface_count);
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "WSMC", 4);
+    header.version = MEDIUM_CACHE_VERSION;
+    header.key = key;
+    header.real_size = sizeof(wsreal_t);
+    header.partition_size = sizeof(cache_partition_t);
+    header.interface_size = sizeof(medium_interface_t);
+    header.partition_count = (uint32_t)partition_count;
+    header.interface_count = interface_count;
+
+    fp = fopen(file_name, "wb");
+    if (fp == NULL)
+        WSRET(WS_ERR_FOPEN_FAILED);
+
+    if (fwrite(&header, sizeof(header), 1, fp) != 1)
+        goto write_error;
+    written = sizeof(header);
+
+    if (!write_padding(fp, &written, layout.partitions))
+        goto write_error;
+    VECTOR_FOR_EACH(&medium->partitions, medium_partition_t, partition)
+        cache_partition_t record;
+        memset(&record, 0, sizeof(record));
+        record.aabb = partition->aabb;
+        record.attr = partition->attr;
+        if (fwrite(&record, sizeof(record), 1, fp) != 1)
+            goto write_error;
+    VECTOR_END_EACH
+    written += sizeof(cache_partition_t) * partition_count;
+
+    if (!write_padding(fp, &written, layout.offsets) ||
+        fwrite(medium->adjacency.offsets, sizeof(uint32_t), partition_count + 1, fp) != partition_count + 1)
+        goto write_error;
+    written += sizeof(uint32_t) * (partition_count + 1);
+
+    if (!write_padding(fp, &written, layout.interfaces) ||
+        fwrite(medium->adjacency.interfaces, sizeof(medium_interface_t), interface_count, fp) != interface_count)
+        goto write_error;
+
+    if (fclose(fp) != 0)
+        WSRET(WS_ERR_WRITE_ERROR);
+    WSRET(WS_OK);
+
+    write_error:
+    fclose(fp);
+    WSRET(WS_ERR_WRITE_ERROR);
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+medium_cache_save(const medium_t* medium, const char* file_name, uint64_t key)
+{
+    wsret result;
+    char* temp_name;
+
+    if (medium->adjacency.offsets == NULL)
+        WSRET(WS_ERR_INVALID_STATE);
+
+    /* Other processes may be saving the same key at the same time */
+    if ((temp_name = ws_file_temp_name(file_name)) == NULL)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+
+    if ((result = write_file(medium, temp_name, key)) != WS_OK)
+    {
+        remove(temp_name);
+        FREE(temp_name);
+        return result;
+    }
+
+    /* rename() doesn't replace existing files everywhere */
+    if (rename(temp_name, file_name) != 0)
+    {
+        remove(file_name);
+        if (rename(temp_name, file_name) != 0)
+        {
+            remove(temp_name);
+            FREE(temp_name);
+            WSRET(WS_ERR_WRITE_ERROR);
+        }
+    }
+
+    FREE(temp_name);
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+static int
+header_is_valid(const medium_cache_header_t* header, uintptr_t file_size, uint64_t key)
+{
+    cache_layout_t layout;
+
+    if (file_size < sizeof(medium_cache_header_t) ||
+        memcmp(header->magic, "WSMC", 4) != 0 ||
+        header->version != MEDIUM_CACHE_VERSION ||
+        header->key != key ||
+        header->real_size != sizeof(wsreal_t) ||
+        header->partition_size != sizeof(cache_partition_t) ||
+        header->interface_size != sizeof(medium_interface_t))
+        return 0;
+
+    compute_layout(&layout, header->partition_count, header->interface_count);
+    return layout.size == file_size;
+}
+
+/* ------------------------------------------------------------------------- */
+static int
+adjacency_is_valid(const uint32_t* offsets,
+                   const medium_interface_t* interfaces,
+                   uint32_t partition_count,
+                   uint32_t interface_count)
+{
+    uint32_t i;
+    if (offsets[0] != 0 || offsets[partition_count] != interface_count)
+        return 0;
+    for (i = 0; i != partition_count; ++i)
+        if (offsets[i] > offsets[i + 1])
+            return 0;
+    for (i = 0; i != interface_count; ++i)
+        if (interfaces[i].neighbour >= partition_count)
+            return 0;
+    return 1;
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+medium_cache_load(medium_t* medium, const char* file_name, uint64_t key)
+{
+    mapped_file_t mf;
+    const medium_cache_header_t* header;
+    const cache_partition_t* partitions;
+    const uint32_t* offsets;
+    const medium_interface_t* interfaces;
+    cache_layout_t layout;
+    uint32_t i;
+    wsret result;
+
+    medium_clear(medium);
+    if ((result = mapped_file_open(&mf, file_name)) != WS_OK)
+        return result == WS_ERR_READ_ERROR ? WS_ERR_BAD_FILE_FORMAT : result;
+
+    header = mf.data;
+    if (!header_is_valid(header, mf.size, key))
+    {
+        mapped_file_close(&mf);
+        WSRET(WS_ERR_BAD_FILE_FORMAT);
+    }
+
+    compute_layout(&layout, header->partition_count, header->interface_count);
+    partitions = (const cache_partition_t*)((const char*)mf.data + layout.partitions);
+    offsets = (const uint32_t*)((const char*)mf.data + layout.offsets);
+    interfaces = (const medium_interface_t*)((const char*)mf.data + layout.interfaces);
+    if (!adjacency_is_valid(offsets, interfaces, header->partition_count, header->interface_count))
+    {
+        mapped_file_close(&mf);
+        WSRET(WS_ERR_BAD_FILE_FORMAT);
+    }
+
+    for (i = 0; i != header->partition_count; ++i)
+        if (medium_add_partition(medium, partitions[i].aabb.xyzxyz, partitions[i].attr) != WS_OK)
+            goto ran_out_of_memory;
+
+    medium->adjacency.offsets = MALLOC(sizeof(uint32_t) * (header->partition_count + 1));
+    medium->adjacency.interfaces = MALLOC(sizeof(medium_interface_t) * (header->interface_count + 1));
+    if (medium->adjacency.offsets == NULL || medium->adjacency.interfaces == NULL)
+        goto ran_out_of_memory;
+    memcpy(medium->adjacency.offsets, offsets, sizeof(uint32_t) * (header->partition_count + 1));
+    memcpy(medium->adjacency.interfaces, interfaces, sizeof(medium_interface_t) * header->interface_count);
+
+    mapped_file_close(&mf);
+    WSRET(WS_OK);
+
+    ran_out_of_memory:
+    medium_clear(medium);
+    mapped_file_close(&mf);
+    WSRET(WS_ERR_OUT_OF_MEMORY);
+}
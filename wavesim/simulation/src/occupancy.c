@@ -0,0 +1,150 @@
+#include "wavesim/memory.h"
+#include "wavesim/simulation/occupancy.h"
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+/* Coordinates within this fraction of a cell of a lattice plane lie on it */
+#define ALIGN_EPSILON 1e-6
+
+/* ------------------------------------------------------------------------- */
+wsret
+occupancy_construct(occupancy_t* occupancy, const wsreal_t boundary[6], const wsreal_t grid_size[3])
+{
+    int i;
+    uintptr_t cell_count, row_count;
+
+    for (i = 0; i != 3; ++i)
+    {
+        wsreal_t cells = (boundary[i+3] - boundary[i]) / grid_size[i];
+        occupancy->origin[i] = boundary[i];
+        occupancy->grid_size[i] = grid_size[i];
+        occupancy->dims[i] = cells > 0.0 ? (uintptr_t)floor(cells + ALIGN_EPSILON) : 0;
+    }
+
+    occupancy->words_per_row = (occupancy->dims[0] + 63) / 64;
+    row_count = occupancy->dims[1] * occupancy->dims[2];
+    cell_count = occupancy->dims[0] * row_count;
+    occupancy->bits = NULL;
+    occupancy->owners = NULL;
+    if (cell_count == 0)
+        WSRET(WS_OK);
+
+    occupancy->bits = MALLOC(sizeof(uint64_t) * occupancy->words_per_row * row_count);
+    occupancy->owners = MALLOC(sizeof(int32_t) * cell_count);
+    if (occupancy->bits == NULL || occupancy->owners == NULL)
+    {
+        occupancy_destruct(occupancy);
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+    }
+
+    memset(occupancy->bits, 0, sizeof(uint64_t) * occupancy->words_per_row * row_count);
+    memset(occupancy->owners, 0xFF, sizeof(int32_t) * cell_count); /* OCCUPANCY_FREE */
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+occupancy_destruct(occupancy_t* occupancy)
+{
+    if (occupancy->bits != NULL)
+        FREE(occupancy->bits);
+    if (occupancy->owners != NULL)
+        FREE(occupancy->owners);
+    occupancy->bits = NULL;
+    occupancy->owners = NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+int
+occupancy_box_from_aabb(const occupancy_t* occupancy, const wsreal_t aabb[6], occupancy_box_t* box)
+{
+    int i;
+    for (i = 0; i != 3; ++i)
+    {
+        wsreal_t lo = (aabb[i+0] - occupancy->origin[i]) / occupancy->grid_size[i];
+        wsreal_t hi = (aabb[i+3] - occupancy->origin[i]) / occupancy->grid_size[i];
+        if (lo < -ALIGN_EPSILON || hi > (wsreal_t)occupancy->dims[i] + ALIGN_EPSILON)
+            return 0;
+        box->min[i] = (uintptr_t)(lo + 0.5);
+        box->max[i] = (uintptr_t)(hi + 0.5);
+        if (box->min[i] >= box->max[i])
+            return 0;
+    }
+
+    return 1;
+}
+
+/* ------------------------------------------------------------------------- */
+void
+occupancy_box_to_aabb(const occupancy_t* occupancy, const occupancy_box_t* box, wsreal_t aabb[6])
+{
+    int i;
+    for (i = 0; i != 3; ++i)
+    {
+        aabb[i+0] = occupancy->origin[i] + (wsreal_t)box->min[i] * occupancy->grid_size[i];
+        aabb[i+3] = occupancy->origin[i] + (wsreal_t)box->max[i] * occupancy->grid_size[i];
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Mask of the bits of word w that lie within [x0, x1).
+ */
+static uint64_t
+row_mask(uintptr_t w, uintptr_t x0, uintptr_t x1)
+{
+    uintptr_t first = w * 64, last = first + 64;
+    uint64_t mask = ~(uint64_t)0;
+    if (x0 > first)
+        mask &= ~(uint64_t)0 << (x0 - first);
+    if (x1 < last)
+        mask &= ~(~(uint64_t)0 << (x1 - first));
+    return mask;
+}
+
+/* ------------------------------------------------------------------------- */
+int
+occupancy_box_is_free(const occupancy_t* occupancy, const occupancy_box_t* box)
+{
+    uintptr_t y, z, w;
+    uintptr_t w0 = box->min[0] / 64, w1 = (box->max[0] + 63) / 64;
+
+    for (z = box->min[2]; z != box->max[2]; ++z)
+        for (y = box->min[1]; y != box->max[1]; ++y)
+        {
+            const uint64_t* row = occupancy->bits + (y + occupancy->dims[1] * z) * occupancy->words_per_row;
+            for (w = w0; w != w1; ++w)
+                if (row[w] & row_mask(w, box->min[0], box->max[0]))
+                    return 0;
+        }
+
+    return 1;
+}
+
+/* ------------------------------------------------------------------------- */
+void
+occupancy_mark(occupancy_t* occupancy, const occupancy_box_t* box, int32_t owner)
+{
+    uintptr_t x, y, z, w;
+    uintptr_t w0 = box->min[0] / 64, w1 = (box->max[0] + 63) / 64;
+
+    for (z = box->min[2]; z != box->max[2]; ++z)
+        for (y = box->min[1]; y != box->max[1]; ++y)
+        {
+            uintptr_t row_index = y + occupancy->dims[1] * z;
+            uint64_t* row = occupancy->bits + row_index * occupancy->words_per_row;
+            int32_t* owners = occupancy->owners + row_index * occupancy->dims[0];
+            for (w = w0; w != w1; ++w)
+                row[w] |= row_mask(w, box->min[0], box->max[0]);
+            for (x = box->min[0]; x != box->max[0]; ++x)
+                owners[x] = owner;
+        }
+}
+
+/* ------------------------------------------------------------------------- */
+int32_t
+occupancy_owner(const occupancy_t* occupancy, uintptr_t x, uintptr_t y, uintptr_t z)
+{
+    return occupancy->owners[x + occupancy->dims[0] * (y + occupancy->dims[1] * z)];
+}
@@ -0,0 +1,251 @@
+#include "wavesim/memory.h"
+#include "wavesim/simulation/medium.h"
+#include "wavesim/simulation/partition_index.h"
+#include <math.h>
+#include <string.h>
+
+typedef struct build_ref_t
+{
+    wsreal_t aabb[6];
+    wsreal_t centroid[3];
+    uint32_t id;
+} build_ref_t;
+
+typedef struct build_state_t
+{
+    partition_index_t* index;
+    build_ref_t* refs;
+    uintptr_t slot_count;
+} build_state_t;
+
+/* ------------------------------------------------------------------------- */
+void
+partition_index_construct(partition_index_t* index)
+{
+    index->nodes = NULL;
+    index->node_count = 0;
+    index->boxes = NULL;
+    index->partition_ids = NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+void
+partition_index_destruct(partition_index_t* index)
+{
+    if (index->nodes != NULL)         FREE(index->nodes);
+    if (index->boxes != NULL)         FREE(index->boxes);
+    if (index->partition_ids != NULL) FREE(index->partition_ids);
+    partition_index_construct(index);
+}
+
+/* ------------------------------------------------------------------------- */
+static int
+aabbs_overlap(const wsreal_t a[6], const wsreal_t b[6])
+{
+    return a[0] <= b[3] && a[3] >= b[0] &&
+           a[1] <= b[4] && a[4] >= b[1] &&
+           a[2] <= b[5] && a[5] >= b[2];
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Partially sorts refs along axis, so that the one at nth is in place and no
+ * ref before it has a larger centroid than any ref after it (quickselect).
+ */
+static void
+select_nth(build_ref_t* refs, intptr_t count, intptr_t nth, int axis)
+{
+    intptr_t lo = 0, hi = count - 1;
+    while (lo < hi)
+    {
+        wsreal_t pivot = refs[nth].centroid[axis];
+        intptr_t i = lo, j = hi;
+        do
+        {
+            while (refs[i].centroid[axis] < pivot) ++i;
+            while (refs[j].centroid[axis] > pivot) --j;
+            if (i <= j)
+            {
+                build_ref_t tmp = refs[i];
+                refs[i] = refs[j];
+                refs[j] = tmp;
+                ++i;
+                --j;
+            }
+        } while (i <= j);
+        if (j < nth) lo = i;
+        if (nth < i) hi = j;
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+build_node(build_state_t* state, uintptr_t begin, uintptr_t end)
+{
+    partition_index_t* index = state->index;
+    partition_index_node_t* node = &index->nodes[index->node_count++];
+    wsreal_t centroid_bounds[6];
+    uintptr_t i, mid;
+    int j, axis;
+
+    for (j = 0; j != 3; ++j)
+    {
+        node->aabb[j] = centroid_bounds[j] = INFINITY;
+        node->aabb[j+3] = centroid_bounds[j+3] = -INFINITY;
+    }
+    for (i = begin; i != end; ++i)
+        for (j = 0; j != 3; ++j)
+        {
+            const build_ref_t* ref = &state->refs[i];
+            if (node->aabb[j]   > ref->aabb[j])       node->aabb[j]   = ref->aabb[j];
+            if (node->aabb[j+3] < ref->aabb[j+3])     node->aabb[j+3] = ref->aabb[j+3];
+            if (centroid_bounds[j]   > ref->centroid[j]) centroid_bounds[j]   = ref->centroid[j];
+            if (centroid_bounds[j+3] < ref->centroid[j]) centroid_bounds[j+3] = ref->centroid[j];
+        }
+
+    if (end - begin <= PARTITION_INDEX_LEAF_SIZE)
+    {
+        node->offset = (uint32_t)state->slot_count;
+        node->count = (uint32_t)(end - begin);
+        for (i = begin; i != end; ++i, ++state->slot_count)
+        {
+            memcpy(index->boxes + state->slot_count * 6, state->refs[i].aabb, sizeof(wsreal_t) * 6);
+            index->partition_ids[state->slot_count] = state->refs[i].id;
+        }
+        return;
+    }
+
+    axis = 0;
+    for (j = 1; j != 3; ++j)
+        if (centroid_bounds[j+3] - centroid_bounds[j] > centroid_bounds[axis+3] - centroid_bounds[axis])
+            axis = j;
+
+    /* Splitting at the median halves the partitions on every level, so the
+     * depth never exceeds log2 of the partition count */
+    mid = begin + (end - begin) / 2;
+    select_nth(state->refs + begin, (intptr_t)(end - begin), (intptr_t)(mid - begin), axis);
+
+    node->count = 0;
+    build_node(state, begin, mid);
+    /* The node array never reallocates, so node is still valid */
+    node->offset = (uint32_t)index->node_count;
+    build_node(state, mid, end);
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+partition_index_build(partition_index_t* index, const medium_t* medium)
+{
+    build_state_t state;
+    uintptr_t i, count = medium_partition_count(medium);
+
+    partition_index_destruct(index);
+    if (count == 0)
+        WSRET(WS_OK);
+
+    state.index = index;
+    state.slot_count = 0;
+    state.refs = MALLOC(sizeof(build_ref_t) * count);
+    index->nodes = MALLOC(sizeof(partition_index_node_t) * 2 * count);
+    index->boxes = MALLOC(sizeof(wsreal_t) * 6 * count);
+    index->partition_ids = MALLOC(sizeof(uint32_t) * count);
+    if (state.refs == NULL || index->nodes == NULL || index->boxes == NULL || index->partition_ids == NULL)
+    {
+        if (state.refs != NULL)
+            FREE(state.refs);
+        partition_index_destruct(index);
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+    }
+
+    for (i = 0; i != count; ++i)
+    {
+        medium_partition_t* partition = vector_get(&medium->partitions, i);
+        int j;
+        memcpy(state.refs[i].aabb, partition->aabb.xyzxyz, sizeof(wsreal_t) * 6);
+        for (j = 0; j != 3; ++j)
+            state.refs[i].centroid[j] = (partition->aabb.xyzxyz[j] + partition->aabb.xyzxyz[j+3]) * 0.5;
+        state.refs[i].id = (uint32_t)i;
+    }
+
+    build_node(&state, 0, count);
+    FREE(state.refs);
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+partition_index_query_aabb(const partition_index_t* index, vector_t* result, const wsreal_t aabb[6])
+{
+    uint32_t stack[PARTITION_INDEX_STACK_SIZE];
+    uintptr_t stack_size = 0;
+    uint32_t i, node_idx = 0;
+
+    if (index->nodes == NULL)
+        WSRET(WS_OK);
+
+    while (1)
+    {
+        const partition_index_node_t* node = &index->nodes[node_idx];
+        if (aabbs_overlap(node->aabb, aabb))
+        {
+            if (node->count == 0)
+            {
+                stack[stack_size++] = node->offset;
+                node_idx++;
+                continue;
+            }
+
+            for (i = node->offset; i != node->offset + node->count; ++i)
+                if (aabbs_overlap(index->boxes + i * 6, aabb))
+                    if (vector_push(result, &index->partition_ids[i]) == VECTOR_ERROR)
+                        WSRET(WS_ERR_OUT_OF_MEMORY);
+        }
+
+        if (stack_size == 0)
+            break;
+        node_idx = stack[--stack_size];
+    }
+
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+int32_t
+partition_index_find(const partition_index_t* index, const wsreal_t point[3])
+{
+    uint32_t stack[PARTITION_INDEX_STACK_SIZE];
+    uintptr_t stack_size = 0;
+    uint32_t i, node_idx = 0;
+    wsreal_t bb[6];
+    int32_t found = -1;
+
+    if (index->nodes == NULL)
+        return -1;
+
+    memcpy(bb, point, sizeof(wsreal_t) * 3);
+    memcpy(bb + 3, point, sizeof(wsreal_t) * 3);
+    while (1)
+    {
+        const partition_index_node_t* node = &index->nodes[node_idx];
+        if (aabbs_overlap(node->aabb, bb))
+        {
+            if (node->count == 0)
+            {
+                stack[stack_size++] = node->offset;
+                node_idx++;
+                continue;
+            }
+
+            for (i = node->offset; i != node->offset + node->count; ++i)
+                if (aabbs_overlap(index->boxes + i * 6, bb))
+                    if (found == -1 || index->partition_ids[i] < (uint32_t)found)
+                        found = (int32_t)index->partition_ids[i];
+        }
+
+        if (stack_size == 0)
+            break;
+        node_idx = stack[--stack_size];
+    }
+
+    return found;
+}
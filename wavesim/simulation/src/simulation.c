@@ -1,12 +1,37 @@
 #include "wavesim/memory.h"
 #include "wavesim/vector.h"
 #include "wavesim/vec3.h"
+#include "wavesim/simulation/audio_listener.h"
 #include "wavesim/simulation/audio_source.h"
 #include "wavesim/simulation/simulation.h"
 #include "wavesim/simulation/simulation_ard.h"
+#include "wavesim/simulation/simulation_hybrid.h"
 #include "wavesim/simulation/simulation_ray.h"
 #include <assert.h>
 #include <stddef.h>
+#include <math.h>
+
+/*!
+ * The recorded impulse response is later trimmed using its Schroeder decay
+ * curve, which can only be evaluated over the recorded samples. For the
+ * trimmed length to match the true decay, the energy that is never recorded
+ * has to be negligible compared to the threshold, hence the run continues
+ * until the remaining energy is this many dB below the threshold.
+ */
+#define IR_MODE_HEADROOM_DB 10.0
+
+/*!
+ * Tracks the energy received by a single listener during an impulse-response
+ * run, so the decay can be estimated without re-scanning all samples every
+ * time step.
+ */
+typedef struct decay_monitor_t
+{
+    uintptr_t samples_seen;    /* Number of samples already accumulated into energy_total */
+    uintptr_t next_check;      /* Sample count at which the decay is next estimated */
+    wsreal_t  energy_total;
+    char      decayed;
+} decay_monitor_t;
 
 /* ------------------------------------------------------------------------- */
 wsret
@@ -32,6 +57,32 @@ simulation_destroy(simulation_t* simulation)
 void
 simulation_construct(simulation_t* simulation, simulation_type_e type)
 {
+    simulation->state = NULL;
+    simulation->user_data = NULL;
+    simulation->interrupt = NULL;
+    simulation->on_advance = NULL;
+    vector_construct(&simulation->meshes, sizeof(mesh_t*));
+    vector_construct(&simulation->audio_sources, sizeof(audio_source_t*));
+    vector_construct(&simulation->audio_listeners, sizeof(audio_listener_t*));
+    simulation->time = 0.0;
+    simulation_set_resolution(simulation, 20000, 0.1);
+    simulation_clear_impulse_response_mode(simulation);
+    simulation->ray.ray_count = 10000;
+    simulation->ray.max_reflections = 100;
+    simulation->ray.listener_radius = 0.5;
+    simulation->ray.seed = 0;
+    simulation->ray.image_source_order = 2;
+    simulation->ray.thread_count = 0;
+    simulation->ray.shared_histogram_listeners = 64;
+    simulation->ray.scattering = 0.0;
+    simulation->ray.diffuse_rain = 1;
+    simulation->ray.extrapolate_tail = 0;
+    simulation->ray.batch_size = 1024;
+    simulation->hybrid.crossover_frequency = 1000;
+    simulation->hybrid.ray_gain = 1.0;
+    simulation->hybrid.wave_prepare = simulation_ard_prepare;
+    simulation->hybrid.wave_advance = simulation_ard_advance;
+    simulation->hybrid.wave_finalize = simulation_ard_finalize;
     simulation_set_type(simulation, type);
 }
 
@@ -39,7 +90,11 @@ simulation_construct(simulation_t* simulation, simulation_type_e type)
 void
 simulation_destruct(simulation_t* simulation)
 {
-    (void)simulation;
+    /* The simulation only references meshes, sources and listeners, the
+     * caller owns them */
+    vector_clear_free(&simulation->audio_listeners);
+    vector_clear_free(&simulation->audio_sources);
+    vector_clear_free(&simulation->meshes);
 }
 
 /* ------------------------------------------------------------------------- */
@@ -59,6 +114,12 @@ simulation_set_type(simulation_t* simulation, enum simulation_type_e type)
             simulation->advance  = simulation_ray_advance;
             simulation->finalize = simulation_ray_finalize;
             break;
+
+        case WAVESIM_HYBRID:
+            simulation->prepare  = simulation_hybrid_prepare;
+            simulation->advance  = simulation_hybrid_advance;
+            simulation->finalize = simulation_hybrid_finalize;
+            break;
     }
 }
 
@@ -68,4 +129,226 @@ simulation_set_resolution(simulation_t* simulation, wsreal_t max_frequency, wsre
 {
     simulation->max_frequency = max_frequency;
     simulation->cell_tolerance = cell_tolerance;
+    simulation->time_step = 1.0 / (2.0 * max_frequency);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+simulation_set_impulse_response_mode(simulation_t* simulation,
+                                     wsreal_t decay_threshold,
+                                     wsreal_t max_duration)
+{
+    assert(decay_threshold < 0.0);
+    simulation->ir_mode.decay_threshold = decay_threshold;
+    simulation->ir_mode.window = 0.01; /* 10ms is short enough to not overshoot
+                                        * much, long enough to not be fooled by
+                                        * a single quiet sample */
+    simulation->ir_mode.max_duration = max_duration;
+    simulation->ir_mode.enabled = 1;
+}
+
+/* ------------------------------------------------------------------------- */
+void
+simulation_clear_impulse_response_mode(simulation_t* simulation)
+{
+    simulation->ir_mode.decay_threshold = -60.0;
+    simulation->ir_mode.window = 0.01;
+    simulation->ir_mode.max_duration = INFINITY;
+    simulation->ir_mode.enabled = 0;
+}
+
+/* ------------------------------------------------------------------------- */
+void
+simulation_set_advance_callback(simulation_t* simulation, simulation_advance_cb_func callback)
+{
+    simulation->on_advance = callback;
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+simulation_add_mesh(simulation_t* simulation, mesh_t* mesh)
+{
+    if (vector_push(&simulation->meshes, &mesh) == VECTOR_ERROR)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+simulation_add_audio_source(simulation_t* simulation, audio_source_t* as)
+{
+    if (vector_push(&simulation->audio_sources, &as) == VECTOR_ERROR)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+simulation_add_audio_listener(simulation_t* simulation, audio_listener_t* al)
+{
+    if (vector_push(&simulation->audio_listeners, &al) == VECTOR_ERROR)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Accumulates any new samples the listener received into the monitor and,
+ * once enough new samples have arrived, estimates the decay.
+ *
+ * The Schroeder decay curve at the current time is the energy that is still
+ * to come relative to the total energy of the impulse response. The energy
+ * still to come is extrapolated from the trailing window: Comparing the
+ * energy of its two halves gives the decay ratio per half-window, and assuming
+ * the decay continues exponentially, the remaining energy is the sum of the
+ * resulting geometric series. Once the remaining energy falls below the
+ * threshold (plus some headroom, see IR_MODE_HEADROOM_DB), the listener is
+ * considered to have decayed.
+ *
+ * To keep this cheap, the estimate is only refreshed every half window.
+ */
+static void
+update_decay_monitor(decay_monitor_t* monitor,
+                     const audio_listener_t* al,
+                     const simulation_ir_mode_t* ir_mode)
+{
+    uintptr_t i, half_window, count;
+    wsreal_t older_energy, newer_energy, ratio, remaining;
+    const wsreal_t* samples = (const wsreal_t*)al->samples.data;
+
+    count = vector_count(&al->samples);
+    for (i = monitor->samples_seen; i < count; ++i)
+        monitor->energy_total += samples[i] * samples[i];
+    monitor->samples_seen = count;
+
+    half_window = (uintptr_t)(ir_mode->window * al->fs * 0.5 + 0.5);
+    if (half_window == 0)
+        half_window = 1;
+    if (count < monitor->next_check || count < half_window * 2)
+        return;
+    monitor->next_check = count + half_window;
+
+    older_energy = 0.0;
+    newer_energy = 0.0;
+    for (i = count - half_window * 2; i != count - half_window; ++i)
+        older_energy += samples[i] * samples[i];
+    for (; i != count; ++i)
+        newer_energy += samples[i] * samples[i];
+
+    /* Nothing arrived yet or the energy isn't decaying (yet) */
+    monitor->decayed = 0;
+    if (older_energy <= 0.0 || newer_energy >= older_energy)
+        return;
+
+    ratio = newer_energy / older_energy;
+    remaining = newer_energy * ratio / (1.0 - ratio);
+    monitor->decayed = (remaining <= (monitor->energy_total + remaining) *
+                        pow(10.0, (ir_mode->decay_threshold - IR_MODE_HEADROOM_DB) / 10.0));
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+simulation_prepare(simulation_t* simulation)
+{
+    return simulation->prepare(simulation);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+simulation_finalize(simulation_t* simulation)
+{
+    simulation->finalize(simulation);
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+simulation_run(simulation_t* simulation)
+{
+    int status;
+    decay_monitor_t* monitors = NULL;
+    uintptr_t listener_count = simulation_audio_listener_count(simulation);
+
+    VECTOR_FOR_EACH(&simulation->audio_sources, audio_source_t*, as)
+        audio_source_reset(*as);
+    VECTOR_END_EACH
+    VECTOR_FOR_EACH(&simulation->audio_listeners, audio_listener_t*, al)
+        audio_listener_reset(*al);
+    VECTOR_END_EACH
+
+    if (simulation->ir_mode.enabled && listener_count > 0)
+    {
+        uintptr_t i;
+        monitors = MALLOC(sizeof(decay_monitor_t) * listener_count);
+        if (monitors == NULL)
+            WSRET(WS_ERR_OUT_OF_MEMORY);
+        for (i = 0; i != listener_count; ++i)
+        {
+            monitors[i].samples_seen = 0;
+            monitors[i].next_check = 0;
+            monitors[i].energy_total = 0.0;
+            monitors[i].decayed = 0;
+        }
+    }
+
+    simulation->time = 0.0;
+    while ((status = simulation->advance(simulation, simulation->time_step)) == 1)
+    {
+        simulation->time += simulation->time_step;
+        if (simulation->on_advance != NULL)
+            simulation->on_advance(simulation, simulation->time);
+
+        if (monitors != NULL)
+        {
+            uintptr_t i;
+            int all_decayed = 1;
+            for (i = 0; i != listener_count; ++i)
+            {
+                update_decay_monitor(&monitors[i],
+                                     simulation_get_audio_listener(simulation, i),
+                                     &simulation->ir_mode);
+                all_decayed &= monitors[i].decayed;
+            }
+
+            if (all_decayed)
+            {
+                log_info(&g_ws_log, "All listeners decayed below %.1f dB after %f seconds",
+                         simulation->ir_mode.decay_threshold, simulation->time);
+                break;
+            }
+        }
+
+        if (simulation->ir_mode.enabled && simulation->time >= simulation->ir_mode.max_duration)
+        {
+            log_info(&g_ws_log, "[WARNING] Impulse response run reached its maximum duration of %f seconds before all listeners decayed",
+                     simulation->ir_mode.max_duration);
+            break;
+        }
+    }
+
+    if (monitors != NULL)
+    {
+        /* Discard everything past the decay threshold to keep the IRs compact */
+        VECTOR_FOR_EACH(&simulation->audio_listeners, audio_listener_t*, al)
+            audio_listener_trim_to_decay(*al, simulation->ir_mode.decay_threshold);
+        VECTOR_END_EACH
+        FREE(monitors);
+    }
+
+    if (status == -1)
+        WSRET(WS_ERR_SIM_ADVANCE_FAILED);
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+simulation_execute(simulation_t* simulation)
+{
+    wsret result;
+
+    if ((result = simulation_prepare(simulation)) != WS_OK)
+        return result;
+
+    result = simulation_run(simulation);
+    simulation_finalize(simulation);
+    return result;
 }
@@ -0,0 +1,206 @@
+#include "wavesim/memory.h"
+#include "wavesim/random.h"
+#include "wavesim/simulation/audio_listener.h"
+#include "wavesim/simulation/biquad.h"
+#include "wavesim/simulation/simulation.h"
+#include "wavesim/simulation/simulation_hybrid.h"
+#include "wavesim/simulation/simulation_ray.h"
+#include <math.h>
+#include <stddef.h>
+
+/* Q of a Butterworth section. Two in series are a Linkwitz-Riley filter */
+#define BUTTERWORTH_Q 0.70710678118654752440
+
+typedef struct crossover_t
+{
+    biquad_t lowpass[2];
+    biquad_t highpass[2];
+    random_t rng;             /* Signs of the noise rendering the rays */
+    uintptr_t processed;      /* Samples of the listener that were filtered */
+    char has_high_band;       /* 0 if the crossover is above Nyquist */
+} crossover_t;
+
+typedef struct simulation_state_t
+{
+    simulation_state_t* wave_state;
+    simulation_state_t* ray_state;
+    vector_t crossovers;      /* crossover_t, one per listener */
+    wsreal_t ray_end_time;    /* Duration of the longest histogram */
+    char wave_running;
+} simulation_state_t;
+
+/* ------------------------------------------------------------------------- */
+wsret
+simulation_hybrid_prepare(simulation_t* simulation)
+{
+    wsret result;
+    simulation_state_t* state = MALLOC(sizeof *state);
+    if (state == NULL)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+
+    if (simulation->max_frequency < simulation->hybrid.crossover_frequency)
+        log_info(&g_ws_log, "[WARNING] Hybrid simulation: max_frequency (%f Hz) is below the crossover frequency (%f Hz)",
+                 simulation->max_frequency, simulation->hybrid.crossover_frequency);
+
+    simulation->state = NULL;
+    if ((result = simulation->hybrid.wave_prepare(simulation)) != WS_OK)
+        goto wave_prepare_failed;
+    state->wave_state = simulation->state;
+
+    simulation->state = NULL;
+    if ((result = simulation_ray_prepare(simulation)) != WS_OK)
+        goto ray_prepare_failed;
+    state->ray_state = simulation->state;
+
+    vector_construct(&state->crossovers, sizeof(crossover_t));
+    state->ray_end_time = 0.0;
+    state->wave_running = 0;
+    simulation->state = state;
+    WSRET(WS_OK);
+
+    ray_prepare_failed:
+    simulation->state = state->wave_state;
+    simulation->hybrid.wave_finalize(simulation);
+    wave_prepare_failed:
+    simulation->state = NULL;
+    FREE(state);
+    return result;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Traces the rays and resets the filters at the start of a run.
+ */
+static wsret
+start_run(simulation_t* simulation)
+{
+    wsret result;
+    uintptr_t i;
+    simulation_state_t* state = simulation->state;
+
+    simulation->state = state->ray_state;
+    result = simulation_ray_trace(simulation);
+    simulation->state = state;
+    if (result != WS_OK)
+        return result;
+
+    vector_clear(&state->crossovers);
+    state->ray_end_time = 0.0;
+    for (i = 0; i != simulation_audio_listener_count(simulation); ++i)
+    {
+        wsreal_t duration;
+        audio_listener_t* al = simulation_get_audio_listener(simulation, i);
+        crossover_t* crossover = vector_emplace(&state->crossovers);
+        if (crossover == NULL)
+            WSRET(WS_ERR_OUT_OF_MEMORY);
+
+        biquad_set_lowpass(&crossover->lowpass[0], simulation->hybrid.crossover_frequency, al->fs, BUTTERWORTH_Q);
+        biquad_set_lowpass(&crossover->lowpass[1], simulation->hybrid.crossover_frequency, al->fs, BUTTERWORTH_Q);
+        biquad_set_highpass(&crossover->highpass[0], simulation->hybrid.crossover_frequency, al->fs, BUTTERWORTH_Q);
+        biquad_set_highpass(&crossover->highpass[1], simulation->hybrid.crossover_frequency, al->fs, BUTTERWORTH_Q);
+        random_seed(&crossover->rng, simulation->ray.seed + i);
+        crossover->processed = vector_count(&al->samples);
+        crossover->has_high_band = simulation->hybrid.crossover_frequency < al->fs * 0.5;
+
+        duration = (wsreal_t)vector_count(&al->energy) * al->energy_bin_width;
+        if (state->ray_end_time < duration)
+            state->ray_end_time = duration;
+    }
+
+    state->wave_running = 1;
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Low-passes the samples written by the wave backend since the last call and
+ * adds the high-passed ray traced band to them.
+ */
+static void
+apply_crossover(simulation_t* simulation, audio_listener_t* al, crossover_t* crossover)
+{
+    uintptr_t n;
+    wsreal_t* samples = (wsreal_t*)al->samples.data;
+    const wsreal_t* bins = (const wsreal_t*)al->energy.data;
+    uintptr_t bin_count = vector_count(&al->energy);
+
+    for (n = crossover->processed; n != vector_count(&al->samples); ++n)
+    {
+        wsreal_t low = biquad_process(&crossover->lowpass[1],
+                       biquad_process(&crossover->lowpass[0], samples[n]));
+
+        if (crossover->has_high_band)
+        {
+            /* White noise whose energy per sample follows the histogram */
+            wsreal_t noise = 0.0;
+            uintptr_t bin = (uintptr_t)((wsreal_t)n / al->fs / al->energy_bin_width);
+            if (bin < bin_count)
+                noise = sqrt(bins[bin] / (al->energy_bin_width * al->fs));
+            if (random_next(&crossover->rng) & 1)
+                noise = -noise;
+
+            low += simulation->hybrid.ray_gain *
+                   biquad_process(&crossover->highpass[1],
+                   biquad_process(&crossover->highpass[0], noise));
+        }
+
+        samples[n] = low;
+    }
+
+    crossover->processed = n;
+}
+
+/* ------------------------------------------------------------------------- */
+int
+simulation_hybrid_advance(simulation_t* simulation, wsreal_t dt)
+{
+    uintptr_t i;
+    simulation_state_t* state = simulation->state;
+
+    /* Listeners are reset at the start of every run */
+    if (simulation->time == 0.0 && start_run(simulation) != WS_OK)
+    {
+        log_info(&g_ws_log, "[SIM] Hybrid simulation failed to start");
+        return -1;
+    }
+
+    if (state->wave_running)
+    {
+        int status;
+        simulation->state = state->wave_state;
+        status = simulation->hybrid.wave_advance(simulation, dt);
+        simulation->state = state;
+        if (status < 0)
+            return -1;
+        state->wave_running = (status == 1);
+    }
+
+    for (i = 0; i != simulation_audio_listener_count(simulation); ++i)
+    {
+        audio_listener_t* al = simulation_get_audio_listener(simulation, i);
+        crossover_t* crossover = vector_get(&state->crossovers, i);
+
+        /* The rays can outlast the wave backend, keep the listener going */
+        if (al->t < simulation->time + dt * 0.5 && audio_listener_add_sample(al, dt, 0.0) != WS_OK)
+            return -1;
+        apply_crossover(simulation, al, crossover);
+    }
+
+    return state->wave_running || simulation->time + dt < state->ray_end_time ? 1 : 0;
+}
+
+/* ------------------------------------------------------------------------- */
+void
+simulation_hybrid_finalize(simulation_t* simulation)
+{
+    simulation_state_t* state = simulation->state;
+
+    simulation->state = state->ray_state;
+    simulation_ray_finalize(simulation);
+    simulation->state = state->wave_state;
+    simulation->hybrid.wave_finalize(simulation);
+
+    vector_clear_free(&state->crossovers);
+    FREE(state);
+    simulation->state = NULL;
+}
@@ -1,30 +1,1346 @@
+#include "wavesim/atomic.h"
+#include "wavesim/clock.h"
+#include "wavesim/memory.h"
+#include "wavesim/random.h"
+#include "wavesim/thread.h"
+#include "wavesim/mesh/bvh.h"
+#include "wavesim/mesh/face.h"
+#include "wavesim/mesh/intersections.h"
+#include "wavesim/mesh/mesh.h"
+#include "wavesim/simulation/audio_listener.h"
+#include "wavesim/simulation/audio_source.h"
+#include "wavesim/simulation/image_source.h"
+#include "wavesim/simulation/simulation.h"
 #include "wavesim/simulation/simulation_ray.h"
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+#define PI 3.14159265358979323846
+
+/* Upper limit of threads tracing rays */
+#define RAY_MAX_THREADS 64
+
+/* Octave bands carried by every ray */
+#define RAY_BANDS ATTRIBUTE_BAND_COUNT
+
+/*
+ * Every audio source emits ray_count rays in uniformly random directions, each
+ * carrying an equal share of one unit of energy in every octave band. When a
+ * ray hits a surface, the surface's reflection, transmission and absorption
+ * fractions (from the attributes of the mesh, interpolated across the face)
+ * averaged over the bands are used as probabilities to decide whether the ray
+ * is specularly reflected, continues through the surface or is terminated
+ * (Russian roulette). The energy of each band is then scaled by the band's
+ * own fraction divided by the probability of the event, which keeps every
+ * band unbiased while a single path is traced for all of them. Surfaces
+ * without frequency dependence never scale the energy. The bands are a fixed
+ * size array processed by simple loops the compiler can vectorize.
+ *
+ * Listeners are spheres. Whenever a ray segment crosses a listener, the
+ * energy times the length of the chord divided by the volume of the sphere is
+ * added to the listener's band histograms, at the time the ray passes the
+ * center of the chord. This estimates the energy flowing through the listener
+ * per unit area; the direct sound at distance r comes out as 1/(4 pi r^2).
+ * The broadband histogram is the mean of the bands.
+ *
+ * Specular paths of low order are computed exactly with image sources
+ * instead (see image_source.h). Rays only contribute once they have been
+ * transmitted or reflected more often than ray.image_source_order, so no
+ * path is counted twice. The image source trees are kept for as long as the
+ * sources don't move, so runs that only move the listeners (e.g. baking) only
+ * validate the paths.
+ *
+ * Every mesh gets its own BVH (a BLAS), and a top-level BVH over them is
+ * what rays are traced against (see bvh_scene_t). Moving a mesh with
+ * simulation_ray_set_mesh_transform() or deforming it in place with
+ * simulation_ray_update_mesh() only refits, nothing is rebuilt.
+ *
+ * Rays are traced in parallel. The rays of every audio source are split into
+ * packets, and thread i traces packets i, i + threads, i + 2 * threads, ...,
+ * each packet seeded from its index, so the result does not depend on the
+ * scheduling. Threads accumulate energy into private histograms, which are
+ * summed pairwise (a tree reduction) into the listeners once all rays of the
+ * source have been traced. Private histograms cost memory per thread and
+ * listener, so with more than ray.shared_histogram_listeners listeners,
+ * threads instead add to the listeners' histograms directly with atomic
+ * compare-and-swap. The shared histograms are sized up front to cover
+ * ir_mode.max_duration, or without a time limit the longest histogram
+ * traced so far. Bins beyond that can't be added atomically, these are
+ * collected per thread and added afterwards.
+ *
+ * Surfaces scatter a fraction ray.scattering of the reflected energy
+ * diffusely. With diffuse rain, every hit sends the expected scattered energy
+ * straight to all listeners that can see it, and the segment after a diffuse
+ * reflection is not recorded. Finally, the late part of each histogram can be
+ * replaced by a fitted exponential decay (ray.extrapolate_tail).
+ *
+ * Rays are traced in batches. Every ray carries one unit of energy into
+ * histograms owned by the backend, which accumulate across batches and calls
+ * for as long as the sources, listeners and settings stay the same; the
+ * listeners receive the accumulated energy divided by the number of rays
+ * traced so far. Ray i of a source is always seeded the same way, so tracing
+ * N rays in one batch or in many gives the same result.
+ * simulation_ray_refine() traces batches until a wall clock budget runs out,
+ * and reports how much the last batch changed each listener's histogram.
+ *
+ * All rays are traced at the start of a run. advance() then plays back the
+ * histograms as samples, where the square of each sample is the energy
+ * received during that time step, so that energy based analyses (decay
+ * monitoring, filter lattice analysis) work the same as for pressure-based
+ * backends.
+ */
+
+/* Rays traced for one listener */
+typedef struct ray_histogram_t
+{
+    vector_t accumulated;     /* wsreal_t, energy of all rays traced so far,
+                               * RAY_BANDS per bin */
+    vector_t batch;           /* wsreal_t, energy of the batch being traced */
+    wsreal_t convergence;     /* Relative change caused by the last batch */
+    wsreal_t bin_width;       /* The listener's energy_bin_width when traced */
+} ray_histogram_t;
+
+typedef struct simulation_state_t
+{
+    vector_t faces;           /* face_t, all faces of all meshes */
+    bvh_t* blases;            /* One per mesh, in object space */
+    uintptr_t mesh_count;
+    bvh_scene_t scene;        /* Instances of the BLASes, one per mesh. Triangle
+                               * indices are face indices */
+    vector_t image_trees;     /* image_source_tree_t, one per audio source */
+    vector_t paths;           /* image_source_path_t, scratch space */
+    wsreal_t speed_of_sound;
+    wsreal_t end_time;        /* Duration of the longest histogram */
+    vector_t histograms;      /* ray_histogram_t, one per listener */
+    uintptr_t rays_traced;    /* Per audio source, accumulated in histograms */
+    uintptr_t overflow_count; /* Energy events of the last batch that missed
+                               * the shared histograms */
+    /* What the histograms were traced for. Changing any of it starts over */
+    vector_t positions;       /* vec3_t, all sources followed by all listeners */
+    simulation_ray_settings_t traced_settings;
+    wsreal_t traced_max_time;
+} simulation_state_t;
+
+typedef struct ray_t
+{
+    vec3_t origin;
+    vec3_t direction;         /* Normalized */
+    wsreal_t time;            /* At the origin */
+    wsreal_t energy[RAY_BANDS];
+    int specular_order;       /* Reflections so far, -1 once transmitted or
+                               * scattered */
+    char after_diffuse;       /* The ray was just scattered. Its energy reaching
+                               * a listener directly was already rained onto it */
+    uint32_t last_face;       /* Face the ray is leaving, BVH_NO_TRIANGLE if none */
+} ray_t;
+
+typedef struct ray_batch_t ray_batch_t;
+
+typedef struct energy_event_t
+{
+    uintptr_t listener;
+    uintptr_t bin;
+    wsreal_t energy[RAY_BANDS];
+} energy_event_t;
+
+/* One per thread, kept for all audio sources */
+typedef struct ray_worker_t
+{
+    ray_batch_t* batch;
+    uintptr_t index;
+    random_t rng;
+    vector_t histograms;      /* vector_t of wsreal_t, one per listener,
+                               * RAY_BANDS per bin */
+    vector_t overflow;        /* energy_event_t, bins that were out of range
+                               * of the shared histograms */
+    wsret result;
+} ray_worker_t;
+
+/* The rays of one audio source, shared by all threads */
+struct ray_batch_t
+{
+    simulation_t* simulation;
+    const audio_source_t* source;
+    uintptr_t source_index;
+    uintptr_t ray_begin;      /* Rays of each source traced in this batch */
+    uintptr_t ray_end;
+    uintptr_t first_packet;   /* Packet containing ray_begin */
+    uintptr_t packet_count;
+    wsreal_t max_time;
+    ray_worker_t* workers;
+    uintptr_t worker_count;
+    wsreal_t** shared_bins;   /* Listener histograms, NULL if threads have
+                               * private histograms */
+    uintptr_t* shared_bin_count; /* Bins, not wsreal_ts */
+};
+
+/* Range of listeners whose histograms one thread reduces */
+typedef struct reduce_job_t
+{
+    ray_batch_t* batch;
+    uintptr_t begin;
+    uintptr_t end;
+    wsret result;
+} reduce_job_t;
 
 /* ------------------------------------------------------------------------- */
 wsret
 simulation_ray_prepare(simulation_t* simulation)
 {
-    (void)simulation;
-    WSRET(WS_ERR_NOT_IMPLEMENTED); /* WSRET(WS_OK) */
+    wsret result;
+    uintptr_t i;
+    simulation_state_t* state = MALLOC(sizeof *state);
+    if (state == NULL)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+
+    state->mesh_count = vector_count(&simulation->meshes);
+    state->blases = MALLOC(sizeof(bvh_t) * (state->mesh_count + 1));
+    if (state->blases == NULL)
+    {
+        FREE(state);
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+    }
+    for (i = 0; i != state->mesh_count; ++i)
+        bvh_construct(&state->blases[i]);
+    bvh_scene_construct(&state->scene);
+    vector_construct(&state->faces, sizeof(face_t));
+    vector_construct(&state->image_trees, sizeof(image_source_tree_t));
+    vector_construct(&state->paths, sizeof(image_source_path_t));
+    state->speed_of_sound = attribute_default_air().sound_velocity;
+    state->end_time = 0.0;
+    vector_construct(&state->histograms, sizeof(ray_histogram_t));
+    vector_construct(&state->positions, sizeof(vec3_t));
+    state->rays_traced = 0;
+    state->overflow_count = 0;
+
+    /* Flatten all meshes into one list of faces, and give every mesh its own
+     * BLAS so it can be moved or deformed on its own */
+    for (i = 0; i != state->mesh_count; ++i)
+    {
+        uintptr_t f;
+        const mesh_t* mesh = simulation_get_mesh(simulation, i);
+        uint32_t first_face = (uint32_t)vector_count(&state->faces);
+        for (f = 0; f != mesh_face_count(mesh); ++f)
+        {
+            face_t* face = vector_emplace(&state->faces);
+            if (face == NULL)
+            {
+                result = WS_ERR_OUT_OF_MEMORY;
+                goto build_failed;
+            }
+            mesh_get_face(face, mesh, f);
+        }
+
+        if ((result = bvh_build_from_mesh(&state->blases[i], mesh)) != WS_OK)
+            goto build_failed;
+        if ((result = bvh_scene_add_instance(&state->scene, &state->blases[i], first_face)) != WS_OK)
+            goto build_failed;
+    }
+    if ((result = bvh_scene_build(&state->scene)) != WS_OK)
+        goto build_failed;
+
+    simulation->state = state;
+    WSRET(WS_OK);
+
+    build_failed:
+    vector_clear_free(&state->image_trees);
+    vector_clear_free(&state->paths);
+    vector_clear_free(&state->faces);
+    bvh_scene_destruct(&state->scene);
+    for (i = 0; i != state->mesh_count; ++i)
+        bvh_destruct(&state->blases[i]);
+    FREE(state->blases);
+    FREE(state);
+    return result;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Copies the faces of a mesh into the flattened list again, transformed into
+ * world space, and discards everything that depended on the old geometry.
+ */
+static void
+update_mesh_faces(simulation_t* simulation, uintptr_t mesh_index)
+{
+    uintptr_t f;
+    simulation_state_t* state = simulation->state;
+    const mesh_t* mesh = simulation_get_mesh(simulation, mesh_index);
+    const bvh_instance_t* instance = vector_get(&state->scene.instances, mesh_index);
+    const wsreal_t* m = instance->transform;
+
+    for (f = 0; f != mesh_face_count(mesh); ++f)
+    {
+        int v;
+        face_t* face = vector_get(&state->faces, instance->first_triangle + f);
+        mesh_get_face(face, mesh, f);
+        for (v = 0; v != 3; ++v)
+        {
+            vec3_t p = face->vertices[v].position;
+            int i;
+            for (i = 0; i != 3; ++i)
+                face->vertices[v].position.xyz[i] = m[i*4]*p.xyz[0] + m[i*4+1]*p.xyz[1] + m[i*4+2]*p.xyz[2] + m[i*4+3];
+        }
+    }
+
+    /* Image sources are mirrored at the faces, and the accumulated rays saw
+     * the old geometry */
+    VECTOR_FOR_EACH(&state->image_trees, image_source_tree_t, tree)
+        image_source_tree_destruct(tree);
+    VECTOR_END_EACH
+    vector_clear(&state->image_trees);
+    state->rays_traced = 0;
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+simulation_ray_update_mesh(simulation_t* simulation, uintptr_t mesh_index)
+{
+    wsret result;
+    simulation_state_t* state = simulation->state;
+
+    if ((result = bvh_refit_from_mesh(&state->blases[mesh_index],
+                                      simulation_get_mesh(simulation, mesh_index))) != WS_OK)
+        return result;
+    bvh_scene_refit(&state->scene);
+    update_mesh_faces(simulation, mesh_index);
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+simulation_ray_set_mesh_transform(simulation_t* simulation, uintptr_t mesh_index, const wsreal_t transform[12])
+{
+    simulation_state_t* state = simulation->state;
+    bvh_scene_set_transform(&state->scene, mesh_index, transform);
+    bvh_scene_refit(&state->scene);
+    update_mesh_faces(simulation, mesh_index);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Adds v to *target atomically. wsreal_t has the size of a pointer, this is
+ * checked before shared histograms are used.
+ */
+static void
+atomic_add_real(wsreal_t* target, wsreal_t value)
+{
+    volatile uintptr_t* bits = (volatile uintptr_t*)target;
+    uintptr_t expected, desired;
+    wsreal_t sum;
+    do
+    {
+        expected = ws_atomic_load_uptr(bits);
+        memcpy(&sum, &expected, sizeof sum);
+        sum += value;
+        memcpy(&desired, &sum, sizeof sum);
+    } while (!ws_atomic_cas_uptr(bits, expected, desired));
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Appends zeros until the histogram holds at least count wsreal_ts.
+ */
+static wsret
+histogram_grow(vector_t* histogram, uintptr_t count)
+{
+    while (vector_count(histogram) < count)
+    {
+        wsreal_t* e = vector_emplace(histogram);
+        if (e == NULL)
+            WSRET(WS_ERR_OUT_OF_MEMORY);
+        *e = 0.0;
+    }
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+static wsret
+histogram_add(vector_t* histogram, uintptr_t first_bin, const wsreal_t* bins, uintptr_t count)
+{
+    uintptr_t i;
+    wsreal_t* dst;
+    wsret result;
+
+    if ((result = histogram_grow(histogram, first_bin + count)) != WS_OK)
+        return result;
+
+    dst = (wsreal_t*)histogram->data + first_bin;
+    for (i = 0; i != count; ++i)
+        dst[i] += bins[i];
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+static wsret
+record_energy(ray_worker_t* worker, uintptr_t listener, uintptr_t bin, const wsreal_t energy[RAY_BANDS])
+{
+    int band;
+    ray_batch_t* batch = worker->batch;
+    if (batch->shared_bins != NULL)
+    {
+        energy_event_t* event;
+        if (bin < batch->shared_bin_count[listener])
+        {
+            for (band = 0; band != RAY_BANDS; ++band)
+                atomic_add_real(&batch->shared_bins[listener][bin * RAY_BANDS + (uintptr_t)band], energy[band]);
+            WSRET(WS_OK);
+        }
+
+        if ((event = vector_emplace(&worker->overflow)) == NULL)
+            WSRET(WS_ERR_OUT_OF_MEMORY);
+        event->listener = listener;
+        event->bin = bin;
+        for (band = 0; band != RAY_BANDS; ++band)
+            event->energy[band] = energy[band];
+    }
+    else
+    {
+        wsreal_t* bins;
+        vector_t* histogram = vector_get(&worker->histograms, listener);
+        while (vector_count(histogram) < (bin + 1) * RAY_BANDS)
+        {
+            wsreal_t* e = vector_emplace(histogram);
+            if (e == NULL)
+                WSRET(WS_ERR_OUT_OF_MEMORY);
+            *e = 0.0;
+        }
+        bins = (wsreal_t*)histogram->data + bin * RAY_BANDS;
+        for (band = 0; band != RAY_BANDS; ++band)
+            bins[band] += energy[band];
+    }
+
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+static wsret
+record_segment(ray_worker_t* worker, const ray_t* ray, wsreal_t length)
+{
+    wsret result;
+    uintptr_t i;
+    simulation_t* simulation = worker->batch->simulation;
+    simulation_state_t* state = simulation->state;
+    wsreal_t r = simulation->ray.listener_radius;
+    wsreal_t volume = 4.0 / 3.0 * PI * r * r * r;
+
+    /* Covered by the image sources or diffuse rain */
+    if (ray->specular_order >= 0 && ray->specular_order <= simulation->ray.image_source_order)
+        WSRET(WS_OK);
+    if (ray->after_diffuse)
+        WSRET(WS_OK);
+
+    for (i = 0; i != vector_count(&simulation->audio_listeners); ++i)
+    {
+        vec3_t to_center;
+        int band;
+        wsreal_t along, distance_sq, half_chord, enter, leave, time, energy[RAY_BANDS];
+        const audio_listener_t* al = *(audio_listener_t**)vector_get(&simulation->audio_listeners, i);
+
+        vec3_copy(&to_center, al->position.xyz);
+        vec3_sub_vec3(to_center.xyz, ray->origin.xyz);
+        along = vec3_dot(to_center.xyz, ray->direction.xyz);
+        distance_sq = vec3_length_squared(to_center.xyz) - along * along;
+        if (distance_sq >= r * r)
+            continue;
+
+        half_chord = sqrt(r * r - distance_sq);
+        enter = along - half_chord;
+        leave = along + half_chord;
+        if (enter < 0.0)    enter = 0.0;
+        if (leave > length) leave = length;
+        if (leave <= enter)
+            continue;
+
+        time = ray->time + (enter + leave) * 0.5 / state->speed_of_sound;
+        if (time >= worker->batch->max_time)
+            continue;
+        for (band = 0; band != RAY_BANDS; ++band)
+            energy[band] = ray->energy[band] * (leave - enter) / volume;
+        if ((result = record_energy(worker, i, (uintptr_t)(time / al->energy_bin_width), energy)) != WS_OK)
+            return result;
+    }
+
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Diffuse rain: the share of the ray's energy that is scattered at the point
+ * of intersection reaches every listener that can see the point, weighted by
+ * Lambert's cosine law. This replaces waiting for a scattered ray to happen to
+ * cross a listener, which is what makes naive late reverberation so noisy.
+ */
+static wsret
+rain_to_listeners(ray_worker_t* worker, const ray_t* ray, const vec3_t* normal, const wsreal_t energy[RAY_BANDS])
+{
+    wsret result;
+    uintptr_t i;
+    simulation_t* simulation = worker->batch->simulation;
+    simulation_state_t* state = simulation->state;
+    wsreal_t r = simulation->ray.listener_radius;
+
+    for (i = 0; i != vector_count(&simulation->audio_listeners); ++i)
+    {
+        vec3_t to_listener;
+        int band;
+        wsreal_t distance_sq, distance, cos_theta, time, received[RAY_BANDS];
+        const audio_listener_t* al = *(audio_listener_t**)vector_get(&simulation->audio_listeners, i);
+
+        vec3_copy(&to_listener, al->position.xyz);
+        vec3_sub_vec3(to_listener.xyz, ray->origin.xyz);
+        distance_sq = vec3_length_squared(to_listener.xyz);
+        distance = sqrt(distance_sq);
+        if (distance == 0.0)
+            continue;
+        cos_theta = vec3_dot(normal->xyz, to_listener.xyz) / distance;
+        if (cos_theta <= 0.0)
+            continue;
+
+        time = ray->time + distance / state->speed_of_sound;
+        if (time >= worker->batch->max_time)
+            continue;
+        if (bvh_scene_ray_any_hit(&state->scene, ray->origin.xyz, to_listener.xyz, 1.0 - 1e-6, ray->last_face))
+            continue;
+
+        /* Listeners are spheres, don't let the flux blow up inside of them */
+        if (distance_sq < r * r)
+            distance_sq = r * r;
+        for (band = 0; band != RAY_BANDS; ++band)
+            received[band] = energy[band] * cos_theta / (PI * distance_sq);
+        if ((result = record_energy(worker, i, (uintptr_t)(time / al->energy_bin_width), received)) != WS_OK)
+            return result;
+    }
+
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Processes the hit of a single ray. Returns 1 if the ray continues, 0 if it
+ * was absorbed or left the time window, and a negative error otherwise.
+ */
+static int
+scatter_ray(ray_worker_t* worker, ray_t* ray, const bvh_hit_t* hit)
+{
+    attribute_t attr;
+    vec3_t normal;
+    int band;
+    wsreal_t weights[3], u, reflection, transmission;
+    wsreal_t band_reflection[RAY_BANDS];
+    const face_t* face;
+    simulation_t* simulation = worker->batch->simulation;
+    simulation_state_t* state = simulation->state;
+    wsreal_t scattering = simulation->ray.scattering;
+
+    if (record_segment(worker, ray, hit->distance) != WS_OK)
+        return -1;
+
+    /* Move to the point of intersection */
+    ray->origin.v.x += ray->direction.v.x * hit->distance;
+    ray->origin.v.y += ray->direction.v.y * hit->distance;
+    ray->origin.v.z += ray->direction.v.z * hit->distance;
+    ray->time += hit->distance / state->speed_of_sound;
+    ray->last_face = hit->triangle;
+    face = (const face_t*)vector_get(&state->faces, hit->triangle);
+    if (ray->time >= worker->batch->max_time)
+        return 0;
+
+    /* bary holds the weights of v1, v2, v0 */
+    weights[0] = hit->bary[2];
+    weights[1] = hit->bary[0];
+    weights[2] = hit->bary[1];
+    face_interpolate_attributes_barycentric(face, &attr, weights);
+
+    /* Probabilities of the events, averaged over the bands */
+    reflection = 0.0;
+    transmission = 0.0;
+    for (band = 0; band != RAY_BANDS; ++band)
+    {
+        band_reflection[band] = attribute_band_reflection(&attr, band);
+        reflection += band_reflection[band];
+        transmission += attr.band_transmission[band];
+    }
+    reflection /= RAY_BANDS;
+    transmission /= RAY_BANDS;
+
+    /* Normal on the side the ray came from */
+    vec3_copy(&normal, face->vertices[1].position.xyz);
+    vec3_sub_vec3(normal.xyz, face->vertices[0].position.xyz);
+    {
+        vec3_t e2;
+        vec3_copy(&e2, face->vertices[2].position.xyz);
+        vec3_sub_vec3(e2.xyz, face->vertices[0].position.xyz);
+        vec3_cross(normal.xyz, e2.xyz);
+    }
+    vec3_normalize(normal.xyz);
+    if (vec3_dot(normal.xyz, ray->direction.xyz) > 0.0)
+        vec3_mul_scalar(normal.xyz, -1.0);
+
+    /* The expected scattered energy rains onto the listeners, whether or not
+     * this particular ray is scattered */
+    if (simulation->ray.diffuse_rain && scattering > 0.0 && reflection > 0.0)
+    {
+        wsreal_t rain[RAY_BANDS];
+        for (band = 0; band != RAY_BANDS; ++band)
+            rain[band] = ray->energy[band] * band_reflection[band] * scattering;
+        if (rain_to_listeners(worker, ray, &normal, rain) != WS_OK)
+            return -1;
+    }
+
+    ray->after_diffuse = 0;
+    u = random_uniform(&worker->rng);
+    if (u < reflection)
+    {
+        for (band = 0; band != RAY_BANDS; ++band)
+            ray->energy[band] *= band_reflection[band] / reflection;
+
+        if (scattering > 0.0 && random_uniform(&worker->rng) < scattering)
+        {
+            /* Lambertian: normal plus a uniform point on the unit sphere */
+            vec3_t offset;
+            random_unit_vector(&worker->rng, offset.xyz);
+            vec3_add_vec3(offset.xyz, normal.xyz);
+            if (vec3_length_squared(offset.xyz) < 1e-12)
+                vec3_copy(&offset, normal.xyz);
+            vec3_normalize(offset.xyz);
+            vec3_copy(&ray->direction, offset.xyz);
+            ray->specular_order = -1;
+            ray->after_diffuse = simulation->ray.diffuse_rain;
+        }
+        else
+        {
+            /* d' = d - 2(d.n)n */
+            vec3_t reflected;
+            vec3_copy(&reflected, normal.xyz);
+            vec3_mul_scalar(reflected.xyz, -2.0 * vec3_dot(ray->direction.xyz, normal.xyz));
+            vec3_add_vec3(ray->direction.xyz, reflected.xyz);
+            if (ray->specular_order >= 0)
+                ray->specular_order++;
+        }
+    }
+    else if (u < reflection + transmission)
+    {
+        for (band = 0; band != RAY_BANDS; ++band)
+            ray->energy[band] *= attr.band_transmission[band] / transmission;
+        ray->specular_order = -1;
+    }
+    else
+        return 0; /* absorbed */
+
+    return 1;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Traces up to BVH_PACKET_SIZE rays together. Rays leaving the same source
+ * visit mostly the same nodes, at least for the first few reflections, so the
+ * BVH is traversed once per bounce for the whole packet. Rays that die are
+ * removed from the packet and the remaining ones are traced on.
+ */
+static wsret
+trace_packet(ray_worker_t* worker, ray_t* rays, uintptr_t count)
+{
+    wsret result;
+    uintptr_t i, order;
+    simulation_t* simulation = worker->batch->simulation;
+    simulation_state_t* state = simulation->state;
+
+    for (order = 0; order <= simulation->ray.max_reflections && count > 0; ++order)
+    {
+        bvh_ray_packet_t packet;
+        bvh_hit_t hits[BVH_PACKET_SIZE];
+        char found[BVH_PACKET_SIZE];
+        uintptr_t alive = 0;
+
+        for (i = 0; i != count; ++i)
+        {
+            int axis;
+            for (axis = 0; axis != 3; ++axis)
+            {
+                packet.origin[axis][i] = rays[i].origin.xyz[axis];
+                packet.direction[axis][i] = rays[i].direction.xyz[axis];
+            }
+            packet.max_distance[i] = INFINITY;
+            packet.ignore_triangle[i] = rays[i].last_face;
+        }
+        packet.count = count;
+        bvh_scene_ray_packet_first_hit(&state->scene, &packet, hits, found);
+
+        /* Rays are processed in order so the random sequence, and with it the
+         * result, only depends on the seed and the packet */
+        for (i = 0; i != count; ++i)
+        {
+            int status;
+            if (!found[i])
+            {
+                /* Escaped the scene */
+                if ((result = record_segment(worker, &rays[i], INFINITY)) != WS_OK)
+                    return result;
+                continue;
+            }
+
+            status = scatter_ray(worker, &rays[i], &hits[i]);
+            if (status < 0)
+                WSRET(WS_ERR_OUT_OF_MEMORY);
+            if (status > 0)
+                rays[alive++] = rays[i];
+        }
+        count = alive;
+    }
+
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+static wsret
+add_image_sources(simulation_t* simulation, uintptr_t source_index, wsreal_t max_time)
+{
+    wsret result;
+    image_source_tree_t* tree;
+    simulation_state_t* state = simulation->state;
+    const audio_source_t* as = *(audio_source_t**)vector_get(&simulation->audio_sources, source_index);
+
+    while (vector_count(&state->image_trees) <= source_index)
+    {
+        if ((tree = vector_emplace(&state->image_trees)) == NULL)
+            WSRET(WS_ERR_OUT_OF_MEMORY);
+        image_source_tree_construct(tree);
+    }
+
+    tree = vector_get(&state->image_trees, source_index);
+    if (image_source_tree_is_stale(tree, as->position.xyz, simulation->ray.image_source_order))
+    {
+        if ((result = image_source_tree_build(tree, as->position.xyz,
+                                              (const face_t*)state->faces.data,
+                                              vector_count(&state->faces),
+                                              simulation->ray.image_source_order)) != WS_OK)
+            return result;
+    }
+
+    VECTOR_FOR_EACH(&simulation->audio_listeners, audio_listener_t*, pal)
+        audio_listener_t* al = *pal;
+        vector_clear(&state->paths);
+        if ((result = image_source_tree_find_paths(tree, &state->scene,
+                                                   (const face_t*)state->faces.data,
+                                                   al->position.xyz, &state->paths)) != WS_OK)
+            return result;
+
+        /* Point source, the energy spreads over a sphere */
+        VECTOR_FOR_EACH(&state->paths, image_source_path_t, path)
+            int band;
+            wsreal_t energy[RAY_BANDS];
+            wsreal_t time = path->length / state->speed_of_sound;
+            wsreal_t spread = 1.0 / (4.0 * PI * path->length * path->length);
+            /* Image sources only carry the specular part of each reflection */
+            spread *= pow(1.0 - simulation->ray.scattering, (wsreal_t)path->order);
+            if (time >= max_time || spread <= 0.0)
+                continue;
+            for (band = 0; band != RAY_BANDS; ++band)
+                energy[band] = path->band_reflection[band] * spread;
+            if ((result = audio_listener_add_band_energy(al, time, energy)) != WS_OK)
+                return result;
+        VECTOR_END_EACH
+    VECTOR_END_EACH
+
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+static void*
+trace_main(void* arg)
+{
+    uintptr_t packet, r;
+    int band;
+    ray_worker_t* worker = arg;
+    ray_batch_t* batch = worker->batch;
+    const simulation_ray_settings_t* settings = &batch->simulation->ray;
+
+    worker->result = WS_OK;
+    for (packet = worker->index; packet < batch->packet_count; packet += batch->worker_count)
+    {
+        ray_t rays[BVH_PACKET_SIZE];
+        uintptr_t first_ray = (batch->first_packet + packet) * BVH_PACKET_SIZE;
+        uintptr_t skip = first_ray < batch->ray_begin ? batch->ray_begin - first_ray : 0;
+        uintptr_t count = batch->ray_end - first_ray;
+        if (count > BVH_PACKET_SIZE)
+            count = BVH_PACKET_SIZE;
+
+        /* Rays of a packet that were traced by an earlier batch are still
+         * generated, so the remaining ones get the same directions */
+        random_seed(&worker->rng, settings->seed +
+                    (((uint64_t)batch->source_index << 32) + batch->first_packet + packet) * 0x9E3779B97F4A7C15ULL);
+        for (r = 0; r != count; ++r)
+        {
+            vec3_copy(&rays[r].origin, batch->source->position.xyz);
+            random_unit_vector(&worker->rng, rays[r].direction.xyz);
+            rays[r].time = 0.0;
+            for (band = 0; band != RAY_BANDS; ++band)
+                rays[r].energy[band] = 1.0;
+            rays[r].specular_order = 0;
+            rays[r].after_diffuse = 0;
+            rays[r].last_face = BVH_NO_TRIANGLE;
+        }
+        if ((worker->result = trace_packet(worker, rays + skip, count - skip)) != WS_OK)
+            break;
+    }
+
+    return NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Adds the private histograms of all threads for a range of listeners, by
+ * summing pairs of neighbours, then pairs of pairs and so on. Each level only
+ * touches half as many histograms as the previous one and the order of the
+ * additions doesn't depend on the scheduling.
+ */
+static void*
+reduce_main(void* arg)
+{
+    uintptr_t listener, stride, i;
+    reduce_job_t* job = arg;
+    ray_batch_t* batch = job->batch;
+
+    job->result = WS_OK;
+    for (listener = job->begin; listener != job->end; ++listener)
+    {
+        vector_t* total;
+        ray_histogram_t* histogram = vector_get(&batch->simulation->state->histograms, listener);
+
+        for (stride = 1; stride < batch->worker_count; stride *= 2)
+            for (i = 0; i + stride < batch->worker_count; i += 2 * stride)
+            {
+                vector_t* dst = vector_get(&batch->workers[i].histograms, listener);
+                vector_t* src = vector_get(&batch->workers[i + stride].histograms, listener);
+                uintptr_t bin;
+                while (vector_count(dst) < vector_count(src))
+                {
+                    wsreal_t* e = vector_emplace(dst);
+                    if (e == NULL)
+                    {
+                        job->result = WS_ERR_OUT_OF_MEMORY;
+                        return NULL;
+                    }
+                    *e = 0.0;
+                }
+                for (bin = 0; bin != vector_count(src); ++bin)
+                    ((wsreal_t*)dst->data)[bin] += ((wsreal_t*)src->data)[bin];
+                vector_clear(src);
+            }
+
+        total = vector_get(&batch->workers[0].histograms, listener);
+        if ((job->result = histogram_add(&histogram->batch, 0, (wsreal_t*)total->data, vector_count(total))) != WS_OK)
+            return NULL;
+        vector_clear(total);
+    }
+
+    return NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Number of bins a shared histogram needs. Rays are cut off at max_time, so
+ * with a limit every bin is known in advance. Without one, the longest
+ * histogram so far is the best guess.
+ */
+static uintptr_t
+shared_bins_needed(const ray_batch_t* batch, const audio_listener_t* al, const ray_histogram_t* histogram)
+{
+    const simulation_state_t* state = batch->simulation->state;
+    uintptr_t bins = vector_count(&histogram->accumulated) / RAY_BANDS;
+    uintptr_t needed = (uintptr_t)(state->end_time / al->energy_bin_width) + 1;
+    if (bins < needed)
+        bins = needed;
+    if (batch->max_time < INFINITY)
+    {
+        needed = (uintptr_t)(batch->max_time / al->energy_bin_width) + 1;
+        if (bins < needed)
+            bins = needed;
+    }
+    return bins;
+}
+
+/* ------------------------------------------------------------------------- */
+static wsret
+trace_source(ray_batch_t* batch)
+{
+    wsret result;
+    uintptr_t i, listener_count = vector_count(&batch->simulation->audio_listeners);
+
+    if (batch->shared_bins != NULL)
+        for (i = 0; i != listener_count; ++i)
+        {
+            ray_histogram_t* histogram = vector_get(&batch->simulation->state->histograms, i);
+            const audio_listener_t* al = *(audio_listener_t**)vector_get(&batch->simulation->audio_listeners, i);
+            if ((result = histogram_grow(&histogram->batch, shared_bins_needed(batch, al, histogram) * RAY_BANDS)) != WS_OK)
+                return result;
+            batch->shared_bins[i] = (wsreal_t*)histogram->batch.data;
+            batch->shared_bin_count[i] = vector_count(&histogram->batch) / RAY_BANDS;
+        }
+
+    if ((result = ws_thread_run_parallel(trace_main, batch->workers, sizeof(ray_worker_t), batch->worker_count)) != WS_OK)
+        return result;
+    for (i = 0; i != batch->worker_count; ++i)
+        if (batch->workers[i].result != WS_OK)
+            return batch->workers[i].result;
+
+    if (batch->shared_bins != NULL)
+    {
+        /* Energy that didn't fit into the shared histograms */
+        for (i = 0; i != batch->worker_count; ++i)
+        {
+            batch->simulation->state->overflow_count += vector_count(&batch->workers[i].overflow);
+            VECTOR_FOR_EACH(&batch->workers[i].overflow, energy_event_t, event)
+                ray_histogram_t* histogram = vector_get(&batch->simulation->state->histograms, event->listener);
+                if ((result = histogram_add(&histogram->batch, event->bin * RAY_BANDS, event->energy, RAY_BANDS)) != WS_OK)
+                    return result;
+            VECTOR_END_EACH
+            vector_clear(&batch->workers[i].overflow);
+        }
+    }
+    else
+    {
+        reduce_job_t jobs[RAY_MAX_THREADS];
+        uintptr_t job_count = batch->worker_count < listener_count ? batch->worker_count : listener_count;
+        for (i = 0; i != job_count; ++i)
+        {
+            jobs[i].batch = batch;
+            jobs[i].begin = listener_count * i / job_count;
+            jobs[i].end = listener_count * (i + 1) / job_count;
+        }
+        if (job_count > 0 && (result = ws_thread_run_parallel(reduce_main, jobs, sizeof(reduce_job_t), job_count)) != WS_OK)
+            return result;
+        for (i = 0; i != job_count; ++i)
+            if (jobs[i].result != WS_OK)
+                return jobs[i].result;
+    }
+
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Traces rays [ray_begin, ray_end) of every audio source into the batch
+ * histograms.
+ */
+static wsret
+trace_batch(simulation_t* simulation, uintptr_t ray_begin, uintptr_t ray_end)
+{
+    uintptr_t i, j, listener_count;
+    wsret result = WS_OK;
+    ray_batch_t batch;
+    simulation_state_t* state = simulation->state;
+
+    batch.simulation = simulation;
+    batch.max_time = state->traced_max_time;
+    batch.ray_begin = ray_begin;
+    batch.ray_end = ray_end;
+    batch.first_packet = ray_begin / BVH_PACKET_SIZE;
+    batch.packet_count = (ray_end + BVH_PACKET_SIZE - 1) / BVH_PACKET_SIZE - batch.first_packet;
+    batch.shared_bins = NULL;
+    batch.shared_bin_count = NULL;
+    state->overflow_count = 0;
+    listener_count = vector_count(&simulation->audio_listeners);
+
+    batch.worker_count = simulation->ray.thread_count;
+    if (batch.worker_count == 0)
+        batch.worker_count = ws_thread_hardware_concurrency();
+    if (batch.worker_count > RAY_MAX_THREADS)
+        batch.worker_count = RAY_MAX_THREADS;
+    if (batch.worker_count > batch.packet_count)
+        batch.worker_count = batch.packet_count;
+    if (batch.worker_count == 0 || listener_count == 0)
+        WSRET(WS_OK);
+
+    batch.workers = MALLOC(sizeof(ray_worker_t) * batch.worker_count);
+    if (batch.workers == NULL)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+    for (i = 0; i != batch.worker_count; ++i)
+    {
+        batch.workers[i].batch = &batch;
+        batch.workers[i].index = i;
+        vector_construct(&batch.workers[i].histograms, sizeof(vector_t));
+        vector_construct(&batch.workers[i].overflow, sizeof(energy_event_t));
+    }
+
+    if (listener_count > simulation->ray.shared_histogram_listeners &&
+        batch.worker_count > 1 && sizeof(wsreal_t) == sizeof(uintptr_t))
+    {
+        batch.shared_bins = MALLOC(sizeof(wsreal_t*) * listener_count);
+        batch.shared_bin_count = MALLOC(sizeof(uintptr_t) * listener_count);
+        if (batch.shared_bins == NULL || batch.shared_bin_count == NULL)
+        {
+            result = WS_ERR_OUT_OF_MEMORY;
+            goto out;
+        }
+    }
+    else
+    {
+        for (i = 0; i != batch.worker_count; ++i)
+            for (j = 0; j != listener_count; ++j)
+            {
+                vector_t* histogram = vector_emplace(&batch.workers[i].histograms);
+                if (histogram == NULL)
+                {
+                    result = WS_ERR_OUT_OF_MEMORY;
+                    goto out;
+                }
+                vector_construct(histogram, sizeof(wsreal_t));
+            }
+    }
+
+    for (i = 0; i != vector_count(&simulation->audio_sources); ++i)
+    {
+        batch.source = *(audio_source_t**)vector_get(&simulation->audio_sources, i);
+        batch.source_index = i;
+        if ((result = trace_source(&batch)) != WS_OK)
+            goto out;
+    }
+
+    out:
+    for (i = 0; i != batch.worker_count; ++i)
+    {
+        VECTOR_FOR_EACH(&batch.workers[i].histograms, vector_t, histogram)
+            vector_clear_free(histogram);
+        VECTOR_END_EACH
+        vector_clear_free(&batch.workers[i].histograms);
+        vector_clear_free(&batch.workers[i].overflow);
+    }
+    if (batch.shared_bins != NULL)      FREE(batch.shared_bins);
+    if (batch.shared_bin_count != NULL) FREE(batch.shared_bin_count);
+    FREE(batch.workers);
+    return result;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Adds the batch histograms to the accumulated ones. previous and total are
+ * the number of rays per source before and after the batch.
+ */
+static wsret
+accumulate_batch(simulation_state_t* state, uintptr_t previous, uintptr_t total)
+{
+    wsret result;
+    VECTOR_FOR_EACH(&state->histograms, ray_histogram_t, histogram)
+        uintptr_t bin, batch_count = vector_count(&histogram->batch);
+        wsreal_t change = 0.0, sum = 0.0;
+        const wsreal_t* batch_bins = (const wsreal_t*)histogram->batch.data;
+        const wsreal_t* bins;
+
+        /* Shared histograms are sized in advance, the bins no ray reached
+         * don't extend the accumulated histogram */
+        while (batch_count > 0 && batch_bins[batch_count - 1] == 0.0)
+            --batch_count;
+        batch_count = (batch_count + RAY_BANDS - 1) / RAY_BANDS * RAY_BANDS;
+
+        if ((result = histogram_add(&histogram->accumulated, 0, batch_bins, batch_count)) != WS_OK)
+            return result;
+
+        /* L1 distance between the estimates before and after the batch,
+         * relative to the energy of the estimate */
+        bins = (const wsreal_t*)histogram->accumulated.data;
+        for (bin = 0; bin != vector_count(&histogram->accumulated); ++bin)
+        {
+            wsreal_t after = bins[bin] / (wsreal_t)total;
+            if (previous > 0)
+            {
+                wsreal_t added = bin < batch_count ? batch_bins[bin] : 0.0;
+                change += fabs(after - (bins[bin] - added) / (wsreal_t)previous);
+            }
+            sum += after;
+        }
+        if (previous == 0)
+            histogram->convergence = 1.0;
+        else
+            histogram->convergence = sum > 0.0 ? change / sum : 0.0;
+
+        vector_clear(&histogram->batch);
+    VECTOR_END_EACH
+
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+static int
+histograms_are_stale(const simulation_t* simulation)
+{
+    uintptr_t i;
+    const simulation_state_t* state = simulation->state;
+    const simulation_ray_settings_t* traced = &state->traced_settings;
+    const simulation_ray_settings_t* current = &simulation->ray;
+    wsreal_t max_time = simulation->ir_mode.enabled ? simulation->ir_mode.max_duration : INFINITY;
+
+    if (state->rays_traced == 0)
+        return 1;
+    if (vector_count(&state->histograms) != vector_count(&simulation->audio_listeners) ||
+        vector_count(&state->positions) != vector_count(&simulation->audio_sources) +
+                                           vector_count(&simulation->audio_listeners))
+        return 1;
+
+    for (i = 0; i != vector_count(&state->histograms); ++i)
+    {
+        const ray_histogram_t* histogram = vector_get(&state->histograms, i);
+        const audio_listener_t* al = *(audio_listener_t**)vector_get(&simulation->audio_listeners, i);
+        if (histogram->bin_width != al->energy_bin_width)
+            return 1;
+    }
+
+    /* Settings that change what a ray contributes. ray_count only sets how
+     * many rays are traced in total, raising it refines further */
+    if (traced->max_reflections != current->max_reflections ||
+        traced->listener_radius != current->listener_radius ||
+        traced->seed != current->seed ||
+        traced->image_source_order != current->image_source_order ||
+        traced->scattering != current->scattering ||
+        traced->diffuse_rain != current->diffuse_rain ||
+        state->traced_max_time != max_time)
+        return 1;
+
+    for (i = 0; i != vector_count(&state->positions); ++i)
+    {
+        const vec3_t* traced_position = vector_get(&state->positions, i);
+        const vec3_t* position;
+        if (i < vector_count(&simulation->audio_sources))
+            position = &(*(audio_source_t**)vector_get(&simulation->audio_sources, i))->position;
+        else
+            position = &(*(audio_listener_t**)vector_get(&simulation->audio_listeners,
+                         i - vector_count(&simulation->audio_sources)))->position;
+        if (traced_position->v.x != position->v.x ||
+            traced_position->v.y != position->v.y ||
+            traced_position->v.z != position->v.z)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+clear_histograms(simulation_state_t* state)
+{
+    VECTOR_FOR_EACH(&state->histograms, ray_histogram_t, histogram)
+        vector_clear_free(&histogram->accumulated);
+        vector_clear_free(&histogram->batch);
+    VECTOR_END_EACH
+    vector_clear_free(&state->histograms);
+    vector_clear_free(&state->positions);
+    state->rays_traced = 0;
+}
+
+/* ------------------------------------------------------------------------- */
+static wsret
+reset_histograms(simulation_t* simulation)
+{
+    simulation_state_t* state = simulation->state;
+
+    clear_histograms(state);
+    VECTOR_FOR_EACH(&simulation->audio_listeners, audio_listener_t*, al)
+        ray_histogram_t* histogram = vector_emplace(&state->histograms);
+        if (histogram == NULL)
+            WSRET(WS_ERR_OUT_OF_MEMORY);
+        vector_construct(&histogram->accumulated, sizeof(wsreal_t));
+        vector_construct(&histogram->batch, sizeof(wsreal_t));
+        histogram->convergence = 1.0;
+        histogram->bin_width = (*al)->energy_bin_width;
+    VECTOR_END_EACH
+
+    VECTOR_FOR_EACH(&simulation->audio_sources, audio_source_t*, as)
+        if (vector_push(&state->positions, &(*as)->position) == VECTOR_ERROR)
+            WSRET(WS_ERR_OUT_OF_MEMORY);
+    VECTOR_END_EACH
+    VECTOR_FOR_EACH(&simulation->audio_listeners, audio_listener_t*, al)
+        if (vector_push(&state->positions, &(*al)->position) == VECTOR_ERROR)
+            WSRET(WS_ERR_OUT_OF_MEMORY);
+    VECTOR_END_EACH
+
+    state->traced_settings = simulation->ray;
+    state->traced_max_time = simulation->ir_mode.enabled ? simulation->ir_mode.max_duration : INFINITY;
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Replaces the listeners' histograms with the accumulated rays and adds the
+ * image sources.
+ */
+static wsret
+publish_histograms(simulation_t* simulation)
+{
+    uintptr_t i, bin;
+    int band;
+    wsret result;
+    simulation_state_t* state = simulation->state;
+
+    for (i = 0; i != vector_count(&simulation->audio_listeners); ++i)
+    {
+        audio_listener_t* al = *(audio_listener_t**)vector_get(&simulation->audio_listeners, i);
+        const ray_histogram_t* histogram = vector_get(&state->histograms, i);
+        const wsreal_t* bins = (const wsreal_t*)histogram->accumulated.data;
+
+        for (band = 0; band != RAY_BANDS; ++band)
+        {
+            vector_clear(&al->band_energy[band]);
+            if (state->rays_traced == 0)
+                continue;
+            for (bin = 0; bin != vector_count(&histogram->accumulated) / RAY_BANDS; ++bin)
+            {
+                wsreal_t* e = vector_emplace(&al->band_energy[band]);
+                if (e == NULL)
+                    WSRET(WS_ERR_OUT_OF_MEMORY);
+                *e = bins[bin * RAY_BANDS + (uintptr_t)band] / (wsreal_t)state->rays_traced;
+            }
+        }
+    }
+
+    if (simulation->ray.image_source_order >= 0)
+        for (i = 0; i != vector_count(&simulation->audio_sources); ++i)
+            if ((result = add_image_sources(simulation, i, state->traced_max_time)) != WS_OK)
+                return result;
+
+    VECTOR_FOR_EACH(&simulation->audio_listeners, audio_listener_t*, al)
+        if ((result = audio_listener_mix_bands(*al)) != WS_OK)
+            return result;
+        if (simulation->ray.extrapolate_tail &&
+            (result = audio_listener_extrapolate_energy_tail(*al, -5.0, -25.0,
+                simulation->ir_mode.enabled ? simulation->ir_mode.decay_threshold : -60.0,
+                state->traced_max_time)) != WS_OK)
+            return result;
+    VECTOR_END_EACH
+
+    state->end_time = 0.0;
+    VECTOR_FOR_EACH(&simulation->audio_listeners, audio_listener_t*, al)
+        wsreal_t duration = (wsreal_t)vector_count(&(*al)->energy) * (*al)->energy_bin_width;
+        if (state->end_time < duration)
+            state->end_time = duration;
+    VECTOR_END_EACH
+
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Traces batches of batch_size rays per source (all remaining rays if 0)
+ * until ray.ray_count rays were traced or the time budget is used up. At
+ * least one batch is traced.
+ */
+static wsret
+refine(simulation_t* simulation, wsreal_t time_budget, uintptr_t batch_size)
+{
+    wsret result;
+    simulation_state_t* state = simulation->state;
+    wsreal_t start = ws_clock_seconds();
+
+    if (histograms_are_stale(simulation) && (result = reset_histograms(simulation)) != WS_OK)
+        return result;
+
+    /* Batches end on packet boundaries */
+    batch_size = (batch_size + BVH_PACKET_SIZE - 1) / BVH_PACKET_SIZE * BVH_PACKET_SIZE;
+    while (state->rays_traced < simulation->ray.ray_count)
+    {
+        uintptr_t end = simulation->ray.ray_count;
+        if (batch_size > 0 && end - state->rays_traced > batch_size)
+            end = (state->rays_traced / BVH_PACKET_SIZE * BVH_PACKET_SIZE) + batch_size;
+
+        if ((result = trace_batch(simulation, state->rays_traced, end)) != WS_OK)
+            return result;
+        if ((result = accumulate_batch(state, state->rays_traced, end)) != WS_OK)
+            return result;
+        state->rays_traced = end;
+
+        if (ws_clock_seconds() - start >= time_budget)
+            break;
+    }
+
+    return publish_histograms(simulation);
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+simulation_ray_trace(simulation_t* simulation)
+{
+    return refine(simulation, INFINITY, 0);
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+simulation_ray_refine(simulation_t* simulation, wsreal_t time_budget)
+{
+    return refine(simulation, time_budget, simulation->ray.batch_size);
+}
+
+/* ------------------------------------------------------------------------- */
+uintptr_t
+simulation_ray_rays_traced(const simulation_t* simulation)
+{
+    return simulation->state->rays_traced;
+}
+
+/* ------------------------------------------------------------------------- */
+wsreal_t
+simulation_ray_convergence(const simulation_t* simulation, uintptr_t listener)
+{
+    const ray_histogram_t* histogram;
+    if (listener >= vector_count(&simulation->state->histograms))
+        return 1.0;
+    histogram = vector_get(&simulation->state->histograms, listener);
+    return histogram->convergence;
+}
+
+/* ------------------------------------------------------------------------- */
+uintptr_t
+simulation_ray_overflow_count(const simulation_t* simulation)
+{
+    return simulation->state->overflow_count;
 }
 
 /* ------------------------------------------------------------------------- */
 int
 simulation_ray_advance(simulation_t* simulation, wsreal_t dt)
 {
-    (void)simulation;
-    (void)dt;
-    return 0; /* Return 1 as long as you need to continue simulation.
-               * Return 0 to indicate simulation has ended successfully.
-               * Return -1 if something went wrong during simulation. If this
-               * happens, make sure to ws_log_data() an error message before
-               * returning.
-               */
+    simulation_state_t* state = simulation->state;
+
+    /* Listeners are reset at the start of every run */
+    if (simulation->time == 0.0 && simulation_ray_trace(simulation) != WS_OK)
+    {
+        log_info(&g_ws_log, "[SIM] Ray tracing failed");
+        return -1;
+    }
+
+    VECTOR_FOR_EACH(&simulation->audio_listeners, audio_listener_t*, pal)
+        wsreal_t sample = 0.0;
+        audio_listener_t* al = *pal;
+        uintptr_t bin = (uintptr_t)(simulation->time / al->energy_bin_width);
+        if (bin < vector_count(&al->energy))
+        {
+            /* Spread the energy of the bin over all steps within it */
+            wsreal_t energy = *(wsreal_t*)vector_get(&al->energy, bin);
+            sample = sqrt(energy * dt / al->energy_bin_width);
+        }
+        if (audio_listener_add_sample(al, dt, sample) != WS_OK)
+            return -1;
+    VECTOR_END_EACH
+
+    return simulation->time + dt < state->end_time ? 1 : 0;
 }
 
 /* ------------------------------------------------------------------------- */
 void
 simulation_ray_finalize(simulation_t* simulation)
 {
-    (void)simulation;
+    uintptr_t i;
+    simulation_state_t* state = simulation->state;
+    clear_histograms(state);
+    VECTOR_FOR_EACH(&state->image_trees, image_source_tree_t, tree)
+        image_source_tree_destruct(tree);
+    VECTOR_END_EACH
+    vector_clear_free(&state->image_trees);
+    vector_clear_free(&state->paths);
+    vector_clear_free(&state->faces);
+    bvh_scene_destruct(&state->scene);
+    for (i = 0; i != state->mesh_count; ++i)
+        bvh_destruct(&state->blases[i]);
+    FREE(state->blases);
+    FREE(state);
+    simulation->state = NULL;
 }
@@ -0,0 +1,533 @@
+#include "wavesim/hashmap.h"
+#include "wavesim/memory.h"
+#include "wavesim/thread.h"
+#include "wavesim/mesh/intersections.h"
+#include "wavesim/mesh/mesh.h"
+#include "wavesim/simulation/voxel_grid.h"
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Upper limit of threads rasterizing tiles */
+#define VOXEL_MAX_THREADS 64
+
+/* Coordinates within this fraction of a cell of a lattice plane lie on it */
+#define ALIGN_EPSILON 1e-6
+
+/* Reflection, transmission, absorption and sound velocity, followed by the
+ * absorption and transmission of every band */
+#define MATERIAL_VALUE_COUNT (4 + 2 * ATTRIBUTE_BAND_COUNT)
+
+/* A face and the range of cells its AABB overlaps, inclusive */
+typedef struct voxel_face_t
+{
+    uintptr_t face;
+    uintptr_t min[3];
+    uintptr_t max[3];
+} voxel_face_t;
+
+/* Shepard weights accumulated for one cell. The weighted sums are relative
+ * to the attributes of the first vertex, so cells whose vertices all have the
+ * same attributes get exactly those and not something that differs in the
+ * last bit, which would make them a separate material */
+typedef struct cell_weights_t
+{
+    wsreal_t base[MATERIAL_VALUE_COUNT]; /* Attributes of the first vertex */
+    wsreal_t sum[MATERIAL_VALUE_COUNT];  /* Weighted differences to base */
+    wsreal_t weight;          /* Sum of the weights, negative if the center of
+                               * the cell lies on a vertex, which then decides */
+} cell_weights_t;
+
+/* The values material_is_same() compares, as a hashmap key */
+typedef struct material_key_t
+{
+    wsreal_t values[MATERIAL_VALUE_COUNT];
+} material_key_t;
+
+/* A range of layers along z, rasterized by one thread */
+typedef struct voxel_tile_t
+{
+    voxel_grid_t* grid;
+    const mesh_t* mesh;
+    const voxel_face_t* faces; /* Sorted by min[2] */
+    uintptr_t face_count;
+    uintptr_t z_begin;
+    uintptr_t z_end;
+    vector_t attributes;      /* attribute_t, materials of this tile. Cells
+                               * store local index + 1 until they are remapped */
+    hashmap_t lookup;         /* material_key_t to uint32_t index into attributes */
+    uint32_t* remap;          /* Local index to grid material */
+    wsret result;
+} voxel_tile_t;
+
+/* ------------------------------------------------------------------------- */
+void
+voxel_grid_construct(voxel_grid_t* grid)
+{
+    memset(grid->origin, 0, sizeof grid->origin);
+    memset(grid->grid_size, 0, sizeof grid->grid_size);
+    memset(grid->dims, 0, sizeof grid->dims);
+    grid->materials = NULL;
+    vector_construct(&grid->attributes, sizeof(attribute_t));
+}
+
+/* ------------------------------------------------------------------------- */
+void
+voxel_grid_destruct(voxel_grid_t* grid)
+{
+    if (grid->materials != NULL)
+        FREE(grid->materials);
+    grid->materials = NULL;
+    vector_clear_free(&grid->attributes);
+}
+
+/* ------------------------------------------------------------------------- */
+static int
+material_is_same(const attribute_t* a, const attribute_t* b)
+{
+    return attribute_is_same(a, b) && a->sound_velocity == b->sound_velocity;
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+get_material_values(wsreal_t values[MATERIAL_VALUE_COUNT], const attribute_t* attr)
+{
+    int band;
+    values[0] = attr->reflection;
+    values[1] = attr->transmission;
+    values[2] = attr->absorption;
+    values[3] = attr->sound_velocity;
+    for (band = 0; band != ATTRIBUTE_BAND_COUNT; ++band)
+    {
+        values[4 + band * 2 + 0] = attr->band_absorption[band];
+        values[4 + band * 2 + 1] = attr->band_transmission[band];
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+make_material_key(material_key_t* key, const attribute_t* attr)
+{
+    int i;
+    get_material_values(key->values, attr);
+    /* Adding 0.0 turns -0.0 into 0.0, which compare equal but differ in bits */
+    for (i = 0; i != MATERIAL_VALUE_COUNT; ++i)
+        key->values[i] += 0.0;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Returns the index of the attribute in the table, adding it to the table and
+ * to lookup if necessary, or VECTOR_ERROR if it ran out of memory. hint is
+ * checked first, neighbouring cells mostly have the same material.
+ */
+static uintptr_t
+find_material(vector_t* attributes, hashmap_t* lookup, const attribute_t* attr, uintptr_t hint)
+{
+    material_key_t key;
+    uint32_t index;
+    const uint32_t* found;
+    attribute_t* copy;
+
+    if (hint < vector_count(attributes) && material_is_same(vector_get(attributes, hint), attr))
+        return hint;
+
+    make_material_key(&key, attr);
+    if ((found = hashmap_find(lookup, &key)) != NULL)
+        return *found;
+
+    index = (uint32_t)vector_count(attributes);
+    if ((copy = vector_emplace(attributes)) == NULL)
+        return VECTOR_ERROR;
+    *copy = *attr;
+    if (hashmap_insert(lookup, &key, &index) != WS_OK)
+    {
+        vector_pop(attributes);
+        return VECTOR_ERROR;
+    }
+    return index;
+}
+
+/* ------------------------------------------------------------------------- */
+static int
+compare_faces(const void* a, const void* b)
+{
+    uintptr_t za = ((const voxel_face_t*)a)->min[2];
+    uintptr_t zb = ((const voxel_face_t*)b)->min[2];
+    return za < zb ? -1 : (za > zb ? 1 : 0);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Adds the vertices of a face to the weights of a cell, using Shepard's
+ * method with p=2. https://en.wikipedia.org/wiki/Inverse_distance_weighting
+ */
+static void
+accumulate_face(cell_weights_t* cell, const face_t* face, const wsreal_t center[3])
+{
+    int v, i;
+    if (cell->weight < 0.0)
+        return;
+
+    for (v = 0; v != 3; ++v)
+    {
+        vec3_t distance = face->vertices[v].position;
+        wsreal_t weight, values[MATERIAL_VALUE_COUNT];
+        get_material_values(values, &face->vertices[v].attr);
+
+        vec3_sub_vec3(distance.xyz, center);
+        weight = vec3_length_squared(distance.xyz);
+        if (weight == 0.0)
+        {
+            /* The cell's center lies right on top of a vertex */
+            for (i = 0; i != MATERIAL_VALUE_COUNT; ++i)
+            {
+                cell->base[i] = values[i];
+                cell->sum[i] = 0.0;
+            }
+            cell->weight = -1.0;
+            return;
+        }
+
+        if (cell->weight == 0.0)
+            for (i = 0; i != MATERIAL_VALUE_COUNT; ++i)
+                cell->base[i] = values[i];
+
+        weight = 1.0 / weight;
+        for (i = 0; i != MATERIAL_VALUE_COUNT; ++i)
+            cell->sum[i] += (values[i] - cell->base[i]) * weight;
+        cell->weight += weight;
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+static void*
+rasterize_tile(void* arg)
+{
+    voxel_tile_t* tile = arg;
+    voxel_grid_t* grid = tile->grid;
+    uintptr_t layer_size = grid->dims[0] * grid->dims[1];
+    uintptr_t next = 0, z, i, material = 0;
+    cell_weights_t* cells;
+    vector_t active;
+
+    tile->result = WS_OK;
+    if ((cells = MALLOC(sizeof(cell_weights_t) * layer_size)) == NULL)
+    {
+        tile->result = WS_ERR_OUT_OF_MEMORY;
+        return NULL;
+    }
+    vector_construct(&active, sizeof(uintptr_t));
+
+    for (z = tile->z_begin; z != tile->z_end; ++z)
+    {
+        uintptr_t alive = 0;
+        uintptr_t* active_faces;
+        uint32_t* layer = grid->materials + z * layer_size;
+
+        /* Sweep: faces start overlapping in sorted order and are dropped once
+         * they end below the current layer */
+        for (; next != tile->face_count && tile->faces[next].min[2] <= z; ++next)
+            if (tile->faces[next].max[2] >= z && vector_push(&active, &next) == VECTOR_ERROR)
+            {
+                tile->result = WS_ERR_OUT_OF_MEMORY;
+                goto out;
+            }
+        active_faces = (uintptr_t*)active.data;
+        for (i = 0; i != vector_count(&active); ++i)
+            if (tile->faces[active_faces[i]].max[2] >= z)
+                active_faces[alive++] = active_faces[i];
+        vector_resize(&active, alive); /* shrinking never reallocates */
+
+        memset(cells, 0, sizeof(cell_weights_t) * layer_size);
+        for (i = 0; i != alive; ++i)
+        {
+            face_t face;
+            uintptr_t x, y;
+            const voxel_face_t* f = &tile->faces[active_faces[i]];
+            mesh_get_face(&face, tile->mesh, f->face);
+
+            for (y = f->min[1]; y <= f->max[1]; ++y)
+                for (x = f->min[0]; x <= f->max[0]; ++x)
+                {
+                    wsreal_t cell[6], center[3];
+                    int axis;
+                    uintptr_t c[3];
+                    c[0] = x; c[1] = y; c[2] = z;
+                    for (axis = 0; axis != 3; ++axis)
+                    {
+                        cell[axis+0] = grid->origin[axis] + (wsreal_t)c[axis] * grid->grid_size[axis];
+                        cell[axis+3] = cell[axis+0] + grid->grid_size[axis];
+                        center[axis] = (cell[axis+0] + cell[axis+3]) * 0.5;
+                    }
+                    if (intersect_triangle_aabb_test(face.vertices[0].position.xyz,
+                                                     face.vertices[1].position.xyz,
+                                                     face.vertices[2].position.xyz,
+                                                     cell) == 0)
+                        continue;
+                    accumulate_face(&cells[x + grid->dims[0] * y], &face, center);
+                }
+        }
+
+        for (i = 0; i != layer_size; ++i)
+        {
+            attribute_t attr;
+            cell_weights_t* cell = &cells[i];
+            wsreal_t values[MATERIAL_VALUE_COUNT], sum;
+            int j;
+            if (cell->weight == 0.0)
+            {
+                layer[i] = VOXEL_AIR;
+                continue;
+            }
+
+            for (j = 0; j != MATERIAL_VALUE_COUNT; ++j)
+                values[j] = cell->base[j] + (cell->weight > 0.0 ? cell->sum[j] / cell->weight : 0.0);
+
+            /* Need to normalize it so 1 = reflection + transmission + absorption */
+            sum = values[0] + values[1] + values[2];
+            if (sum > 0.0)
+            {
+                attr = attribute(values[0] / sum, values[1] / sum, values[2] / sum, values[3], vec3(0, 0, 0));
+                /* The bands are weighted averages of valid bands and need no
+                 * normalizing */
+                for (j = 0; j != ATTRIBUTE_BAND_COUNT; ++j)
+                {
+                    attr.band_absorption[j] = values[4 + j * 2 + 0];
+                    attr.band_transmission[j] = values[4 + j * 2 + 1];
+                }
+            }
+            else
+                attribute_set_default_solid(&attr);
+
+            if ((material = find_material(&tile->attributes, &tile->lookup, &attr, material)) == VECTOR_ERROR)
+            {
+                tile->result = WS_ERR_OUT_OF_MEMORY;
+                goto out;
+            }
+            layer[i] = (uint32_t)material + 1;
+        }
+    }
+
+    out:
+    vector_clear_free(&active);
+    FREE(cells);
+    return NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+static void*
+remap_tile(void* arg)
+{
+    voxel_tile_t* tile = arg;
+    voxel_grid_t* grid = tile->grid;
+    uintptr_t layer_size = grid->dims[0] * grid->dims[1];
+    uint32_t* cell = grid->materials + tile->z_begin * layer_size;
+    uint32_t* end = grid->materials + tile->z_end * layer_size;
+
+    for (; cell != end; ++cell)
+        if (*cell != VOXEL_AIR)
+            *cell = tile->remap[*cell - 1];
+    return NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * Computes the range of cells overlapped by the AABB of every face, grown by
+ * one cell so faces lying on a lattice plane reach the cells on both sides.
+ */
+static wsret
+collect_faces(vector_t* faces, const voxel_grid_t* grid, const mesh_t* mesh)
+{
+    uintptr_t i;
+    for (i = 0; i != mesh_face_count(mesh); ++i)
+    {
+        wsib_t indices[3];
+        wsreal_t vertices[9];
+        voxel_face_t* f;
+        voxel_face_t range;
+        int axis, outside = 0;
+
+        mesh_get_face_indices(indices, mesh, i);
+        mesh_get_face_vertices(vertices, mesh, indices);
+        for (axis = 0; axis != 3; ++axis)
+        {
+            wsreal_t lo = vertices[axis], hi = vertices[axis];
+            int v;
+            for (v = 1; v != 3; ++v)
+            {
+                if (lo > vertices[v*3 + axis]) lo = vertices[v*3 + axis];
+                if (hi < vertices[v*3 + axis]) hi = vertices[v*3 + axis];
+            }
+            lo = floor((lo - grid->origin[axis]) / grid->grid_size[axis]) - 1.0;
+            hi = floor((hi - grid->origin[axis]) / grid->grid_size[axis]) + 1.0;
+            if (hi < 0.0 || lo >= (wsreal_t)grid->dims[axis])
+            {
+                outside = 1;
+                break;
+            }
+            range.min[axis] = lo < 0.0 ? 0 : (uintptr_t)lo;
+            range.max[axis] = hi >= (wsreal_t)grid->dims[axis] ? grid->dims[axis] - 1 : (uintptr_t)hi;
+        }
+        if (outside)
+            continue;
+
+        if ((f = vector_emplace(faces)) == NULL)
+            WSRET(WS_ERR_OUT_OF_MEMORY);
+        *f = range;
+        f->face = i;
+    }
+
+    if (vector_count(faces) > 0)
+        qsort(faces->data, vector_count(faces), sizeof(voxel_face_t), compare_faces);
+    WSRET(WS_OK);
+}
+
+/* ------------------------------------------------------------------------- */
+wsret
+voxel_grid_build(voxel_grid_t* grid,
+                 const mesh_t* mesh,
+                 const wsreal_t boundary[6],
+                 const wsreal_t grid_size[3],
+                 uintptr_t thread_count)
+{
+    wsret result = WS_OK;
+    uintptr_t i, j, tile_count, cell_count;
+    voxel_tile_t tiles[VOXEL_MAX_THREADS];
+    attribute_t air;
+    vector_t faces;
+    hashmap_t lookup;
+    material_key_t key;
+    uint32_t air_index = 0;
+
+    voxel_grid_destruct(grid);
+    voxel_grid_construct(grid);
+    for (i = 0; i != 3; ++i)
+    {
+        wsreal_t cells = (boundary[i+3] - boundary[i]) / grid_size[i];
+        grid->origin[i] = boundary[i];
+        grid->grid_size[i] = grid_size[i];
+        grid->dims[i] = cells > 0.0 ? (uintptr_t)floor(cells + ALIGN_EPSILON) : 0;
+    }
+
+    attribute_set_default_air(&air);
+    if (vector_push(&grid->attributes, &air) == VECTOR_ERROR)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+    cell_count = grid->dims[0] * grid->dims[1] * grid->dims[2];
+    if (cell_count == 0)
+        WSRET(WS_OK);
+    if ((grid->materials = MALLOC(sizeof(uint32_t) * cell_count)) == NULL)
+        WSRET(WS_ERR_OUT_OF_MEMORY);
+
+    /* Air is material 0 of the grid */
+    if ((result = hashmap_construct(&lookup, sizeof(material_key_t), sizeof(uint32_t))) != WS_OK)
+    {
+        voxel_grid_destruct(grid);
+        voxel_grid_construct(grid);
+        return result;
+    }
+    make_material_key(&key, &air);
+    vector_construct(&faces, sizeof(voxel_face_t));
+    if ((result = hashmap_insert(&lookup, &key, &air_index)) != WS_OK)
+        goto out;
+    if ((result = collect_faces(&faces, grid, mesh)) != WS_OK)
+        goto out;
+
+    tile_count = thread_count == 0 ? ws_thread_hardware_concurrency() : thread_count;
+    if (tile_count > VOXEL_MAX_THREADS) tile_count = VOXEL_MAX_THREADS;
+    if (tile_count > grid->dims[2])     tile_count = grid->dims[2];
+    if (tile_count == 0)                tile_count = 1;
+    for (i = 0; i != tile_count; ++i)
+    {
+        tiles[i].grid = grid;
+        tiles[i].mesh = mesh;
+        tiles[i].faces = (const voxel_face_t*)faces.data;
+        tiles[i].face_count = vector_count(&faces);
+        tiles[i].z_begin = grid->dims[2] * i / tile_count;
+        tiles[i].z_end = grid->dims[2] * (i + 1) / tile_count;
+        tiles[i].remap = NULL;
+        vector_construct(&tiles[i].attributes, sizeof(attribute_t));
+        if ((result = hashmap_construct(&tiles[i].lookup, sizeof(material_key_t), sizeof(uint32_t))) != WS_OK)
+        {
+            tile_count = i;
+            goto free_tiles;
+        }
+    }
+
+    if ((result = ws_thread_run_parallel(rasterize_tile, tiles, sizeof(voxel_tile_t), tile_count)) != WS_OK)
+        goto free_tiles;
+    for (i = 0; i != tile_count; ++i)
+        if ((result = tiles[i].result) != WS_OK)
+            goto free_tiles;
+
+    /* Merge the materials of all tiles, then translate the cells */
+    for (i = 0; i != tile_count; ++i)
+    {
+        uintptr_t material = 0;
+        tiles[i].remap = MALLOC(sizeof(uint32_t) * (vector_count(&tiles[i].attributes) + 1));
+        if (tiles[i].remap == NULL)
+        {
+            result = WS_ERR_OUT_OF_MEMORY;
+            goto free_tiles;
+        }
+        for (j = 0; j != vector_count(&tiles[i].attributes); ++j)
+        {
+            material = find_material(&grid->attributes, &lookup, vector_get(&tiles[i].attributes, j), material);
+            if (material == VECTOR_ERROR)
+            {
+                result = WS_ERR_OUT_OF_MEMORY;
+                goto free_tiles;
+            }
+            tiles[i].remap[j] = (uint32_t)material;
+        }
+    }
+    result = ws_thread_run_parallel(remap_tile, tiles, sizeof(voxel_tile_t), tile_count);
+
+    free_tiles:
+    for (i = 0; i != tile_count; ++i)
+    {
+        if (tiles[i].remap != NULL)
+            FREE(tiles[i].remap);
+        hashmap_destruct(&tiles[i].lookup);
+        vector_clear_free(&tiles[i].attributes);
+    }
+    out:
+    hashmap_destruct(&lookup);
+    vector_clear_free(&faces);
+    if (result != WS_OK)
+    {
+        voxel_grid_destruct(grid);
+        voxel_grid_construct(grid);
+    }
+    return result;
+}
+
+/* ------------------------------------------------------------------------- */
+uint32_t
+voxel_grid_material(const voxel_grid_t* grid, uintptr_t x, uintptr_t y, uintptr_t z)
+{
+    return grid->materials[x + grid->dims[0] * (y + grid->dims[1] * z)];
+}
+
+/* ------------------------------------------------------------------------- */
+const attribute_t*
+voxel_grid_attribute(const voxel_grid_t* grid, uint32_t material)
+{
+    return (const attribute_t*)vector_get(&grid->attributes, material);
+}
+
+/* ------------------------------------------------------------------------- */
+int
+voxel_grid_locate(const voxel_grid_t* grid, const wsreal_t point[3], uintptr_t cell[3])
+{
+    int i;
+    for (i = 0; i != 3; ++i)
+    {
+        wsreal_t c = floor((point[i] - grid->origin[i]) / grid->grid_size[i]);
+        if (c < 0.0 || c >= (wsreal_t)grid->dims[i])
+            return 0;
+        cell[i] = (uintptr_t)c;
+    }
+    return 1;
+}
@@ -124,3 +124,31 @@ TEST(NAME, normalize_two_negatives)
     EXPECT_THAT(a.transmission, Le(1.0));
     EXPECT_THAT(a.absorption, Le(1.0));
 }
+
+TEST(NAME, equality_compares_bands)
+{
+    attribute_t a = attribute(1, 2, 3, 200, vec3(4, 5, 6));
+    attribute_t b = a;
+    b.band_absorption[3] = 0.9;
+    EXPECT_THAT(attribute_is_same(&a, &b), Eq(false));
+    b = a;
+    b.band_transmission[0] = 0.0;
+    EXPECT_THAT(attribute_is_same(&a, &b), Eq(false));
+}
+
+TEST(NAME, normalize_keeps_per_band_values)
+{
+    attribute_t a = attribute(2, 1, 1, 200, vec3(4, 5, 6));
+    a.band_absorption[0] = 0.1;
+    a.band_absorption[7] = 0.8;
+    a.band_transmission[7] = -0.2;
+    a.band_absorption[4] = 1.5;
+    a.band_transmission[4] = 0.5;
+    attribute_normalize_rta(&a);
+    EXPECT_THAT(a.reflection, DoubleEq(0.5));
+    EXPECT_THAT(a.band_absorption[0], DoubleEq(0.1));
+    EXPECT_THAT(a.band_absorption[7], DoubleEq(0.8));
+    EXPECT_THAT(a.band_transmission[7], DoubleEq(0.2));
+    EXPECT_THAT(a.band_absorption[4], DoubleEq(0.75));
+    EXPECT_THAT(a.band_transmission[4], DoubleEq(0.25));
+}
@@ -0,0 +1,84 @@
+#include "gmock/gmock.h"
+#include "wavesim/simulation/audio_listener.h"
+#include <math.h>
+
+#define NAME audio_listener
+
+using namespace ::testing;
+
+TEST(NAME, add_sample_resamples_to_listener_rate)
+{
+    audio_listener_t* al;
+    ASSERT_THAT(audio_listener_create(&al), Eq(WS_OK));
+    al->fs = 1000;
+
+    for (int i = 0; i != 20; ++i)
+        ASSERT_THAT(audio_listener_add_sample(al, 0.0005, 1.0), Eq(WS_OK));
+    EXPECT_THAT(vector_count(&al->samples), Eq(10u));
+
+    audio_listener_destroy(al);
+}
+
+TEST(NAME, trim_exponential_decay_at_60db)
+{
+    audio_listener_t* al;
+    ASSERT_THAT(audio_listener_create(&al), Eq(WS_OK));
+    al->fs = 1000;
+
+    // 60 dB of decay per second, recorded for 3 seconds
+    for (int i = 0; i != 3000; ++i)
+        *(wsreal_t*)vector_emplace(&al->samples) = pow(10.0, -3.0 * i / 1000.0);
+
+    EXPECT_THAT(audio_listener_trim_to_decay(al, -60), AllOf(Ge(990u), Le(1010u)));
+    EXPECT_THAT(vector_count(&al->samples), AllOf(Ge(990u), Le(1010u)));
+
+    audio_listener_destroy(al);
+}
+
+TEST(NAME, trim_silence_keeps_samples)
+{
+    audio_listener_t* al;
+    ASSERT_THAT(audio_listener_create(&al), Eq(WS_OK));
+
+    for (int i = 0; i != 100; ++i)
+        *(wsreal_t*)vector_emplace(&al->samples) = 0.0;
+    EXPECT_THAT(audio_listener_trim_to_decay(al, -60), Eq(100u));
+
+    audio_listener_destroy(al);
+}
+
+TEST(NAME, extrapolate_truncated_energy_decay)
+{
+    audio_listener_t* al;
+    ASSERT_THAT(audio_listener_create(&al), Eq(WS_OK));
+    al->energy_bin_width = 0.001;
+
+    // 60 dB of decay in 300ms, but only the first 200ms were traced
+    for (int i = 0; i != 200; ++i)
+        *(wsreal_t*)vector_emplace(&al->energy) = pow(10.0, -6.0 * i / 300.0);
+
+    ASSERT_THAT(audio_listener_extrapolate_energy_tail(al, -5, -25, -60, 10), Eq(WS_OK));
+    EXPECT_THAT(vector_count(&al->energy), AllOf(Ge(290u), Le(310u)));
+    for (uintptr_t i = 100; i < 280; i += 20)
+    {
+        wsreal_t expected = pow(10.0, -6.0 * i / 300.0);
+        EXPECT_THAT(*(wsreal_t*)vector_get(&al->energy, i), DoubleNear(expected, expected * 0.05));
+    }
+
+    audio_listener_destroy(al);
+}
+
+TEST(NAME, extrapolate_never_exceeds_max_duration)
+{
+    audio_listener_t* al;
+    ASSERT_THAT(audio_listener_create(&al), Eq(WS_OK));
+    al->energy_bin_width = 0.001;
+
+    for (int i = 0; i != 200; ++i)
+        *(wsreal_t*)vector_emplace(&al->energy) = pow(10.0, -6.0 * i / 300.0);
+
+    ASSERT_THAT(audio_listener_extrapolate_energy_tail(al, -5, -25, -60, 0.25), Eq(WS_OK));
+    EXPECT_THAT(vector_count(&al->energy), Eq(250u));
+
+    audio_listener_destroy(al);
+}
@@ -0,0 +1,259 @@
+#include "gmock/gmock.h"
+#include "wavesim/simulation/audio_listener.h"
+#include "wavesim/simulation/audio_source.h"
+#include "wavesim/simulation/bake.h"
+#include "wavesim/simulation/medium.h"
+#include "wavesim/simulation/simulation.h"
+#include <math.h>
+#include <stdio.h>
+#include <vector>
+
+#define NAME bake
+
+using namespace ::testing;
+
+static const char* prefix = "bake_test";
+
+// Writes a single impulse to every listener when the direct sound arrives.
+// Stateless, so it can run on any number of threads.
+static wsret fake_prepare(simulation_t* s)
+{
+    (void)s;
+    return WS_OK;
+}
+
+static int fake_advance(simulation_t* s, wsreal_t dt)
+{
+    const audio_source_t* as = *(audio_source_t**)vector_get(&s->audio_sources, 0);
+    for (uintptr_t i = 0; i != simulation_audio_listener_count(s); ++i)
+    {
+        audio_listener_t* al = simulation_get_audio_listener(s, i);
+        wsreal_t dx = al->position.v.x - as->position.v.x;
+        wsreal_t dy = al->position.v.y - as->position.v.y;
+        wsreal_t dz = al->position.v.z - as->position.v.z;
+        wsreal_t arrival = sqrt(dx*dx + dy*dy + dz*dz) / 343.0;
+        wsreal_t sample = (s->time <= arrival && arrival < s->time + dt) ? 1.0 : 0.0;
+        audio_listener_add_sample(al, dt, sample);
+    }
+    return s->time + dt < 0.05 ? 1 : 0;
+}
+
+static void fake_finalize(simulation_t* s)
+{
+    (void)s;
+}
+
+class NAME : public Test
+{
+protected:
+    virtual void SetUp() override
+    {
+        // Air in [0,2], a solid wall in [2,3] along x
+        wsreal_t air[6] = {0, 0, 0, 2, 1, 1};
+        wsreal_t solid[6] = {2, 0, 0, 3, 1, 1};
+        medium_construct(&medium);
+        ASSERT_THAT(medium_add_partition(&medium, air, attribute_default_air()), Eq(0));
+        ASSERT_THAT(medium_add_partition(&medium, solid, attribute_default_solid()), Eq(0));
+
+        simulation_construct(&sim, WAVESIM_ARD);
+        sim.prepare = fake_prepare;
+        sim.advance = fake_advance;
+        sim.finalize = fake_finalize;
+        sim.time_step = 1.0 / 8000;
+
+        bake_settings_set_default(&settings);
+        settings.probe_spacing = 1.0;
+        settings.emitter_spacing = 1.0;
+        settings.sample_rate = 8000;
+        settings.thread_count = 2;
+        settings.output_prefix = prefix;
+    }
+
+    virtual void TearDown() override
+    {
+        for (int i = 0; i != 2; ++i)
+        {
+            char name[64];
+            sprintf(name, "%s.%d.shard", prefix, i);
+            remove(name);
+            sprintf(name, "%s.%d.manifest", prefix, i);
+            remove(name);
+        }
+        remove("bake_test.wsfl");
+        simulation_destruct(&sim);
+        medium_destruct(&medium);
+    }
+
+    medium_t medium;
+    simulation_t sim;
+    bake_settings_t settings;
+};
+
+TEST_F(NAME, probes_inside_solids_are_skipped)
+{
+    bake_t bake;
+    ASSERT_THAT(bake_construct(&bake, &sim, &medium, &settings), Eq(WS_OK));
+    // 4x2x2 lattice points, the x=3 layer lies outside of the air
+    EXPECT_THAT(bake.listener_point_count, Eq(16u));
+    EXPECT_THAT(bake_remaining(&bake), Eq(12u));
+    EXPECT_THAT(vector_count(&bake.emitters), Eq(12u));
+    EXPECT_THAT(bake.completed, Eq(0u));
+    bake_destruct(&bake);
+}
+
+TEST_F(NAME, run_and_merge)
+{
+    bake_t bake;
+    ASSERT_THAT(bake_construct(&bake, &sim, &medium, &settings), Eq(WS_OK));
+    ASSERT_THAT(bake_run(&bake), Eq(WS_OK));
+    EXPECT_THAT(bake_remaining(&bake), Eq(0u));
+    EXPECT_THAT(bake.completed, Eq(12u));
+    bake_destruct(&bake);
+
+    ASSERT_THAT(bake_merge(prefix, 1, "bake_test.wsfl"), Eq(WS_OK));
+    filter_lattice_t fl;
+    filter_lattice_filter_t f;
+    ASSERT_THAT(filter_lattice_open(&fl, "bake_test.wsfl"), Eq(WS_OK));
+    wsreal_t listener[3] = {0, 0, 0};
+    wsreal_t emitter[3] = {1, 1, 1};
+    ASSERT_THAT(filter_lattice_lookup(&fl, listener, emitter, &f), Eq(1));
+    EXPECT_THAT(f.tap_delay[0], DoubleNear(sqrt(3.0) / 343.0, 2.0 / 8000));
+
+    // Inside the wall
+    emitter[0] = 3;
+    EXPECT_THAT(filter_lattice_lookup(&fl, listener, emitter, &f), Eq(0));
+    filter_lattice_close(&fl);
+}
+
+TEST_F(NAME, resume_skips_completed_probes)
+{
+    bake_t bake;
+    ASSERT_THAT(bake_construct(&bake, &sim, &medium, &settings), Eq(WS_OK));
+    ASSERT_THAT(bake_run(&bake), Eq(WS_OK));
+    bake_destruct(&bake);
+
+    ASSERT_THAT(bake_construct(&bake, &sim, &medium, &settings), Eq(WS_OK));
+    EXPECT_THAT(bake_remaining(&bake), Eq(0u));
+    EXPECT_THAT(bake.completed, Eq(12u));
+    bake_destruct(&bake);
+
+    // Different settings don't match the manifest
+    settings.emitter_spacing = 0.5;
+    EXPECT_THAT(bake_construct(&bake, &sim, &medium, &settings), Eq(WS_ERR_BAD_FILE_FORMAT));
+
+    // Same point counts, but they don't match the shard's header
+    settings.emitter_spacing = 1;
+    settings.sample_rate = 16000;
+    EXPECT_THAT(bake_construct(&bake, &sim, &medium, &settings), Eq(WS_ERR_BAD_FILE_FORMAT));
+}
+
+TEST_F(NAME, resume_after_a_killed_bake_cuts_the_shard_back)
+{
+    bake_t bake;
+    ASSERT_THAT(bake_construct(&bake, &sim, &medium, &settings), Eq(WS_OK));
+    ASSERT_THAT(bake_run(&bake), Eq(WS_OK));
+    bake_destruct(&bake);
+
+    // Keep 4 complete entries and half of the 5th one, and cut the 5th line
+    // of the manifest short, the way a killed bake would leave them
+    char header[128];
+    unsigned long probe[6], offset[6];
+    FILE* fp = fopen("bake_test.0.manifest", "r");
+    ASSERT_THAT(fp, NotNull());
+    ASSERT_THAT(fgets(header, sizeof(header), fp), NotNull());
+    for (int i = 0; i != 6; ++i)
+        ASSERT_THAT(fscanf(fp, "%lu %lu", &probe[i], &offset[i]), Eq(2));
+    fclose(fp);
+    fp = fopen("bake_test.0.manifest", "w");
+    ASSERT_THAT(fp, NotNull());
+    fputs(header, fp);
+    for (int i = 0; i != 4; ++i)
+        fprintf(fp, "%lu %lu\n", probe[i], offset[i]);
+    fprintf(fp, "%lu", probe[4]);
+    fclose(fp);
+
+    std::vector<char> data(offset[4] + (offset[5] - offset[4]) / 2);
+    fp = fopen("bake_test.0.shard", "rb");
+    ASSERT_THAT(fp, NotNull());
+    ASSERT_THAT(fread(data.data(), 1, data.size(), fp), Eq(data.size()));
+    fclose(fp);
+    fp = fopen("bake_test.0.shard", "wb");
+    ASSERT_THAT(fp, NotNull());
+    ASSERT_THAT(fwrite(data.data(), 1, data.size(), fp), Eq(data.size()));
+    fclose(fp);
+
+    ASSERT_THAT(bake_construct(&bake, &sim, &medium, &settings), Eq(WS_OK));
+    EXPECT_THAT(bake.completed, Eq(4u));
+    EXPECT_THAT(bake_remaining(&bake), Eq(8u));
+    ASSERT_THAT(bake_run(&bake), Eq(WS_OK));
+    bake_destruct(&bake);
+
+    ASSERT_THAT(bake_merge(prefix, 1, "bake_test.wsfl"), Eq(WS_OK));
+    filter_lattice_t fl;
+    filter_lattice_filter_t f;
+    ASSERT_THAT(filter_lattice_open(&fl, "bake_test.wsfl"), Eq(WS_OK));
+    for (int l = 0; l != 12; ++l)
+        for (int e = 0; e != 12; ++e)
+        {
+            wsreal_t listener[3] = {(wsreal_t)(l % 3), (wsreal_t)((l / 3) % 2), (wsreal_t)(l / 6)};
+            wsreal_t emitter[3] = {(wsreal_t)(e % 3), (wsreal_t)((e / 3) % 2), (wsreal_t)(e / 6)};
+            wsreal_t dx = listener[0] - emitter[0];
+            wsreal_t dy = listener[1] - emitter[1];
+            wsreal_t dz = listener[2] - emitter[2];
+            ASSERT_THAT(filter_lattice_lookup(&fl, listener, emitter, &f), Eq(1));
+            EXPECT_THAT(f.tap_delay[0], DoubleNear(sqrt(dx*dx + dy*dy + dz*dz) / 343.0, 2.0 / 8000));
+        }
+    filter_lattice_close(&fl);
+}
+
+TEST_F(NAME, probes_are_split_across_processes)
+{
+    bake_t bake;
+    settings.process_count = 2;
+    settings.process_index = 1;
+    ASSERT_THAT(bake_construct(&bake, &sim, &medium, &settings), Eq(WS_OK));
+    EXPECT_THAT(bake_remaining(&bake), Eq(6u));
+    ASSERT_THAT(bake_run(&bake), Eq(WS_OK));
+    bake_destruct(&bake);
+
+    settings.process_index = 0;
+    ASSERT_THAT(bake_construct(&bake, &sim, &medium, &settings), Eq(WS_OK));
+    EXPECT_THAT(bake_remaining(&bake), Eq(6u));
+    ASSERT_THAT(bake_run(&bake), Eq(WS_OK));
+    bake_destruct(&bake);
+
+    ASSERT_THAT(bake_merge(prefix, 2, "bake_test.wsfl"), Eq(WS_OK));
+    filter_lattice_t fl;
+    ASSERT_THAT(filter_lattice_open(&fl, "bake_test.wsfl"), Eq(WS_OK));
+    wsreal_t listeners[6] = {0, 0, 0, 1, 0, 0};
+    wsreal_t emitters[6] = {1, 0, 0, 1, 0, 0};
+    filter_lattice_filter_t f[2];
+    EXPECT_THAT(filter_lattice_lookup_batch(&fl, listeners, emitters, 2, f, NULL), Eq(2u));
+    EXPECT_THAT(f[0].tap_delay[0], DoubleNear(1.0 / 343.0, 2.0 / 8000));
+    EXPECT_THAT(f[1].tap_delay[0], DoubleNear(0.0, 2.0 / 8000));
+    filter_lattice_close(&fl);
+}
+
+TEST_F(NAME, merge_skips_processes_without_a_shard)
+{
+    // Nothing was baked yet
+    EXPECT_THAT(bake_merge(prefix, 2, "bake_test.wsfl"), Eq(WS_ERR_FOPEN_FAILED));
+
+    bake_t bake;
+    settings.process_count = 2;
+    settings.process_index = 1;
+    ASSERT_THAT(bake_construct(&bake, &sim, &medium, &settings), Eq(WS_OK));
+    ASSERT_THAT(bake_run(&bake), Eq(WS_OK));
+    bake_destruct(&bake);
+
+    // Process 0 never ran, so only the probes of process 1 have data
+    ASSERT_THAT(bake_merge(prefix, 2, "bake_test.wsfl"), Eq(WS_OK));
+    filter_lattice_t fl;
+    ASSERT_THAT(filter_lattice_open(&fl, "bake_test.wsfl"), Eq(WS_OK));
+    wsreal_t listeners[6] = {0, 0, 0, 1, 0, 0};
+    wsreal_t emitters[6] = {1, 0, 0, 1, 0, 0};
+    filter_lattice_filter_t f[2];
+    uintptr_t found = filter_lattice_lookup_batch(&fl, listeners, emitters, 2, f, NULL);
+    EXPECT_THAT(found, Eq(1u));
+    filter_lattice_close(&fl);
+}
@@ -0,0 +1,334 @@
+#include "gmock/gmock.h"
+#include "wavesim/mesh/bvh.h"
+#include "wavesim/mesh/intersections.h"
+#include "wavesim/random.h"
+#include <math.h>
+#include <vector>
+
+#define NAME bvh
+
+using namespace ::testing;
+
+class NAME : public Test
+{
+protected:
+    virtual void SetUp() override
+    {
+        // Small random triangles scattered in a 10m cube, plus a few large
+        // ones spanning all of it
+        random_t rng;
+        random_seed(&rng, 7);
+        for (int i = 0; i != 500; ++i)
+        {
+            wsreal_t c[3], size = (i < 5 ? 10.0 : 0.5);
+            for (int j = 0; j != 3; ++j)
+                c[j] = random_uniform(&rng) * 10;
+            for (int v = 0; v != 3; ++v)
+                for (int j = 0; j != 3; ++j)
+                    vertices.push_back(c[j] + (random_uniform(&rng) - 0.5) * size);
+        }
+        bvh_construct(&tree);
+        ASSERT_THAT(bvh_build(&tree, vertices.data(), 500), Eq(WS_OK));
+        random_seed(&rng, 8);
+        rng_ = rng;
+    }
+
+    virtual void TearDown() override
+    {
+        bvh_destruct(&tree);
+    }
+
+    int brute_force(const wsreal_t o[3], const wsreal_t d[3], wsreal_t* closest, uint32_t* id)
+    {
+        return brute_force(vertices, o, d, closest, id);
+    }
+
+    static int brute_force(const std::vector<wsreal_t>& tris, const wsreal_t o[3], const wsreal_t d[3], wsreal_t* closest, uint32_t* id)
+    {
+        int found = 0;
+        *closest = INFINITY;
+        for (uint32_t i = 0; i != tris.size() / 9; ++i)
+        {
+            wsreal_t t, bary[3];
+            const wsreal_t* v = &tris[i * 9];
+            if (intersect_ray_triangle(&t, bary, o, d, v, v + 3, v + 6) && t < *closest)
+            {
+                *closest = t;
+                *id = i;
+                found = 1;
+            }
+        }
+        return found;
+    }
+
+    std::vector<wsreal_t> vertices;
+    bvh_t tree;
+    random_t rng_;
+};
+
+TEST_F(NAME, nodes_are_32_bytes_and_depth_first)
+{
+    EXPECT_THAT(sizeof(bvh_node_t), Eq(32u));
+    EXPECT_THAT(tree.triangle_count, Eq(500u));
+
+    // Every triangle is in exactly one leaf
+    std::vector<int> seen(500, 0);
+    for (uintptr_t i = 0; i != tree.node_count; ++i)
+    {
+        const bvh_node_t* node = &tree.nodes[i];
+        if (node->count == 0)
+        {
+            EXPECT_THAT(node->offset, Gt(i + 1));
+            continue;
+        }
+        EXPECT_THAT(node->count, Le(BVH_MAX_LEAF_SIZE));
+        // Leaves start on a block boundary
+        EXPECT_THAT(node->offset % BVH_BLOCK_SIZE, Eq(0u));
+        for (uint32_t t = node->offset; t != node->offset + node->count; ++t)
+            seen[tree.triangle_ids[t]]++;
+    }
+    for (int i = 0; i != 500; ++i)
+        EXPECT_THAT(seen[i], Eq(1));
+}
+
+TEST_F(NAME, first_hit_matches_brute_force)
+{
+    for (int i = 0; i != 2000; ++i)
+    {
+        wsreal_t o[3], d[3], expected;
+        uint32_t expected_id = 0;
+        bvh_hit_t hit;
+        for (int j = 0; j != 3; ++j)
+            o[j] = random_uniform(&rng_) * 12 - 1;
+        random_unit_vector(&rng_, d);
+
+        int found = brute_force(o, d, &expected, &expected_id);
+        ASSERT_THAT(bvh_ray_first_hit(&tree, o, d, INFINITY, BVH_NO_TRIANGLE, &hit), Eq(found));
+        EXPECT_THAT(bvh_ray_any_hit(&tree, o, d, INFINITY, BVH_NO_TRIANGLE), Eq(found));
+        if (found)
+        {
+            EXPECT_THAT(hit.distance, DoubleEq(expected));
+            EXPECT_THAT(hit.triangle, Eq(expected_id));
+            // Nothing is closer than the first hit
+            EXPECT_THAT(bvh_ray_any_hit(&tree, o, d, expected * 0.999, BVH_NO_TRIANGLE), Eq(0));
+        }
+    }
+}
+
+TEST_F(NAME, packet_matches_single_rays)
+{
+    for (int i = 0; i != 200; ++i)
+    {
+        // Coherent packet: common origin, similar directions, partially full
+        bvh_ray_packet_t packet;
+        bvh_hit_t hits[BVH_PACKET_SIZE];
+        char found[BVH_PACKET_SIZE];
+        wsreal_t o[3], base[3];
+        for (int j = 0; j != 3; ++j)
+            o[j] = random_uniform(&rng_) * 12 - 1;
+        random_unit_vector(&rng_, base);
+        packet.count = 1 + (uintptr_t)i % BVH_PACKET_SIZE;
+        for (uintptr_t r = 0; r != packet.count; ++r)
+        {
+            wsreal_t jitter[3];
+            random_unit_vector(&rng_, jitter);
+            for (int j = 0; j != 3; ++j)
+            {
+                packet.origin[j][r] = o[j];
+                packet.direction[j][r] = base[j] + jitter[j] * 0.2;
+            }
+            packet.max_distance[r] = (r == 3 ? 2.0 : INFINITY);
+            packet.ignore_triangle[r] = (r == 5 ? 0 : BVH_NO_TRIANGLE);
+        }
+
+        uintptr_t expected_count = 0;
+        uintptr_t count = bvh_ray_packet_first_hit(&tree, &packet, hits, found);
+        for (uintptr_t r = 0; r != packet.count; ++r)
+        {
+            bvh_hit_t hit;
+            wsreal_t ro[3], rd[3];
+            for (int j = 0; j != 3; ++j)
+            {
+                ro[j] = packet.origin[j][r];
+                rd[j] = packet.direction[j][r];
+            }
+            int single = bvh_ray_first_hit(&tree, ro, rd, packet.max_distance[r], packet.ignore_triangle[r], &hit);
+            ASSERT_THAT(found[r], Eq(single));
+            expected_count += (uintptr_t)single;
+            if (single)
+            {
+                EXPECT_THAT(hits[r].distance, DoubleEq(hit.distance));
+                EXPECT_THAT(hits[r].triangle, Eq(hit.triangle));
+            }
+        }
+        EXPECT_THAT(count, Eq(expected_count));
+    }
+}
+
+TEST_F(NAME, ignored_triangle_is_skipped)
+{
+    // Straight down through the middle of triangle 0
+    const wsreal_t* v = &vertices[0];
+    wsreal_t o[3], d[3] = {0, 0, 0}, hit_distance;
+    for (int j = 0; j != 3; ++j)
+        o[j] = (v[j] + v[j+3] + v[j+6]) / 3;
+    wsreal_t n[3] = {v[3]-v[0], v[4]-v[1], v[5]-v[2]};
+    wsreal_t e[3] = {v[6]-v[0], v[7]-v[1], v[8]-v[2]};
+    d[0] = n[1]*e[2] - n[2]*e[1];
+    d[1] = n[2]*e[0] - n[0]*e[2];
+    d[2] = n[0]*e[1] - n[1]*e[0];
+    for (int j = 0; j != 3; ++j)
+        o[j] -= d[j];
+
+    bvh_hit_t hit;
+    ASSERT_THAT(bvh_ray_first_hit(&tree, o, d, INFINITY, BVH_NO_TRIANGLE, &hit), Eq(1));
+    hit_distance = hit.distance;
+    if (hit.triangle == 0)
+    {
+        EXPECT_THAT(hit_distance, DoubleNear(1.0, 1e-9));
+        if (bvh_ray_first_hit(&tree, o, d, INFINITY, 0, &hit))
+            EXPECT_THAT(hit.triangle, Ne(0u));
+    }
+}
+
+TEST_F(NAME, aabb_query_matches_brute_force)
+{
+    wsreal_t box[6] = {2, 2, 2, 4, 5, 3};
+    vector_t result;
+    vector_construct(&result, sizeof(uint32_t));
+    ASSERT_THAT(bvh_query_aabb(&tree, &result, box), Eq(WS_OK));
+
+    std::vector<int> expected(500, 0), found(500, 0);
+    for (int i = 0; i != 500; ++i)
+    {
+        const wsreal_t* v = &vertices[i * 9];
+        int overlaps = 1;
+        for (int j = 0; j != 3; ++j)
+        {
+            wsreal_t lo = fmin(v[j], fmin(v[j+3], v[j+6]));
+            wsreal_t hi = fmax(v[j], fmax(v[j+3], v[j+6]));
+            if (hi < box[j] || lo > box[j+3])
+                overlaps = 0;
+        }
+        expected[i] = overlaps;
+    }
+    for (uintptr_t i = 0; i != vector_count(&result); ++i)
+        found[*(uint32_t*)vector_get(&result, i)]++;
+    for (int i = 0; i != 500; ++i)
+        EXPECT_THAT(found[i], Eq(expected[i]));
+
+    vector_clear_free(&result);
+}
+
+TEST_F(NAME, empty_bvh_hits_nothing)
+{
+    bvh_t empty;
+    bvh_hit_t hit;
+    wsreal_t o[3] = {0, 0, 0}, d[3] = {1, 0, 0};
+    bvh_construct(&empty);
+    ASSERT_THAT(bvh_build(&empty, NULL, 0), Eq(WS_OK));
+    EXPECT_THAT(bvh_ray_first_hit(&empty, o, d, INFINITY, BVH_NO_TRIANGLE, &hit), Eq(0));
+    bvh_destruct(&empty);
+}
+
+TEST_F(NAME, refit_matches_brute_force)
+{
+    // Deform everything, the triangles stay the same
+    for (uintptr_t i = 0; i != vertices.size(); ++i)
+        vertices[i] += sin(vertices[i] * 3 + (wsreal_t)i) * 0.5 + 1.0;
+    bvh_refit(&tree, vertices.data());
+
+    for (int i = 0; i != 1000; ++i)
+    {
+        wsreal_t o[3], d[3], expected;
+        uint32_t expected_id = 0;
+        bvh_hit_t hit;
+        for (int j = 0; j != 3; ++j)
+            o[j] = random_uniform(&rng_) * 14 - 1;
+        random_unit_vector(&rng_, d);
+
+        int found = brute_force(o, d, &expected, &expected_id);
+        ASSERT_THAT(bvh_ray_first_hit(&tree, o, d, INFINITY, BVH_NO_TRIANGLE, &hit), Eq(found));
+        if (found)
+        {
+            EXPECT_THAT(hit.distance, DoubleEq(expected));
+            EXPECT_THAT(hit.triangle, Eq(expected_id));
+        }
+    }
+}
+
+TEST_F(NAME, scene_instances_match_transformed_triangles)
+{
+    // The tree as is, and rotated 90 degrees about z, scaled and moved next to it
+    const wsreal_t transform[12] = {
+        0, -2, 0, 25,
+        2,  0, 0, 0,
+        0,  0, 2, 0
+    };
+    bvh_scene_t scene;
+    bvh_scene_construct(&scene);
+    ASSERT_THAT(bvh_scene_add_instance(&scene, &tree, 0), Eq(WS_OK));
+    ASSERT_THAT(bvh_scene_add_instance(&scene, &tree, 500), Eq(WS_OK));
+    ASSERT_THAT(bvh_scene_build(&scene), Eq(WS_OK));
+    bvh_scene_set_transform(&scene, 1, transform);
+    bvh_scene_refit(&scene);
+
+    std::vector<wsreal_t> world = vertices;
+    for (uintptr_t v = 0; v != vertices.size() / 3; ++v)
+        for (int i = 0; i != 3; ++i)
+            world.push_back(transform[i*4] * vertices[v*3] + transform[i*4+1] * vertices[v*3+1] +
+                            transform[i*4+2] * vertices[v*3+2] + transform[i*4+3]);
+
+    for (int i = 0; i != 500; ++i)
+    {
+        bvh_ray_packet_t packet;
+        bvh_hit_t hits[BVH_PACKET_SIZE];
+        char found[BVH_PACKET_SIZE];
+        wsreal_t o[3], base[3];
+        o[0] = random_uniform(&rng_) * 30 - 15;
+        o[1] = random_uniform(&rng_) * 20 - 5;
+        o[2] = random_uniform(&rng_) * 20 - 5;
+        random_unit_vector(&rng_, base);
+        packet.count = BVH_PACKET_SIZE;
+        for (uintptr_t r = 0; r != packet.count; ++r)
+        {
+            wsreal_t jitter[3];
+            random_unit_vector(&rng_, jitter);
+            for (int j = 0; j != 3; ++j)
+            {
+                packet.origin[j][r] = o[j];
+                packet.direction[j][r] = base[j] + jitter[j] * 0.2;
+            }
+            packet.max_distance[r] = INFINITY;
+            packet.ignore_triangle[r] = BVH_NO_TRIANGLE;
+        }
+        bvh_scene_ray_packet_first_hit(&scene, &packet, hits, found);
+
+        for (uintptr_t r = 0; r != packet.count; ++r)
+        {
+            wsreal_t ro[3], rd[3], expected;
+            uint32_t expected_id = 0;
+            bvh_hit_t hit;
+            for (int j = 0; j != 3; ++j)
+            {
+                ro[j] = packet.origin[j][r];
+                rd[j] = packet.direction[j][r];
+            }
+
+            // Transforming the ray rounds differently than transforming the triangles
+            int expect_hit = brute_force(world, ro, rd, &expected, &expected_id);
+            ASSERT_THAT(bvh_scene_ray_first_hit(&scene, ro, rd, INFINITY, BVH_NO_TRIANGLE, &hit), Eq(expect_hit));
+            ASSERT_THAT(found[r], Eq(expect_hit));
+            EXPECT_THAT(bvh_scene_ray_any_hit(&scene, ro, rd, INFINITY, BVH_NO_TRIANGLE), Eq(expect_hit));
+            if (expect_hit)
+            {
+                EXPECT_THAT(hit.distance, DoubleNear(expected, 1e-9));
+                EXPECT_THAT(hit.triangle, Eq(expected_id));
+                EXPECT_THAT(hits[r].distance, DoubleEq(hit.distance));
+                EXPECT_THAT(hits[r].triangle, Eq(hit.triangle));
+            }
+        }
+    }
+
+    bvh_scene_destruct(&scene);
+}
@@ -0,0 +1,119 @@
+#include "gmock/gmock.h"
+#include "wavesim/simulation/convolver.h"
+#include <vector>
+
+#define NAME convolver
+
+using namespace ::testing;
+
+static std::vector<wsreal_t> make_signal(int length, unsigned seed)
+{
+    std::vector<wsreal_t> signal(length);
+    for (int i = 0; i != length; ++i)
+    {
+        seed = seed * 1103515245u + 12345u;
+        signal[i] = (wsreal_t)((seed >> 16) & 0x7FFF) / 16384.0 - 1.0;
+    }
+    return signal;
+}
+
+static std::vector<wsreal_t> direct_convolution(const std::vector<wsreal_t>& x, const std::vector<wsreal_t>& h)
+{
+    std::vector<wsreal_t> y(x.size(), 0.0);
+    for (size_t n = 0; n != x.size(); ++n)
+        for (size_t k = 0; k != h.size() && k <= n; ++k)
+            y[n] += x[n - k] * h[k];
+    return y;
+}
+
+TEST(NAME, matches_direct_convolution)
+{
+    const int block_size = 16;
+    std::vector<wsreal_t> h = make_signal(53, 1); // not a multiple of the block size
+    std::vector<wsreal_t> x = make_signal(block_size * 12, 2);
+    std::vector<wsreal_t> expected = direct_convolution(x, h);
+    std::vector<wsreal_t> y(x.size());
+
+    convolver_ir_t ir;
+    convolver_t conv;
+    ASSERT_THAT(convolver_ir_construct(&ir, h.data(), h.size(), block_size), Eq(WS_OK));
+    ASSERT_THAT(convolver_construct(&conv, &ir), Eq(WS_OK));
+    EXPECT_THAT(ir.partition_count, Eq(4u));
+
+    for (size_t i = 0; i < x.size(); i += block_size)
+        convolver_process(&conv, &x[i], &y[i]);
+
+    for (size_t i = 0; i != x.size(); ++i)
+        EXPECT_THAT(y[i], DoubleNear(expected[i], 1e-9)) << "sample " << i;
+
+    convolver_destruct(&conv);
+    convolver_ir_destruct(&ir);
+}
+
+TEST(NAME, reset_clears_history)
+{
+    const int block_size = 8;
+    std::vector<wsreal_t> h = make_signal(20, 3);
+    std::vector<wsreal_t> x = make_signal(block_size, 4);
+    std::vector<wsreal_t> first(block_size), second(block_size);
+
+    convolver_ir_t ir;
+    convolver_t conv;
+    ASSERT_THAT(convolver_ir_construct(&ir, h.data(), h.size(), block_size), Eq(WS_OK));
+    ASSERT_THAT(convolver_construct(&conv, &ir), Eq(WS_OK));
+
+    convolver_process(&conv, x.data(), first.data());
+    convolver_process(&conv, x.data(), second.data());
+    convolver_reset(&conv);
+    convolver_process(&conv, x.data(), second.data());
+
+    for (int i = 0; i != block_size; ++i)
+        EXPECT_THAT(second[i], DoubleNear(first[i], 1e-12));
+
+    convolver_destruct(&conv);
+    convolver_ir_destruct(&ir);
+}
+
+TEST(NAME, batch_matches_individual_voices)
+{
+    const int block_size = 32;
+    const int voices = 3;
+    std::vector<wsreal_t> h = make_signal(100, 5);
+
+    convolver_ir_t ir;
+    convolver_t batch[voices], single[voices];
+    ASSERT_THAT(convolver_ir_construct(&ir, h.data(), h.size(), block_size), Eq(WS_OK));
+    for (int v = 0; v != voices; ++v)
+    {
+        ASSERT_THAT(convolver_construct(&batch[v], &ir), Eq(WS_OK));
+        ASSERT_THAT(convolver_construct(&single[v], &ir), Eq(WS_OK));
+    }
+
+    for (int block = 0; block != 6; ++block)
+    {
+        std::vector<wsreal_t> in[voices], out_batch[voices], out_single[voices];
+        const wsreal_t* in_ptrs[voices];
+        wsreal_t* out_ptrs[voices];
+        for (int v = 0; v != voices; ++v)
+        {
+            in[v] = make_signal(block_size, 100 + block * voices + v);
+            out_batch[v].resize(block_size);
+            out_single[v].resize(block_size);
+            in_ptrs[v] = in[v].data();
+            out_ptrs[v] = out_batch[v].data();
+            convolver_process(&single[v], in[v].data(), out_single[v].data());
+        }
+        convolver_process_batch(&ir, batch, in_ptrs, out_ptrs, voices);
+
+        for (int v = 0; v != voices; ++v)
+            for (int i = 0; i != block_size; ++i)
+                EXPECT_THAT(out_batch[v][i], DoubleNear(out_single[v][i], 1e-12));
+    }
+
+    for (int v = 0; v != voices; ++v)
+    {
+        convolver_destruct(&batch[v]);
+        convolver_destruct(&single[v]);
+    }
+    convolver_ir_destruct(&ir);
+}
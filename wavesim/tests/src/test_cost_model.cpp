@@ -0,0 +1,66 @@
+#include "gmock/gmock.h"
+#include "wavesim/simulation/cost_model.h"
+#include "wavesim/simulation/medium.h"
+
+#define NAME cost_model
+
+using namespace ::testing;
+
+class NAME : public Test
+{
+protected:
+    virtual void SetUp() override
+    {
+        medium_construct(&medium);
+        medium.boundary = aabb(0, 0, 0, 4, 4, 4);
+    }
+
+    virtual void TearDown() override
+    {
+        medium_destruct(&medium);
+    }
+
+    void add_box(wsreal_t x0, wsreal_t y0, wsreal_t z0, wsreal_t x1, wsreal_t y1, wsreal_t z1)
+    {
+        wsreal_t bb[6] = {x0, y0, z0, x1, y1, z1};
+        ASSERT_THAT(medium_add_partition(&medium, bb, attribute_default_air()), Eq(WS_OK));
+    }
+
+    medium_t medium;
+    wsreal_t grid_size[3] = {1, 1, 1};
+};
+
+TEST_F(NAME, calibration_measures_this_machine)
+{
+    cost_model_t model;
+    cost_model_construct(&model);
+    EXPECT_THAT(model.calibrated, Eq(0));
+    ASSERT_THAT(cost_model_calibrate(&model), Eq(WS_OK));
+    EXPECT_THAT(model.calibrated, Ne(0));
+    EXPECT_THAT(model.transform, Gt(0));
+    EXPECT_THAT(model.interface, Gt(0));
+    EXPECT_THAT(model.partition, Ge(0));
+}
+
+TEST_F(NAME, one_partition_has_no_interfaces)
+{
+    cost_model_t model = {1, 0, 1, 1};
+    add_box(0, 0, 0, 4, 4, 4);
+    EXPECT_THAT(cost_model_predict(&model, &medium, grid_size), DoubleEq(1));
+
+    // 64 cells, 64 * log2(64) = 384
+    cost_model_t transform_only = {0, 1, 0, 1};
+    EXPECT_THAT(cost_model_predict(&transform_only, &medium, grid_size), DoubleNear(384, 1e-9));
+}
+
+TEST_F(NAME, every_partition_and_interface_cell_costs)
+{
+    for (int z = 0; z != 4; ++z)
+        for (int y = 0; y != 4; ++y)
+            for (int x = 0; x != 4; ++x)
+                add_box(x, y, z, x + 1, y + 1, z + 1);
+
+    // 64 partitions. 3 axes * 3 inner planes * 16 cells = 144 interface cells
+    cost_model_t model = {1, 0, 1, 1};
+    EXPECT_THAT(cost_model_predict(&model, &medium, grid_size), DoubleEq(64 + 144));
+}
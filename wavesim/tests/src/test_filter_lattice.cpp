@@ -0,0 +1,185 @@
+#include "gmock/gmock.h"
+#include "wavesim/simulation/filter_lattice.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#define NAME filter_lattice
+
+using namespace ::testing;
+
+static filter_lattice_filter_t make_filter(wsreal_t delay, wsreal_t level, wsreal_t decay)
+{
+    filter_lattice_filter_t f;
+    for (int i = 0; i != FILTER_LATTICE_TAP_COUNT; ++i)
+    {
+        f.tap_delay[i] = delay + i * 0.001;
+        f.tap_gain[i] = 0.5 / (i + 1);
+    }
+    for (int i = 0; i != FILTER_LATTICE_BAND_COUNT; ++i)
+    {
+        f.band_level[i] = level;
+        f.band_decay[i] = decay;
+    }
+    return f;
+}
+
+TEST(NAME, encode_decode_roundtrip)
+{
+    filter_lattice_record_t record;
+    filter_lattice_filter_t in = make_filter(0.01, 0.25, 1.2), out;
+
+    filter_lattice_encode(&record, &in, 48000);
+    filter_lattice_decode(&out, &record, 48000);
+    EXPECT_THAT(sizeof(record), Eq(48u));
+    EXPECT_THAT(filter_lattice_record_is_empty(&record), Eq(0));
+
+    for (int i = 0; i != FILTER_LATTICE_TAP_COUNT; ++i)
+    {
+        EXPECT_THAT(out.tap_delay[i], DoubleNear(in.tap_delay[i], 1.0 / 48000));
+        EXPECT_THAT(out.tap_gain[i], DoubleNear(in.tap_gain[i], 1.0 / 32768));
+    }
+    for (int i = 0; i != FILTER_LATTICE_BAND_COUNT; ++i)
+    {
+        EXPECT_THAT(20 * log10(out.band_level[i]), DoubleNear(20 * log10(in.band_level[i]), 0.25));
+        EXPECT_THAT(out.band_decay[i], DoubleNear(in.band_decay[i], in.band_decay[i] * 0.015));
+    }
+}
+
+TEST(NAME, save_open_and_interpolate)
+{
+    const char* file_name = "filter_lattice_test.wsfl";
+    filter_lattice_grid_t listener_grid = {{0, 0, 0}, 2.0, {2, 1, 1}};
+    filter_lattice_grid_t emitter_grid = {{-1, -1, -1}, 1.0, {2, 2, 2}};
+    std::vector<filter_lattice_record_t> records(2 * 8);
+
+    // Emitter points along x=0 have short decays, along x=1 long ones. The
+    // second listener point has no data at the x=1 emitter points.
+    for (int l = 0; l != 2; ++l)
+        for (int e = 0; e != 8; ++e)
+        {
+            filter_lattice_filter_t f = make_filter(0.01 + l * 0.01, 0.5, (e & 1) ? 2.0 : 1.0);
+            filter_lattice_encode(&records[l * 8 + e], &f, 48000);
+            if (l == 1 && (e & 1))
+                filter_lattice_record_set_empty(&records[l * 8 + e]);
+        }
+    ASSERT_THAT(filter_lattice_save(file_name, &listener_grid, &emitter_grid, 48000, records.data()), Eq(WS_OK));
+
+    filter_lattice_t fl;
+    ASSERT_THAT(filter_lattice_open(&fl, file_name), Eq(WS_OK));
+
+    filter_lattice_filter_t f;
+    wsreal_t listener[3] = {0.2, 0, 0};
+    wsreal_t emitter[3] = {-0.5, -0.5, -0.5};
+    ASSERT_THAT(filter_lattice_lookup(&fl, listener, emitter, &f), Eq(1));
+    EXPECT_THAT(f.tap_delay[0], DoubleNear(0.01, 1e-4));
+    EXPECT_THAT(f.band_decay[0], DoubleNear(1.5, 0.03));
+
+    // Snaps to the second listener point, only the x=0 emitter points have data
+    listener[0] = 1.8;
+    ASSERT_THAT(filter_lattice_lookup(&fl, listener, emitter, &f), Eq(1));
+    EXPECT_THAT(f.tap_delay[0], DoubleNear(0.02, 1e-4));
+    EXPECT_THAT(f.band_decay[0], DoubleNear(1.0, 0.02));
+
+    emitter[0] = 0.0;
+    ASSERT_THAT(filter_lattice_lookup(&fl, listener, emitter, &f), Eq(0));
+
+    // Batch lookup
+    wsreal_t listeners[6] = {0, 0, 0, 2, 0, 0};
+    wsreal_t emitters[6] = {-1, -1, -1, 0, 0, 0};
+    filter_lattice_filter_t filters[2];
+    char found[2];
+    EXPECT_THAT(filter_lattice_lookup_batch(&fl, listeners, emitters, 2, filters, found), Eq(1u));
+    EXPECT_THAT(found[0], Eq(1));
+    EXPECT_THAT(found[1], Eq(0));
+
+    filter_lattice_close(&fl);
+    remove(file_name);
+}
+
+// A valid header of a 1x1x1 lattice of listeners and emitters
+static filter_lattice_header_t minimal_header()
+{
+    filter_lattice_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "WSFL", 4);
+    header.version = FILTER_LATTICE_VERSION;
+    header.byte_order = FILTER_LATTICE_BYTE_ORDER;
+    header.tap_count = FILTER_LATTICE_TAP_COUNT;
+    header.band_count = FILTER_LATTICE_BAND_COUNT;
+    header.sample_rate = 48000;
+    header.listener_spacing = 1;
+    header.emitter_spacing = 1;
+    header.listener_dims[0] = header.listener_dims[1] = header.listener_dims[2] = 1;
+    header.emitter_dims[0] = header.emitter_dims[1] = header.emitter_dims[2] = 1;
+    return header;
+}
+
+TEST(NAME, open_rejects_truncated_data)
+{
+    struct { filter_lattice_header_t header; filter_lattice_record_t record; } file;
+    filter_lattice_t fl;
+    file.header = minimal_header();
+    filter_lattice_record_set_empty(&file.record);
+
+    EXPECT_THAT(filter_lattice_open_memory(&fl, &file, sizeof(file)), Eq(WS_OK));
+    EXPECT_THAT(filter_lattice_open_memory(&fl, &file, sizeof(file.header)), Eq(WS_ERR_BAD_FILE_FORMAT));
+    EXPECT_THAT(filter_lattice_open(&fl, "does_not_exist.wsfl"), Eq(WS_ERR_FOPEN_FAILED));
+}
+
+TEST(NAME, open_rejects_other_byte_order)
+{
+    struct { filter_lattice_header_t header; filter_lattice_record_t record; } file;
+    filter_lattice_t fl;
+    file.header = minimal_header();
+    file.header.byte_order = 0x04030201u;
+    filter_lattice_record_set_empty(&file.record);
+    EXPECT_THAT(filter_lattice_open_memory(&fl, &file, sizeof(file)), Eq(WS_ERR_BAD_FILE_FORMAT));
+}
+
+TEST(NAME, open_rejects_degenerate_grids)
+{
+    struct { filter_lattice_header_t header; filter_lattice_record_t record; } file;
+    filter_lattice_t fl;
+    const float bad_spacings[] = {0.0f, -1.0f, INFINITY, NAN};
+    filter_lattice_record_set_empty(&file.record);
+
+    for (float spacing : bad_spacings)
+    {
+        file.header = minimal_header();
+        file.header.listener_spacing = spacing;
+        EXPECT_THAT(filter_lattice_open_memory(&fl, &file, sizeof(file)), Eq(WS_ERR_BAD_FILE_FORMAT));
+        file.header = minimal_header();
+        file.header.emitter_spacing = spacing;
+        EXPECT_THAT(filter_lattice_open_memory(&fl, &file, sizeof(file)), Eq(WS_ERR_BAD_FILE_FORMAT));
+    }
+
+    file.header = minimal_header();
+    file.header.emitter_origin[1] = NAN;
+    EXPECT_THAT(filter_lattice_open_memory(&fl, &file, sizeof(file)), Eq(WS_ERR_BAD_FILE_FORMAT));
+}
+
+TEST(NAME, analyze_exponential_decay)
+{
+    const wsreal_t fs = 16000;
+    const wsreal_t t60 = 0.5;
+    std::vector<wsreal_t> ir(16000, 0.0);
+    unsigned seed = 1;
+
+    // Exponentially decaying noise with a strong direct path after 5ms
+    for (size_t i = 81; i != ir.size(); ++i)
+    {
+        seed = seed * 1103515245u + 12345u;
+        wsreal_t noise = (wsreal_t)((seed >> 16) & 0x7FFF) / 16384.0 - 1.0;
+        ir[i] = 0.1 * noise * pow(10.0, -3.0 * (i - 80) / (t60 * fs));
+    }
+    ir[80] = 1.0;
+
+    filter_lattice_filter_t f;
+    ASSERT_THAT(filter_lattice_analyze_ir(&f, ir.data(), ir.size(), fs), Eq(WS_OK));
+    EXPECT_THAT(f.tap_delay[0], DoubleNear(0.005, 1e-9));
+    EXPECT_THAT(f.tap_gain[0], DoubleEq(1.0));
+    for (int band = 2; band != 7; ++band)
+        EXPECT_THAT(f.band_decay[band], DoubleNear(t60, t60 * 0.15)) << "band " << band;
+}
@@ -0,0 +1,167 @@
+#include "gmock/gmock.h"
+#include "wavesim/simulation/filter_lattice_runtime.h"
+#include "wavesim/simulation/simulation.h"
+#include "wavesim/simulation/audio_listener.h"
+#include <math.h>
+#include <vector>
+
+#define NAME filter_lattice_runtime
+
+using namespace ::testing;
+
+static const filter_lattice_grid_t listener_grid = {{0, 0, 0}, 1.0, {2, 1, 1}};
+static const filter_lattice_grid_t emitter_grid = {{0, 0, 0}, 1.0, {2, 1, 1}};
+
+static std::vector<filter_lattice_record_t> make_block(wsreal_t delay)
+{
+    std::vector<filter_lattice_record_t> block(2);
+    filter_lattice_filter_t f;
+    for (int i = 0; i != FILTER_LATTICE_TAP_COUNT; ++i)
+    {
+        f.tap_delay[i] = delay;
+        f.tap_gain[i] = 0.5;
+    }
+    for (int i = 0; i != FILTER_LATTICE_BAND_COUNT; ++i)
+    {
+        f.band_level[i] = 0.5;
+        f.band_decay[i] = 1.0;
+    }
+    filter_lattice_encode(&block[0], &f, 48000);
+    filter_lattice_encode(&block[1], &f, 48000);
+    return block;
+}
+
+TEST(NAME, query_sees_published_blocks)
+{
+    filter_lattice_runtime_t* rt;
+    filter_lattice_reader_t reader;
+    ASSERT_THAT(filter_lattice_runtime_create(&rt, &listener_grid, &emitter_grid, 48000, 1), Eq(WS_OK));
+    ASSERT_THAT(filter_lattice_runtime_register_reader(rt, &reader), Eq(WS_OK));
+
+    wsreal_t listener[3] = {1, 0, 0};
+    wsreal_t emitter[3] = {0.5, 0, 0};
+    filter_lattice_filter_t f;
+    EXPECT_THAT(filter_lattice_runtime_query(rt, &reader, listener, emitter, 1, &f, NULL), Eq(0u));
+
+    ASSERT_THAT(filter_lattice_runtime_publish(rt, 1, make_block(0.01).data()), Eq(WS_OK));
+    ASSERT_THAT(filter_lattice_runtime_query(rt, &reader, listener, emitter, 1, &f, NULL), Eq(1u));
+    EXPECT_THAT(f.tap_delay[0], DoubleNear(0.01, 1e-4));
+
+    // Replace it many times, old blocks must be recycled
+    for (int i = 0; i != 10; ++i)
+        ASSERT_THAT(filter_lattice_runtime_publish(rt, 1, make_block(0.02).data()), Eq(WS_OK));
+    ASSERT_THAT(filter_lattice_runtime_query(rt, &reader, listener, emitter, 1, &f, NULL), Eq(1u));
+    EXPECT_THAT(f.tap_delay[0], DoubleNear(0.02, 1e-4));
+
+    filter_lattice_runtime_unregister_reader(rt, &reader);
+    filter_lattice_runtime_destroy(rt);
+}
+
+TEST(NAME, blocks_are_not_reused_while_a_reader_is_active)
+{
+    filter_lattice_runtime_t* rt;
+    filter_lattice_reader_t reader;
+    ASSERT_THAT(filter_lattice_runtime_create(&rt, &listener_grid, &emitter_grid, 48000, 1), Eq(WS_OK));
+    ASSERT_THAT(filter_lattice_runtime_register_reader(rt, &reader), Eq(WS_OK));
+
+    // Simulate a reader that is in the middle of a query
+    reader.slot->epoch = (rt->epoch << 1) | 1;
+
+    // 2 listener points + 1 spare block = 3 publishes, the 4th needs a
+    // retired block back
+    ASSERT_THAT(filter_lattice_runtime_publish(rt, 0, make_block(0.01).data()), Eq(WS_OK));
+    ASSERT_THAT(filter_lattice_runtime_publish(rt, 1, make_block(0.01).data()), Eq(WS_OK));
+    ASSERT_THAT(filter_lattice_runtime_publish(rt, 1, make_block(0.02).data()), Eq(WS_OK));
+    EXPECT_THAT(filter_lattice_runtime_publish(rt, 1, make_block(0.03).data()), Eq(WS_ERR_WOULD_BLOCK));
+
+    // Reader finishes
+    reader.slot->epoch = 0;
+    EXPECT_THAT(filter_lattice_runtime_publish(rt, 1, make_block(0.03).data()), Eq(WS_OK));
+
+    filter_lattice_runtime_unregister_reader(rt, &reader);
+    filter_lattice_runtime_destroy(rt);
+}
+
+TEST(NAME, reader_slots_are_limited)
+{
+    filter_lattice_runtime_t* rt;
+    filter_lattice_reader_t readers[FILTER_LATTICE_RUNTIME_MAX_READERS + 1];
+    ASSERT_THAT(filter_lattice_runtime_create(&rt, &listener_grid, &emitter_grid, 48000, 1), Eq(WS_OK));
+
+    for (int i = 0; i != FILTER_LATTICE_RUNTIME_MAX_READERS; ++i)
+        ASSERT_THAT(filter_lattice_runtime_register_reader(rt, &readers[i]), Eq(WS_OK));
+    EXPECT_THAT(filter_lattice_runtime_register_reader(rt, &readers[FILTER_LATTICE_RUNTIME_MAX_READERS]), Eq(WS_ERR_WOULD_BLOCK));
+    filter_lattice_runtime_unregister_reader(rt, &readers[3]);
+    EXPECT_THAT(filter_lattice_runtime_register_reader(rt, &readers[FILTER_LATTICE_RUNTIME_MAX_READERS]), Eq(WS_OK));
+
+    filter_lattice_runtime_destroy(rt);
+}
+
+static int fake_advance_calls;
+
+static wsret fake_prepare(simulation_t* s)
+{
+    (void)s;
+    fake_advance_calls = 0;
+    return WS_OK;
+}
+
+static int fake_advance(simulation_t* s, wsreal_t dt)
+{
+    // Emitter 0 receives an impulse after 1ms, emitter 1 receives nothing
+    if (simulation_audio_listener_count(s) > 0)
+        audio_listener_add_sample(simulation_get_audio_listener(s, 0), dt,
+                                  fake_advance_calls == 48 ? 1.0 : 0.0);
+    return ++fake_advance_calls < 4800 ? 1 : 0;
+}
+
+static void fake_finalize(simulation_t* s)
+{
+    (void)s;
+}
+
+TEST(NAME, simulation_publishes_progressively)
+{
+    filter_lattice_runtime_t* rt;
+    filter_lattice_progress_t progress;
+    filter_lattice_reader_t reader;
+    simulation_t* s;
+    audio_listener_t* al[2];
+
+    ASSERT_THAT(filter_lattice_runtime_create(&rt, &listener_grid, &emitter_grid, 48000, 2), Eq(WS_OK));
+    ASSERT_THAT(filter_lattice_runtime_register_reader(rt, &reader), Eq(WS_OK));
+    ASSERT_THAT(filter_lattice_progress_construct(&progress, rt, 0, 0.01), Eq(WS_OK));
+    ASSERT_THAT(simulation_create(&s, WAVESIM_ARD), Eq(WS_OK));
+    for (int i = 0; i != 2; ++i)
+    {
+        ASSERT_THAT(audio_listener_create(&al[i]), Eq(WS_OK));
+        al[i]->fs = 48000;
+        ASSERT_THAT(simulation_add_audio_listener(s, al[i]), Eq(WS_OK));
+    }
+
+    s->prepare = fake_prepare;
+    s->advance = fake_advance;
+    s->finalize = fake_finalize;
+    s->time_step = 1.0 / 48000;
+    s->user_data = (simulation_user_data_t*)&progress;
+    simulation_set_advance_callback(s, filter_lattice_runtime_on_advance);
+    ASSERT_THAT(simulation_execute(s), Eq(WS_OK));
+
+    wsreal_t listener[3] = {0, 0, 0};
+    wsreal_t emitter[3] = {0, 0, 0};
+    filter_lattice_filter_t f;
+    ASSERT_THAT(filter_lattice_runtime_query(rt, &reader, listener, emitter, 1, &f, NULL), Eq(1u));
+    EXPECT_THAT(f.tap_delay[0], DoubleNear(0.001, 1e-4));
+    EXPECT_THAT(f.tap_gain[0], DoubleNear(1.0, 1e-4));
+
+    // No energy ever arrived at the second emitter
+    emitter[0] = 1;
+    EXPECT_THAT(filter_lattice_runtime_query(rt, &reader, listener, emitter, 1, &f, NULL), Eq(0u));
+
+    simulation_destroy(s);
+    audio_listener_destroy(al[0]);
+    audio_listener_destroy(al[1]);
+    filter_lattice_progress_destruct(&progress);
+    filter_lattice_runtime_unregister_reader(rt, &reader);
+    filter_lattice_runtime_destroy(rt);
+}
@@ -0,0 +1,145 @@
+#include "gmock/gmock.h"
+#include "wavesim/mesh/bvh.h"
+#include "wavesim/mesh/face.h"
+#include "wavesim/simulation/image_source.h"
+#include <algorithm>
+#include <math.h>
+#include <vector>
+
+#define NAME image_source
+
+using namespace ::testing;
+
+class NAME : public Test
+{
+protected:
+    virtual void SetUp() override
+    {
+        // Two parallel walls at x=0 and x=10, reflecting half of the energy
+        attr = attribute(0.5, 0, 0.5, 340, vec3(0, 0, 0));
+        add_quad(0);
+        add_quad(10);
+        source[0] = 3; source[1] = 2;  source[2] = 5;
+        listener[0] = 6; listener[1] = -2; listener[2] = 5.5;
+        bvh_construct(&tree_bvh);
+        bvh_scene_construct(&scene);
+        image_source_tree_construct(&tree);
+        vector_construct(&paths, sizeof(image_source_path_t));
+    }
+
+    virtual void TearDown() override
+    {
+        vector_clear_free(&paths);
+        image_source_tree_destruct(&tree);
+        bvh_scene_destruct(&scene);
+        bvh_destruct(&tree_bvh);
+    }
+
+    void add_triangle(vec3_t a, vec3_t b, vec3_t c)
+    {
+        faces.push_back(face(vertex(a, attr), vertex(b, attr), vertex(c, attr)));
+    }
+
+    void add_quad(wsreal_t x)
+    {
+        add_triangle(vec3(x, -10, -10), vec3(x, 10, -10), vec3(x, 10, 10));
+        add_triangle(vec3(x, -10, -10), vec3(x, 10, 10), vec3(x, -10, 10));
+    }
+
+    void build(int order)
+    {
+        std::vector<wsreal_t> vertices;
+        for (const face_t& f : faces)
+            for (int v = 0; v != 3; ++v)
+                for (int j = 0; j != 3; ++j)
+                    vertices.push_back(f.vertices[v].position.xyz[j]);
+        ASSERT_THAT(bvh_build(&tree_bvh, vertices.data(), faces.size()), Eq(WS_OK));
+        ASSERT_THAT(bvh_scene_add_instance(&scene, &tree_bvh, 0), Eq(WS_OK));
+        ASSERT_THAT(bvh_scene_build(&scene), Eq(WS_OK));
+        ASSERT_THAT(image_source_tree_build(&tree, source, faces.data(), faces.size(), order), Eq(WS_OK));
+    }
+
+    std::vector<image_source_path_t> find_paths()
+    {
+        vector_clear(&paths);
+        EXPECT_THAT(image_source_tree_find_paths(&tree, &scene, faces.data(), listener, &paths), Eq(WS_OK));
+        std::vector<image_source_path_t> result;
+        for (uintptr_t i = 0; i != vector_count(&paths); ++i)
+            result.push_back(*(image_source_path_t*)vector_get(&paths, i));
+        std::sort(result.begin(), result.end(), [](const image_source_path_t& a, const image_source_path_t& b) {
+            return a.length < b.length;
+        });
+        return result;
+    }
+
+    // Distance from the listener to an image source at the specified x
+    wsreal_t distance_to_image(wsreal_t x)
+    {
+        wsreal_t dx = x - listener[0], dy = source[1] - listener[1], dz = source[2] - listener[2];
+        return sqrt(dx*dx + dy*dy + dz*dz);
+    }
+
+    attribute_t attr;
+    std::vector<face_t> faces;
+    wsreal_t source[3], listener[3];
+    bvh_t tree_bvh;
+    bvh_scene_t scene;
+    image_source_tree_t tree;
+    vector_t paths;
+};
+
+TEST_F(NAME, finds_all_specular_paths_between_two_walls)
+{
+    build(2);
+    std::vector<image_source_path_t> p = find_paths();
+
+    // Direct, off x=0 (image at -3), off x=10 (image at 17),
+    // off 0 then 10 (image at 23), off 10 then 0 (image at -17)
+    ASSERT_THAT(p.size(), Eq(5u));
+    wsreal_t expected_x[5] = {3, -3, 17, 23, -17};
+    uint32_t expected_order[5] = {0, 1, 1, 2, 2};
+    for (int i = 0; i != 5; ++i)
+    {
+        EXPECT_THAT(p[i].length, DoubleNear(distance_to_image(expected_x[i]), 1e-9));
+        EXPECT_THAT(p[i].order, Eq(expected_order[i]));
+        EXPECT_THAT(p[i].reflection, DoubleEq(pow(0.5, expected_order[i])));
+    }
+}
+
+TEST_F(NAME, coplanar_faces_are_pruned)
+{
+    // Reflecting twice off the same wall is impossible. Only the 4 first
+    // order images and the 4 second order images wall->other wall remain.
+    build(2);
+    EXPECT_THAT(vector_count(&tree.images), Eq(1u + 4u + 4u * 2u));
+}
+
+TEST_F(NAME, occluded_paths_are_rejected)
+{
+    // A small blocker halfway along the direct path
+    add_triangle(vec3(4.5, -0.1, 5.15), vec3(4.5, 0.1, 5.15), vec3(4.5, 0.0, 5.35));
+    build(1);
+    std::vector<image_source_path_t> p = find_paths();
+
+    ASSERT_THAT(p.size(), Ge(2u));
+    for (const image_source_path_t& path : p)
+        EXPECT_THAT(path.order, Ne(0u));
+    EXPECT_THAT(p[0].length, DoubleNear(distance_to_image(-3), 1e-9));
+    EXPECT_THAT(p[1].length, DoubleNear(distance_to_image(17), 1e-9));
+}
+
+TEST_F(NAME, tree_is_rebuilt_only_when_the_source_moves)
+{
+    build(1);
+    EXPECT_THAT(image_source_tree_is_stale(&tree, source, 1), Eq(0));
+    EXPECT_THAT(image_source_tree_is_stale(&tree, source, 2), Ne(0));
+    source[0] = 4;
+    EXPECT_THAT(image_source_tree_is_stale(&tree, source, 1), Ne(0));
+
+    // Moving the listener only needs the existing tree
+    listener[0] = 8;
+    std::vector<image_source_path_t> p = find_paths();
+    ASSERT_THAT(p.size(), Eq(3u));
+    source[0] = 3;
+    EXPECT_THAT(p[0].length, DoubleNear(distance_to_image(3), 1e-9));
+}
@@ -234,6 +234,18 @@ TEST(NAME, face_aabb_random_test_2)
     ASSERT_THAT(intersect_triangle_aabb_test(v1, v2, v3, bb), Eq(0));
 }
 
+TEST(NAME, face_aabb__edge_axes_dont_separate_overlapping_face)
+{
+    // Cuts through the inside of the box. Projecting onto the cross products
+    // of the edges with the box axes using the wrong components found a
+    // separating axis and rejected it
+    wsreal_t v1[3] = {3.0, 2.5, 0.0};
+    wsreal_t v2[3] = {0.0, 3.0, 2.5};
+    wsreal_t v3[3] = {2.5, -1.0, -0.5};
+    wsreal_t bb[6] = {0, 0, 0, 2, 2, 2};
+    ASSERT_THAT(intersect_triangle_aabb_test(v1, v2, v3, bb), Eq(1));
+}
+
 // ----------------------------------------------------------------------------
 // Here we place a small triangle at each of the 8 corners of the AABB and move
 // it slightly in range and out of range and test for collision. The numbers
@@ -423,3 +435,51 @@ TEST(NAME, aabb_edge_touches_edge_of_face)
     wsreal_t bb[6] = {0, 0, 0, 2, 2, 2};
     ASSERT_THAT(intersect_triangle_aabb_test(v1, v2, v3, bb), Eq(1));
 }
+
+TEST(NAME, ray_hits_face)
+{
+    wsreal_t origin[3] = {0.2, 3, 0.2};
+    wsreal_t direction[3] = {0, -2, 0};
+    wsreal_t v1[3] = {0, 0, 0};
+    wsreal_t v2[3] = {1, 0, 0};
+    wsreal_t v3[3] = {0, 0, 1};
+    wsreal_t distance, bary[3];
+    ASSERT_THAT(intersect_ray_triangle(&distance, bary, origin, direction, v1, v2, v3), Eq(1));
+    EXPECT_THAT(distance, DoubleNear(1.5, 1e-9));
+    EXPECT_THAT(bary[0], DoubleNear(0.2, 1e-9));
+    EXPECT_THAT(bary[1], DoubleNear(0.2, 1e-9));
+    EXPECT_THAT(bary[2], DoubleNear(0.6, 1e-9));
+}
+
+TEST(NAME, ray_misses_face_behind_it)
+{
+    wsreal_t origin[3] = {0.2, 3, 0.2};
+    wsreal_t direction[3] = {0, 1, 0};
+    wsreal_t v1[3] = {0, 0, 0};
+    wsreal_t v2[3] = {1, 0, 0};
+    wsreal_t v3[3] = {0, 0, 1};
+    wsreal_t distance, bary[3];
+    EXPECT_THAT(intersect_ray_triangle(&distance, bary, origin, direction, v1, v2, v3), Eq(0));
+}
+
+TEST(NAME, ray_misses_face_outside_edges)
+{
+    wsreal_t origin[3] = {0.6, 3, 0.6};
+    wsreal_t direction[3] = {0, -1, 0};
+    wsreal_t v1[3] = {0, 0, 0};
+    wsreal_t v2[3] = {1, 0, 0};
+    wsreal_t v3[3] = {0, 0, 1};
+    wsreal_t distance, bary[3];
+    EXPECT_THAT(intersect_ray_triangle(&distance, bary, origin, direction, v1, v2, v3), Eq(0));
+}
+
+TEST(NAME, ray_parallel_to_face_misses)
+{
+    wsreal_t origin[3] = {0.2, 0, -1};
+    wsreal_t direction[3] = {0, 0, 1};
+    wsreal_t v1[3] = {0, 0, 0};
+    wsreal_t v2[3] = {1, 0, 0};
+    wsreal_t v3[3] = {0, 0, 1};
+    wsreal_t distance, bary[3];
+    EXPECT_THAT(intersect_ray_triangle(&distance, bary, origin, direction, v1, v2, v3), Eq(0));
+}
@@ -1,7 +1,11 @@
 #include "gmock/gmock.h"
 #include "wavesim/simulation/medium.h"
+#include "wavesim/simulation/occupancy.h"
+#include "wavesim/simulation/voxel_grid.h"
 #include "wavesim/mesh/mesh.h"
 #include "wavesim/mesh/obj.h"
+#include <algorithm>
+#include <vector>
 
 #define NAME medium
 
@@ -21,3 +25,440 @@ TEST(NAME, cube_with_interior)
     medium_destroy(medium);
     mesh_destroy(mesh);
 }
+
+// A quad through a lattice of 1x1x1 cells
+class medium_quad : public Test
+{
+protected:
+    virtual void SetUp() override
+    {
+        // Horizontal, through the middle of a 6x6x6 lattice
+        static const double vb[] = {
+            1.5, 3.5, 1.5,  4.5, 3.5, 1.5,  4.5, 3.5, 4.5,  1.5, 3.5, 4.5
+        };
+        build(vb, aabb(0, 0, 0, 6, 6, 6));
+    }
+
+    void build(const double vb[12], aabb_t boundary)
+    {
+        static const uint32_t ib[] = {0, 1, 2, 0, 2, 3};
+        ASSERT_THAT(mesh_create(&mesh, "quad"), Eq(WS_OK));
+        ASSERT_THAT(mesh_copy_from_buffers(mesh, vb, ib, 4, 6, MESH_VB_DOUBLE, MESH_IB_UINT32), Eq(WS_OK));
+        medium_construct(&medium);
+        medium_construct(&mediumdef);
+        mediumdef.boundary = boundary;
+        voxel_grid_construct(&grid);
+        ASSERT_THAT(voxel_grid_build(&grid, mesh, mediumdef.boundary.xyzxyz, grid_size, 1), Eq(WS_OK));
+    }
+
+    virtual void TearDown() override
+    {
+        voxel_grid_destruct(&grid);
+        medium_destruct(&mediumdef);
+        medium_destruct(&medium);
+        mesh_destroy(mesh);
+    }
+
+    // Every cell is owned by exactly one partition with the cell's attributes
+    void expect_homogeneous_cover()
+    {
+        occupancy_t occupancy;
+        ASSERT_THAT(occupancy_construct(&occupancy, mediumdef.boundary.xyzxyz, grid_size), Eq(WS_OK));
+
+        EXPECT_THAT(medium_partition_count(&medium), Gt(1u));
+        uintptr_t cells = 0;
+        for (uintptr_t i = 0; i != medium_partition_count(&medium); ++i)
+        {
+            medium_partition_t* partition = medium_get_partition(&medium, i);
+            occupancy_box_t box;
+            ASSERT_THAT(occupancy_box_from_aabb(&occupancy, partition->aabb.xyzxyz, &box), Eq(1));
+            EXPECT_THAT(occupancy_box_is_free(&occupancy, &box), Eq(1));
+            occupancy_mark(&occupancy, &box, (int32_t)i);
+
+            for (uintptr_t z = box.min[2]; z != box.max[2]; ++z)
+                for (uintptr_t y = box.min[1]; y != box.max[1]; ++y)
+                    for (uintptr_t x = box.min[0]; x != box.max[0]; ++x)
+                    {
+                        const attribute_t* attr = voxel_grid_attribute(&grid, voxel_grid_material(&grid, x, y, z));
+                        EXPECT_THAT(attribute_is_same(attr, &partition->attr), Ne(0));
+                        ++cells;
+                    }
+        }
+        EXPECT_THAT(cells, Eq(grid.dims[0] * grid.dims[1] * grid.dims[2]));
+
+        occupancy_destruct(&occupancy);
+    }
+
+    std::vector<aabb_t> partition_boxes()
+    {
+        std::vector<aabb_t> boxes;
+        for (uintptr_t i = 0; i != medium_partition_count(&medium); ++i)
+        {
+            medium_partition_t* partition = medium_get_partition(&medium, i);
+            boxes.push_back(partition->aabb);
+        }
+        return boxes;
+    }
+
+    mesh_t* mesh;
+    medium_t medium;
+    medium_t mediumdef;
+    voxel_grid_t grid;
+    wsreal_t grid_size[3] = {1, 1, 1};
+};
+
+TEST_F(medium_quad, partitions_cover_the_boundary_with_homogeneous_boxes)
+{
+    ASSERT_THAT(medium_build_from_mesh(&medium, &mediumdef, mesh, grid_size), Eq(WS_OK));
+    expect_homogeneous_cover();
+}
+
+TEST_F(medium_quad, adjacency_is_symmetric)
+{
+    ASSERT_THAT(medium_build_from_mesh(&medium, &mediumdef, mesh, grid_size), Eq(WS_OK));
+
+    wsreal_t area = 0;
+    for (uintptr_t p = 0; p != medium_partition_count(&medium); ++p)
+    {
+        const medium_interface_t* interfaces = medium_get_interfaces(&medium, p);
+        for (uintptr_t i = 0; i != medium_interface_count(&medium, p); ++i)
+        {
+            uint32_t q = interfaces[i].neighbour;
+            ASSERT_THAT(q, Ne((uint32_t)p));
+            ASSERT_THAT(q, Lt(medium_partition_count(&medium)));
+            if (i > 0)
+                EXPECT_THAT(q, Gt(interfaces[i-1].neighbour));
+
+            const medium_interface_t* back = medium_get_interfaces(&medium, q);
+            uintptr_t j = 0;
+            while (j != medium_interface_count(&medium, q) && back[j].neighbour != p)
+                ++j;
+            ASSERT_THAT(j, Ne(medium_interface_count(&medium, q)));
+            EXPECT_THAT(back[j].axis, Eq(interfaces[i].axis));
+            EXPECT_THAT(back[j].side, Ne(interfaces[i].side));
+
+            const wsreal_t* face = interfaces[i].face.xyzxyz;
+            int u = (interfaces[i].axis + 1) % 3, v = (interfaces[i].axis + 2) % 3;
+            area += (face[u+3] - face[u]) * (face[v+3] - face[v]);
+        }
+    }
+    EXPECT_THAT(area / 2, DoubleEq(medium_interface_area(&medium)));
+}
+
+TEST_F(medium_quad, regions_are_stitched_back_together)
+{
+    // A vertical quad running through all layers of a lattice that is split
+    // into several regions along z. Nothing changes along z, so no partition
+    // should end at a seam between regions
+    static const double vb[] = {
+        0.5, 2.5, -1,  3.5, 2.5, -1,  3.5, 2.5, 65,  0.5, 2.5, 65
+    };
+    TearDown();
+    build(vb, aabb(0, 0, 0, 4, 4, 64));
+    ASSERT_THAT(medium_build_from_mesh(&medium, &mediumdef, mesh, grid_size), Eq(WS_OK));
+    expect_homogeneous_cover();
+
+    for (uintptr_t i = 0; i != medium_partition_count(&medium); ++i)
+    {
+        medium_partition_t* partition = medium_get_partition(&medium, i);
+        EXPECT_THAT(AABB_AZ(partition->aabb), DoubleEq(0));
+        EXPECT_THAT(AABB_BZ(partition->aabb), DoubleEq(64));
+    }
+}
+
+TEST_F(medium_quad, greedy_partitions_cover_the_boundary_with_homogeneous_boxes)
+{
+    medium_set_decomposition_method(&medium, medium_decompose_greedy_random);
+    for (uint64_t seed = 0; seed != 8; ++seed)
+    {
+        medium_set_seed(&mediumdef, seed);
+        ASSERT_THAT(medium_build_from_mesh(&medium, &mediumdef, mesh, grid_size), Eq(WS_OK));
+        expect_homogeneous_cover();
+    }
+}
+
+TEST_F(medium_quad, greedy_decomposition_is_reproducible)
+{
+    medium_set_decomposition_method(&medium, medium_decompose_greedy_random);
+    medium_set_seed(&mediumdef, 42);
+    ASSERT_THAT(medium_build_from_mesh(&medium, &mediumdef, mesh, grid_size), Eq(WS_OK));
+    std::vector<aabb_t> first = partition_boxes();
+    ASSERT_THAT(medium_build_from_mesh(&medium, &mediumdef, mesh, grid_size), Eq(WS_OK));
+    std::vector<aabb_t> second = partition_boxes();
+
+    ASSERT_THAT(second.size(), Eq(first.size()));
+    for (size_t i = 0; i != first.size(); ++i)
+        for (int j = 0; j != 6; ++j)
+            EXPECT_THAT(second[i].xyzxyz[j], DoubleEq(first[i].xyzxyz[j]));
+}
+
+TEST_F(medium_quad, kd_split_partitions_cover_the_boundary_with_homogeneous_boxes)
+{
+    medium_set_decomposition_method(&medium, medium_decompose_kd_split);
+    ASSERT_THAT(medium_build_from_mesh(&medium, &mediumdef, mesh, grid_size), Eq(WS_OK));
+    expect_homogeneous_cover();
+}
+
+TEST_F(medium_quad, kd_split_cuts_along_the_material_boundaries)
+{
+    // The quad turns into one slab of cells. Splitting on both of its faces
+    // leaves air below, the slab, and air above
+    static const double vb[] = {
+        -1, 2.5, -1,  5, 2.5, -1,  5, 2.5, 65,  -1, 2.5, 65
+    };
+    TearDown();
+    build(vb, aabb(0, 0, 0, 4, 4, 64));
+    medium_set_decomposition_method(&medium, medium_decompose_kd_split);
+    ASSERT_THAT(medium_build_from_mesh(&medium, &mediumdef, mesh, grid_size), Eq(WS_OK));
+    expect_homogeneous_cover();
+    EXPECT_THAT(medium_partition_count(&medium), Eq(3u));
+}
+
+static wsreal_t count_partitions(const cost_model_t*, const medium_t* medium, const wsreal_t*)
+{
+    return (wsreal_t)medium_partition_count(medium);
+}
+
+TEST_F(medium_quad, cheapest_decomposition_is_kept)
+{
+    // Rate by partition count, and skip calibrating
+    medium_set_cost_function(&mediumdef, count_partitions);
+    mediumdef.cost_model.calibrated = 1;
+
+    uintptr_t fewest = (uintptr_t)-1;
+    for (int i = 0; medium_decomposition_strategies[i] != NULL; ++i)
+    {
+        medium_set_decomposition_method(&medium, medium_decomposition_strategies[i]);
+        ASSERT_THAT(medium_build_from_mesh(&medium, &mediumdef, mesh, grid_size), Eq(WS_OK));
+        fewest = std::min(fewest, medium_partition_count(&medium));
+    }
+
+    medium_set_decomposition_method(&medium, medium_decompose_cheapest);
+    ASSERT_THAT(medium_build_from_mesh(&medium, &mediumdef, mesh, grid_size), Eq(WS_OK));
+    EXPECT_THAT(medium_partition_count(&medium), Eq(fewest));
+    expect_homogeneous_cover();
+}
+
+static void add_unit_box(medium_t* medium, wsreal_t x, wsreal_t y, wsreal_t absorption)
+{
+    wsreal_t bb[6] = {x, y, 0, x + 1, y + 1, 1};
+    ASSERT_THAT(medium_add_partition(medium, bb, attribute(absorption, 0, 1 - absorption, 340, vec3(0, 0, 0))), Eq(WS_OK));
+}
+
+TEST(NAME, coalesce_merges_alike_boxes_into_one)
+{
+    medium_t medium;
+    medium_coalesce_stats_t stats;
+    medium_construct(&medium);
+    medium.boundary = aabb(0, 0, 0, 2, 2, 1);
+    add_unit_box(&medium, 0, 0, 0.5);
+    add_unit_box(&medium, 1, 0, 0.5);
+    add_unit_box(&medium, 0, 1, 0.5);
+    add_unit_box(&medium, 1, 1, 0.5);
+
+    ASSERT_THAT(medium_coalesce(&medium, &stats), Eq(WS_OK));
+    ASSERT_THAT(medium_partition_count(&medium), Eq(1u));
+    medium_partition_t* partition = medium_get_partition(&medium, 0);
+    EXPECT_THAT(AABB_AX(partition->aabb), DoubleEq(0));
+    EXPECT_THAT(AABB_BX(partition->aabb), DoubleEq(2));
+    EXPECT_THAT(AABB_AY(partition->aabb), DoubleEq(0));
+    EXPECT_THAT(AABB_BY(partition->aabb), DoubleEq(2));
+    EXPECT_THAT(stats.partitions_before, Eq(4u));
+    EXPECT_THAT(stats.partitions_after, Eq(1u));
+    EXPECT_THAT(stats.interface_area_before, DoubleEq(4));
+    EXPECT_THAT(stats.interface_area_after, DoubleEq(0));
+
+    medium_destruct(&medium);
+}
+
+TEST(NAME, coalesce_only_merges_boxes_whose_union_is_a_box)
+{
+    // Three alike boxes forming an L around a different one
+    medium_t medium;
+    medium_coalesce_stats_t stats;
+    medium_construct(&medium);
+    medium.boundary = aabb(0, 0, 0, 2, 2, 1);
+    add_unit_box(&medium, 0, 0, 0.5);
+    add_unit_box(&medium, 1, 0, 0.5);
+    add_unit_box(&medium, 0, 1, 0.5);
+    add_unit_box(&medium, 1, 1, 0.2);
+
+    ASSERT_THAT(medium_coalesce(&medium, &stats), Eq(WS_OK));
+    ASSERT_THAT(medium_partition_count(&medium), Eq(3u));
+    EXPECT_THAT(stats.interface_area_before, DoubleEq(4));
+    EXPECT_THAT(stats.interface_area_after, DoubleEq(3));
+
+    medium_destruct(&medium);
+}
+
+TEST(NAME, adjacency_lists_the_shared_faces)
+{
+    medium_t medium;
+    wsreal_t grid_size[3] = {0.5, 0.5, 0.5};
+    medium_construct(&medium);
+    medium.boundary = aabb(0, 0, 0, 2, 2, 1);
+    add_unit_box(&medium, 0, 0, 0.5);
+    add_unit_box(&medium, 1, 0, 0.5);
+    add_unit_box(&medium, 0, 1, 0.5);
+    add_unit_box(&medium, 1, 1, 0.5);
+
+    // Boxes 0 and 3 only share an edge
+    ASSERT_THAT(medium_build_adjacency(&medium, grid_size), Eq(WS_OK));
+    for (uintptr_t i = 0; i != 4; ++i)
+        EXPECT_THAT(medium_interface_count(&medium, i), Eq(2u));
+
+    const medium_interface_t* interfaces = medium_get_interfaces(&medium, 0);
+    EXPECT_THAT(interfaces[0].neighbour, Eq(1u));
+    EXPECT_THAT(interfaces[0].axis, Eq(0));
+    EXPECT_THAT(interfaces[0].side, Eq(1));
+    EXPECT_THAT(AABB_AX(interfaces[0].face), DoubleEq(1));
+    EXPECT_THAT(AABB_BX(interfaces[0].face), DoubleEq(1));
+    EXPECT_THAT(AABB_AY(interfaces[0].face), DoubleEq(0));
+    EXPECT_THAT(AABB_BY(interfaces[0].face), DoubleEq(1));
+    EXPECT_THAT(interfaces[0].cell_offset[0], Eq(2u));
+    EXPECT_THAT(interfaces[0].cell_count[0], Eq(0u));
+    EXPECT_THAT(interfaces[0].cell_count[1], Eq(2u));
+    EXPECT_THAT(interfaces[0].cell_count[2], Eq(2u));
+    EXPECT_THAT(interfaces[1].neighbour, Eq(2u));
+    EXPECT_THAT(interfaces[1].axis, Eq(1));
+
+    interfaces = medium_get_interfaces(&medium, 3);
+    EXPECT_THAT(interfaces[0].neighbour, Eq(1u));
+    EXPECT_THAT(interfaces[0].axis, Eq(1));
+    EXPECT_THAT(interfaces[0].side, Eq(0));
+    EXPECT_THAT(interfaces[0].cell_offset[1], Eq(0u));
+
+    medium_destruct(&medium);
+}
+
+TEST(NAME, adjacency_locates_faces_within_the_larger_partition)
+{
+    // A 1x2 box next to two unit boxes stacked along y
+    medium_t medium;
+    wsreal_t grid_size[3] = {0.5, 0.5, 0.5};
+    wsreal_t bb[6] = {0, 0, 0, 1, 2, 1};
+    medium_construct(&medium);
+    medium.boundary = aabb(0, 0, 0, 2, 2, 1);
+    ASSERT_THAT(medium_add_partition(&medium, bb, attribute(0.5, 0, 0.5, 340, vec3(0, 0, 0))), Eq(WS_OK));
+    add_unit_box(&medium, 1, 0, 0.2);
+    add_unit_box(&medium, 1, 1, 0.3);
+
+    ASSERT_THAT(medium_build_adjacency(&medium, grid_size), Eq(WS_OK));
+    ASSERT_THAT(medium_interface_count(&medium, 0), Eq(2u));
+    const medium_interface_t* interfaces = medium_get_interfaces(&medium, 0);
+    EXPECT_THAT(interfaces[0].neighbour, Eq(1u));
+    EXPECT_THAT(interfaces[0].cell_offset[0], Eq(2u));
+    EXPECT_THAT(interfaces[0].cell_offset[1], Eq(0u));
+    EXPECT_THAT(interfaces[1].neighbour, Eq(2u));
+    EXPECT_THAT(interfaces[1].cell_offset[0], Eq(2u));
+    EXPECT_THAT(interfaces[1].cell_offset[1], Eq(2u));
+    EXPECT_THAT(interfaces[1].cell_count[1], Eq(2u));
+
+    // Seen from the small box, the face is all of its low x side
+    ASSERT_THAT(medium_interface_count(&medium, 2), Eq(2u));
+    interfaces = medium_get_interfaces(&medium, 2);
+    EXPECT_THAT(interfaces[0].neighbour, Eq(0u));
+    EXPECT_THAT(interfaces[0].side, Eq(0));
+    EXPECT_THAT(interfaces[0].cell_offset[0], Eq(0u));
+    EXPECT_THAT(interfaces[0].cell_offset[1], Eq(0u));
+
+    medium_destruct(&medium);
+}
+
+TEST(NAME, changing_the_partitions_discards_the_adjacency_and_the_index)
+{
+    medium_t medium;
+    wsreal_t grid_size[3] = {0.5, 0.5, 0.5};
+    medium_construct(&medium);
+    medium.boundary = aabb(0, 0, 0, 2, 2, 1);
+    add_unit_box(&medium, 0, 0, 0.5);
+    add_unit_box(&medium, 1, 0, 0.5);
+    ASSERT_THAT(medium_build_adjacency(&medium, grid_size), Eq(WS_OK));
+    ASSERT_THAT(medium_build_index(&medium), Eq(WS_OK));
+
+    add_unit_box(&medium, 0, 1, 0.5);
+    EXPECT_THAT(medium.adjacency.offsets, IsNull());
+    EXPECT_THAT(medium.adjacency.interfaces, IsNull());
+    EXPECT_THAT(partition_index_is_built(&medium.index), Eq(0));
+
+    ASSERT_THAT(medium_build_adjacency(&medium, grid_size), Eq(WS_OK));
+    ASSERT_THAT(medium_build_index(&medium), Eq(WS_OK));
+    ASSERT_THAT(medium_coalesce(&medium, NULL), Eq(WS_OK));
+    EXPECT_THAT(medium.adjacency.offsets, IsNull());
+    EXPECT_THAT(medium.adjacency.interfaces, IsNull());
+    EXPECT_THAT(partition_index_is_built(&medium.index), Eq(0));
+
+    medium_destruct(&medium);
+}
+
+TEST(NAME, locate_points_interpolates_between_cell_centers)
+{
+    medium_t medium;
+    wsreal_t bb0[6] = {0, 0, 0, 2, 1, 1};
+    wsreal_t bb1[6] = {2, 0, 0, 4, 1, 1};
+    medium_construct(&medium);
+    ASSERT_THAT(medium_add_partition(&medium, bb0, attribute_default_air()), Eq(0));
+    ASSERT_THAT(medium_add_partition(&medium, bb1, attribute_default_air()), Eq(0));
+    ASSERT_THAT(medium_build_index(&medium), Eq(WS_OK));
+
+    // 0.25 sized cells
+    for (uintptr_t i = 0; i != 2; ++i)
+    {
+        medium_partition_t* partition = medium_get_partition(&medium, i);
+        partition->cell_size = 0.25;
+        partition->cell_count[0] = 8;
+        partition->cell_count[1] = 4;
+        partition->cell_count[2] = 4;
+    }
+
+    wsreal_t points[4][3] = {
+        {2.5, 0.5, 0.5},    // Between the centers of cells 1 and 2
+        {0.05, 0.9, 0.3},   // Before the first center, past the last one
+        {1.0, 0.5, 0.5},
+        {5.0, 0.5, 0.5}     // Outside
+    };
+    medium_location_t locations[4];
+    EXPECT_THAT(medium_locate_points(&medium, &points[0][0], 4, locations), Eq(3u));
+
+    EXPECT_THAT(locations[0].partition, Eq(1));
+    EXPECT_THAT(locations[0].cell[0], Eq(1u));
+    EXPECT_THAT(locations[0].weight[0], DoubleEq(0.5));
+    EXPECT_THAT(locations[0].cell[1], Eq(1u));
+    EXPECT_THAT(locations[0].weight[1], DoubleEq(0.5));
+
+    EXPECT_THAT(locations[1].partition, Eq(0));
+    EXPECT_THAT(locations[1].cell[0], Eq(0u));
+    EXPECT_THAT(locations[1].weight[0], DoubleEq(0));
+    EXPECT_THAT(locations[1].cell[1], Eq(2u));
+    EXPECT_THAT(locations[1].weight[1], DoubleEq(1));
+    EXPECT_THAT(locations[1].cell[2], Eq(0u));
+    EXPECT_THAT(locations[1].weight[2], DoubleEq(0.7));
+
+    EXPECT_THAT(locations[2].partition, Eq(0));
+    EXPECT_THAT(locations[2].cell[0], Eq(3u));
+    EXPECT_THAT(locations[2].weight[0], DoubleEq(0.5));
+
+    EXPECT_THAT(locations[3].partition, Eq(-1));
+
+    medium_destruct(&medium);
+}
+
+TEST_F(medium_quad, index_locates_every_cell_in_its_partition)
+{
+    ASSERT_THAT(medium_build_from_mesh(&medium, &mediumdef, mesh, grid_size), Eq(WS_OK));
+
+    for (uintptr_t i = 0; i != medium_partition_count(&medium); ++i)
+    {
+        medium_partition_t* partition = medium_get_partition(&medium, i);
+        aabb_t bb = partition->aabb;
+        for (wsreal_t z = bb.b.min.v.z + 0.5; z < bb.b.max.v.z; z += 1)
+            for (wsreal_t y = bb.b.min.v.y + 0.5; y < bb.b.max.v.y; y += 1)
+                for (wsreal_t x = bb.b.min.v.x + 0.5; x < bb.b.max.v.x; x += 1)
+                {
+                    wsreal_t point[3] = {x, y, z};
+                    medium_location_t location;
+                    ASSERT_THAT(medium_locate_points(&medium, point, 1, &location), Eq(1u));
+                    EXPECT_THAT(location.partition, Eq((int32_t)i));
+                }
+    }
+}
@@ -0,0 +1,198 @@
+#include "gmock/gmock.h"
+#include "wavesim/file.h"
+#include "wavesim/memory.h"
+#include "wavesim/mesh/mesh.h"
+#include "wavesim/simulation/medium.h"
+#include "wavesim/simulation/medium_cache.h"
+#include <stdio.h>
+
+#define NAME medium_cache
+
+using namespace ::testing;
+
+class NAME : public Test
+{
+protected:
+    virtual void SetUp() override
+    {
+        // A quad through the middle of a 6x6x6 lattice
+        static const double vb[] = {
+            1.5, 3.5, 1.5,  4.5, 3.5, 1.5,  4.5, 3.5, 4.5,  1.5, 3.5, 4.5
+        };
+        static const uint32_t ib[] = {0, 1, 2, 0, 2, 3};
+        ASSERT_THAT(mesh_create(&mesh, "quad"), Eq(WS_OK));
+        ASSERT_THAT(mesh_copy_from_buffers(mesh, vb, ib, 4, 6, MESH_VB_DOUBLE, MESH_IB_UINT32), Eq(WS_OK));
+        medium_construct(&medium);
+        medium_construct(&mediumdef);
+        mediumdef.boundary = aabb(0, 0, 0, 6, 6, 6);
+        ASSERT_THAT(medium_set_cache_directory(&medium, "."), Eq(WS_OK));
+        medium.boundary = mediumdef.boundary;
+        ASSERT_THAT(medium_cache_key(&medium, mesh, grid_size, &key), Eq(1));
+        file_name = medium_cache_file_name(".", key);
+        ASSERT_THAT(file_name, NotNull());
+        remove(file_name);
+    }
+
+    virtual void TearDown() override
+    {
+        remove(file_name);
+        FREE(file_name);
+        medium_destruct(&mediumdef);
+        medium_destruct(&medium);
+        mesh_destroy(mesh);
+    }
+
+    uint64_t key_of(const medium_t* m, const wsreal_t grid[3])
+    {
+        uint64_t k = 0;
+        EXPECT_THAT(medium_cache_key(m, mesh, grid, &k), Eq(1));
+        return k;
+    }
+
+    mesh_t* mesh;
+    medium_t medium;
+    medium_t mediumdef;
+    wsreal_t grid_size[3] = {1, 1, 1};
+    uint64_t key;
+    char* file_name;
+};
+
+TEST_F(NAME, key_changes_with_every_input)
+{
+    medium_t other;
+    wsreal_t other_grid[3] = {1, 1, 0.5};
+    medium_construct(&other);
+    other.boundary = medium.boundary;
+    EXPECT_THAT(key_of(&other, grid_size), Eq(key));
+    EXPECT_THAT(key_of(&other, other_grid), Ne(key));
+
+    other.boundary = aabb(0, 0, 0, 6, 6, 7);
+    EXPECT_THAT(key_of(&other, grid_size), Ne(key));
+    other.boundary = medium.boundary;
+
+    medium_set_seed(&other, 1);
+    EXPECT_THAT(key_of(&other, grid_size), Ne(key));
+    medium_set_seed(&other, 0);
+
+    medium_set_decomposition_method(&other, medium_decompose_kd_split);
+    EXPECT_THAT(key_of(&other, grid_size), Ne(key));
+    medium_set_decomposition_method(&other, medium_decompose_systematic);
+
+    ((double*)mesh->vb)[1] = 3.25;
+    EXPECT_THAT(key_of(&other, grid_size), Ne(key));
+
+    medium_destruct(&other);
+}
+
+TEST_F(NAME, custom_decomposition_methods_are_not_cached)
+{
+    uint64_t k;
+    medium_set_decomposition_method(&medium, NULL);
+    EXPECT_THAT(medium_cache_key(&medium, mesh, grid_size, &k), Eq(0));
+}
+
+TEST_F(NAME, cheapest_decomposition_is_not_cached)
+{
+    // The winner depends on the cost function and the calibration
+    uint64_t k;
+    medium_set_decomposition_method(&medium, medium_decompose_cheapest);
+    EXPECT_THAT(medium_cache_key(&medium, mesh, grid_size, &k), Eq(0));
+}
+
+TEST_F(NAME, saved_medium_loads_back_identically)
+{
+    ASSERT_THAT(medium_build_from_mesh(&medium, &mediumdef, mesh, grid_size), Eq(WS_OK));
+    medium_t loaded;
+    medium_construct(&loaded);
+    ASSERT_THAT(medium_cache_load(&loaded, file_name, key), Eq(WS_OK));
+
+    ASSERT_THAT(medium_partition_count(&loaded), Eq(medium_partition_count(&medium)));
+    for (uintptr_t i = 0; i != medium_partition_count(&medium); ++i)
+    {
+        medium_partition_t* a = medium_get_partition(&medium, i);
+        medium_partition_t* b = medium_get_partition(&loaded, i);
+        for (int j = 0; j != 6; ++j)
+            EXPECT_THAT(b->aabb.xyzxyz[j], DoubleEq(a->aabb.xyzxyz[j]));
+        EXPECT_THAT(attribute_is_same(&a->attr, &b->attr), Ne(0));
+
+        ASSERT_THAT(medium_interface_count(&loaded, i), Eq(medium_interface_count(&medium, i)));
+        for (uintptr_t j = 0; j != medium_interface_count(&medium, i); ++j)
+        {
+            const medium_interface_t* ia = medium_get_interfaces(&medium, i) + j;
+            const medium_interface_t* ib = medium_get_interfaces(&loaded, i) + j;
+            EXPECT_THAT(ib->neighbour, Eq(ia->neighbour));
+            EXPECT_THAT(ib->axis, Eq(ia->axis));
+            EXPECT_THAT(ib->side, Eq(ia->side));
+        }
+    }
+
+    medium_destruct(&loaded);
+}
+
+TEST_F(NAME, build_from_mesh_loads_from_the_cache)
+{
+    // Plant a file with a single partition under the key, which a
+    // decomposition would never produce
+    medium_t planted;
+    medium_construct(&planted);
+    ASSERT_THAT(medium_add_partition(&planted, mediumdef.boundary.xyzxyz, attribute_default_air()), Eq(WS_OK));
+    ASSERT_THAT(medium_build_adjacency(&planted, grid_size), Eq(WS_OK));
+    ASSERT_THAT(medium_cache_save(&planted, file_name, key), Eq(WS_OK));
+    medium_destruct(&planted);
+
+    ASSERT_THAT(medium_build_from_mesh(&medium, &mediumdef, mesh, grid_size), Eq(WS_OK));
+    EXPECT_THAT(medium_partition_count(&medium), Eq(1u));
+
+    // The index is built on loading too
+    wsreal_t point[3] = {3, 3, 3};
+    medium_location_t location;
+    EXPECT_THAT(medium_locate_points(&medium, point, 1, &location), Eq(1u));
+}
+
+TEST_F(NAME, corrupt_files_are_rebuilt)
+{
+    FILE* fp = fopen(file_name, "wb");
+    ASSERT_THAT(fp, NotNull());
+    fputs("WSMC but not really", fp);
+    fclose(fp);
+
+    medium_t loaded;
+    medium_construct(&loaded);
+    EXPECT_THAT(medium_cache_load(&loaded, file_name, key), Eq(WS_ERR_BAD_FILE_FORMAT));
+    EXPECT_THAT(medium_partition_count(&loaded), Eq(0u));
+    medium_destruct(&loaded);
+
+    ASSERT_THAT(medium_build_from_mesh(&medium, &mediumdef, mesh, grid_size), Eq(WS_OK));
+    EXPECT_THAT(medium_partition_count(&medium), Gt(1u));
+
+    medium_construct(&loaded);
+    EXPECT_THAT(medium_cache_load(&loaded, file_name, key), Eq(WS_OK));
+    EXPECT_THAT(medium_partition_count(&loaded), Eq(medium_partition_count(&medium)));
+    medium_destruct(&loaded);
+}
+
+TEST_F(NAME, media_without_adjacency_are_not_saved)
+{
+    ASSERT_THAT(medium_add_partition(&medium, mediumdef.boundary.xyzxyz, attribute_default_air()), Eq(WS_OK));
+    EXPECT_THAT(medium_cache_save(&medium, file_name, key), Eq(WS_ERR_INVALID_STATE));
+    EXPECT_THAT(medium_cache_load(&medium, file_name, key), Eq(WS_ERR_FOPEN_FAILED));
+}
+
+TEST_F(NAME, missing_files_are_reported)
+{
+    EXPECT_THAT(medium_cache_load(&medium, file_name, key), Eq(WS_ERR_FOPEN_FAILED));
+}
+
+TEST_F(NAME, temporary_names_are_unique)
+{
+    // Processes and threads saving the same key must not share a file
+    char* a = ws_file_temp_name(file_name);
+    char* b = ws_file_temp_name(file_name);
+    ASSERT_THAT(a, NotNull());
+    ASSERT_THAT(b, NotNull());
+    EXPECT_THAT(a, StartsWith(file_name));
+    EXPECT_THAT(a, HasSubstr(std::to_string(ws_process_id())));
+    EXPECT_THAT(std::string(a), Ne(std::string(b)));
+    FREE(b);
+    FREE(a);
+}
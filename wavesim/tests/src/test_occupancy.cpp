@@ -0,0 +1,83 @@
+#include "gmock/gmock.h"
+#include "wavesim/simulation/occupancy.h"
+
+#define NAME occupancy
+
+using namespace ::testing;
+
+class NAME : public Test
+{
+protected:
+    virtual void SetUp() override
+    {
+        // 100 cells along x spans two words per row
+        wsreal_t boundary[6] = {0, 0, 0, 10, 1, 0.5};
+        wsreal_t grid_size[3] = {0.1, 0.1, 0.1};
+        ASSERT_THAT(occupancy_construct(&grid, boundary, grid_size), Eq(WS_OK));
+    }
+
+    virtual void TearDown() override
+    {
+        occupancy_destruct(&grid);
+    }
+
+    occupancy_box_t box(uintptr_t x0, uintptr_t y0, uintptr_t z0, uintptr_t x1, uintptr_t y1, uintptr_t z1)
+    {
+        occupancy_box_t b = {{x0, y0, z0}, {x1, y1, z1}};
+        return b;
+    }
+
+    occupancy_t grid;
+};
+
+TEST_F(NAME, lattice_covers_whole_cells_of_the_boundary)
+{
+    EXPECT_THAT(grid.dims[0], Eq(100u));
+    EXPECT_THAT(grid.dims[1], Eq(10u));
+    EXPECT_THAT(grid.dims[2], Eq(5u));
+    EXPECT_THAT(grid.words_per_row, Eq(2u));
+}
+
+TEST_F(NAME, aabbs_are_converted_to_cells)
+{
+    occupancy_box_t b;
+    wsreal_t inside[6] = {0.2, 0.3, 0.0, 7.0, 0.4, 0.5};
+    ASSERT_THAT(occupancy_box_from_aabb(&grid, inside, &b), Eq(1));
+    EXPECT_THAT(b.min[0], Eq(2u));  EXPECT_THAT(b.max[0], Eq(70u));
+    EXPECT_THAT(b.min[1], Eq(3u));  EXPECT_THAT(b.max[1], Eq(4u));
+    EXPECT_THAT(b.min[2], Eq(0u));  EXPECT_THAT(b.max[2], Eq(5u));
+
+    wsreal_t back[6];
+    occupancy_box_to_aabb(&grid, &b, back);
+    for (int i = 0; i != 6; ++i)
+        EXPECT_THAT(back[i], DoubleNear(inside[i], 1e-12));
+
+    // Slices adjacent to the boundary lie outside of it
+    wsreal_t outside[6] = {-0.1, 0.0, 0.0, 0.0, 0.1, 0.1};
+    EXPECT_THAT(occupancy_box_from_aabb(&grid, outside, &b), Eq(0));
+    wsreal_t beyond[6] = {9.9, 0.0, 0.0, 10.0, 0.1, 0.6};
+    EXPECT_THAT(occupancy_box_from_aabb(&grid, beyond, &b), Eq(0));
+}
+
+TEST_F(NAME, marked_cells_are_occupied_across_word_boundaries)
+{
+    occupancy_box_t marked = box(60, 2, 1, 70, 4, 3);
+    EXPECT_THAT(occupancy_box_is_free(&grid, &marked), Eq(1));
+    occupancy_mark(&grid, &marked, 7);
+
+    EXPECT_THAT(occupancy_owner(&grid, 60, 2, 1), Eq(7));
+    EXPECT_THAT(occupancy_owner(&grid, 69, 3, 2), Eq(7));
+    EXPECT_THAT(occupancy_owner(&grid, 70, 3, 2), Eq(OCCUPANCY_FREE));
+    EXPECT_THAT(occupancy_owner(&grid, 59, 2, 1), Eq(OCCUPANCY_FREE));
+
+    occupancy_box_t overlapping = box(0, 0, 0, 61, 3, 2);
+    occupancy_box_t left = box(0, 0, 0, 60, 10, 5);
+    occupancy_box_t right = box(70, 0, 0, 100, 10, 5);
+    occupancy_box_t above = box(60, 4, 0, 70, 10, 5);
+    occupancy_box_t corner = box(69, 3, 2, 70, 4, 3);
+    EXPECT_THAT(occupancy_box_is_free(&grid, &overlapping), Eq(0));
+    EXPECT_THAT(occupancy_box_is_free(&grid, &corner), Eq(0));
+    EXPECT_THAT(occupancy_box_is_free(&grid, &left), Eq(1));
+    EXPECT_THAT(occupancy_box_is_free(&grid, &right), Eq(1));
+    EXPECT_THAT(occupancy_box_is_free(&grid, &above), Eq(1));
+}
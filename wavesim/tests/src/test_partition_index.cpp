@@ -0,0 +1,84 @@
+#include "gmock/gmock.h"
+#include "wavesim/simulation/medium.h"
+#include "wavesim/simulation/partition_index.h"
+#include "wavesim/mesh/attribute.h"
+#include <algorithm>
+
+#define NAME partition_index
+
+using namespace ::testing;
+
+class NAME : public Test
+{
+protected:
+    virtual void SetUp() override
+    {
+        // 10x10x10 unit boxes, enough for several levels of nodes
+        medium_construct(&medium);
+        for (int z = 0; z != 10; ++z)
+            for (int y = 0; y != 10; ++y)
+                for (int x = 0; x != 10; ++x)
+                {
+                    wsreal_t bb[6] = {(wsreal_t)x, (wsreal_t)y, (wsreal_t)z,
+                                      (wsreal_t)x + 1, (wsreal_t)y + 1, (wsreal_t)z + 1};
+                    ASSERT_THAT(medium_add_partition(&medium, bb, attribute_default_air()), Eq(0));
+                }
+        partition_index_construct(&index);
+        ASSERT_THAT(partition_index_build(&index, &medium), Eq(WS_OK));
+    }
+
+    virtual void TearDown() override
+    {
+        partition_index_destruct(&index);
+        medium_destruct(&medium);
+    }
+
+    medium_t medium;
+    partition_index_t index;
+};
+
+TEST_F(NAME, finds_the_partition_containing_a_point)
+{
+    for (int i = 0; i != 1000; ++i)
+    {
+        wsreal_t point[3] = {(wsreal_t)(i % 10) + 0.5, (wsreal_t)((i / 10) % 10) + 0.25, (wsreal_t)(i / 100) + 0.75};
+        EXPECT_THAT(partition_index_find(&index, point), Eq(i));
+    }
+}
+
+TEST_F(NAME, points_on_shared_faces_belong_to_the_lowest_index)
+{
+    wsreal_t point[3] = {1, 1, 1};
+    EXPECT_THAT(partition_index_find(&index, point), Eq(0));
+}
+
+TEST_F(NAME, points_outside_are_not_found)
+{
+    wsreal_t point[3] = {5, 5, 10.5};
+    EXPECT_THAT(partition_index_find(&index, point), Eq(-1));
+}
+
+TEST_F(NAME, query_aabb_finds_overlapping_and_touching_partitions)
+{
+    vector_t result;
+    wsreal_t bb[6] = {0.5, 0.5, 0.5, 2, 1.5, 0.75};
+    vector_construct(&result, sizeof(uint32_t));
+    ASSERT_THAT(partition_index_query_aabb(&index, &result, bb), Eq(WS_OK));
+
+    std::vector<uint32_t> found;
+    for (uintptr_t i = 0; i != vector_count(&result); ++i)
+        found.push_back(*(uint32_t*)vector_get(&result, i));
+    std::sort(found.begin(), found.end());
+    EXPECT_THAT(found, ElementsAre(0u, 1u, 2u, 10u, 11u, 12u));
+
+    vector_clear_free(&result);
+}
+
+TEST_F(NAME, empty_medium_finds_nothing)
+{
+    wsreal_t point[3] = {0.5, 0.5, 0.5};
+    medium_clear(&medium);
+    ASSERT_THAT(partition_index_build(&index, &medium), Eq(WS_OK));
+    EXPECT_THAT(partition_index_is_built(&index), Eq(0));
+    EXPECT_THAT(partition_index_find(&index, point), Eq(-1));
+}
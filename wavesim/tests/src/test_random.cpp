@@ -0,0 +1,48 @@
+#include "gmock/gmock.h"
+#include "wavesim/random.h"
+#include <math.h>
+
+#define NAME random
+
+using namespace ::testing;
+
+TEST(NAME, same_seed_same_sequence)
+{
+    random_t a, b;
+    random_seed(&a, 42);
+    random_seed(&b, 42);
+    for (int i = 0; i != 100; ++i)
+        EXPECT_THAT(random_next(&a), Eq(random_next(&b)));
+}
+
+TEST(NAME, uniform_is_in_range_and_unbiased)
+{
+    random_t rng;
+    wsreal_t sum = 0.0;
+    random_seed(&rng, 0);
+    for (int i = 0; i != 100000; ++i)
+    {
+        wsreal_t u = random_uniform(&rng);
+        ASSERT_THAT(u, Ge(0.0));
+        ASSERT_THAT(u, Lt(1.0));
+        sum += u;
+    }
+    EXPECT_THAT(sum / 100000, DoubleNear(0.5, 0.01));
+}
+
+TEST(NAME, unit_vectors_are_normalized_and_uniform)
+{
+    random_t rng;
+    wsreal_t mean[3] = {0, 0, 0};
+    random_seed(&rng, 1);
+    for (int i = 0; i != 100000; ++i)
+    {
+        wsreal_t v[3];
+        random_unit_vector(&rng, v);
+        ASSERT_THAT(sqrt(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]), DoubleNear(1.0, 1e-9));
+        for (int j = 0; j != 3; ++j)
+            mean[j] += v[j] / 100000;
+    }
+    for (int j = 0; j != 3; ++j)
+        EXPECT_THAT(mean[j], DoubleNear(0.0, 0.01));
+}
@@ -3,6 +3,7 @@
 #include "wavesim/simulation/audio_listener.h"
 #include "wavesim/simulation/audio_source.h"
 #include "wavesim/simulation/medium.h"
+#include <math.h>
 
 #define NAME simulation
 
@@ -29,3 +30,79 @@ TEST(NAME, rectangular_medium)
     audio_listener_destroy(al);
     medium_destroy(m);
 }
+
+/*
+ * Stand-in backend that plays back an exponentially decaying impulse response
+ * (60 dB decay in 0.5 seconds) to every listener.
+ */
+static const wsreal_t fake_t60 = 0.5;
+static int fake_advance_calls;
+
+static wsret fake_prepare(simulation_t* s)
+{
+    (void)s;
+    fake_advance_calls = 0;
+    return WS_OK;
+}
+
+static int fake_advance(simulation_t* s, wsreal_t dt)
+{
+    wsreal_t sample = pow(10.0, -3.0 * s->time / fake_t60);
+    for (uintptr_t i = 0; i != simulation_audio_listener_count(s); ++i)
+        audio_listener_add_sample(simulation_get_audio_listener(s, i), dt, sample);
+    fake_advance_calls++;
+    return 1; /* never finishes on its own */
+}
+
+static void fake_finalize(simulation_t* s)
+{
+    (void)s;
+}
+
+TEST(NAME, impulse_response_mode_stops_after_decay)
+{
+    simulation_t* s;
+    audio_listener_t* al;
+    ASSERT_THAT(simulation_create(&s, WAVESIM_ARD), Eq(WS_OK));
+    ASSERT_THAT(audio_listener_create(&al), Eq(WS_OK));
+    ASSERT_THAT(simulation_add_audio_listener(s, al), Eq(WS_OK));
+
+    s->prepare = fake_prepare;
+    s->advance = fake_advance;
+    s->finalize = fake_finalize;
+    s->time_step = 1.0 / al->fs;
+    simulation_set_impulse_response_mode(s, -60, 10);
+
+    EXPECT_THAT(simulation_execute(s), Eq(WS_OK));
+
+    // Must have stopped shortly after T60, not at the 10 second limit
+    EXPECT_THAT(s->time, Gt(fake_t60));
+    EXPECT_THAT(s->time, Lt(fake_t60 * 1.2));
+
+    // IR is trimmed to where the decay curve crosses -60 dB
+    EXPECT_THAT((wsreal_t)vector_count(&al->samples) / al->fs, DoubleNear(fake_t60, 0.01));
+
+    simulation_destroy(s);
+    audio_listener_destroy(al);
+}
+
+TEST(NAME, impulse_response_mode_respects_max_duration)
+{
+    simulation_t* s;
+    audio_listener_t* al;
+    ASSERT_THAT(simulation_create(&s, WAVESIM_ARD), Eq(WS_OK));
+    ASSERT_THAT(audio_listener_create(&al), Eq(WS_OK));
+    ASSERT_THAT(simulation_add_audio_listener(s, al), Eq(WS_OK));
+
+    s->prepare = fake_prepare;
+    s->advance = fake_advance;
+    s->finalize = fake_finalize;
+    s->time_step = 1.0 / al->fs;
+    simulation_set_impulse_response_mode(s, -60, 0.1);
+
+    EXPECT_THAT(simulation_execute(s), Eq(WS_OK));
+    EXPECT_THAT(s->time, DoubleNear(0.1, 0.001));
+
+    simulation_destroy(s);
+    audio_listener_destroy(al);
+}
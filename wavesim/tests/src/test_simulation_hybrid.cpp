@@ -0,0 +1,105 @@
+#include "gmock/gmock.h"
+#include "wavesim/simulation/simulation.h"
+#include "wavesim/simulation/audio_listener.h"
+#include "wavesim/simulation/audio_source.h"
+#include <math.h>
+
+#define NAME simulation_hybrid
+
+using namespace ::testing;
+
+static const wsreal_t pi = 3.14159265358979323846;
+
+// Stands in for the wave based backend. Writes a sine of the specified
+// frequency (0 for silence) to every listener for 0.1 seconds.
+static wsreal_t wave_frequency;
+
+static wsret fake_prepare(simulation_t* s)
+{
+    (void)s;
+    return WS_OK;
+}
+
+static int fake_advance(simulation_t* s, wsreal_t dt)
+{
+    for (uintptr_t i = 0; i != simulation_audio_listener_count(s); ++i)
+        audio_listener_add_sample(simulation_get_audio_listener(s, i), dt, sin(2 * pi * wave_frequency * s->time));
+    return s->time + dt < 0.1 ? 1 : 0;
+}
+
+static void fake_finalize(simulation_t* s)
+{
+    (void)s;
+}
+
+class NAME : public Test
+{
+protected:
+    virtual void SetUp() override
+    {
+        simulation_construct(&sim, WAVESIM_HYBRID);
+        sim.hybrid.wave_prepare = fake_prepare;
+        sim.hybrid.wave_advance = fake_advance;
+        sim.hybrid.wave_finalize = fake_finalize;
+        sim.hybrid.crossover_frequency = 1000;
+        sim.time_step = 0.0001;
+        audio_source_construct(&as);
+        audio_listener_construct(&al);
+        al.fs = 10000;
+        al.position = vec3(4, 0, 0);
+        ASSERT_THAT(simulation_add_audio_source(&sim, &as), Eq(WS_OK));
+        ASSERT_THAT(simulation_add_audio_listener(&sim, &al), Eq(WS_OK));
+    }
+
+    virtual void TearDown() override
+    {
+        simulation_destruct(&sim);
+        audio_listener_destruct(&al);
+        audio_source_destruct(&as);
+    }
+
+    wsreal_t energy(uintptr_t begin, uintptr_t end)
+    {
+        wsreal_t sum = 0.0;
+        for (uintptr_t i = begin; i < end && i < vector_count(&al.samples); ++i)
+        {
+            wsreal_t s = *(wsreal_t*)vector_get(&al.samples, i);
+            sum += s * s;
+        }
+        return sum;
+    }
+
+    simulation_t sim;
+    audio_source_t as;
+    audio_listener_t al;
+};
+
+TEST_F(NAME, wave_band_is_low_passed)
+{
+    // No rays
+    sim.ray.ray_count = 0;
+    sim.ray.image_source_order = -1;
+
+    // A 100Hz sine passes, the steady state has a mean square of 1/2
+    wave_frequency = 100;
+    ASSERT_THAT(simulation_execute(&sim), Eq(WS_OK));
+    ASSERT_THAT(vector_count(&al.samples), Eq(1000u));
+    EXPECT_THAT(energy(500, 1000) / 500, DoubleNear(0.5, 0.01));
+
+    // A 4kHz sine is attenuated by 1/(1+4^4) in amplitude
+    wave_frequency = 4000;
+    ASSERT_THAT(simulation_execute(&sim), Eq(WS_OK));
+    EXPECT_THAT(energy(500, 1000) / 500, Lt(0.5 * 0.01 * 0.01));
+}
+
+TEST_F(NAME, ray_band_is_high_passed)
+{
+    // Only the direct sound, which lands in the first histogram bin. The
+    // rendered noise is white, so the high band keeps 1 - 1000 / 5000 of it.
+    wave_frequency = 0;
+    al.energy_bin_width = 0.05;
+    ASSERT_THAT(simulation_execute(&sim), Eq(WS_OK));
+
+    wsreal_t direct = 1.0 / (4 * pi * 16);
+    EXPECT_THAT(energy(0, vector_count(&al.samples)), DoubleNear(direct * 0.8, direct * 0.8 * 0.15));
+}
@@ -0,0 +1,363 @@
+#include "gmock/gmock.h"
+#include "wavesim/mesh/mesh.h"
+#include "wavesim/simulation/simulation.h"
+#include "wavesim/simulation/audio_listener.h"
+#include "wavesim/simulation/audio_source.h"
+#include "wavesim/simulation/simulation_ray.h"
+#include <math.h>
+#include <vector>
+
+#define NAME simulation_ray
+
+using namespace ::testing;
+
+static const wsreal_t pi = 3.14159265358979323846;
+
+class NAME : public Test
+{
+protected:
+    virtual void SetUp() override
+    {
+        simulation_construct(&sim, WAVESIM_RAY);
+        sim.ray.ray_count = 200000;
+        sim.time_step = 0.0001;
+        audio_source_construct(&as);
+        audio_listener_construct(&al);
+        al.fs = 10000;
+        al.position = vec3(4, 0, 0);
+        ASSERT_THAT(simulation_add_audio_source(&sim, &as), Eq(WS_OK));
+        ASSERT_THAT(simulation_add_audio_listener(&sim, &al), Eq(WS_OK));
+        mesh = NULL;
+    }
+
+    virtual void TearDown() override
+    {
+        simulation_destruct(&sim);
+        audio_listener_destruct(&al);
+        audio_source_destruct(&as);
+        if (mesh != NULL)
+            mesh_destroy(mesh);
+    }
+
+    // A large floor, by default 1m below the source and listener
+    void add_floor(attribute_t attr, double y = -1)
+    {
+        const double vb[] = {
+            -100, y, -100,  100, y, -100,  100, y, 100,  -100, y, 100
+        };
+        static const uint32_t ib[] = {0, 1, 2, 0, 2, 3};
+        ASSERT_THAT(mesh_create(&mesh, "floor"), Eq(WS_OK));
+        ASSERT_THAT(mesh_copy_from_buffers(mesh, vb, ib, 4, 6, MESH_VB_DOUBLE, MESH_IB_UINT32), Eq(WS_OK));
+        for (int i = 0; i != 4; ++i)
+            mesh->ab[i] = attr;
+        ASSERT_THAT(simulation_add_mesh(&sim, mesh), Eq(WS_OK));
+    }
+
+    std::vector<wsreal_t> histogram()
+    {
+        std::vector<wsreal_t> result;
+        for (uintptr_t i = 0; i != vector_count(&al.energy); ++i)
+            result.push_back(*(wsreal_t*)vector_get(&al.energy, i));
+        return result;
+    }
+
+    void expect_histogram(const std::vector<wsreal_t>& expected)
+    {
+        ASSERT_THAT(vector_count(&al.energy), Eq(expected.size()));
+        for (uintptr_t i = 0; i != expected.size(); ++i)
+            EXPECT_THAT(*(wsreal_t*)vector_get(&al.energy, i), DoubleNear(expected[i], 1e-12));
+    }
+
+    wsreal_t energy_between(wsreal_t t0, wsreal_t t1, const vector_t* bins = NULL)
+    {
+        wsreal_t sum = 0.0;
+        if (bins == NULL)
+            bins = &al.energy;
+        for (uintptr_t i = 0; i != vector_count(bins); ++i)
+        {
+            wsreal_t t = i * al.energy_bin_width;
+            if (t >= t0 && t < t1)
+                sum += *(wsreal_t*)vector_get(bins, i);
+        }
+        return sum;
+    }
+
+    // A floor absorbing more of every octave band than of the one below
+    void add_band_floor()
+    {
+        attribute_t attr = attribute(1, 0, 0, 340, vec3(0, 0, 0));
+        for (int band = 0; band != ATTRIBUTE_BAND_COUNT; ++band)
+            attr.band_absorption[band] = band / 8.0;
+        add_floor(attr);
+    }
+
+    simulation_t sim;
+    audio_source_t as;
+    audio_listener_t al;
+    mesh_t* mesh;
+};
+
+TEST_F(NAME, free_field_follows_inverse_square_law)
+{
+    ASSERT_THAT(simulation_execute(&sim), Eq(WS_OK));
+
+    // 4m at 340m/s arrives after 11.8ms
+    wsreal_t expected = 1.0 / (4 * pi * 4 * 4);
+    EXPECT_THAT(energy_between(0.011, 0.013), DoubleNear(expected, expected * 0.15));
+    EXPECT_THAT(energy_between(0.0, 0.011), DoubleEq(0.0));
+    EXPECT_THAT(energy_between(0.013, 1.0), DoubleEq(0.0));
+
+    // The samples carry the same energy as the histogram
+    wsreal_t sample_energy = 0.0;
+    for (uintptr_t i = 0; i != vector_count(&al.samples); ++i)
+    {
+        wsreal_t s = *(wsreal_t*)vector_get(&al.samples, i);
+        sample_energy += s * s;
+    }
+    EXPECT_THAT(sample_energy, DoubleNear(energy_between(0.0, 1.0), expected * 0.01));
+}
+
+TEST_F(NAME, reflective_floor_adds_a_reflection)
+{
+    add_floor(attribute(1, 0, 0, 340, vec3(0, 0, 0)));
+    ASSERT_THAT(simulation_execute(&sim), Eq(WS_OK));
+
+    // The reflection travels sqrt(4^2 + 2^2) = 4.47m and arrives after 13.2ms
+    wsreal_t direct = 1.0 / (4 * pi * 16);
+    wsreal_t reflected = 1.0 / (4 * pi * 20);
+    EXPECT_THAT(energy_between(0.011, 0.012), DoubleNear(direct, direct * 0.15));
+    EXPECT_THAT(energy_between(0.013, 0.014), DoubleNear(reflected, reflected * 0.15));
+}
+
+TEST_F(NAME, absorbing_floor_adds_nothing)
+{
+    add_floor(attribute_default_solid());
+    ASSERT_THAT(simulation_execute(&sim), Eq(WS_OK));
+    EXPECT_THAT(energy_between(0.013, 0.014), DoubleEq(0.0));
+}
+
+TEST_F(NAME, transmitting_floor_lets_rays_through)
+{
+    // A listener below the floor only receives energy through it
+    al.position = vec3(0, -4, 0);
+    add_floor(attribute(0, 1, 0, 340, vec3(0, 0, 0)));
+    ASSERT_THAT(simulation_execute(&sim), Eq(WS_OK));
+    wsreal_t expected = 1.0 / (4 * pi * 16);
+    EXPECT_THAT(energy_between(0.011, 0.013), DoubleNear(expected, expected * 0.15));
+}
+
+TEST_F(NAME, image_sources_absorb_each_band_separately)
+{
+    add_band_floor();
+    ASSERT_THAT(simulation_execute(&sim), Eq(WS_OK));
+
+    wsreal_t reflected = 1.0 / (4 * pi * 20);
+    wsreal_t mean = 0.0;
+    for (int band = 0; band != ATTRIBUTE_BAND_COUNT; ++band)
+    {
+        wsreal_t expected = reflected * (1.0 - band / 8.0);
+        EXPECT_THAT(energy_between(0.013, 0.014, &al.band_energy[band]), DoubleNear(expected, 1e-12));
+        mean += expected / ATTRIBUTE_BAND_COUNT;
+    }
+    EXPECT_THAT(energy_between(0.013, 0.014), DoubleNear(mean, 1e-12));
+}
+
+TEST_F(NAME, rays_absorb_each_band_separately)
+{
+    // A single path is traced for all bands, so every band stays unbiased
+    // even though the floor only reflects some of them well
+    sim.ray.image_source_order = -1;
+    add_band_floor();
+    ASSERT_THAT(simulation_execute(&sim), Eq(WS_OK));
+
+    wsreal_t reflected = 1.0 / (4 * pi * 20);
+    for (int band = 0; band != ATTRIBUTE_BAND_COUNT - 1; ++band)
+    {
+        wsreal_t expected = reflected * (1.0 - band / 8.0);
+        EXPECT_THAT(energy_between(0.013, 0.014, &al.band_energy[band]), DoubleNear(expected, reflected * 0.15));
+    }
+    EXPECT_THAT(energy_between(0.013, 0.014, &al.band_energy[ATTRIBUTE_BAND_COUNT - 1]),
+                Lt(energy_between(0.013, 0.014, &al.band_energy[0])));
+}
+
+TEST_F(NAME, runs_are_reproducible)
+{
+    add_floor(attribute(0.5, 0.2, 0.3, 340, vec3(0, 0, 0)));
+    sim.ray.ray_count = 1000;
+    ASSERT_THAT(simulation_execute(&sim), Eq(WS_OK));
+    wsreal_t first = energy_between(0.0, 1.0);
+    ASSERT_THAT(simulation_execute(&sim), Eq(WS_OK));
+    EXPECT_THAT(energy_between(0.0, 1.0), DoubleEq(first));
+}
+
+TEST_F(NAME, thread_count_and_histogram_mode_dont_change_the_result)
+{
+    add_floor(attribute(0.5, 0.2, 0.3, 340, vec3(0, 0, 0)));
+    sim.ray.ray_count = 20000;
+    sim.ray.thread_count = 1;
+    ASSERT_THAT(simulation_execute(&sim), Eq(WS_OK));
+    std::vector<wsreal_t> expected;
+    for (uintptr_t i = 0; i != vector_count(&al.energy); ++i)
+        expected.push_back(*(wsreal_t*)vector_get(&al.energy, i));
+
+    // Private histograms, merged by tree reduction
+    sim.ray.thread_count = 4;
+    ASSERT_THAT(simulation_execute(&sim), Eq(WS_OK));
+    ASSERT_THAT(vector_count(&al.energy), Eq(expected.size()));
+    for (uintptr_t i = 0; i != expected.size(); ++i)
+        EXPECT_THAT(*(wsreal_t*)vector_get(&al.energy, i), DoubleNear(expected[i], 1e-12));
+
+    // Shared histograms with atomic adds
+    sim.ray.shared_histogram_listeners = 0;
+    ASSERT_THAT(simulation_execute(&sim), Eq(WS_OK));
+    ASSERT_THAT(vector_count(&al.energy), Eq(expected.size()));
+    for (uintptr_t i = 0; i != expected.size(); ++i)
+        EXPECT_THAT(*(wsreal_t*)vector_get(&al.energy, i), DoubleNear(expected[i], 1e-12));
+}
+
+TEST_F(NAME, shared_histograms_cover_the_whole_duration)
+{
+    add_floor(attribute(0.5, 0.2, 0.3, 340, vec3(0, 0, 0)));
+    simulation_set_impulse_response_mode(&sim, -60.0, 0.5);
+    sim.ray.ray_count = 20000;
+    sim.ray.thread_count = 4;
+    ASSERT_THAT(simulation_execute(&sim), Eq(WS_OK));
+    std::vector<wsreal_t> expected = histogram();
+
+    // Every bin up to max_duration exists before tracing, nothing is queued
+    sim.ray.shared_histogram_listeners = 0;
+    ASSERT_THAT(simulation_prepare(&sim), Eq(WS_OK));
+    ASSERT_THAT(simulation_run(&sim), Eq(WS_OK));
+    EXPECT_THAT(simulation_ray_overflow_count(&sim), Eq(0u));
+    simulation_finalize(&sim);
+    expect_histogram(expected);
+}
+
+TEST_F(NAME, diffuse_rain_matches_scattered_rays)
+{
+    // A fully diffuse floor, only the scattered energy arrives after the direct sound
+    add_floor(attribute(1, 0, 0, 340, vec3(0, 0, 0)));
+    sim.ray.scattering = 1;
+    sim.ray.diffuse_rain = 0;
+    sim.ray.ray_count = 400000;
+    ASSERT_THAT(simulation_execute(&sim), Eq(WS_OK));
+    wsreal_t expected = energy_between(0.013, 1.0);
+    ASSERT_THAT(expected, Gt(0.0));
+
+    // Raining onto the listener gets there with a fraction of the rays
+    sim.ray.diffuse_rain = 1;
+    sim.ray.ray_count = 20000;
+    ASSERT_THAT(simulation_execute(&sim), Eq(WS_OK));
+    EXPECT_THAT(energy_between(0.013, 1.0), DoubleNear(expected, expected * 0.1));
+}
+
+TEST_F(NAME, refining_in_batches_matches_a_single_batch)
+{
+    // Without image sources, so the rays carry everything
+    add_floor(attribute(0.5, 0.2, 0.3, 340, vec3(0, 0, 0)));
+    sim.ray.image_source_order = -1;
+    sim.ray.ray_count = 4000;
+    ASSERT_THAT(simulation_execute(&sim), Eq(WS_OK));
+    std::vector<wsreal_t> expected = histogram();
+
+    // A budget of 0 traces one batch per call
+    sim.ray.batch_size = 500;
+    ASSERT_THAT(simulation_prepare(&sim), Eq(WS_OK));
+    int calls = 0;
+    wsreal_t first_convergence = 0.0;
+    while (simulation_ray_rays_traced(&sim) < sim.ray.ray_count)
+    {
+        ASSERT_THAT(simulation_ray_refine(&sim, 0), Eq(WS_OK));
+        if (calls++ == 1)
+            first_convergence = simulation_ray_convergence(&sim, 0);
+    }
+    EXPECT_THAT(calls, Eq(8));
+    EXPECT_THAT(simulation_ray_convergence(&sim, 0), AllOf(Gt(0.0), Lt(first_convergence)));
+    expect_histogram(expected);
+
+    // Running resumes from the refined histograms
+    ASSERT_THAT(simulation_run(&sim), Eq(WS_OK));
+    EXPECT_THAT(simulation_ray_rays_traced(&sim), Eq(4000u));
+    expect_histogram(expected);
+    simulation_finalize(&sim);
+}
+
+TEST_F(NAME, raising_ray_count_resumes_and_moving_restarts)
+{
+    add_floor(attribute(0.5, 0.2, 0.3, 340, vec3(0, 0, 0)));
+    sim.ray.ray_count = 2000;
+    ASSERT_THAT(simulation_execute(&sim), Eq(WS_OK));
+    std::vector<wsreal_t> expected = histogram();
+
+    // Resuming from a ray count that isn't a multiple of the packet size
+    ASSERT_THAT(simulation_prepare(&sim), Eq(WS_OK));
+    sim.ray.ray_count = 1001;
+    ASSERT_THAT(simulation_run(&sim), Eq(WS_OK));
+    EXPECT_THAT(simulation_ray_rays_traced(&sim), Eq(1001u));
+    sim.ray.ray_count = 2000;
+    ASSERT_THAT(simulation_run(&sim), Eq(WS_OK));
+    EXPECT_THAT(simulation_ray_rays_traced(&sim), Eq(2000u));
+    expect_histogram(expected);
+
+    // Moving the listener discards the rays
+    sim.ray.batch_size = 64;
+    al.position = vec3(5, 0, 0);
+    ASSERT_THAT(simulation_ray_refine(&sim, 0), Eq(WS_OK));
+    EXPECT_THAT(simulation_ray_rays_traced(&sim), Eq(64u));
+    EXPECT_THAT(simulation_ray_convergence(&sim, 0), DoubleEq(1.0));
+    ASSERT_THAT(simulation_ray_refine(&sim, 0), Eq(WS_OK));
+    EXPECT_THAT(simulation_ray_rays_traced(&sim), Eq(128u));
+
+    // So does changing the listener's bin width
+    al.energy_bin_width *= 2;
+    ASSERT_THAT(simulation_ray_refine(&sim, 0), Eq(WS_OK));
+    EXPECT_THAT(simulation_ray_rays_traced(&sim), Eq(64u));
+    EXPECT_THAT(simulation_ray_convergence(&sim, 0), DoubleEq(1.0));
+    simulation_finalize(&sim);
+}
+
+TEST_F(NAME, moving_or_deforming_a_mesh_matches_building_it_there)
+{
+    add_floor(attribute(0.5, 0.2, 0.3, 340, vec3(0, 0, 0)), -2);
+    sim.ray.ray_count = 4000;
+    ASSERT_THAT(simulation_execute(&sim), Eq(WS_OK));
+    std::vector<wsreal_t> expected = histogram();
+    ASSERT_THAT(energy_between(0.0, 1.0), Gt(0.0));
+    simulation_destruct(&sim);
+    mesh_destroy(mesh);
+    simulation_construct(&sim, WAVESIM_RAY);
+    sim.ray.ray_count = 4000;
+    sim.time_step = 0.0001;
+    ASSERT_THAT(simulation_add_audio_source(&sim, &as), Eq(WS_OK));
+    ASSERT_THAT(simulation_add_audio_listener(&sim, &al), Eq(WS_OK));
+
+    // Moved down by 1m with a transform
+    const wsreal_t down[12] = {
+        1, 0, 0, 0,
+        0, 1, 0, -1,
+        0, 0, 1, 0
+    };
+    add_floor(attribute(0.5, 0.2, 0.3, 340, vec3(0, 0, 0)));
+    ASSERT_THAT(simulation_prepare(&sim), Eq(WS_OK));
+    ASSERT_THAT(simulation_run(&sim), Eq(WS_OK));
+    EXPECT_THAT(histogram(), Ne(expected));
+    simulation_ray_set_mesh_transform(&sim, 0, down);
+    ASSERT_THAT(simulation_run(&sim), Eq(WS_OK));
+    ASSERT_THAT(vector_count(&al.energy), Eq(expected.size()));
+    for (uintptr_t i = 0; i != expected.size(); ++i)
+        EXPECT_THAT(*(wsreal_t*)vector_get(&al.energy, i), DoubleNear(expected[i], expected[i] * 1e-6 + 1e-15));
+
+    // Moved back, then deformed in place to the same spot
+    const wsreal_t identity[12] = {
+        1, 0, 0, 0,
+        0, 1, 0, 0,
+        0, 0, 1, 0
+    };
+    simulation_ray_set_mesh_transform(&sim, 0, identity);
+    for (int v = 0; v != 4; ++v)
+        ((double*)mesh->vb)[v * 3 + 1] = -2;
+    ASSERT_THAT(simulation_ray_update_mesh(&sim, 0), Eq(WS_OK));
+    ASSERT_THAT(simulation_run(&sim), Eq(WS_OK));
+    expect_histogram(expected);
+    simulation_finalize(&sim);
+}
@@ -0,0 +1,111 @@
+#include "gmock/gmock.h"
+#include "wavesim/mesh/mesh.h"
+#include "wavesim/simulation/voxel_grid.h"
+#include <vector>
+
+#define NAME voxel_grid
+
+using namespace ::testing;
+
+class NAME : public Test
+{
+protected:
+    virtual void SetUp() override
+    {
+        // A horizontal quad through the layer of cells at y=2 of a 4x4x4 lattice
+        const double vb[] = {
+            0.5, 2.5, 0.5,  3.5, 2.5, 0.5,  3.5, 2.5, 3.5,  0.5, 2.5, 3.5
+        };
+        static const uint32_t ib[] = {0, 1, 2, 0, 2, 3};
+        ASSERT_THAT(mesh_create(&mesh, "quad"), Eq(WS_OK));
+        ASSERT_THAT(mesh_copy_from_buffers(mesh, vb, ib, 4, 6, MESH_VB_DOUBLE, MESH_IB_UINT32), Eq(WS_OK));
+        for (int i = 0; i != 4; ++i)
+            mesh->ab[i] = attribute(0.5, 0.2, 0.3, 1000, vec3(0, 0, 0));
+        voxel_grid_construct(&grid);
+    }
+
+    virtual void TearDown() override
+    {
+        voxel_grid_destruct(&grid);
+        mesh_destroy(mesh);
+    }
+
+    void build(uintptr_t thread_count)
+    {
+        wsreal_t boundary[6] = {0, 0, 0, 4, 4, 4};
+        wsreal_t grid_size[3] = {1, 1, 1};
+        ASSERT_THAT(voxel_grid_build(&grid, mesh, boundary, grid_size, thread_count), Eq(WS_OK));
+    }
+
+    std::vector<uint32_t> materials()
+    {
+        return std::vector<uint32_t>(grid.materials, grid.materials + grid.dims[0] * grid.dims[1] * grid.dims[2]);
+    }
+
+    mesh_t* mesh;
+    voxel_grid_t grid;
+};
+
+TEST_F(NAME, cells_the_quad_passes_through_get_its_attributes)
+{
+    build(1);
+    ASSERT_THAT(grid.dims[0], Eq(4u));
+    ASSERT_THAT(grid.dims[1], Eq(4u));
+    ASSERT_THAT(grid.dims[2], Eq(4u));
+    ASSERT_THAT(voxel_grid_material_count(&grid), Eq(2u));
+
+    const attribute_t* solid = voxel_grid_attribute(&grid, 1);
+    EXPECT_THAT(solid->reflection, DoubleNear(0.5, 1e-12));
+    EXPECT_THAT(solid->transmission, DoubleNear(0.2, 1e-12));
+    EXPECT_THAT(solid->absorption, DoubleNear(0.3, 1e-12));
+    EXPECT_THAT(solid->sound_velocity, DoubleNear(1000, 1e-9));
+    EXPECT_THAT(voxel_grid_attribute(&grid, VOXEL_AIR)->transmission, DoubleEq(1.0));
+
+    for (uintptr_t z = 0; z != 4; ++z)
+        for (uintptr_t y = 0; y != 4; ++y)
+            for (uintptr_t x = 0; x != 4; ++x)
+                EXPECT_THAT(voxel_grid_material(&grid, x, y, z), Eq(y == 2 ? 1u : VOXEL_AIR));
+}
+
+TEST_F(NAME, cells_keep_the_bands_of_the_quad)
+{
+    for (int i = 0; i != 4; ++i)
+        for (int band = 0; band != ATTRIBUTE_BAND_COUNT; ++band)
+        {
+            mesh->ab[i].band_absorption[band] = 0.1 * (band + 1);
+            mesh->ab[i].band_transmission[band] = 0.05;
+        }
+    build(1);
+    ASSERT_THAT(voxel_grid_material_count(&grid), Eq(2u));
+
+    const attribute_t* solid = voxel_grid_attribute(&grid, 1);
+    for (int band = 0; band != ATTRIBUTE_BAND_COUNT; ++band)
+    {
+        EXPECT_THAT(solid->band_absorption[band], DoubleNear(0.1 * (band + 1), 1e-12));
+        EXPECT_THAT(solid->band_transmission[band], DoubleNear(0.05, 1e-12));
+    }
+}
+
+TEST_F(NAME, tiles_dont_change_the_result)
+{
+    build(1);
+    std::vector<uint32_t> single = materials();
+    build(3);
+    EXPECT_THAT(materials(), ContainerEq(single));
+    build(8);
+    EXPECT_THAT(materials(), ContainerEq(single));
+}
+
+TEST_F(NAME, points_are_located_in_cells)
+{
+    build(1);
+    uintptr_t cell[3];
+    wsreal_t inside[3] = {3.5, 0.2, 2.0};
+    ASSERT_THAT(voxel_grid_locate(&grid, inside, cell), Eq(1));
+    EXPECT_THAT(cell[0], Eq(3u));
+    EXPECT_THAT(cell[1], Eq(0u));
+    EXPECT_THAT(cell[2], Eq(2u));
+
+    wsreal_t outside[3] = {4.5, 0.2, 2.0};
+    EXPECT_THAT(voxel_grid_locate(&grid, outside, cell), Eq(0));
+}